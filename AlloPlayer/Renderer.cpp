@@ -162,33 +162,58 @@ bool Renderer::onFrame()
                         }
                     }
                     
+                    // The planes are either laid out one after the other in the face's content
+                    // or borrowed from the decoder with rows that may be padded
+                    void* planes[3];
+                    int   rowLengths[3];
+                    if (face->hasPlanes())
+                    {
+                        for (int p = 0; p < 3; p++)
+                        {
+                            planes[p]     = face->getPlane(p);
+                            rowLengths[p] = face->getLinesize(p);
+                        }
+                    }
+                    else
+                    {
+                        planes[0] = face->getContent()->getPixels();
+                        planes[1] = (char*)planes[0] +
+                                        face->getContent()->getWidth() * face->getContent()->getHeight();
+                        planes[2] = (char*)planes[1] +
+                                        (face->getContent()->getWidth()/2) * (face->getContent()->getHeight()/2);
+                        rowLengths[0] = 0;
+                        rowLengths[1] = 0;
+                        rowLengths[2] = 0;
+                    }
+                    
                     tex.yTexture->bind();
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLengths[0]);
                     glTexSubImage2D(tex.yTexture->target(), 0,
                                     0, 0,
                                     tex.yTexture->width(),
                                     tex.yTexture->height(),
                                     tex.yTexture->format(),
                                     tex.yTexture->type(),
-                                    face->getContent()->getPixels());
+                                    planes[0]);
                     tex.vTexture->bind();
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLengths[1]);
                     glTexSubImage2D(tex.vTexture->target(), 0,
                                     0, 0,
                                     tex.vTexture->width(),
                                     tex.vTexture->height(),
                                     tex.vTexture->format(),
                                     tex.vTexture->type(),
-                                    (char*)face->getContent()->getPixels() +
-                                        face->getContent()->getWidth() * face->getContent()->getHeight());
+                                    planes[1]);
                     tex.uTexture->bind();
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLengths[2]);
                     glTexSubImage2D(tex.uTexture->target(), 0,
                                     0, 0,
                                     tex.uTexture->width(),
                                     tex.uTexture->height(),
                                     tex.uTexture->format(),
                                     tex.uTexture->type(),
-                                    (char*)face->getContent()->getPixels() +
-                                        face->getContent()->getWidth() * face->getContent()->getHeight() +
-                                        (face->getContent()->getWidth()/2) * (face->getContent()->getHeight()/2));
+                                    planes[2]);
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
                     tex.uTexture->unbind();
                     
                     if (onDisplayedCubemapFace) onDisplayedCubemapFace(this, i + j * Cubemap::MAX_FACES_COUNT);
@@ -2,6 +2,8 @@
 #include <boost/lexical_cast.hpp>
 
 #include <iomanip>
+#include <stdexcept>
+#include <atomic>
 
 #include "Renderer.hpp"
 #include "AlloShared/StatsUtils.hpp"
@@ -14,6 +16,7 @@
 #include "AlloReceiver/AlloReceiver.h"
 #include "AlloReceiver/Stats.hpp"
 #include "AlloReceiver/H264CubemapSource.h"
+#include "AlloReceiver/BatchingReceiveGroupsock.hpp"
 
 #define DEG_DIV_RAD 57.29577951308233
 #define RAD_DIV_DEG  0.01745329251994
@@ -30,9 +33,20 @@ static std::string   interfaceAddress = "0.0.0.0";
 static unsigned long bufferSize       = DEFAULT_SINK_BUFFER_SIZE;
 static bool          matchStereoPairs = false;
 static boost::filesystem::path configFilePath;
-static bool          robustSyncing    = false;
 static size_t        maxFrameMapSize  = 2;
 static std::string   logPath          = ".";
+static bool          batchedReceive   = false;
+static int           busyPoll         = 0;
+static int           cubemapDeadline  = 50;
+static double        lateRate         = 1.0;
+static std::string   concealment      = "hold";
+static int           receiveTimeout   = 5000;
+static std::string   decoderThreading = "none";
+static unsigned int  decoderCores     = 0;
+static size_t        workerThreads    = 0;
+static auto          connectTime      = std::chrono::steady_clock::now();
+// Microseconds from connecting until the first cubemap was played out (-1 before that)
+static std::atomic<long long> timeToFirstCubemap(-1);
 
 StereoCubemap* onNextCubemap(CubemapSource* source, StereoCubemap* cubemap)
 {
@@ -84,6 +98,76 @@ void onDisplayedFrame(Renderer* renderer)
     stats.store(StatsUtils::Cubemap());
 }
 
+void onReceivedBatch(RTSPCubemapSourceClient* client, size_t packetsCount, size_t syscallsCount)
+{
+    stats.store(StatsUtils::Reception(packetsCount, syscallsCount));
+}
+
+void onFramesAggregatorWokeUp(H264CubemapSource* source, std::chrono::microseconds wakeUpLatency, std::chrono::microseconds cpuTime)
+{
+    stats.store(StatsUtils::WakeUp(wakeUpLatency, cpuTime));
+}
+
+void onPlayedOutCubemap(H264CubemapSource* source, std::chrono::microseconds delay, std::chrono::microseconds jitter, int concealedFaces)
+{
+    stats.store(StatsUtils::Playout(delay, jitter, concealedFaces));
+    
+    long long none = -1;
+    long long time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - connectTime).count();
+    if (timeToFirstCubemap.compare_exchange_strong(none, time))
+    {
+        std::cout << "Time to first cubemap: " << time / 1000 << "ms" << std::endl;
+    }
+}
+
+void onDroppedLateFrame(H264CubemapSource* source, int face)
+{
+    stats.store(StatsUtils::LateFrame(face));
+}
+
+void onDroppedFrameWithoutRoom(H264CubemapSource* source, int face)
+{
+    stats.store(StatsUtils::FrameWithoutRoom(face));
+}
+
+void onReceivedUnstampedFrame(H264CubemapSource* source, int face)
+{
+    stats.store(StatsUtils::UnstampedFrame(face));
+}
+
+void onRequestedKeyframe(H264CubemapSource* source, int face)
+{
+    stats.store(StatsUtils::KeyframeRequest(face));
+}
+
+void onRecoveredFace(H264CubemapSource* source, int face, std::chrono::microseconds concealedFor)
+{
+    stats.store(StatsUtils::Concealment(face, concealedFor));
+}
+
+void onShedLoad(H264CubemapSource* source, int face, H264NALUSink::LoadShedding step)
+{
+    switch (step)
+    {
+    case H264NALUSink::FAST_DECODE:
+        stats.store(StatsUtils::LoadShedding(face, StatsUtils::LoadShedding::FAST_DECODE));
+        break;
+    case H264NALUSink::DROP_NON_REFERENCE:
+        stats.store(StatsUtils::LoadShedding(face, StatsUtils::LoadShedding::DROP_NON_REFERENCE));
+        break;
+    case H264NALUSink::SKIP_TO_IDR:
+        stats.store(StatsUtils::LoadShedding(face, StatsUtils::LoadShedding::SKIP_TO_IDR));
+        break;
+    default:
+        break;
+    }
+}
+
+void onMeasuredDecodeTime(H264CubemapSource* source, int face, std::chrono::microseconds decodeTime)
+{
+    stats.store(StatsUtils::DecodeTime(face, decodeTime));
+}
+
 void onDidConnect(RTSPCubemapSourceClient* client, CubemapSource* cubemapSource)
 {
     H264CubemapSource* h264CubemapSource = dynamic_cast<H264CubemapSource*>(cubemapSource);
@@ -96,6 +180,15 @@ void onDidConnect(RTSPCubemapSourceClient* client, CubemapSource* cubemapSource)
         h264CubemapSource->setOnColorConvertedFrame    (std::bind(&onColorConvertedFrame,        _1, _2, _3, _4));
         h264CubemapSource->setOnAddedFrameToCubemap    (std::bind(&onAddedFrameToCubemap,        _1, _2));
         h264CubemapSource->setOnScheduledFrameInCubemap(std::bind(&setOnScheduledFrameInCubemap, _1, _2));
+        h264CubemapSource->setOnFramesAggregatorWokeUp (std::bind(&onFramesAggregatorWokeUp,     _1, _2, _3));
+        h264CubemapSource->setOnPlayedOutCubemap       (std::bind(&onPlayedOutCubemap,           _1, _2, _3, _4));
+        h264CubemapSource->setOnDroppedLateFrame       (std::bind(&onDroppedLateFrame,           _1, _2));
+        h264CubemapSource->setOnDroppedFrameWithoutRoom(std::bind(&onDroppedFrameWithoutRoom,    _1, _2));
+        h264CubemapSource->setOnReceivedUnstampedFrame (std::bind(&onReceivedUnstampedFrame,     _1, _2));
+        h264CubemapSource->setOnRequestedKeyframe      (std::bind(&onRequestedKeyframe,          _1, _2));
+        h264CubemapSource->setOnRecoveredFace          (std::bind(&onRecoveredFace,              _1, _2, _3));
+        h264CubemapSource->setOnShedLoad               (std::bind(&onShedLoad,                   _1, _2, _3));
+        h264CubemapSource->setOnMeasuredDecodeTime     (std::bind(&onMeasuredDecodeTime,         _1, _2, _3));
     }
     
     if (noDisplay)
@@ -109,6 +202,12 @@ void onDidConnect(RTSPCubemapSourceClient* client, CubemapSource* cubemapSource)
     }
 }
 
+void onDidDisconnect(RTSPCubemapSourceClient* client, CubemapSource* cubemapSource)
+{
+    // The renderer keeps showing the last cubemap until the client is connected again
+    std::cout << "Disconnected from the server" << std::endl;
+}
+
 
 
 int main(int argc, char* argv[])
@@ -258,19 +357,91 @@ int main(int argc, char* argv[])
             }
         },
         {
-            "robust-syncing",
+            "cubemap-queue-size",
+            {"size"},
+            [](const std::vector<std::string>& values)
+            {
+                maxFrameMapSize = boost::lexical_cast<size_t>(values[0]);
+            }
+        },
+        {
+            "batched-receive",
             {},
             [](const std::vector<std::string>& values)
             {
-                robustSyncing = true;
+                batchedReceive = true;
             }
         },
         {
-            "cubemap-queue-size",
-            {"size"},
+            "busy-poll",
+            {"microseconds"},
             [](const std::vector<std::string>& values)
             {
-                maxFrameMapSize = boost::lexical_cast<size_t>(values[0]);
+                busyPoll = boost::lexical_cast<int>(values[0]);
+            }
+        },
+        {
+            "cubemap-deadline",
+            {"milliseconds"},
+            [](const std::vector<std::string>& values)
+            {
+                cubemapDeadline = boost::lexical_cast<int>(values[0]);
+            }
+        },
+        {
+            "late-rate",
+            {"percent"},
+            [](const std::vector<std::string>& values)
+            {
+                lateRate = boost::lexical_cast<double>(values[0]);
+            }
+        },
+        {
+            "concealment",
+            {"hold|freeze|mask"},
+            [](const std::vector<std::string>& values)
+            {
+                if (values[0] != "hold" && values[0] != "freeze" && values[0] != "mask")
+                {
+                    throw std::invalid_argument("concealment has to be hold, freeze or mask");
+                }
+                concealment = values[0];
+            }
+        },
+        {
+            "receive-timeout",
+            {"milliseconds"},
+            [](const std::vector<std::string>& values)
+            {
+                receiveTimeout = boost::lexical_cast<int>(values[0]);
+            }
+        },
+        {
+            "decoder-threading",
+            {"none|slice|frame"},
+            [](const std::vector<std::string>& values)
+            {
+                if (values[0] != "none" && values[0] != "slice" && values[0] != "frame")
+                {
+                    throw std::invalid_argument("decoder-threading has to be none, slice or frame");
+                }
+                decoderThreading = values[0];
+            }
+        },
+        {
+            "decoder-cores",
+            {"count"},
+            [](const std::vector<std::string>& values)
+            {
+                decoderCores = boost::lexical_cast<unsigned int>(values[0]);
+            }
+        },
+        {
+            "worker-threads",
+            {"count"},
+            [](const std::vector<std::string>& values)
+            {
+                workerThreads = boost::lexical_cast<size_t>(values[0]);
             }
         }
     };
@@ -336,9 +507,28 @@ int main(int argc, char* argv[])
                     std::cout << std::endl << "                    ";
                 }
                 std::cout << std::endl;
-                std::cout << "Robust syncing:     " << ((robustSyncing) ? "yes" : "no") << std::endl;
                 std::cout << "Cubemap queue size: " << maxFrameMapSize << std::endl;
+                std::cout << "Cubemap deadline:   " << cubemapDeadline << "ms" << std::endl;
+                std::cout << "Late rate:          " << lateRate << "%" << std::endl;
+                std::cout << "Concealment:        " << concealment << std::endl;
+                std::cout << "Receive timeout:    " << receiveTimeout << "ms" << std::endl;
+                std::cout << "Decoder threading:  " << decoderThreading << std::endl;
+                std::cout << "Decoder cores:      " << ((decoderCores > 0) ? std::to_string(decoderCores) : "all") << std::endl;
+                std::cout << "Worker threads:     " << ((workerThreads > 0) ? std::to_string(workerThreads) : "one per core") << std::endl;
+                std::cout << "First cubemap:      ";
+                if (timeToFirstCubemap.load() < 0)
+                {
+                    std::cout << "none yet" << std::endl;
+                }
+                else
+                {
+                    std::cout << timeToFirstCubemap.load() / 1000.0 << "ms after connecting" << std::endl;
+                }
                 std::cout << "Force mono:         " << ((renderer.getForceMono()) ? "yes" : "no") << std::endl;
+                std::cout << "Batched receive:    " << ((batchedReceive) ? "yes" : "no")
+                          << " (recvmmsg: " << ((BatchingReceiveGroupsock::isRecvmmsgSupported()) ? "yes" : "no")
+                          << ", UDP GRO: " << ((BatchingReceiveGroupsock::isGROSupported()) ? "yes" : "no") << ")" << std::endl;
+                std::cout << "Busy poll:          " << busyPoll << "µs" << std::endl;
             }
         }
     };
@@ -371,12 +561,47 @@ int main(int argc, char* argv[])
                                                                           bufferSize,
                                                                           AV_PIX_FMT_YUV420P,
                                                                           matchStereoPairs,
-                                                                          robustSyncing,
                                                                           maxFrameMapSize,
                                                                           interfaceAddress.c_str());
 
     using namespace std::placeholders;
     rtspClient->setOnDidConnect(std::bind(&onDidConnect, _1, _2));
+    rtspClient->setOnDidDisconnect(std::bind(&onDidDisconnect, _1, _2));
+    rtspClient->setOnReceivedBatch(std::bind(&onReceivedBatch, _1, _2, _3));
+    rtspClient->setBatchedReceive(batchedReceive);
+    rtspClient->setBusyPoll(busyPoll);
+    rtspClient->setCubemapDeadline(std::chrono::milliseconds(cubemapDeadline));
+    rtspClient->setLateRate(lateRate / 100.0);
+    rtspClient->setReceiveTimeout(std::chrono::milliseconds(receiveTimeout));
+    if (decoderThreading == "slice")
+    {
+        rtspClient->setDecoderThreading(H264NALUSink::SLICE_THREADING);
+    }
+    else if (decoderThreading == "frame")
+    {
+        rtspClient->setDecoderThreading(H264NALUSink::FRAME_THREADING);
+    }
+    else
+    {
+        rtspClient->setDecoderThreading(H264NALUSink::NO_THREADING);
+    }
+    rtspClient->setDecoderCoreBudget(decoderCores);
+    rtspClient->setWorkerThreadsCount(workerThreads);
+    // The renderer uploads the decoded planes straight from the decoder
+    rtspClient->setFacesReferencePlanes(true);
+    if (concealment == "freeze")
+    {
+        rtspClient->setConcealmentPolicy(FaceConcealer::FREEZE_STEREO_PAIR);
+    }
+    else if (concealment == "mask")
+    {
+        rtspClient->setConcealmentPolicy(FaceConcealer::MASK_CORRUPT);
+    }
+    else
+    {
+        rtspClient->setConcealmentPolicy(FaceConcealer::HOLD_FACE);
+    }
+    connectTime = std::chrono::steady_clock::now();
     rtspClient->connect();
     
     
@@ -0,0 +1,300 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <GroupsockHelper.hh>
+
+#if defined(__linux__)
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <netinet/udp.h>
+    #include <unistd.h>
+#endif
+
+#include "BatchingReceiveGroupsock.hpp"
+#include "BatchingReceiveTaskScheduler.hpp"
+
+#if defined(__linux__)
+
+// Older headers do not know UDP GRO yet
+#ifndef SOL_UDP
+    #define SOL_UDP 17
+#endif
+#ifndef UDP_GRO
+    #define UDP_GRO 104
+#endif
+
+static bool detectRecvmmsg()
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // Receiving nothing only fails with ENOSYS if the syscall is missing
+    bool supported = recvmmsg(fd, NULL, 0, MSG_DONTWAIT, NULL) >= 0 || errno != ENOSYS;
+    close(fd);
+    return supported;
+}
+
+static bool detectGRO()
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    int on = 1;
+    bool supported = setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    close(fd);
+    return supported;
+}
+
+#else
+
+static bool detectRecvmmsg()
+{
+    return false;
+}
+
+static bool detectGRO()
+{
+    return false;
+}
+
+#endif
+
+bool BatchingReceiveGroupsock::isRecvmmsgSupported()
+{
+    static bool supported = detectRecvmmsg();
+    return supported;
+}
+
+bool BatchingReceiveGroupsock::isGROSupported()
+{
+    static bool supported = detectGRO();
+    return supported;
+}
+
+BatchingReceiveGroupsock::BatchingReceiveGroupsock(UsageEnvironment& env, const struct in_addr& groupAddr, Port port, u_int8_t ttl,
+                                                   bool isBatching)
+    :
+    Groupsock(env, groupAddr, port, ttl),
+    nextDatagram(0), isBatching(false), useGRO(false), nextStamp(0), stampsCount(0)
+{
+    memset(recentPackets, 0, sizeof(recentPackets));
+
+    BatchingReceiveTaskScheduler* scheduler = dynamic_cast<BatchingReceiveTaskScheduler*>(&env.taskScheduler());
+    if (!isBatching || !scheduler || !isRecvmmsgSupported() || socketNum() < 0)
+    {
+        return;
+    }
+
+    this->isBatching = true;
+    scheduler->addGroupsock(this);
+
+#if defined(__linux__)
+    if (isGROSupported())
+    {
+        int on = 1;
+        useGRO = setsockopt(socketNum(), SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    }
+#endif
+
+    buffer.resize((useGRO) ? MAX_GRO_MESSAGES * MAX_GRO_MESSAGE_SIZE : MAX_BATCH_MESSAGES * MAX_DATAGRAM_SIZE);
+    datagrams.reserve((useGRO) ? MAX_GRO_MESSAGES * MAX_GRO_MESSAGE_SIZE / 512 : MAX_BATCH_MESSAGES);
+}
+
+BatchingReceiveGroupsock::~BatchingReceiveGroupsock()
+{
+    if (isBatching)
+    {
+        ((BatchingReceiveTaskScheduler&)env().taskScheduler()).removeGroupsock(this);
+    }
+}
+
+size_t BatchingReceiveGroupsock::getPendingDatagramsCount() const
+{
+    return datagrams.size() - nextDatagram;
+}
+
+void BatchingReceiveGroupsock::setOnReceivedBatch(const OnReceivedBatch& callback)
+{
+    onReceivedBatch = callback;
+}
+
+Boolean BatchingReceiveGroupsock::handleRead(unsigned char* buffer, unsigned bufferMaxSize,
+                                             unsigned& bytesRead, struct sockaddr_in& fromAddressAndPort)
+{
+    if (!isBatching)
+    {
+        Boolean result = Groupsock::handleRead(buffer, bufferMaxSize, bytesRead, fromAddressAndPort);
+        if (bytesRead > 0)
+        {
+            keepStamp(buffer, bytesRead);
+            if (onReceivedBatch) onReceivedBatch(this, 1, 1);
+        }
+        return result;
+    }
+
+    // Unlike Groupsock, no loop-back filtering or relaying to other members.
+    // Neither is used for RTP we receive.
+    bytesRead = 0;
+    if (getPendingDatagramsCount() == 0)
+    {
+        if (!receive())
+        {
+            return False;
+        }
+        if (getPendingDatagramsCount() == 0)
+        {
+            return True; // nothing waiting after all
+        }
+    }
+
+    const Datagram& datagram = datagrams[nextDatagram++];
+    bytesRead = (unsigned)(std::min)(datagram.size, (size_t)bufferMaxSize);
+    memcpy(buffer, this->buffer.data() + datagram.offset, bytesRead);
+    fromAddressAndPort = datagram.from;
+    keepStamp(buffer, bytesRead);
+    return True;
+}
+
+void BatchingReceiveGroupsock::keepStamp(const unsigned char* datagram, unsigned size)
+{
+    if (size < 12)
+    {
+        return;
+    }
+
+    u_int16_t rtpSeqNum    = (datagram[2] << 8) | datagram[3];
+    u_int32_t rtpTimestamp = ((u_int32_t)datagram[4] << 24) | (datagram[5] << 16) | (datagram[6] << 8) | datagram[7];
+
+    RecentPacket& packet = recentPackets[rtpSeqNum % MAX_RECENT_PACKETS];
+    packet.isValid      = true;
+    packet.rtpSeqNum    = rtpSeqNum;
+    packet.rtpTimestamp = rtpTimestamp;
+
+    CubemapFrameStamp stamp;
+    if (!CubemapFrameStamp::readRTPPacket(datagram, size, stamp))
+    {
+        return;
+    }
+
+    Stamp& entry = stamps[nextStamp];
+    entry.rtpTimestamp = rtpTimestamp;
+    entry.stamp        = stamp;
+    nextStamp = (nextStamp + 1) % MAX_STAMPS;
+    stampsCount = (std::min)(stampsCount + 1, (size_t)MAX_STAMPS);
+}
+
+bool BatchingReceiveGroupsock::getCubemapFrameStamp(u_int16_t rtpSeqNum, CubemapFrameStamp& stamp) const
+{
+    const RecentPacket& packet = recentPackets[rtpSeqNum % MAX_RECENT_PACKETS];
+    if (!packet.isValid || packet.rtpSeqNum != rtpSeqNum)
+    {
+        return false;
+    }
+
+    // Newest first
+    for (size_t i = 1; i <= stampsCount; i++)
+    {
+        const Stamp& entry = stamps[(nextStamp + MAX_STAMPS - i) % MAX_STAMPS];
+        if (entry.rtpTimestamp == packet.rtpTimestamp)
+        {
+            stamp = entry.stamp;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BatchingReceiveGroupsock::receive()
+{
+    datagrams.clear();
+    nextDatagram = 0;
+
+#if defined(__linux__)
+    const size_t messagesCount = (useGRO) ? MAX_GRO_MESSAGES     : MAX_BATCH_MESSAGES;
+    const size_t slotSize      = (useGRO) ? MAX_GRO_MESSAGE_SIZE : MAX_DATAGRAM_SIZE;
+
+    struct mmsghdr     messages[MAX_BATCH_MESSAGES];
+    struct iovec       iovecs[MAX_BATCH_MESSAGES];
+    struct sockaddr_in froms[MAX_BATCH_MESSAGES];
+    union
+    {
+        char           buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr alignment;
+    }                  controls[MAX_BATCH_MESSAGES];
+
+    for (size_t m = 0; m < messagesCount; m++)
+    {
+        iovecs[m].iov_base = buffer.data() + m * slotSize;
+        iovecs[m].iov_len  = slotSize;
+
+        struct msghdr& header = messages[m].msg_hdr;
+        memset(&header, 0, sizeof(header));
+        header.msg_name    = &froms[m];
+        header.msg_namelen = sizeof(froms[m]);
+        header.msg_iov     = &iovecs[m];
+        header.msg_iovlen  = 1;
+        if (useGRO)
+        {
+            header.msg_control    = controls[m].buffer;
+            header.msg_controllen = sizeof(controls[m].buffer);
+        }
+    }
+
+    int receivedMessagesCount = recvmmsg(socketNum(), messages, (unsigned int)messagesCount, MSG_DONTWAIT, NULL);
+    if (receivedMessagesCount < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            if (onReceivedBatch) onReceivedBatch(this, 0, 1);
+            return true;
+        }
+        env().setResultErrMsg("recvmmsg() error: ");
+        return false;
+    }
+
+    for (int m = 0; m < receivedMessagesCount; m++)
+    {
+        struct msghdr& header = messages[m].msg_hdr;
+        size_t messageSize = messages[m].msg_len;
+        if (header.msg_flags & MSG_TRUNC)
+        {
+            // Not RTP of ours. Receiving part of it would only confuse the reader.
+            continue;
+        }
+
+        // A coalesced message consists of segments of the same size except for the last one
+        size_t segmentSize = messageSize;
+        if (useGRO)
+        {
+            for (struct cmsghdr* control = CMSG_FIRSTHDR(&header); control; control = CMSG_NXTHDR(&header, control))
+            {
+                if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+                {
+                    int gsoSize;
+                    memcpy(&gsoSize, CMSG_DATA(control), sizeof(gsoSize));
+                    if (gsoSize > 0)
+                    {
+                        segmentSize = gsoSize;
+                    }
+                }
+            }
+        }
+
+        for (size_t offset = 0; offset < messageSize; offset += segmentSize)
+        {
+            Datagram datagram = { m * slotSize + offset, (std::min)(segmentSize, messageSize - offset), froms[m] };
+            datagrams.push_back(datagram);
+        }
+    }
+
+    if (onReceivedBatch) onReceivedBatch(this, datagrams.size(), 1);
+#endif
+
+    return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <Groupsock.hh>
+#include <functional>
+#include <vector>
+#include <cstdint>
+
+#include "AlloReceiver.h"
+#include "AlloShared/CubemapFrameStamp.hpp"
+
+// A Groupsock that does not read every RTP packet with its own syscall.
+// When the reader asks for a datagram and none is queued, all datagrams
+// waiting on the socket are taken with one recvmmsg() call. With UDP GRO the
+// kernel additionally coalesces datagrams of a flow, which are split up here again.
+// The reader then gets the queued datagrams one by one.
+// Because select() does not report the socket readable for queued datagrams,
+// a BatchingReceiveTaskScheduler has to hand them to the reader.
+// Without such a scheduler, recvmmsg support or on other platforms than Linux
+// (or with isBatching false) it reads one datagram at a time like Groupsock does
+// but still reports every read so that both paths can be compared.
+// Either way it keeps the CubemapFrameStamps of the RTP header extensions it sees
+// since live555 skips the header extension.
+class ALLORECEIVER_API BatchingReceiveGroupsock : public Groupsock
+{
+public:
+    BatchingReceiveGroupsock(UsageEnvironment& env, const struct in_addr& groupAddr, Port port, u_int8_t ttl,
+                             bool isBatching = true);
+    virtual ~BatchingReceiveGroupsock();
+
+    // Datagrams that have been taken off the socket but not been read yet
+    size_t getPendingDatagramsCount() const;
+
+    typedef std::function<void(BatchingReceiveGroupsock* self,
+                               size_t datagramsCount,
+                               size_t syscallsCount)> OnReceivedBatch;
+
+    void setOnReceivedBatch(const OnReceivedBatch& callback);
+
+    // Whether the kernel supports the respective feature (detected once per process)
+    static bool isRecvmmsgSupported();
+    static bool isGROSupported();
+
+    // Stamp of the frame the RTP packet with the given sequence number belongs to
+    // if one of the frame's packets had one. Only the last few frames are remembered.
+    bool getCubemapFrameStamp(u_int16_t rtpSeqNum, CubemapFrameStamp& stamp) const;
+
+    virtual Boolean handleRead(unsigned char* buffer, unsigned bufferMaxSize,
+                               unsigned& bytesRead, struct sockaddr_in& fromAddressAndPort);
+
+private:
+    // Slots are big enough for jumbo frames or, with GRO, for a coalesced message
+    enum { MAX_BATCH_MESSAGES = 64, MAX_DATAGRAM_SIZE = 9216,
+           MAX_GRO_MESSAGES = 16,   MAX_GRO_MESSAGE_SIZE = 65536,
+           MAX_STAMPS = 16,         MAX_RECENT_PACKETS = 256 };
+
+    struct Datagram
+    {
+        size_t             offset;
+        size_t             size;
+        struct sockaddr_in from;
+    };
+
+    struct Stamp
+    {
+        u_int32_t         rtpTimestamp;
+        CubemapFrameStamp stamp;
+    };
+
+    // live555 only tells the sequence number of the packet it delivered
+    struct RecentPacket
+    {
+        bool      isValid;
+        u_int16_t rtpSeqNum;
+        u_int32_t rtpTimestamp;
+    };
+
+    // Queues all datagrams waiting on the socket. Returns false on error.
+    bool receive();
+    // Remembers the RTP timestamp and stamp of a datagram that is handed out
+    void keepStamp(const unsigned char* datagram, unsigned size);
+
+    OnReceivedBatch onReceivedBatch;
+
+    std::vector<uint8_t>  buffer;
+    std::vector<Datagram> datagrams;
+    size_t                nextDatagram;
+
+    bool isBatching;
+    bool useGRO;
+
+    Stamp        stamps[MAX_STAMPS]; // ring buffer
+    size_t       nextStamp;
+    size_t       stampsCount;
+    RecentPacket recentPackets[MAX_RECENT_PACKETS]; // indexed by sequence number
+};
@@ -0,0 +1,54 @@
+#include "BatchingReceiveMediaSession.hpp"
+#include "BatchingReceiveGroupsock.hpp"
+
+BatchingReceiveMediaSession* BatchingReceiveMediaSession::createNew(UsageEnvironment& env,
+                                                                    char const*       sdpDescription,
+                                                                    bool              isBatching)
+{
+    BatchingReceiveMediaSession* session = new BatchingReceiveMediaSession(env, isBatching);
+    if (!session->initializeWithSDP(sdpDescription))
+    {
+        delete session;
+        return NULL;
+    }
+    return session;
+}
+
+BatchingReceiveMediaSession::BatchingReceiveMediaSession(UsageEnvironment& env, bool isBatching)
+    :
+    MediaSession(env), isBatching(isBatching)
+{
+}
+
+MediaSubsession* BatchingReceiveMediaSession::createNewMediaSubsession()
+{
+    return new BatchingReceiveMediaSubsession(*this, isBatching);
+}
+
+BatchingReceiveMediaSubsession::BatchingReceiveMediaSubsession(MediaSession& parent, bool isBatching)
+    :
+    MediaSubsession(parent), isBatching(isBatching)
+{
+}
+
+Boolean BatchingReceiveMediaSubsession::createSourceObjects(int useSpecialRTPoffset)
+{
+    // Swap the RTP socket initiate() created for one of ours on the same address and port.
+    // Source-specific multicast and RTCP multiplexed with RTP keep theirs.
+    if (fRTPSocket != NULL && fRTPSocket != fRTCPSocket && !fRTPSocket->isSSM())
+    {
+        struct in_addr groupAddress = fRTPSocket->groupAddress();
+        u_int8_t       ttl          = fRTPSocket->ttl();
+
+        // fRTPSocket may have been bound to an ephemeral port, which is fClientPortNum now
+        delete fRTPSocket;
+        fRTPSocket = new BatchingReceiveGroupsock(env(), groupAddress, Port(fClientPortNum), ttl, isBatching);
+        if (fRTPSocket->socketNum() < 0)
+        {
+            env().setResultMsg("Failed to recreate the RTP socket");
+            return False;
+        }
+    }
+
+    return MediaSubsession::createSourceObjects(useSpecialRTPoffset);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <liveMedia.hh>
+
+#include "AlloReceiver.h"
+
+// A MediaSession whose subsessions receive RTP through a BatchingReceiveGroupsock.
+// Everything above the socket (RTP sources, RTCP, sinks) stays as it is.
+class ALLORECEIVER_API BatchingReceiveMediaSession : public MediaSession
+{
+public:
+    static BatchingReceiveMediaSession* createNew(UsageEnvironment& env,
+                                                  char const*       sdpDescription,
+                                                  bool              isBatching);
+
+protected:
+    BatchingReceiveMediaSession(UsageEnvironment& env, bool isBatching);
+
+    virtual MediaSubsession* createNewMediaSubsession();
+
+private:
+    bool isBatching;
+};
+
+class ALLORECEIVER_API BatchingReceiveMediaSubsession : public MediaSubsession
+{
+    friend class BatchingReceiveMediaSession;
+
+protected:
+    BatchingReceiveMediaSubsession(MediaSession& parent, bool isBatching);
+
+    // Called by initiate() once the sockets exist
+    virtual Boolean createSourceObjects(int useSpecialRTPoffset);
+
+private:
+    bool isBatching;
+};
@@ -0,0 +1,60 @@
+#include <algorithm>
+
+#include "BatchingReceiveTaskScheduler.hpp"
+#include "BatchingReceiveGroupsock.hpp"
+
+// Needs BasicUsageEnvironment.hh first
+#include <HandlerSet.hh>
+
+BatchingReceiveTaskScheduler* BatchingReceiveTaskScheduler::createNew(unsigned maxSchedulerGranularity)
+{
+    return new BatchingReceiveTaskScheduler(maxSchedulerGranularity);
+}
+
+BatchingReceiveTaskScheduler::BatchingReceiveTaskScheduler(unsigned maxSchedulerGranularity)
+    :
+    BasicTaskScheduler(maxSchedulerGranularity)
+{
+}
+
+void BatchingReceiveTaskScheduler::addGroupsock(BatchingReceiveGroupsock* groupsock)
+{
+    groupsocks.push_back(groupsock);
+}
+
+void BatchingReceiveTaskScheduler::removeGroupsock(BatchingReceiveGroupsock* groupsock)
+{
+    groupsocks.erase(std::remove(groupsocks.begin(), groupsocks.end(), groupsock), groupsocks.end());
+}
+
+void BatchingReceiveTaskScheduler::SingleStep(unsigned maxDelayTime)
+{
+    for (BatchingReceiveGroupsock* groupsock : groupsocks)
+    {
+        // The reader takes one datagram per call. It is looked up every time
+        // because it may turn off its read handling in between.
+        for (size_t i = groupsock->getPendingDatagramsCount(); i > 0; i--)
+        {
+            HandlerIterator iterator(*fHandlers);
+            HandlerDescriptor* handler;
+            while ((handler = iterator.next()) != NULL)
+            {
+                if (handler->socketNum == groupsock->socketNum() &&
+                    (handler->conditionSet & SOCKET_READABLE) &&
+                    handler->handlerProc != NULL)
+                {
+                    break;
+                }
+            }
+
+            if (handler == NULL)
+            {
+                // Nobody reads for now. The datagrams wait for the next reader.
+                break;
+            }
+            (*handler->handlerProc)(handler->clientData, SOCKET_READABLE);
+        }
+    }
+
+    BasicTaskScheduler::SingleStep(maxDelayTime);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <BasicUsageEnvironment.hh>
+#include <vector>
+
+#include "AlloReceiver.h"
+
+class BatchingReceiveGroupsock;
+
+// A BasicTaskScheduler that hands datagrams queued by BatchingReceiveGroupsocks
+// to their readers before it waits in select() again.
+// select() does not know about them since they are not on the socket anymore.
+class ALLORECEIVER_API BatchingReceiveTaskScheduler : public BasicTaskScheduler
+{
+public:
+    static BatchingReceiveTaskScheduler* createNew(unsigned maxSchedulerGranularity = 10000/*microseconds*/);
+
+    // Called by BatchingReceiveGroupsock
+    void addGroupsock   (BatchingReceiveGroupsock* groupsock);
+    void removeGroupsock(BatchingReceiveGroupsock* groupsock);
+
+protected:
+    BatchingReceiveTaskScheduler(unsigned maxSchedulerGranularity);
+
+    virtual void SingleStep(unsigned maxDelayTime);
+
+private:
+    std::vector<BatchingReceiveGroupsock*> groupsocks;
+};
@@ -0,0 +1,113 @@
+#include "FaceConcealer.hpp"
+
+FaceConcealer::FaceConcealer(Policy policy, size_t facesCount, size_t stereoPairOffset, const ReleaseFrame& releaseFrame)
+    :
+    policy(policy), stereoPairOffset(stereoPairOffset), releaseFrame(releaseFrame),
+    lastGoodFrames(facesCount, nullptr), damagedShownFrames(facesCount, nullptr),
+    isConcealing(facesCount, false), concealedSince(facesCount)
+{
+}
+
+void FaceConcealer::clear()
+{
+    for (size_t i = 0; i < lastGoodFrames.size(); i++)
+    {
+        if (lastGoodFrames[i])
+        {
+            releaseFrame(i, lastGoodFrames[i]);
+            lastGoodFrames[i] = nullptr;
+        }
+        if (damagedShownFrames[i])
+        {
+            releaseFrame(i, damagedShownFrames[i]);
+            damagedShownFrames[i] = nullptr;
+        }
+        isConcealing[i] = false;
+    }
+}
+
+FaceConcealer::Policy FaceConcealer::getPolicy()
+{
+    return policy;
+}
+
+bool FaceConcealer::isDamaged(AVFrame* frame)
+{
+    // H264NALUSink marks frames with lost packets or damaged references
+    return frame->decode_error_flags != 0;
+}
+
+void FaceConcealer::conceal(const std::vector<AVFrame*>&          frames,
+                            std::chrono::steady_clock::time_point now,
+                            std::vector<Picture>&                 pictures)
+{
+    size_t facesCount = lastGoodFrames.size();
+
+    for (size_t i = 0; i < facesCount; i++)
+    {
+        if (damagedShownFrames[i])
+        {
+            releaseFrame(i, damagedShownFrames[i]);
+            damagedShownFrames[i] = nullptr;
+        }
+    }
+
+    // Whether a face may show its new frame
+    std::vector<bool> isShown(facesCount);
+    for (size_t i = 0; i < facesCount; i++)
+    {
+        AVFrame* frame = (i < frames.size()) ? frames[i] : nullptr;
+        isShown[i] = frame && (policy == MASK_CORRUPT || !isDamaged(frame));
+    }
+    if (policy == FREEZE_STEREO_PAIR && stereoPairOffset > 0)
+    {
+        for (size_t i = 0; i + stereoPairOffset < facesCount; i++)
+        {
+            bool isPairShown = isShown[i] && isShown[i + stereoPairOffset];
+            isShown[i]                    = isPairShown;
+            isShown[i + stereoPairOffset] = isPairShown;
+        }
+    }
+
+    pictures.resize(facesCount);
+    for (size_t i = 0; i < facesCount; i++)
+    {
+        AVFrame* frame   = (i < frames.size()) ? frames[i] : nullptr;
+        Picture& picture = pictures[i];
+
+        if (isShown[i])
+        {
+            picture.frame       = frame;
+            picture.isNew       = true;
+            picture.isConcealed = isDamaged(frame);
+            if (picture.isConcealed)
+            {
+                damagedShownFrames[i] = frame;
+            }
+            else
+            {
+                if (lastGoodFrames[i]) releaseFrame(i, lastGoodFrames[i]);
+                lastGoodFrames[i] = frame;
+            }
+        }
+        else
+        {
+            if (frame) releaseFrame(i, frame);
+            picture.frame       = lastGoodFrames[i];
+            picture.isNew       = false;
+            picture.isConcealed = true;
+        }
+
+        picture.recoveredAfter = std::chrono::microseconds(0);
+        if (picture.isConcealed && !isConcealing[i])
+        {
+            isConcealing[i]   = true;
+            concealedSince[i] = now;
+        }
+        else if (!picture.isConcealed && isConcealing[i])
+        {
+            isConcealing[i]        = false;
+            picture.recoveredAfter = std::chrono::duration_cast<std::chrono::microseconds>(now - concealedSince[i]);
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavutil/frame.h>
+}
+#include <chrono>
+#include <vector>
+#include <functional>
+
+#include "AlloReceiver.h"
+
+// Decides what a face shows when its frame for a cubemap is missing or damaged
+// by lost packets (see H264NALUSink::getNextFrame()) so that a single lost packet
+// does not show up as artifacts on the screen.
+// It holds on to the last good frame of every face for that.
+// Only one thread may use it.
+class ALLORECEIVER_API FaceConcealer
+{
+public:
+    enum Policy
+    {
+        // A missing or damaged frame is replaced by the face's last good one
+        HOLD_FACE,
+        // Like HOLD_FACE, but both eyes of a face hold if either does so that the stereo pair stays consistent
+        FREEZE_STEREO_PAIR,
+        // A damaged frame is shown as libavcodec's error concealment masked its broken macroblocks.
+        // A missing one is replaced by the face's last good one.
+        MASK_CORRUPT
+    };
+
+    // The frames belong to the face's sink
+    typedef std::function<void (size_t face, AVFrame* frame)> ReleaseFrame;
+
+    // Face i and face i + stereoPairOffset are the left and right eye of the same face
+    FaceConcealer(Policy policy, size_t facesCount, size_t stereoPairOffset, const ReleaseFrame& releaseFrame);
+
+    struct Picture
+    {
+        // What the face shows (nullptr if nothing good came yet).
+        // Stays valid until the next call of conceal().
+        AVFrame*                  frame;
+        // Whether frame is the new one
+        bool                      isNew;
+        // Whether the face does not show an intact new frame
+        bool                      isConcealed;
+        // How long the face was concealed if it just stopped being concealed, zero otherwise
+        std::chrono::microseconds recoveredAfter;
+    };
+
+    // frames[i] is the new frame of face i for the next cubemap (nullptr if it is missing).
+    // Takes over all frames and releases them once they are not needed any more.
+    void conceal(const std::vector<AVFrame*>&          frames,
+                 std::chrono::steady_clock::time_point now,
+                 std::vector<Picture>&                 pictures);
+
+    // Releases all frames it holds on to
+    void clear();
+    
+    Policy getPolicy();
+
+private:
+    static bool isDamaged(AVFrame* frame);
+
+    Policy       policy;
+    size_t       stereoPairOffset;
+    ReleaseFrame releaseFrame;
+
+    std::vector<AVFrame*> lastGoodFrames;
+    // Shown by the last conceal() call but not good, so released by the next one
+    std::vector<AVFrame*> damagedShownFrames;
+
+    std::vector<bool>                                  isConcealing;
+    std::vector<std::chrono::steady_clock::time_point> concealedSince;
+};
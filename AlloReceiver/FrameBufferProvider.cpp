@@ -0,0 +1,180 @@
+#include "FrameBufferProvider.hpp"
+
+#include <cstdint>
+
+void FrameBufferProvider::install(AVCodecContext* context)
+{
+    context->opaque      = this;
+    context->get_buffer2 = &FrameBufferProvider::getBuffer2;
+    // With frame threading the decoder threads get their pictures themselves
+    context->thread_safe_callbacks = 1;
+}
+
+Frame* FrameBufferProvider::getFrame(const AVFrame* picture)
+{
+    // Set by getBuffer2(). Pictures that were converted or copied have none.
+    Frame* frame = (Frame*)picture->opaque;
+    if (frame && frame->getPixels() == picture->data[0])
+    {
+        return frame;
+    }
+    return nullptr;
+}
+
+int FrameBufferProvider::getBuffer2(AVCodecContext* context, AVFrame* picture, int flags)
+{
+    FrameBufferProvider* self   = (FrameBufferProvider*)context->opaque;
+    AVPixelFormat        format = (AVPixelFormat)picture->format;
+    picture->opaque = nullptr;
+
+    // How much room the decoder wants around the picture and how its rows have to be aligned
+    int alignedWidth  = picture->width;
+    int alignedHeight = picture->height;
+    int linesizeAlignments[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(context, &alignedWidth, &alignedHeight, linesizeAlignments);
+
+    // Rows below the picture fit at the end of the buffer, but there is no room on its right.
+    // The decoder only writes whole macroblocks, so the picture has to consist of them.
+    if (alignedWidth == picture->width && picture->width % 16 == 0 && picture->height % 16 == 0)
+    {
+        // Offsets of the planes from the start of the buffer
+        AVPicture layout;
+        int pictureSize = avpicture_fill(&layout, NULL, format, picture->width, picture->height);
+
+        bool isAligned = pictureSize > 0;
+        for (int i = 0; i < AV_NUM_DATA_POINTERS && i < 4 && isAligned; i++)
+        {
+            if (layout.linesize[i] > 0)
+            {
+                isAligned = (uintptr_t)layout.data[i] % Frame::PIXELS_ALIGNMENT == 0 &&
+                            layout.linesize[i] % linesizeAlignments[i] == 0;
+            }
+        }
+
+        if (isAligned)
+        {
+            int          size   = pictureSize + (alignedHeight - picture->height) * layout.linesize[0];
+            Frame*       frame  = nullptr;
+            AVBufferRef* buffer = self->getBuffer(picture->width, picture->height, format, size, frame);
+            if (buffer)
+            {
+                picture->buf[0] = buffer;
+                for (int i = 0; i < 4; i++)
+                {
+                    picture->data[i]     = (layout.linesize[i] > 0) ? buffer->data + (uintptr_t)layout.data[i] : NULL;
+                    picture->linesize[i] = layout.linesize[i];
+                }
+                picture->extended_data = picture->data;
+                picture->opaque        = frame;
+                return 0;
+            }
+        }
+    }
+
+    return avcodec_default_get_buffer2(context, picture, flags);
+}
+
+FrameBufferPool::FrameBufferPool(Allocator& allocator, size_t maxFramesCount)
+    :
+    allocator(allocator), maxFramesCount(maxFramesCount)
+{
+}
+
+FrameBufferPool::~FrameBufferPool()
+{
+    for (Frame* frame : freeFrames)
+    {
+        Frame::destroy(frame);
+    }
+}
+
+AVBufferRef* FrameBufferPool::getBuffer(int width, int height, AVPixelFormat format, int size, Frame*& frame)
+{
+    if ((size_t)width * height * 4 < (size_t)size)
+    {
+        // Does not fit into a frame's pixels
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    Frame* result = nullptr;
+    while (!result && !freeFrames.empty())
+    {
+        result = freeFrames.back();
+        freeFrames.pop_back();
+        if ((int)result->getWidth() != width || (int)result->getHeight() != height || result->getFormat() != format)
+        {
+            // Left over from before the resolution changed
+            Frame::destroy(result);
+            result = nullptr;
+        }
+    }
+
+    if (!result)
+    {
+        if (usedFrames.size() >= maxFramesCount)
+        {
+            return nullptr;
+        }
+        result = Frame::create(width, height, format, std::chrono::system_clock::time_point(), allocator);
+    }
+
+    AVBufferRef* buffer = av_buffer_create((uint8_t*)result->getPixels(), size, &FrameBufferPool::releaseBuffer, this, 0);
+    if (!buffer)
+    {
+        freeFrames.push_back(result);
+        return nullptr;
+    }
+
+    usedFrames[result->getPixels()] = result;
+    frame = result;
+    return buffer;
+}
+
+void FrameBufferPool::releaseBuffer(void* self, uint8_t* data)
+{
+    FrameBufferPool* pool = (FrameBufferPool*)self;
+    std::unique_lock<std::mutex> lock(pool->mutex);
+
+    std::map<void*, Frame*>::iterator it = pool->usedFrames.find(data);
+    if (it != pool->usedFrames.end())
+    {
+        pool->freeFrames.push_back(it->second);
+        pool->usedFrames.erase(it);
+    }
+}
+
+StagingBufferProvider::StagingBufferProvider(const std::vector<uint8_t*>& buffers, int bufferSize)
+    :
+    bufferSize(bufferSize), freeBuffers(buffers)
+{
+}
+
+AVBufferRef* StagingBufferProvider::getBuffer(int width, int height, AVPixelFormat format, int size, Frame*& frame)
+{
+    if (size > bufferSize)
+    {
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (freeBuffers.empty())
+    {
+        return nullptr;
+    }
+
+    AVBufferRef* buffer = av_buffer_create(freeBuffers.back(), size, &StagingBufferProvider::releaseBuffer, this, 0);
+    if (buffer)
+    {
+        freeBuffers.pop_back();
+    }
+    return buffer;
+}
+
+void StagingBufferProvider::releaseBuffer(void* self, uint8_t* data)
+{
+    StagingBufferProvider* provider = (StagingBufferProvider*)self;
+    std::unique_lock<std::mutex> lock(provider->mutex);
+    provider->freeBuffers.push_back(data);
+}
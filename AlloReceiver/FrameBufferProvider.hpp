@@ -0,0 +1,85 @@
+#pragma once
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/buffer.h>
+    #include <libavutil/frame.h>
+}
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include "AlloReceiver.h"
+#include "AlloShared/Frame.hpp"
+#include "AlloShared/Allocator.h"
+
+// Decides where a decoder puts its pictures (see AVCodecContext::get_buffer2), e.g. into the
+// storage of a Frame, so that its consumer gets them without a copy.
+// The planes are laid out one after the other like avpicture_layout() does. Pictures that
+// cannot be laid out like that or for which getBuffer() has no buffer are left to libavcodec.
+// A buffer must not be handed out again until its AVBufferRef was freed, since the decoder
+// holds on to reference pictures and the pictures may be referenced further down the pipeline.
+// The provider has to outlive all buffers it handed out.
+class ALLORECEIVER_API FrameBufferProvider
+{
+public:
+    virtual ~FrameBufferProvider() {}
+
+    // Makes the decoder get its pictures from this provider. context->opaque is taken for that.
+    void install(AVCodecContext* context);
+
+    // The frame whose pixels hold picture's planes, nullptr if they are not a frame's
+    static Frame* getFrame(const AVFrame* picture);
+
+protected:
+    // A buffer of at least size bytes for a width x height picture of format,
+    // aligned to Frame::PIXELS_ALIGNMENT. nullptr if there is none.
+    // frame is set to the frame whose pixels the buffer is, nullptr if it is no frame's.
+    // Called from the decoder's threads.
+    virtual AVBufferRef* getBuffer(int width, int height, AVPixelFormat format, int size, Frame*& frame) = 0;
+
+private:
+    static int getBuffer2(AVCodecContext* context, AVFrame* picture, int flags);
+};
+
+// Hands out frames allocated with allocator (e.g. a HeapAllocator or a ShmAllocator), reusing the released ones.
+// There are at most maxFramesCount at a time, the decoder allocates further pictures itself.
+// The frames have a single slot.
+class ALLORECEIVER_API FrameBufferPool : public FrameBufferProvider
+{
+public:
+    FrameBufferPool(Allocator& allocator, size_t maxFramesCount);
+    ~FrameBufferPool();
+
+protected:
+    virtual AVBufferRef* getBuffer(int width, int height, AVPixelFormat format, int size, Frame*& frame);
+
+private:
+    static void releaseBuffer(void* self, uint8_t* data);
+
+    Allocator&               allocator;
+    size_t                   maxFramesCount;
+    std::mutex               mutex;
+    std::vector<Frame*>      freeFrames;
+    // By their pixels
+    std::map<void*, Frame*>  usedFrames;
+};
+
+// Hands out buffers that belong to the caller, e.g. mapped upload buffers.
+// They have to be bufferSize bytes each and aligned to Frame::PIXELS_ALIGNMENT.
+class ALLORECEIVER_API StagingBufferProvider : public FrameBufferProvider
+{
+public:
+    StagingBufferProvider(const std::vector<uint8_t*>& buffers, int bufferSize);
+
+protected:
+    virtual AVBufferRef* getBuffer(int width, int height, AVPixelFormat format, int size, Frame*& frame);
+
+private:
+    static void releaseBuffer(void* self, uint8_t* data);
+
+    int                   bufferSize;
+    std::mutex            mutex;
+    std::vector<uint8_t*> freeBuffers;
+};
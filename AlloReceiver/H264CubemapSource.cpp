@@ -2,8 +2,12 @@
 #include <unordered_map>
 #include <functional>
 #include <iostream>
-#include <boost/accumulators/accumulators.hpp>
-#include <boost/accumulators/statistics/median.hpp>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
 
 extern "C"
 {
@@ -48,109 +52,282 @@ void H264CubemapSource::setOnScheduledFrameInCubemap(const OnScheduledFrameInCub
     onScheduledFrameInCubemap = callback;
 }
 
+void H264CubemapSource::setOnFramesAggregatorWokeUp(const OnFramesAggregatorWokeUp& callback)
+{
+    onFramesAggregatorWokeUp = callback;
+}
+
+void H264CubemapSource::setOnPlayedOutCubemap(const OnPlayedOutCubemap& callback)
+{
+    onPlayedOutCubemap = callback;
+}
+
+void H264CubemapSource::setOnDroppedLateFrame(const OnDroppedLateFrame& callback)
+{
+    onDroppedLateFrame = callback;
+}
+
+void H264CubemapSource::setOnDroppedFrameWithoutRoom(const OnDroppedFrameWithoutRoom& callback)
+{
+    onDroppedFrameWithoutRoom = callback;
+}
+
+void H264CubemapSource::setOnReceivedUnstampedFrame(const OnReceivedUnstampedFrame& callback)
+{
+    onReceivedUnstampedFrame = callback;
+}
+
+void H264CubemapSource::setOnRequestedKeyframe(const OnRequestedKeyframe& callback)
+{
+    onRequestedKeyframe = callback;
+}
+
+void H264CubemapSource::setOnRecoveredFace(const OnRecoveredFace& callback)
+{
+    onRecoveredFace = callback;
+}
+
+void H264CubemapSource::setOnShedLoad(const OnShedLoad& callback)
+{
+    onShedLoad = callback;
+}
+
+void H264CubemapSource::setOnMeasuredDecodeTime(const OnMeasuredDecodeTime& callback)
+{
+    onMeasuredDecodeTime = callback;
+}
+
+// Releases the planes a face referenced (see CubemapFace::setPlanes())
+static void releaseFrameReference(void* owner)
+{
+    AVFrame* frame = (AVFrame*)owner;
+    av_frame_free(&frame);
+}
+
+static size_t countBits(uint32_t mask)
+{
+    size_t count = 0;
+    for (; mask; mask &= mask - 1)
+    {
+        count++;
+    }
+    return count;
+}
+
+// CPU time the calling thread used so far
+static std::chrono::microseconds getThreadCPUTime()
+{
+#if defined(_WIN32)
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime);
+    uint64_t hundredNanoseconds = ((uint64_t)kernelTime.dwHighDateTime << 32) + kernelTime.dwLowDateTime +
+                                  ((uint64_t)userTime.dwHighDateTime   << 32) + userTime.dwLowDateTime;
+    return std::chrono::microseconds(hundredNanoseconds / 10);
+#else
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return std::chrono::microseconds((int64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000);
+#endif
+}
+
 void H264CubemapSource::getNextFramesLoop()
 {
 	std::vector<AVFrame*> frames(sinks.size(), nullptr);
+    uint32_t expectedFaces = 0;
+    size_t   expectedFacesCount = sinks.size();
+    
+    // Sinks may have got frames before they knew the waiter
+    uint64_t readyMask = ~(uint64_t)0;
+    std::chrono::microseconds wakeUpLatency(0);
+    std::chrono::microseconds lastCPUTime = getThreadCPUTime();
 
-    while (true)
+    while (!isStopping)
     {
-        // Get all the decoded frames
+        // Get all the decoded frames of the sinks that notified us
         for (int i = 0; i < sinks.size(); i++)
         {
+            if (!(readyMask & ((uint64_t)1 << (i % MultiQueueWaiter::MAX_QUEUES))))
+            {
+                continue;
+            }
             
-			frames[i] = sinks[i]->getNextFrame();
-            
-            if (frames[i])
+			while ((frames[i] = sinks[i]->getNextFrame()))
             {
-                std::unique_lock<std::mutex> lock(frameMapMutex);
-                
                 int64_t key;
-                if (robustSyncing)
-                {
-                    key = frames[i]->pts;
-                }
-                else
+                if (frames[i]->pkt_pos == -1)
                 {
+                    // The server does not stamp or live555 read the packet with the stamp itself
+                    // (see BatchingReceiveGroupsock). The decoders number the frames of all faces
+                    // alike as long as they decoded the same ones.
                     key = frames[i]->coded_picture_number;
+                    if (onReceivedUnstampedFrame) onReceivedUnstampedFrame(this, i);
                 }
-                
-                if (key <= lastFrameSeqNum)
+                else
                 {
-                    std::cout << "frame comes too late (" << lastFrameSeqNum-key+1 << " frame/s)" << std::endl;
-                    sinks[i]->returnFrame(frames[i]);
-                    continue;
+                    CubemapFrameStamp stamp = CubemapFrameStamp::unpack(frames[i]->pkt_pos);
+                    if (stamp.expectedFaces != expectedFaces)
+                    {
+                        expectedFaces = stamp.expectedFaces;
+                        expectedFacesCount = countBits(expectedFaces);
+                        frameRing.setCompleteMask(expectedFaces);
+                    }
+                    key = stamp.frameId;
                 }
                 
-                if (frameMap.find(key) == frameMap.end())
-                {
-                    frameMap[key].resize(sinks.size());
-                }
+                // Late frames count as well so that the playout delay grows
+                playoutScheduler.addFrame(i, (uint32_t)key, frames[i]->pts, std::chrono::steady_clock::now(), expectedFacesCount);
                 
-                std::vector<AVFrame*>& bucketFrames = frameMap[key];
-                if (bucketFrames[i])
+                switch (frameRing.insert(key, i, frames[i]))
                 {
+                case ReorderRing<AVFrame*>::INSERTED:
+                    if (onAddedFrameToCubemap) onAddedFrameToCubemap(this, i);
+                    cubemapWaiter.notify(0);
+                    break;
+                case ReorderRing<AVFrame*>::LATE:
+                    // Its cubemap was shown already
+                    sinks[i]->returnFrame(frames[i]);
+                    if (onDroppedLateFrame) onDroppedLateFrame(this, i);
+                    break;
+                case ReorderRing<AVFrame*>::DUPLICATE:
                     // Matches should not happen here.
                     // If it happens give back frame immediately
                     std::cout << "match!? (" << i << ", " << key << ")" << std::endl;
                     sinks[i]->returnFrame(frames[i]);
+                    break;
+                case ReorderRing<AVFrame*>::FULL:
+                    // Cubemaps are not taken out as fast as they come in
+                    sinks[i]->returnFrame(frames[i]);
+                    if (onDroppedFrameWithoutRoom) onDroppedFrameWithoutRoom(this, i);
+                    break;
+                }
+            }
+        }
+        
+        std::chrono::microseconds cpuTime = getThreadCPUTime();
+        if (onFramesAggregatorWokeUp) onFramesAggregatorWokeUp(this, wakeUpLatency, cpuTime - lastCPUTime);
+        lastCPUTime = cpuTime;
+        
+        // Sleep until a sink has a frame
+        readyMask = framesWaiter.wait(wakeUpLatency);
+    }
+}
+
+bool H264CubemapSource::waitForNextCubemap(std::vector<AVFrame*>& frames)
+{
+    // The oldest pending cubemap and since when we know it
+    uint32_t                              oldestKey = 0;
+    std::chrono::steady_clock::time_point oldestKeySince;
+    bool                                  hasOldestKey = false;
+    
+    while (!isStopping)
+    {
+        std::chrono::microseconds timeout = std::chrono::microseconds::max();
+        
+        uint32_t key;
+        bool     complete;
+        size_t   pendingCubemaps;
+        if (frameRing.peekOldest(key, complete, pendingCubemaps))
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (!hasOldestKey || key != oldestKey)
+            {
+                // We get woken up for every frame so this is about when its first face arrived
+                oldestKey      = key;
+                oldestKeySince = now;
+                hasOldestKey   = true;
+            }
+            
+            bool isDue;
+            bool isTooLate = false;
+            size_t maxPendingCubemaps;
+            std::chrono::steady_clock::time_point playoutTime;
+            if (playoutScheduler.getPlayoutTime(key, playoutTime))
+            {
+                // Faces that are still missing then keep their previous picture
+                isDue = now >= playoutTime;
+                if (isDue)
+                {
+                    // Showing it more than a frame late would only delay the next one if that is here already
+                    std::chrono::microseconds frameInterval = playoutScheduler.getFrameInterval();
+                    isTooLate = pendingCubemaps > 1 && frameInterval.count() > 0 && now - playoutTime > frameInterval;
                 }
                 else
                 {
-                    bucketFrames[i] = frames[i];
-                    if (onAddedFrameToCubemap) onAddedFrameToCubemap(this, i);
+                    // Rounded up so that we do not wake up right before it is due
+                    timeout = std::chrono::duration_cast<std::chrono::microseconds>(playoutTime - now) + std::chrono::microseconds(1);
                 }
-                
-                if (frameMap.size() >= maxFrameMapSize)
+                // Cubemaps wait for their playout time, so more are pending
+                maxPendingCubemaps = frameRing.getCapacity() / 2;
+            }
+            else
+            {
+                // Nothing is known about its schedule yet, e.g. since no cubemap was complete so far
+                std::chrono::microseconds waited = std::chrono::duration_cast<std::chrono::microseconds>(now - oldestKeySince);
+                isDue = complete || waited >= cubemapDeadline;
+                if (!isDue)
                 {
-                    frameMapCondition.notify_all();
+                    timeout = cubemapDeadline - waited;
                 }
+                maxPendingCubemaps = maxFrameMapSize;
+            }
+            
+            if (isDue || pendingCubemaps >= maxPendingCubemaps)
+            {
+                bool late;
+                frameRing.claimOldest(frames, late);
+                // late is set if a newer cubemap was shown already
+                return !late && !isTooLate;
             }
         }
+        
+        std::chrono::microseconds wakeUpLatency;
+        cubemapWaiter.wait(wakeUpLatency, timeout);
     }
+    return false;
 }
 
 void H264CubemapSource::getNextCubemapLoop()
 {
-    int64_t lastPTS = 0;
-    std::chrono::system_clock::time_point lastDisplayTime(std::chrono::microseconds(0));
-    
-    while (true)
+    while (!isStopping)
     {
-        size_t pendingCubemaps;
-        int frameSeqNum;
-        // Get frames with the oldest frame seq # and remove the associated bucket
         std::vector<AVFrame*> frames;
+        if (!waitForNextCubemap(frames))
         {
-            std::unique_lock<std::mutex> lock(frameMapMutex);
-            
-            if (frameMap.size() < maxFrameMapSize)
+            for (int i = 0; i < frames.size(); i++)
             {
-                frameMapCondition.wait(lock);
+                if (frames[i])
+                {
+                    sinks[i]->returnFrame(frames[i]);
+                    if (onDroppedLateFrame) onDroppedLateFrame(this, i);
+                }
             }
-            pendingCubemaps = frameMap.size();
-            
-            auto it = frameMap.begin();
-            frameSeqNum = it->first;
-            lastFrameSeqNum = frameSeqNum;
-            frames = it->second;
-            frameMap.erase(it);
+            continue;
         }
         
+        // Missing and damaged faces are concealed according to the policy
+        std::vector<FaceConcealer::Picture> pictures;
+        faceConcealer.conceal(frames, std::chrono::steady_clock::now(), pictures);
+        
         StereoCubemap* cubemap;
         
         // Allocate cubemap if necessary
         if (!oldCubemap)
         {
-            int width, height;
-            for (AVFrame* frame : frames)
+            int width = 0, height = 0;
+            for (const FaceConcealer::Picture& picture : pictures)
             {
-                if (frame)
+                if (picture.frame)
                 {
-                    width  = frame->width;
-                    height = frame->height;
+                    width  = picture.frame->width;
+                    height = picture.frame->height;
                     break;
                 }
             }
+            if (width == 0)
+            {
+                // Nothing good came so far
+                continue;
+            }
             
             std::vector<Cubemap*> eyes;
             for (int j = 0, faceIndex = 0; j < StereoCubemap::MAX_EYES_COUNT && faceIndex < sinks.size(); j++)
@@ -181,117 +358,81 @@ void H264CubemapSource::getNextCubemapLoop()
             cubemap = oldCubemap;
         }
         
-        size_t count = 0;
-        // Fill cubemap making sure stereo pairs match
-        for (int i = 0; i < (std::min)(frames.size(), (size_t)CUBEMAP_MAX_FACES_COUNT); i++)
+        // Fill the cubemap faces with the pictures the concealer picked.
+        // The cubemap we get back may be an older one so held pictures have to be copied (or referenced) again.
+        int concealedFaces = 0;
+        for (int i = 0; i < (std::min)(pictures.size(), (size_t)(StereoCubemap::MAX_EYES_COUNT * CUBEMAP_MAX_FACES_COUNT)); i++)
         {
-            AVFrame*     leftFrame = frames[i];
-            CubemapFace* leftFace  = cubemap->getEye(0)->getFace(i, true);
+            const FaceConcealer::Picture& picture = pictures[i];
+            CubemapFace* face = cubemap->getEye(i / CUBEMAP_MAX_FACES_COUNT)->getFace(i % CUBEMAP_MAX_FACES_COUNT, true);
             
-            AVFrame*     rightFrame = nullptr;
-            CubemapFace* rightFace  = nullptr;
+            // Set if the decoder wrote the picture straight into a frame (see FrameBufferProvider)
+            Frame* pictureContent = (picture.frame) ? FrameBufferProvider::getFrame(picture.frame) : nullptr;
             
-            if (frames.size() > i + CUBEMAP_MAX_FACES_COUNT)
+            if (picture.frame && (isReferencingPlanes || pictureContent))
             {
-                rightFrame = frames[i+CUBEMAP_MAX_FACES_COUNT];
-                rightFace  = cubemap->getEye(1)->getFace(i, true);
-            }
-            
-            if (matchStereoPairs && frames.size() > i + CUBEMAP_MAX_FACES_COUNT)
-            {
-                // check if matched
-                if (!leftFrame || !rightFrame)
+                // The face keeps its own reference, so the planes outlive the sink's frame
+                // and stay valid for as long as the user of this library holds the cubemap.
+                // A picture that is a frame's pixels becomes the face's content instead of being copied into it.
+                AVFrame* reference = av_frame_clone(picture.frame);
+                if (reference)
                 {
-                    // if they don't match give them back and forget about them
-                    sinks[i]->returnFrame(leftFrame);
-                    sinks[i + CUBEMAP_MAX_FACES_COUNT]->returnFrame(rightFrame);
-                    leftFrame  = nullptr;
-                    rightFrame = nullptr;
+                    face->setPlanes(reference->data, reference->linesize, &releaseFrameReference, reference, pictureContent);
                 }
             }
-            
-            // Fill the cubemapfaces with pixels if pixels are available
-            if (leftFrame)
-            {
-                count++;
-                leftFace->setNewFaceFlag(true);
-                avpicture_layout((AVPicture*)leftFrame, (AVPixelFormat)leftFrame->format,
-                                 leftFrame->width, leftFrame->height,
-                                 (unsigned char*)leftFace->getContent()->getPixels(), leftFace->getContent()->getWidth() * leftFace->getContent()->getHeight() * 4);
-                sinks[i]->returnFrame(leftFrame);
-                if (onScheduledFrameInCubemap) onScheduledFrameInCubemap(this, i);
-            }
-            else
+            else if (picture.frame)
             {
-                leftFace->setNewFaceFlag(false);
+                // The face may still show a picture of the decoder's from an earlier cubemap
+                face->releasePlanes();
+                avpicture_layout((AVPicture*)picture.frame, (AVPixelFormat)picture.frame->format,
+                                 picture.frame->width, picture.frame->height,
+                                 (unsigned char*)face->getContent()->getPixels(), face->getContent()->getWidth() * face->getContent()->getHeight() * 4);
             }
+            face->setNewFaceFlag(picture.isNew);
             
-            if (rightFrame)
-            {
-                count++;
-                rightFace->setNewFaceFlag(true);
-                avpicture_layout((AVPicture*)rightFrame, (AVPixelFormat)rightFrame->format,
-                                 rightFrame->width, rightFrame->height,
-                                 (unsigned char*)rightFace->getContent()->getPixels(), rightFace->getContent()->getWidth() * rightFace->getContent()->getHeight() * 4);
-                sinks[i + CUBEMAP_MAX_FACES_COUNT]->returnFrame(rightFrame);
-                if (onScheduledFrameInCubemap) onScheduledFrameInCubemap(this, i+CUBEMAP_MAX_FACES_COUNT);
-            }
-            else if (rightFace)
+            if (picture.isNew && onScheduledFrameInCubemap) onScheduledFrameInCubemap(this, i);
+            if (picture.isConcealed)
             {
-                rightFace->setNewFaceFlag(false);
+                concealedFaces++;
             }
+            if (picture.recoveredAfter.count() > 0 && onRecoveredFace) onRecoveredFace(this, i, picture.recoveredAfter);
         }
         
-        // Give it to the user of this library (AlloPlayer etc.)
+        // Give it to the user of this library (AlloPlayer etc.).
+        // waitForNextCubemap() returned at its playout time already.
         if (onNextCubemap)
         {
-            // calculate PTS for the cubemap (median of the individual faces' PTS)
-            boost::accumulators::accumulator_set<int64_t, boost::accumulators::features<boost::accumulators::tag::median> > acc;
-            for (AVFrame* frame : frames)
-            {
-                if (frame)
-                {
-                    acc(frame->pts);
-                }
-            }
-            int64_t pts = boost::accumulators::median(acc);
-            
-            // Calculate time interval from until this cubemap should be displayed
-            if (lastPTS == 0)
-            {
-                lastPTS = pts;
-            }
-            
-            if (lastDisplayTime.time_since_epoch().count() == 0)
-            {
-                lastDisplayTime = std::chrono::system_clock::now();
-                lastDisplayTime += std::chrono::seconds(5);
-            }
-            uint64_t ptsDiff = pts - lastPTS;
-            lastDisplayTime += std::chrono::microseconds(ptsDiff);
-            lastPTS = pts;
-            
-            std::chrono::milliseconds sleepDuration = std::chrono::duration_cast<std::chrono::milliseconds>(lastDisplayTime - std::chrono::system_clock::now());
-            
-            // Wait until frame should be displayed
-            //boost::this_thread::sleep_for(sleepDuration);
-            
-            // Display frame
             oldCubemap = onNextCubemap(this, cubemap);
 		}
+        
+        if (onPlayedOutCubemap) onPlayedOutCubemap(this, playoutScheduler.getDelay(), playoutScheduler.getJitter(), concealedFaces);
     }
 }
 
 
 H264CubemapSource::H264CubemapSource(std::vector<H264NALUSink*>& sinks,
                                      AVPixelFormat               format,
-                                     bool                        matchStereoPairs,
-                                     bool                        robustSyncing,
-                                     size_t                      maxFrameMapSize)
+                                     FaceConcealer::Policy       concealmentPolicy,
+                                     std::chrono::microseconds   cubemapDeadline,
+                                     size_t                      maxFrameMapSize,
+                                     double                      lateRate,
+                                     bool                        referencePlanes)
     :
-    sinks(sinks), format(format), oldCubemap(nullptr), lastFrameSeqNum(0), matchStereoPairs(matchStereoPairs),
-    robustSyncing(robustSyncing), maxFrameMapSize(maxFrameMapSize)
+    sinks(sinks), frameRing((std::max)(maxFrameMapSize * 2, (size_t)16), sinks.size()),
+    playoutScheduler(sinks.size(), lateRate, cubemapDeadline),
+    faceConcealer(concealmentPolicy, sinks.size(), CUBEMAP_MAX_FACES_COUNT, [this](size_t face, AVFrame* frame)
+    {
+        this->sinks[face]->returnFrame(frame);
+    }),
+    format(format), isStopping(false), oldCubemap(nullptr), cubemapDeadline(cubemapDeadline), maxFrameMapSize(maxFrameMapSize),
+    isReferencingPlanes(referencePlanes)
 {
+    if (sinks.size() > ReorderRing<AVFrame*>::MAX_SOURCES)
+    {
+        std::cerr << "Too many faces: " << sinks.size() << std::endl;
+        abort();
+    }
+    
     int i = 0;
     for (H264NALUSink* sink : sinks)
     {
@@ -300,6 +441,10 @@ H264CubemapSource::H264CubemapSource(std::vector<H264NALUSink*>& sinks,
         sink->setOnReceivedFrame      (std::bind(&H264CubemapSource::sinkOnReceivedFrame,       this, _1, _2, _3));
         sink->setOnDecodedFrame       (std::bind(&H264CubemapSource::sinkOnDecodedFrame,        this, _1, _2, _3));
         sink->setOnColorConvertedFrame(std::bind(&H264CubemapSource::sinkOnColorConvertedFrame, this, _1, _2, _3));
+        sink->setOnRequestedKeyframe  (std::bind(&H264CubemapSource::sinkOnRequestedKeyframe,   this, _1));
+        sink->setOnShedLoad           (std::bind(&H264CubemapSource::sinkOnShedLoad,            this, _1, _2));
+        sink->setOnMeasuredDecodeTime (std::bind(&H264CubemapSource::sinkOnMeasuredDecodeTime,  this, _1, _2));
+        sink->setFrameWaiter(&framesWaiter, i);
         
         sinksFaceMap[sink] = i;
         i++;
@@ -308,6 +453,35 @@ H264CubemapSource::H264CubemapSource(std::vector<H264NALUSink*>& sinks,
     getNextCubemapThread = std::thread(std::bind(&H264CubemapSource::getNextCubemapLoop, this));
 }
 
+H264CubemapSource::~H264CubemapSource()
+{
+    isStopping = true;
+    framesWaiter.notify(0);
+    cubemapWaiter.notify(0);
+    if (getNextFramesThread.joinable())  getNextFramesThread.join();
+    if (getNextCubemapThread.joinable()) getNextCubemapThread.join();
+    
+    // Frames of cubemaps that were not shown yet
+    std::vector<AVFrame*> frames;
+    bool                  late;
+    while (frameRing.claimOldest(frames, late))
+    {
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            if (frames[i]) sinks[i]->returnFrame(frames[i]);
+        }
+    }
+    faceConcealer.clear();
+    
+    for (H264NALUSink* sink : sinks)
+    {
+        sink->setFrameWaiter(nullptr, 0);
+    }
+    
+    // The other cubemaps belong to the user of this library
+    if (oldCubemap) StereoCubemap::destroy(oldCubemap);
+}
+
 void H264CubemapSource::sinkOnReceivedNALU(H264NALUSink* sink, u_int8_t type, size_t size)
 {
     int face = sinksFaceMap[sink];
@@ -332,3 +506,20 @@ void H264CubemapSource::sinkOnColorConvertedFrame(H264NALUSink* sink, u_int8_t t
     if (onColorConvertedFrame) onColorConvertedFrame(this, type, size, face);
 }
 
+void H264CubemapSource::sinkOnRequestedKeyframe(H264NALUSink* sink)
+{
+    int face = sinksFaceMap[sink];
+    if (onRequestedKeyframe) onRequestedKeyframe(this, face);
+}
+
+void H264CubemapSource::sinkOnShedLoad(H264NALUSink* sink, H264NALUSink::LoadShedding step)
+{
+    int face = sinksFaceMap[sink];
+    if (onShedLoad) onShedLoad(this, face, step);
+}
+
+void H264CubemapSource::sinkOnMeasuredDecodeTime(H264NALUSink* sink, std::chrono::microseconds decodeTime)
+{
+    int face = sinksFaceMap[sink];
+    if (onMeasuredDecodeTime) onMeasuredDecodeTime(this, face, decodeTime);
+}
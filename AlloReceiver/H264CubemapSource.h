@@ -5,8 +5,14 @@
 #include <liveMedia.hh>
 #include <boost/filesystem/path.hpp>
 #include <map>
+#include <atomic>
 
 #include "AlloReceiver.h"
+#include "AlloShared/MultiQueueWaiter.hpp"
+#include "AlloShared/ReorderRing.hpp"
+#include "AlloShared/CubemapFrameStamp.hpp"
+#include "PlayoutScheduler.hpp"
+#include "FaceConcealer.hpp"
 #include "H264NALUSink.hpp"
 #include "RTSPCubemapSourceClient.hpp"
 
@@ -19,6 +25,37 @@ public:
     typedef std::function<void (H264CubemapSource*, u_int8_t, size_t, int)>     OnColorConvertedFrame;
     typedef std::function<void (H264CubemapSource*, int)>                       OnAddedFrameToCubemap;
     typedef std::function<void (H264CubemapSource*, int)>                       OnScheduledFrameInCubemap;
+    // The thread collecting the faces' frames woke up wakeUpLatency after the first frame became available
+    // and used cpuTime since it woke up the last time
+    typedef std::function<void (H264CubemapSource*,
+                                std::chrono::microseconds wakeUpLatency,
+                                std::chrono::microseconds cpuTime)>             OnFramesAggregatorWokeUp;
+    // A cubemap was handed on at its playout time with the given playout delay.
+    // concealedFaces did not show an intact new frame (see FaceConcealer).
+    typedef std::function<void (H264CubemapSource*,
+                                std::chrono::microseconds delay,
+                                std::chrono::microseconds jitter,
+                                int                       concealedFaces)>      OnPlayedOutCubemap;
+    // A face's frame came after its cubemap was due and was dropped
+    typedef std::function<void (H264CubemapSource*, int)>                       OnDroppedLateFrame;
+    // A face's frame found no room among the pending cubemaps and was dropped
+    typedef std::function<void (H264CubemapSource*, int)>                       OnDroppedFrameWithoutRoom;
+    // A face's frame came without CubemapFrameStamp and was put into a cubemap by its coded picture number
+    typedef std::function<void (H264CubemapSource*, int)>                       OnReceivedUnstampedFrame;
+    // A face lost packets and asked the server for an IDR frame
+    typedef std::function<void (H264CubemapSource*, int)>                       OnRequestedKeyframe;
+    // A face shows intact new frames again after it was concealed for concealedFor
+    typedef std::function<void (H264CubemapSource*,
+                                int                       face,
+                                std::chrono::microseconds concealedFor)>        OnRecoveredFace;
+    // A face's decoder fell behind and a frame was decoded fast or dropped (see H264NALUSink::LoadShedding)
+    typedef std::function<void (H264CubemapSource*,
+                                int                        face,
+                                H264NALUSink::LoadShedding step)>               OnShedLoad;
+    // A face's frame came out of its decoder decodeTime after its packet went in
+    typedef std::function<void (H264CubemapSource*,
+                                int                       face,
+                                std::chrono::microseconds decodeTime)>          OnMeasuredDecodeTime;
     
     virtual void setOnReceivedNALU           (const OnReceivedNALU&            callback);
     virtual void setOnReceivedFrame          (const OnReceivedFrame&           callback);
@@ -27,12 +64,35 @@ public:
     virtual void setOnNextCubemap            (const OnNextCubemap&             callback);
     virtual void setOnAddedFrameToCubemap    (const OnAddedFrameToCubemap&     callback);
     virtual void setOnScheduledFrameInCubemap(const OnScheduledFrameInCubemap& callback);
+    virtual void setOnFramesAggregatorWokeUp (const OnFramesAggregatorWokeUp&  callback);
+    virtual void setOnPlayedOutCubemap       (const OnPlayedOutCubemap&        callback);
+    virtual void setOnDroppedLateFrame       (const OnDroppedLateFrame&        callback);
+    virtual void setOnDroppedFrameWithoutRoom(const OnDroppedFrameWithoutRoom& callback);
+    virtual void setOnReceivedUnstampedFrame (const OnReceivedUnstampedFrame&  callback);
+    virtual void setOnRequestedKeyframe      (const OnRequestedKeyframe&       callback);
+    virtual void setOnRecoveredFace          (const OnRecoveredFace&           callback);
+    virtual void setOnShedLoad               (const OnShedLoad&                callback);
+    virtual void setOnMeasuredDecodeTime     (const OnMeasuredDecodeTime&      callback);
     
+    // A cubemap is handed on at its playout time (see PlayoutScheduler), whether all faces arrived or not.
+    // The playout delay is chosen so that about lateRate of the cubemaps miss faces
+    // but it never grows beyond cubemapDeadline.
+    // Until the first cubemap was complete, a cubemap is handed on as soon as all faces arrived,
+    // when cubemapDeadline passed since its oldest face arrived
+    // or when maxFrameMapSize newer cubemaps are pending.
+    // Faces that are missing or damaged then are concealed according to concealmentPolicy.
+    // With referencePlanes the faces reference the planes of the sinks' pictures (see CubemapFace::setPlanes())
+    // instead of getting a copy in their content, so the user of the library has to read them from there.
     H264CubemapSource(std::vector<H264NALUSink*>& sinks,
                       AVPixelFormat               format,
-                      bool                        matchStereoPairs,
-                      bool                        robustSyncing,
-                      size_t                      maxFrameMapSize);
+                      FaceConcealer::Policy       concealmentPolicy,
+                      std::chrono::microseconds   cubemapDeadline,
+                      size_t                      maxFrameMapSize,
+                      double                      lateRate,
+                      bool                        referencePlanes = false);
+    // The sinks must be stopped (see H264NALUSink::stop()) before.
+    // Gives all frames it holds back to them.
+    virtual ~H264CubemapSource();
 
 protected:
     OnReceivedNALU            onReceivedNALU;
@@ -42,28 +102,47 @@ protected:
     OnNextCubemap             onNextCubemap;
     OnAddedFrameToCubemap     onAddedFrameToCubemap;
     OnScheduledFrameInCubemap onScheduledFrameInCubemap;
+    OnFramesAggregatorWokeUp  onFramesAggregatorWokeUp;
+    OnPlayedOutCubemap        onPlayedOutCubemap;
+    OnDroppedLateFrame        onDroppedLateFrame;
+    OnDroppedFrameWithoutRoom onDroppedFrameWithoutRoom;
+    OnReceivedUnstampedFrame  onReceivedUnstampedFrame;
+    OnRequestedKeyframe       onRequestedKeyframe;
+    OnRecoveredFace           onRecoveredFace;
+    OnShedLoad                onShedLoad;
+    OnMeasuredDecodeTime      onMeasuredDecodeTime;
     
 private:
     void getNextFramesLoop();
     void getNextCubemapLoop();
+    // Returns false if the frames were dropped since they come too late
+    bool waitForNextCubemap(std::vector<AVFrame*>& frames);
     
     void sinkOnReceivedNALU       (H264NALUSink* sink, u_int8_t type, size_t size);
     void sinkOnReceivedFrame      (H264NALUSink* sink, u_int8_t type, size_t size);
     void sinkOnDecodedFrame       (H264NALUSink* sink, u_int8_t type, size_t size);
     void sinkOnColorConvertedFrame(H264NALUSink* sink, u_int8_t type, size_t size);
+    void sinkOnRequestedKeyframe  (H264NALUSink* sink);
+    void sinkOnShedLoad           (H264NALUSink* sink, H264NALUSink::LoadShedding step);
+    void sinkOnMeasuredDecodeTime (H264NALUSink* sink, std::chrono::microseconds decodeTime);
   
-    std::mutex                              frameMapMutex;
-    std::condition_variable                 frameMapCondition;
-    std::map<int, std::vector<AVFrame*> >     frameMap;
     std::vector<H264NALUSink*>                sinks;
+    // The faces' frames of the cubemaps that are still incomplete
+    ReorderRing<AVFrame*>                     frameRing;
     std::map<H264NALUSink*, int64_t>          sinksFaceMap;
+    // Sinks notify it when they have a new frame
+    MultiQueueWaiter                          framesWaiter;
+    // Notified when frameRing got a frame
+    MultiQueueWaiter                          cubemapWaiter;
+    PlayoutScheduler                          playoutScheduler;
+    FaceConcealer                             faceConcealer;
     AVPixelFormat                             format;
     HeapAllocator                             heapAllocator;
     std::thread                             getNextCubemapThread;
     std::thread                             getNextFramesThread;
+    std::atomic<bool>                         isStopping;
     StereoCubemap*                            oldCubemap;
-    int64_t                                   lastFrameSeqNum;
-    bool                                      matchStereoPairs;
-    bool                                      robustSyncing;
+    std::chrono::microseconds                 cubemapDeadline;
     size_t                                    maxFrameMapSize;
+    bool                                      isReferencingPlanes;
 };
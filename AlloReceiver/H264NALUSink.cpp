@@ -2,10 +2,16 @@
 
 #include <iostream>
 #include <map>
+#include <algorithm>
 #include <thread>
+#include <mutex>
 #include <GroupsockHelper.hh>
+#include <H264VideoRTPSource.hh>
 
 #include "H264NALUSink.hpp"
+#include "BatchingReceiveGroupsock.hpp"
+#include "AlloShared/StartCodeScanner.hpp"
+#include "AlloShared/RTCPKeyframeRequest.hpp"
 
 //namespace bc = boost::chrono;
 
@@ -13,17 +19,54 @@ const size_t MAX_NALUS_PER_PKT = 30;
 unsigned char const START_CODE[4] = { 0x00, 0x00, 0x00, 0x01 };
 const size_t MAX_NALU_SIZE = 1000000;
 const size_t MAX_PKT_SIZE  = (sizeof(START_CODE) + MAX_NALU_SIZE) * MAX_NALUS_PER_PKT;
+// Long enough for the server to answer a request even if it just sent an IDR frame
+const std::chrono::milliseconds KEYFRAME_REQUEST_TIMEOUT(250);
+// Frames waiting for the decoder from which on the sink sheds load (see H264NALUSink::LoadShedding).
+// pktPool holds 5 packets, so at most 4 can wait.
+const size_t FAST_DECODE_QUEUE_DEPTH        = 2;
+const size_t DROP_NON_REFERENCE_QUEUE_DEPTH = 3;
+
+// Sinks are created in parallel, and avcodec_open2() needs a lock manager for that
+static int lockManager(void** mutex, enum AVLockOp op)
+{
+    switch (op)
+    {
+    case AV_LOCK_CREATE:
+        *mutex = new std::mutex;
+        return 0;
+    case AV_LOCK_OBTAIN:
+        ((std::mutex*)*mutex)->lock();
+        return 0;
+    case AV_LOCK_RELEASE:
+        ((std::mutex*)*mutex)->unlock();
+        return 0;
+    case AV_LOCK_DESTROY:
+        delete (std::mutex*)*mutex;
+        *mutex = nullptr;
+        return 0;
+    }
+    return 1;
+}
+
+static std::once_flag initializeOnce;
 
 H264NALUSink* H264NALUSink::createNew(UsageEnvironment& env,
                                       unsigned long     bufferSize,
                                       AVPixelFormat     format,
                                       MediaSubsession*  subsession,
-                                      bool              robustSyncing)
+                                      WorkerPool&       workerPool,
+                                      DecoderThreading  threading,
+                                      int               threadsCount,
+                                      FrameBufferProvider* bufferProvider)
 {
-    av_log_set_level(AV_LOG_FATAL);
-    avcodec_register_all();
-    avformat_network_init();
-	return new H264NALUSink(env, bufferSize, format, subsession, robustSyncing);
+    std::call_once(initializeOnce, []
+    {
+        av_log_set_level(AV_LOG_FATAL);
+        av_lockmgr_register(&lockManager);
+        avcodec_register_all();
+        avformat_network_init();
+    });
+	return new H264NALUSink(env, bufferSize, format, subsession, workerPool, threading, threadsCount, bufferProvider);
 }
 
 void H264NALUSink::setOnReceivedNALU(const OnReceivedNALU& callback)
@@ -46,20 +89,54 @@ void H264NALUSink::setOnColorConvertedFrame(const OnColorConvertedFrame& callbac
     onColorConvertedFrame = callback;
 }
 
+void H264NALUSink::setOnRequestedKeyframe(const OnRequestedKeyframe& callback)
+{
+    onRequestedKeyframe = callback;
+}
+
+void H264NALUSink::setOnFirstFrame(const OnFirstFrame& callback)
+{
+    onFirstFrame = callback;
+}
+
+void H264NALUSink::setOnShedLoad(const OnShedLoad& callback)
+{
+    onShedLoad = callback;
+}
+
+void H264NALUSink::setOnMeasuredDecodeTime(const OnMeasuredDecodeTime& callback)
+{
+    onMeasuredDecodeTime = callback;
+}
+
+void H264NALUSink::setFrameWaiter(MultiQueueWaiter* waiter, size_t queue)
+{
+    frameWaiterQueue = queue;
+    frameWaiter.store(waiter);
+}
+
 H264NALUSink::H264NALUSink(UsageEnvironment& env,
                            unsigned int      bufferSize,
                            AVPixelFormat     format,
                            MediaSubsession*  subsession,
-                           bool              robustSyncing)
+                           WorkerPool&       workerPool,
+                           DecoderThreading  threading,
+                           int               threadsCount,
+                           FrameBufferProvider* bufferProvider)
     :
     MediaSink(env), bufferSize(bufferSize), buffer(new unsigned char[bufferSize]),
-    imageConvertCtx(NULL), receivedFirstPriorityPackages(false), format(format),
+    imageConvertCtx(NULL), convertedBufferPool(NULL), convertedBufferSize(0), receivedFirstPriorityPackages(false), format(format),
     counter(0), sumRelativePresentationTimeMicroSec(0), maxRelativePresentationTimeMicroSec(0), subsession(subsession), lastTotal(0),
-    pts(-1), lastPTS(-1), robustSyncing(robustSyncing)
+    pts(-1), lastPTS(-1), frameWaiter(nullptr), frameWaiterQueue(0),
+    isFrameDamaged(false), areReferencesDamaged(true),
+    isKeyframeNeeded(false), isAwaitingKeyframe(false), lastLostPacketsCount(0),
+    workerPool(workerPool), nextPacketId(0), hasConvertedFrame(false), lastReceiveTime(0), loadShedding(NO_SHEDDING), isDecodingFast(false)
 {
     for (int i = 0; i < MAX_NALUS_PER_PKT + 1; i++)
     {
-        naluPool.push(new NALU({new unsigned char[MAX_NALU_SIZE], 0, -1}));
+        NALU* nalu = new NALU({new unsigned char[MAX_NALU_SIZE], 0, -1});
+        allNALUs.push_back(nalu);
+        naluPool.push(nalu);
     }
     
     for (int i = 0; i < 5; i++)
@@ -67,6 +144,8 @@ H264NALUSink::H264NALUSink(UsageEnvironment& env,
         AVPacket* pkt = new AVPacket;
         av_new_packet(pkt, MAX_PKT_SIZE);
         pkt->size = 0;
+        pkt->pos  = -1;
+        allPkts.push_back(pkt);
         pktPool.push(pkt);
     }
     pktPool.waitAndPop(currentPkt);
@@ -81,6 +160,7 @@ H264NALUSink::H264NALUSink(UsageEnvironment& env,
 			fprintf(stderr, "Could not allocate video frame\n");
 			abort();
 		}
+		allFrames.push_back(frame);
 		framePool.push(frame);
         
         AVFrame* resizedFrame = av_frame_alloc();
@@ -89,7 +169,7 @@ H264NALUSink::H264NALUSink(UsageEnvironment& env,
             fprintf(stderr, "Could not allocate video frame\n");
 			abort();
         }
-        resizedFrame->format = format;
+        allConvertedFrames.push_back(resizedFrame);
         convertedFramePool.push(resizedFrame);
 	}
 
@@ -110,6 +190,40 @@ H264NALUSink::H264NALUSink(UsageEnvironment& env,
 		abort();
 	}
 
+	// Guesses the macroblocks of lost slices from their neighbours and the previous frame
+	codecContext->error_concealment = FF_EC_GUESS_MVS | FF_EC_DEBLOCK;
+
+	// Decoded pictures stay ours until we unreference them, so they can be handed on without copying
+	codecContext->refcounted_frames = 1;
+
+	// Lets the decoder write its pictures straight into their consumer's storage
+	if (bufferProvider)
+	{
+		bufferProvider->install(codecContext);
+	}
+
+	// Slice threading decodes the slices of a frame in parallel and adds no delay,
+	// but only helps if the server sends several slices per frame.
+	// Frame threading decodes consecutive frames in parallel and delays every frame by threadsCount - 1 frames.
+	switch (threading)
+	{
+	case SLICE_THREADING:
+		codecContext->thread_type  = FF_THREAD_SLICE;
+		codecContext->thread_count = (std::max)(threadsCount, 1);
+		break;
+	case FRAME_THREADING:
+		codecContext->thread_type  = FF_THREAD_FRAME;
+		codecContext->thread_count = (std::max)(threadsCount, 1);
+		break;
+	default:
+		codecContext->thread_count = 1;
+		break;
+	}
+
+	// The SPS and PPS from the SDP let us decode the first IDR frame even if
+	// the server does not repeat them in front of it
+	setParameterSets(subsession->fmtp_spropparametersets());
+
 	/* open it */
 	if (avcodec_open2(codecContext, codec, NULL) < 0)
 	{
@@ -118,8 +232,40 @@ H264NALUSink::H264NALUSink(UsageEnvironment& env,
 	}
 
     //packageNALUsThread = std::thread(std::bind(&H264NALUSink::packageNALUsLoop, this));
-    decodeFrameThread  = std::thread(std::bind(&H264NALUSink::decodeFrameLoop,  this));
-    convertFrameThread = std::thread(std::bind(&H264NALUSink::convertFrameLoop, this));
+    decodeStrand  = workerPool.createStrand(std::bind(&H264NALUSink::decodeNextFrame,  this));
+    convertStrand = workerPool.createStrand(std::bind(&H264NALUSink::convertNextFrame, this));
+}
+
+void H264NALUSink::setParameterSets(char const* sPropParameterSets)
+{
+    if (!sPropParameterSets || sPropParameterSets[0] == '\0')
+    {
+        return;
+    }
+    
+    unsigned     recordsCount;
+    SPropRecord* records = parseSPropParameterSets(sPropParameterSets, recordsCount);
+    
+    // libavcodec takes the parameter sets as Annex B byte stream
+    unsigned char const start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+    int size = 0;
+    for (unsigned i = 0; i < recordsCount; i++)
+    {
+        size += sizeof(start_code) + records[i].sPropLength;
+    }
+    
+    codecContext->extradata = (uint8_t*)av_mallocz(size + FF_INPUT_BUFFER_PADDING_SIZE);
+    codecContext->extradata_size = size;
+    uint8_t* data = codecContext->extradata;
+    for (unsigned i = 0; i < recordsCount; i++)
+    {
+        memcpy(data, start_code, sizeof(start_code));
+        data += sizeof(start_code);
+        memcpy(data, records[i].sPropBytes, records[i].sPropLength);
+        data += records[i].sPropLength;
+    }
+    
+    delete[] records;
 }
 
 void H264NALUSink::packageData(AVPacket* pkt, unsigned int frameSize, timeval presentationTime)
@@ -139,6 +285,68 @@ void H264NALUSink::packageData(AVPacket* pkt, unsigned int frameSize, timeval pr
     memcpy(pkt->data + sizeof(start_code), buffer, frameSize);
 }
 
+u_int8_t H264NALUSink::getFrameType(AVPacket* pkt)
+{
+    // The first NALU is often an SPS or AUD.
+    // Report the type of the first slice instead and IDR if there is any IDR slice.
+    u_int8_t frameType = 0;
+    StartCodeScanner::forEachNALU(pkt->data, pkt->data + pkt->size, [&frameType](const uint8_t* nalu, size_t size)
+    {
+        u_int8_t type = nalu[0] & 0x1F;
+        if (type == 5 || (frameType == 0 && type >= 1 && type <= 5))
+        {
+            frameType = type;
+        }
+    });
+    return frameType;
+}
+
+bool H264NALUSink::isReferenceFrame(AVPacket* pkt)
+{
+    // nal_ref_idc is 0 in all slices of a frame that nothing refers to
+    bool hasSlice     = false;
+    bool isReferenced = false;
+    StartCodeScanner::forEachNALU(pkt->data, pkt->data + pkt->size, [&hasSlice, &isReferenced](const uint8_t* nalu, size_t size)
+    {
+        u_int8_t type = nalu[0] & 0x1F;
+        if (type >= 1 && type <= 5)
+        {
+            hasSlice = true;
+            if ((nalu[0] >> 5) & 0x03)
+            {
+                isReferenced = true;
+            }
+        }
+    });
+    return !hasSlice || isReferenced;
+}
+
+H264NALUSink::LoadShedding H264NALUSink::updateLoadShedding(size_t queueDepth)
+{
+    LoadShedding step = (LoadShedding)loadShedding.load();
+    if (step == SKIP_TO_IDR)
+    {
+        return step;
+    }
+    
+    if (queueDepth >= DROP_NON_REFERENCE_QUEUE_DEPTH)
+    {
+        step = DROP_NON_REFERENCE;
+    }
+    else if (queueDepth >= FAST_DECODE_QUEUE_DEPTH)
+    {
+        step = (std::max)(step, FAST_DECODE);
+    }
+    else if (queueDepth == 0 && step != NO_SHEDDING)
+    {
+        // The decoder caught up
+        step = (LoadShedding)(step - 1);
+    }
+    
+    loadShedding.store(step);
+    return step;
+}
+
 void H264NALUSink::afterGettingFrame(unsigned frameSize,
 	unsigned numTruncatedBytes,
 	timeval presentationTime)
@@ -149,6 +357,9 @@ void H264NALUSink::afterGettingFrame(unsigned frameSize,
     
     //std::cout << this << " " << presentationTime.tv_sec << " " << presentationTime.tv_usec << std::endl;
     
+    lastReceiveTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    
     u_int8_t nal_unit_type = buffer[0] & 0x1F;
 
 	/*if (onDroppedNALU) onDroppedNALU(this, nal_unit_type, frameSize);
@@ -167,34 +378,41 @@ void H264NALUSink::afterGettingFrame(unsigned frameSize,
     altPts = *((int64_t*)(buffer + frameSize - sizeof(int64_t)));
     std::cout << altPts << " " << pts << std::endl;*/
     
-    size_t packageSize;
-    if (robustSyncing && frameSize >= sizeof(int64_t))
+    size_t packageSize = frameSize;
+    
+    // The server puts a stamp in the RTP header extension of every frame's first packet.
+    // live555 skips it, so the groupsock keeps it for us.
+    RTPSource* rtpSource = subsession->rtpSource();
+    BatchingReceiveGroupsock* groupsock = (rtpSource) ? dynamic_cast<BatchingReceiveGroupsock*>(rtpSource->RTPgs()) : nullptr;
+    CubemapFrameStamp stamp;
+    bool isStamped = groupsock && groupsock->getCubemapFrameStamp(rtpSource->curPacketRTPSeqNum(), stamp);
+    if (isStamped)
     {
-        pts = *((int64_t*)(buffer + frameSize - sizeof(int64_t)));
-        packageSize = frameSize - sizeof(int64_t);
+        pts = stamp.captureTime;
     }
     else
     {
         pts = presentationTime.tv_sec * 1000000 + presentationTime.tv_usec;
-        packageSize = frameSize;
     }
     
-    // Check if all NALUs for current frame have arrived
-    if (lastPTS != -1 && lastPTS != pts)
+    // The lost packets belong to the frame we are assembling or to the beginning of this one
+    if (hasLostPackets())
     {
-        if (onReceivedFrame) onReceivedFrame(this, currentPkt->data[4] & 0x1F, currentPkt->size);
-        
-        // make frame available to the decoder
-        // if we currently have the capacities to encode another frame
-        AVPacket* pkt;
-        if (pktPool.tryPop(pkt))
-        {
-            pktBuffer.push(currentPkt);
-            currentPkt = pkt;
-        }
-        
-        // Reset current pkt so that we can fill it with new NALUs
-        currentPkt->size = 0;
+        isFrameDamaged = true;
+        isKeyframeNeeded.store(true);
+    }
+    requestKeyframeIfNeeded(nal_unit_type);
+    
+    // A NALU of the next frame means that the current one is complete as well.
+    // This is only needed if the server does not set the marker bit or its packet got lost.
+    if (lastPTS != -1 && lastPTS != pts && currentPkt->size > 0)
+    {
+        completeFrame();
+    }
+    
+    if (isStamped)
+    {
+        currentPkt->pos = stamp.pack();
     }
     
     // Add NALU to current frame pkt
@@ -212,6 +430,12 @@ void H264NALUSink::afterGettingFrame(unsigned frameSize,
     
     lastPTS = pts;
     
+    // The RTP marker bit is set on the last packet of a frame
+    if (rtpSource && rtpSource->curPacketMarkerBit() && currentPkt->size > 0)
+    {
+        completeFrame();
+    }
+    
 //    NALU* nalu;
 //    if (naluPool.tryPop(nalu))
 //    {
@@ -362,6 +586,112 @@ void H264NALUSink::afterGettingFrame(unsigned frameSize,
 //	continuePlaying();
 }
 
+void H264NALUSink::completeFrame()
+{
+    u_int8_t frameType = getFrameType(currentPkt);
+    if (onReceivedFrame) onReceivedFrame(this, frameType, currentPkt->size);
+    
+    // The frames waiting for the decoder tell how far it is behind
+    LoadShedding step = updateLoadShedding(pktBuffer.size());
+    bool isDropped = (step == SKIP_TO_IDR        && frameType != 5) ||
+                     (step >= DROP_NON_REFERENCE && !isReferenceFrame(currentPkt));
+    
+    // make frame available to the decoder
+    // if we currently have the capacities to encode another frame
+    if (isFrameDamaged)
+    {
+        currentPkt->flags |= AV_PKT_FLAG_CORRUPT;
+    }
+    
+    AVPacket* pkt;
+    if (isDropped)
+    {
+        if (onShedLoad) onShedLoad(this, step);
+    }
+    else if (pktPool.tryPop(pkt))
+    {
+        int64_t deadline = currentPkt->pts;
+        pktBuffer.push(currentPkt);
+        workerPool.schedule(decodeStrand, deadline);
+        currentPkt = pkt;
+        
+        if (step == SKIP_TO_IDR)
+        {
+            // The IDR frame is on its way, but the decoder is still behind
+            loadShedding.store(DROP_NON_REFERENCE);
+        }
+    }
+    else
+    {
+        // There is no room for the frame. Later frames refer to it, so rather than decoding
+        // them into corrupt pictures we wait for the next IDR frame and ask for it right away.
+        loadShedding.store(SKIP_TO_IDR);
+        isKeyframeNeeded.store(true);
+        if (onShedLoad) onShedLoad(this, SKIP_TO_IDR);
+    }
+    
+    // Reset current pkt so that we can fill it with new NALUs.
+    // The frame was handed on or thrown away, so its damage must not stick to the next one.
+    currentPkt->size  = 0;
+    currentPkt->pos   = -1;
+    currentPkt->flags = 0;
+    isFrameDamaged    = false;
+}
+
+bool H264NALUSink::hasLostPackets()
+{
+    RTPSource* rtpSource = subsession->rtpSource();
+    if (!rtpSource)
+    {
+        return false;
+    }
+    
+    // live555 counts the packets that never came for us
+    RTPReceptionStats* receptionStats = rtpSource->receptionStatsDB().lookup(rtpSource->lastReceivedSSRC());
+    if (!receptionStats)
+    {
+        return false;
+    }
+    
+    int64_t lostPacketsCount = (int64_t)receptionStats->totNumPacketsExpected() - receptionStats->totNumPacketsReceived();
+    bool    hasLost          = lostPacketsCount > lastLostPacketsCount;
+    lastLostPacketsCount = lostPacketsCount;
+    return hasLost;
+}
+
+void H264NALUSink::requestKeyframeIfNeeded(u_int8_t nalUnitType)
+{
+    RTPSource*    rtpSource = subsession->rtpSource();
+    RTCPInstance* rtcp      = subsession->rtcpInstance();
+    if (!rtpSource || !rtcp)
+    {
+        return;
+    }
+    
+    if (nalUnitType == 5)
+    {
+        isAwaitingKeyframe = false;
+    }
+    
+    // Losses until the IDR frame comes are served by it as well
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool isNewLoss = isKeyframeNeeded.exchange(false) && !isAwaitingKeyframe;
+    bool isOverdue = isAwaitingKeyframe && now - lastKeyframeRequestTime >= KEYFRAME_REQUEST_TIMEOUT;
+    if (!isNewLoss && !isOverdue)
+    {
+        return;
+    }
+    
+    unsigned char packet[RTCPKeyframeRequest::PACKET_SIZE];
+    size_t size = RTCPKeyframeRequest::write(packet, rtpSource->SSRC(), rtpSource->lastReceivedSSRC());
+    rtcp->RTCPgs()->output(envir(), rtcp->RTCPgs()->ttl(), packet, (unsigned)size);
+    
+    isAwaitingKeyframe      = true;
+    lastKeyframeRequestTime = now;
+    
+    if (onRequestedKeyframe) onRequestedKeyframe(this);
+}
+
 Boolean H264NALUSink::continuePlaying()
 {
 	fSource->getNextFrame(buffer, bufferSize,
@@ -498,192 +828,341 @@ void H264NALUSink::packageNALUsLoop()
     }
 }
 
-void H264NALUSink::decodeFrameLoop()
+void H264NALUSink::decodeNextFrame()
 {
-	while (true)
-	{
-		// Pop frame ptr from buffer
-		AVFrame* frame;
-		AVPacket* pkt;
-
-		if (!pktBuffer.waitAndPop(pkt))
-		{
-			// queue did close
-			return;
-		}
-        //std::cout << pktPool.size() << std::endl;
-
-		if (!framePool.waitAndPop(frame))
-		{
-			// queue did close
-			return;
-		}
-        //std::cout << framePool.size() << std::endl;
-
-		int got_frame;
-		int len = avcodec_decode_video2(codecContext, frame, &got_frame, pkt);
+    AVFrame* frame;
+    AVPacket* pkt;
+    
+    if (!framePool.tryPop(frame))
+    {
+        // All frames wait for conversion. convertNextFrame() schedules us again when it is done with one.
+        return;
+    }
+    //std::cout << framePool.size() << std::endl;
+    
+    if (!pktBuffer.tryPop(pkt))
+    {
+        framePool.push(frame);
+        return;
+    }
+    //std::cout << pktPool.size() << std::endl;
+    
+    // The loop filter is the cheapest thing to leave out while the decoder is behind
+    bool isFastDecode = loadShedding.load() != NO_SHEDDING;
+    if (isFastDecode != isDecodingFast)
+    {
+        codecContext->skip_loop_filter = (isFastDecode) ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+        isDecodingFast = isFastDecode;
+        if (!isFastDecode)
+        {
+            // Later frames predict from the unfiltered references and would drift
+            // until the next scheduled IDR frame, so we ask for one now
+            isKeyframeNeeded.store(true);
+        }
+    }
+    
+    // The frame that comes out carries the id of its packet
+    int64_t packetId = nextPacketId++;
+    decodingPackets[packetId] = { pkt->pts, pkt->pos, (pkt->flags & AV_PKT_FLAG_CORRUPT) != 0, std::chrono::steady_clock::now() };
+    codecContext->reordered_opaque = packetId;
+    
+	int got_frame;
+	int len = avcodec_decode_video2(codecContext, frame, &got_frame, pkt);
+    
+    // Damage spreads to every frame that refers to a damaged one until the next intact IDR frame
+    if (len < 0)
+    {
+        areReferencesDamaged = true;
+    }
+    
+    //std::cout << "len " << len - pkt->size << std::endl;
+    //std::cout << "type: " << int(pkt->data[4] & 0x1F) << std::endl;
+    //std::cout << "time " << pkt->pts << std::endl;
+    
+    if (got_frame == 1 && decodingPackets.count(frame->reordered_opaque) == 0)
+    {
+        // Its packet was dropped from decodingPackets already, so we know nothing about it
+        got_frame = 0;
+    }
+    
+    if (got_frame == 1)
+    {
+        DecodingPacket decodedPacket = decodingPackets[frame->reordered_opaque];
+        // Packets before it did not produce a frame (or never will)
+        decodingPackets.erase(decodingPackets.begin(), decodingPackets.upper_bound(frame->reordered_opaque));
         
-        //std::cout << "len " << len - pkt->size << std::endl;
-        //std::cout << "type: " << int(pkt->data[4] & 0x1F) << std::endl;
-        //std::cout << "time " << pkt->pts << std::endl;
+        bool isFrameDamaged = decodedPacket.isDamaged || len < 0;
+        if (isFrameDamaged)
+        {
+            areReferencesDamaged = true;
+        }
+        else if (frame->key_frame)
+        {
+            areReferencesDamaged = false;
+        }
         
-		pktPool.push(pkt);
-
-        if (got_frame == 1)
+        if (onMeasuredDecodeTime) onMeasuredDecodeTime(this,
+                                                       std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                                                                             decodedPacket.decodeStartTime));
+        if (onDecodedFrame) onDecodedFrame(this,
+                                           frame->key_frame,
+                                           avpicture_get_size((AVPixelFormat)frame->format,
+                                                              frame->width,
+                                                              frame->height));
+        if (isDecodingFast && onShedLoad) onShedLoad(this, FAST_DECODE);
+        //std::cout << "got frame" << std::endl;
+        
+        // We have decoded a frame :) ->
+        // Make the frame available to the application
+        frame->pts = decodedPacket.pts;
+        // The frame's CubemapFrameStamp (see afterGettingFrame())
+        frame->pkt_pos = decodedPacket.pos;
+        if (isFrameDamaged)
         {
-            if (onDecodedFrame) onDecodedFrame(this,
-                                               frame->key_frame,
-                                               avpicture_get_size((AVPixelFormat)frame->format,
-                                                                  frame->width,
-                                                                  frame->height));
-            //std::cout << "got frame" << std::endl;
-            
-            // We have decoded a frame :) ->
-            // Make the frame available to the application
-            frame->pts = pkt->pts;
-            
-            static uint64_t last = 0;
-            
-            uint64_t t = frame->pts;
-            
-            //std::cout << t - last << std::endl;
-            last = t;
-            
-            //std::cout << this << " " << frame->pts << std::endl;
-            
-            frameBuffer.push(frame);
-            //framePool.push(frame);
-            
-            //std::cout << "frame" << std::endl;
-		}
-        else
+            frame->decode_error_flags |= FF_DECODE_ERROR_INVALID_BITSTREAM;
+        }
+        else if (areReferencesDamaged)
         {
-            //std::cout << "didn't get frame" << std::endl;
-            
-            // No frame could be decoded :( ->
-            // Put frame back to the pool so that the next packet will be read
-            framePool.push(frame);
-            
-            if (len < 0)
-            {
-                // error decoding frame
-            }
-            else if (len == 0)
-            {
-                // package contained no frame
-            }
-            
-            //std::cout << "no frame" << std::endl;
+            frame->decode_error_flags |= FF_DECODE_ERROR_MISSING_REFERENCE;
         }
         
+        static uint64_t last = 0;
+        
+        uint64_t t = frame->pts;
+        
+        //std::cout << t - last << std::endl;
+        last = t;
+        
+        //std::cout << this << " " << frame->pts << std::endl;
+        
+        int64_t deadline = frame->pts;
+        frameBuffer.push(frame);
+        workerPool.schedule(convertStrand, deadline);
+        //framePool.push(frame);
+        
+        //std::cout << "frame" << std::endl;
+	}
+    else
+    {
+        //std::cout << "didn't get frame" << std::endl;
+        
+        // No frame could be decoded :( ->
+        // Put frame back to the pool so that the next packet will be read
+        av_frame_unref(frame);
+        framePool.push(frame);
+        
+        if (len < 0)
+        {
+            // error decoding frame
+            isKeyframeNeeded.store(true);
+            decodingPackets.erase(packetId);
+        }
+        else if (len == 0)
+        {
+            // package contained no frame
+        }
+        
+        //std::cout << "no frame" << std::endl;
+    }
+    
 
-        std::chrono::microseconds nowSinceEpoch =
-            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch());
-
-		AVRational microSecBase = { 1, 1000000 };
-        std::chrono::microseconds presentationTimeSinceEpoch =
-            std::chrono::microseconds(av_rescale_q(pkt->pts, codecContext->time_base, microSecBase));
+    std::chrono::microseconds nowSinceEpoch =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch());
 
+	AVRational microSecBase = { 1, 1000000 };
+    std::chrono::microseconds presentationTimeSinceEpoch =
+        std::chrono::microseconds(av_rescale_q(pkt->pts, codecContext->time_base, microSecBase));
 
-        std::chrono::microseconds relativePresentationTime = presentationTimeSinceEpoch - nowSinceEpoch;
+	pktPool.push(pkt);
 
-		sumRelativePresentationTimeMicroSec += relativePresentationTime.count();
-		if (maxRelativePresentationTimeMicroSec > relativePresentationTime.count())
-		{
-			maxRelativePresentationTimeMicroSec = relativePresentationTime.count();
-		}
+    std::chrono::microseconds relativePresentationTime = presentationTimeSinceEpoch - nowSinceEpoch;
 
-		const long frequency = 100;
-		if (counter % frequency == 0)
-		{
-			//std::cout << this << " delay: avg " << -sumRelativePresentationTimeMicroSec / 1000.0 / frequency << " ms; max " << -maxRelativePresentationTimeMicroSec / 1000.0 << " ms" << std::endl;
-			sumRelativePresentationTimeMicroSec = 0;
-			maxRelativePresentationTimeMicroSec = 0;
-            
-            //std::cout << stats.summary(std::chrono::milliseconds(1001)) << std::endl;
-		}
+	sumRelativePresentationTimeMicroSec += relativePresentationTime.count();
+	if (maxRelativePresentationTimeMicroSec > relativePresentationTime.count())
+	{
+		maxRelativePresentationTimeMicroSec = relativePresentationTime.count();
+	}
 
-		counter++;
-		
+	const long frequency = 100;
+	if (counter % frequency == 0)
+	{
+		//std::cout << this << " delay: avg " << -sumRelativePresentationTimeMicroSec / 1000.0 / frequency << " ms; max " << -maxRelativePresentationTimeMicroSec / 1000.0 << " ms" << std::endl;
+		sumRelativePresentationTimeMicroSec = 0;
+		maxRelativePresentationTimeMicroSec = 0;
+        
+        //std::cout << stats.summary(std::chrono::milliseconds(1001)) << std::endl;
 	}
+
+	counter++;
+    
+    // One frame per run so that the faces with earlier deadlines get their turn in between.
+    // Only this strand pops from pktBuffer, so the packet in front stays put.
+    if (pktBuffer.tryFront(pkt))
+    {
+        workerPool.schedule(decodeStrand, pkt->pts);
+    }
 }
 
-void H264NALUSink::convertFrameLoop()
+void H264NALUSink::convertNextFrame()
 {
-    while(true)
+    AVFrame* frame;
+    AVFrame* convertedFrame;
+    
+    if (!convertedFramePool.tryPop(convertedFrame))
     {
-        AVFrame* frame;
-        AVFrame* convertedFrame;
-        
-        if (!frameBuffer.waitAndPop(frame))
+        // The application holds all converted frames. returnFrame() schedules us again.
+        return;
+    }
+    
+    if (!frameBuffer.tryPop(frame))
+    {
+        convertedFramePool.push(convertedFrame);
+        return;
+    }
+    //std::cout /*<< this << " "*/ << frameBuffer.size() << std::endl;
+    
+    if (frame->format == format)
+    {
+        // The decoder already puts out the format we want, so we only take a reference to its planes
+        if (av_frame_ref(convertedFrame, frame) < 0)
         {
-            // queue did close
-            return;
+            fprintf(stderr, "Could not reference video frame\n");
+            abort();
         }
-        //std::cout /*<< this << " "*/ << frameBuffer.size() << std::endl;
-        
-        if (!convertedFramePool.waitAndPop(convertedFrame))
+    }
+    else
+    {
+        // We have to convert the color format of this frame
+        int size = avpicture_get_size(format, frame->width, frame->height);
+        if (!convertedBufferPool || size != convertedBufferSize)
         {
-            // queue did close
-            return;
+            // Buffers that are still referenced are freed once they come back
+            av_buffer_pool_uninit(&convertedBufferPool);
+            convertedBufferPool = av_buffer_pool_init(size, av_buffer_alloc);
+            convertedBufferSize = size;
         }
         
-        if (!convertedFrame->data[0])
+        convertedFrame->buf[0] = av_buffer_pool_get(convertedBufferPool);
+        if (!convertedFrame->buf[0])
         {
-            convertedFrame->width = frame->width;
-            convertedFrame->height = frame->height;
-            if (av_image_alloc(convertedFrame->data, convertedFrame->linesize, convertedFrame->width, convertedFrame->height,
-                               (AVPixelFormat)convertedFrame->format, 32) < 0)
-            {
-                fprintf(stderr, "Could not allocate raw picture buffer\n");
-                abort();
-            }
+            fprintf(stderr, "Could not allocate raw picture buffer\n");
+            abort();
         }
+        convertedFrame->format = format;
+        convertedFrame->width  = frame->width;
+        convertedFrame->height = frame->height;
+        // Laid out like avpicture_layout() would, so that the planes can be used as one picture
+        avpicture_fill((AVPicture*)convertedFrame, convertedFrame->buf[0]->data, format, frame->width, frame->height);
         
-        if (frame->format != format)
+        if (ColorConverter::isSupported((AVPixelFormat)frame->format, format))
         {
-            // We have to convert the color format of this frame
-            
-            if (!imageConvertCtx)
-            {
-                // setup resizer for received frames
-                imageConvertCtx = sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format,
-                                                 convertedFrame->width, convertedFrame->height, format,
-                                                 SWS_BICUBIC, NULL, NULL, NULL);
-            }
-            
-            
-            
-            // resize frame
-            sws_scale(imageConvertCtx, frame->data, frame->linesize, 0, frame->height,
-                      convertedFrame->data, convertedFrame->linesize);
+            colorConverter.convert(frame->data, frame->linesize, (AVPixelFormat)frame->format,
+                                   convertedFrame->data, convertedFrame->linesize, format,
+                                   frame->width, frame->height);
         }
         else
         {
-            // We only have to copy the frame since the color format is already the desired one
-            av_frame_copy(convertedFrame, frame);
+            // Other formats are left to swscale
+            imageConvertCtx = sws_getCachedContext(imageConvertCtx,
+                                                   frame->width, frame->height, (AVPixelFormat)frame->format,
+                                                   convertedFrame->width, convertedFrame->height, format,
+                                                   SWS_BICUBIC, NULL, NULL, NULL);
+            sws_scale(imageConvertCtx, frame->data, frame->linesize, 0, frame->height,
+                      convertedFrame->data, convertedFrame->linesize);
         }
-            
-        
         
         convertedFrame->pts = frame->pts;
+        convertedFrame->key_frame = frame->key_frame;
         convertedFrame->coded_picture_number = frame->coded_picture_number;
-        
-        if (onColorConvertedFrame) onColorConvertedFrame(this,
-                                                         frame->key_frame,
-                                                         avpicture_get_size((AVPixelFormat)frame->format,
-                                                                            frame->width,
-                                                                            frame->height));
-        
-        // continue decoding
-        framePool.push(frame);
-        
-        // make frame available
-        convertedFrameBuffer.push(convertedFrame);
-		//convertedFramePool.push(convertedFrame);
+        convertedFrame->pkt_pos = frame->pkt_pos;
+        convertedFrame->decode_error_flags = frame->decode_error_flags;
+    }
+    
+    if (!hasConvertedFrame)
+    {
+        hasConvertedFrame = true;
+        if (onFirstFrame) onFirstFrame(this);
+    }
+    
+    if (onColorConvertedFrame) onColorConvertedFrame(this,
+                                                     frame->key_frame,
+                                                     avpicture_get_size((AVPixelFormat)frame->format,
+                                                                        frame->width,
+                                                                        frame->height));
+    
+    // continue decoding.
+    // The packet in front of pktBuffer may be taken by the decode strand any time, so its pts
+    // is out of reach here. The frame we are done with is older and stands in for it.
+    int64_t deadline = frame->pts;
+    av_frame_unref(frame);
+    framePool.push(frame);
+    if (!pktBuffer.empty())
+    {
+        workerPool.schedule(decodeStrand, deadline);
+    }
+    
+    // make frame available
+    convertedFrameBuffer.push(convertedFrame);
+    MultiQueueWaiter* waiter = frameWaiter.load();
+    if (waiter) waiter->notify(frameWaiterQueue);
+	//convertedFramePool.push(convertedFrame);
+    
+    // One frame per run, see decodeNextFrame()
+    if (frameBuffer.tryFront(frame))
+    {
+        workerPool.schedule(convertStrand, frame->pts);
     }
 }
 
+std::chrono::steady_clock::time_point H264NALUSink::getLastReceiveTime()
+{
+    return std::chrono::steady_clock::time_point(std::chrono::microseconds(lastReceiveTime.load()));
+}
+
+void H264NALUSink::stop()
+{
+    // Runs that start from now on find nothing to do
+    pktBuffer.close();
+    framePool.close();
+    frameBuffer.close();
+    convertedFramePool.close();
+    
+    workerPool.destroyStrand(decodeStrand);
+    workerPool.destroyStrand(convertStrand);
+}
+
+H264NALUSink::~H264NALUSink()
+{
+    stop();
+    
+    for (NALU* nalu : allNALUs)
+    {
+        delete[] nalu->buffer;
+        delete nalu;
+    }
+    for (AVPacket* pkt : allPkts)
+    {
+        av_free_packet(pkt);
+        delete pkt;
+    }
+    for (AVFrame* frame : allFrames)
+    {
+        av_frame_free(&frame);
+    }
+    for (AVFrame* frame : allConvertedFrames)
+    {
+        av_frame_free(&frame);
+    }
+    // Planes that the user of the sink still references keep their buffers
+    av_buffer_pool_uninit(&convertedBufferPool);
+    
+    if (imageConvertCtx) sws_freeContext(imageConvertCtx);
+    avcodec_close(codecContext);
+    av_freep(&codecContext->extradata);
+    av_free(codecContext);
+    delete[] buffer;
+}
+
 AVFrame* H264NALUSink::getNextFrame()
 {
     AVFrame* frame;
@@ -701,6 +1180,15 @@ void H264NALUSink::returnFrame(AVFrame* frame)
 {
 	if (frame)
     {
+		int64_t deadline = frame->pts;
+		// Its planes go back to the decoder or convertedBufferPool unless someone else references them
+		av_frame_unref(frame);
 		convertedFramePool.push(frame);
+		// The returned frame is older than the ones waiting for conversion,
+		// which the convert strand may take any time
+		if (!frameBuffer.empty())
+		{
+			workerPool.schedule(convertStrand, deadline);
+		}
 	}
 }
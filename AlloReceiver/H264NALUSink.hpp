@@ -5,6 +5,7 @@ extern "C"
 	#include <libavcodec/avcodec.h>
 	#include <libavutil/opt.h>
 	#include <libavutil/frame.h>
+	#include <libavutil/buffer.h>
 	#include <libavutil/imgutils.h>
 	#include <libavutil/time.h>
 	#include <libswscale/swscale.h>
@@ -14,21 +15,52 @@ extern "C"
 #include <MediaSink.hh>
 #include <MediaSession.hh>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <memory>
 
 #include "AlloReceiver.h"
 
 #include "AlloShared/ConcurrentQueue.hpp"
 #include "AlloShared/Cubemap.hpp"
+#include "AlloShared/ColorConverter.hpp"
+#include "AlloShared/MultiQueueWaiter.hpp"
+#include "AlloShared/CubemapFrameStamp.hpp"
+#include "AlloShared/WorkerPool.hpp"
+#include "FrameBufferProvider.hpp"
 
 class ALLORECEIVER_API H264NALUSink : public MediaSink
 {
 public:
+    // How libavcodec spreads decoding over threadsCount threads
+    enum DecoderThreading
+    {
+        NO_THREADING,
+        // For low latency
+        SLICE_THREADING,
+        // For throughput
+        FRAME_THREADING
+    };
+    
 	static H264NALUSink* createNew(UsageEnvironment& env,
                                         unsigned long     bufferSize,
                                         AVPixelFormat     format,
                                         MediaSubsession*  subsession,
-                                        bool              robustSyncing);
+                                        WorkerPool&       workerPool,
+                                        DecoderThreading  threading      = NO_THREADING,
+                                        int               threadsCount   = 1,
+                                        FrameBufferProvider* bufferProvider = nullptr);
 
+	// The frame's pkt_pos holds its packed CubemapFrameStamp (-1 without stamp).
+	// With a stamp its pts is the capture time, otherwise the RTP presentation time.
+	// decode_error_flags is set if packets of the frame were lost (FF_DECODE_ERROR_INVALID_BITSTREAM)
+	// or it refers to a damaged frame (FF_DECODE_ERROR_MISSING_REFERENCE).
+	// Its planes are reference counted. If the decoder already puts out format, they are the decoder's own,
+	// otherwise they hold the converted picture. A reference taken with av_frame_ref()/av_frame_clone()
+	// keeps them after the frame was given back with returnFrame().
+	// With a bufferProvider the decoder gets its pictures from it where it can (see FrameBufferProvider::getFrame()).
 	AVFrame* getNextFrame();
     void returnFrame(AVFrame* usedFrame);
     
@@ -36,18 +68,63 @@ public:
     typedef std::function<void (H264NALUSink*, u_int8_t, size_t)> OnReceivedFrame;
     typedef std::function<void (H264NALUSink*, u_int8_t, size_t)> OnDecodedFrame;
     typedef std::function<void (H264NALUSink*, u_int8_t, size_t)> OnColorConvertedFrame;
+    // We lost packets or could not decode a frame and asked the server for an IDR frame
+    typedef std::function<void (H264NALUSink*)>                   OnRequestedKeyframe;
+    // The first frame is ready to be taken with getNextFrame()
+    typedef std::function<void (H264NALUSink*)>                   OnFirstFrame;
+    
+    // What the sink does when the decoder falls behind, mildest first.
+    // The step depends on the number of frames waiting for the decoder.
+    enum LoadShedding
+    {
+        NO_SHEDDING,
+        // The decoder skips the loop filter, also for reference frames. The pictures
+        // get blocky and later frames drift from what the encoder predicted,
+        // so an IDR frame is asked for when the decoder caught up.
+        FAST_DECODE,
+        // Frames that no other frame refers to are dropped before decoding
+        DROP_NON_REFERENCE,
+        // All frames are dropped until the next IDR frame, which is asked for.
+        // Used when there was no room for a frame.
+        SKIP_TO_IDR
+    };
+    // A frame was decoded fast or dropped according to step
+    typedef std::function<void (H264NALUSink*, LoadShedding step)> OnShedLoad;
+    // A frame came out of the decoder decodeTime after its packet went in
+    typedef std::function<void (H264NALUSink*, std::chrono::microseconds decodeTime)> OnMeasuredDecodeTime;
     
     void setOnReceivedNALU       (const OnReceivedNALU&        callback);
     void setOnReceivedFrame      (const OnReceivedFrame&       callback);
     void setOnDecodedFrame       (const OnDecodedFrame&        callback);
     void setOnColorConvertedFrame(const OnColorConvertedFrame& callback);
+    void setOnRequestedKeyframe  (const OnRequestedKeyframe&   callback);
+    void setOnFirstFrame         (const OnFirstFrame&          callback);
+    void setOnShedLoad           (const OnShedLoad&            callback);
+    void setOnMeasuredDecodeTime (const OnMeasuredDecodeTime&  callback);
+    
+    // waiter gets notified for queue whenever getNextFrame() has a new frame
+    void setFrameWaiter(MultiQueueWaiter* waiter, size_t queue);
+    
+    // When the last NALU came in (the epoch of the steady clock if none came yet).
+    // May be called from any thread.
+    std::chrono::steady_clock::time_point getLastReceiveTime();
+    
+    // Stops decoding and converting. No callbacks are called after it returns.
+    // The sink must not get data any more when it is called.
+    // Frames that were taken with getNextFrame() stay valid until the sink is closed.
+    void stop();
 	
 protected:
 	H264NALUSink(UsageEnvironment& env,
                       unsigned int      bufferSize,
                       AVPixelFormat     format,
                       MediaSubsession*  subsession,
-                      bool              robustSyncing);
+                      WorkerPool&       workerPool,
+                      DecoderThreading  threading,
+                      int               threadsCount,
+                      FrameBufferProvider* bufferProvider);
+	// called by Medium::close()
+	virtual ~H264NALUSink();
 
 	virtual void afterGettingFrame(unsigned frameSize,
 		unsigned numTruncatedBytes,
@@ -65,6 +142,10 @@ protected:
     OnReceivedFrame       onReceivedFrame;
     OnDecodedFrame        onDecodedFrame;
     OnColorConvertedFrame onColorConvertedFrame;
+    OnRequestedKeyframe   onRequestedKeyframe;
+    OnFirstFrame          onFirstFrame;
+    OnShedLoad            onShedLoad;
+    OnMeasuredDecodeTime  onMeasuredDecodeTime;
 
 private:
     struct NALU
@@ -85,14 +166,25 @@ private:
 	ConcurrentQueue<AVFrame*> framePool;
     ConcurrentQueue<AVFrame*> convertedFrameBuffer;
     ConcurrentQueue<AVFrame*> convertedFramePool;
+    // Everything that goes through the queues above, so that it can be freed whatever queue it is in
+    std::vector<NALU*>        allNALUs;
+    std::vector<AVPacket*>    allPkts;
+    std::vector<AVFrame*>     allFrames;
+    std::vector<AVFrame*>     allConvertedFrames;
+    
+    std::atomic<MultiQueueWaiter*> frameWaiter;
+    size_t                         frameWaiterQueue;
     
     AVPacket* currentPkt;
     int64_t pts;
     int64_t lastPTS;
     
-    bool robustSyncing;
-    
 	SwsContext* imageConvertCtx;
+    // The faces are converted in parallel on the worker pool already so one thread per face suffices
+    ColorConverter colorConverter;
+    // Planes of the converted frames. Recreated when the picture size changes.
+    AVBufferPool*  convertedBufferPool;
+    int            convertedBufferSize;
     
     std::queue<AVPacket*> priorityPackages; // SPS, PPS, IDR-slice NAL
     bool receivedFirstPriorityPackages; // first sequence of SPS, PPS and IDR-slice NALUs has been received
@@ -100,11 +192,36 @@ private:
     AVPixelFormat format;
     
     void packageNALUsLoop();
-	void decodeFrameLoop();
-    void convertFrameLoop();
     std::thread packageNALUsThread;
-    std::thread decodeFrameThread;
-    std::thread convertFrameThread;
+    
+    // Decoding and converting run as strands on the worker pool that all sinks share, one frame per run.
+    // A strand is only scheduled when there is work for it and it has what it needs, so idle faces cost nothing.
+    // The deadline of a run is the pts of the oldest frame it waits for.
+    WorkerPool&                         workerPool;
+    std::shared_ptr<WorkerPool::Strand> decodeStrand;
+    std::shared_ptr<WorkerPool::Strand> convertStrand;
+    // Decodes the oldest packet of pktBuffer if there is a frame in framePool for it
+    void decodeNextFrame();
+    // Converts the oldest frame of frameBuffer if there is a frame in convertedFramePool for it
+    void convertNextFrame();
+    
+    // What we need to know about the packets in the decoder when their frames come out.
+    // With frame threading a frame comes out while later packets go in.
+    struct DecodingPacket
+    {
+        int64_t                               pts;
+        int64_t                               pos;
+        bool                                  isDamaged;
+        std::chrono::steady_clock::time_point decodeStartTime;
+    };
+    // Only touched by the decode strand. Keyed by the id of the packet (see AVCodecContext::reordered_opaque).
+    std::map<int64_t, DecodingPacket> decodingPackets;
+    int64_t                           nextPacketId;
+    
+    // Only touched by the convert strand
+    bool        hasConvertedFrame;
+    // Steady clock microseconds
+    std::atomic<int64_t> lastReceiveTime;
 
 	int counter;
 	long sumRelativePresentationTimeMicroSec;
@@ -114,5 +231,38 @@ private:
     int lastTotal;
     
     void packageData(AVPacket* pkt, unsigned int frameSize, timeval presentationTime);
+    // Hands currentPkt to the decoder
+    void completeFrame();
+    // Type of the most important slice NALU in pkt
+    u_int8_t getFrameType(AVPacket* pkt);
+    
+    // Hands the SPS and PPS of an SDP sprop-parameter-sets attribute to the decoder before it is opened
+    void setParameterSets(char const* sPropParameterSets);
+    
+    // Packets of currentPkt were lost or the frame before it was dropped
+    bool                                  isFrameDamaged;
+    // Only touched by the decode strand. Set from a damaged frame (or the start) until the next intact IDR frame.
+    bool                                  areReferencesDamaged;
+    // Returns whether live555 noticed lost packets since the last call
+    bool hasLostPackets();
+    // Set from any thread when the decoder's references are broken
+    std::atomic<bool>                     isKeyframeNeeded;
+    // A request went out and no IDR frame came since
+    bool                                  isAwaitingKeyframe;
+    std::chrono::steady_clock::time_point lastKeyframeRequestTime;
+    int64_t                               lastLostPacketsCount;
+    // Asks the server for an IDR frame over RTCP if packets were lost or decoding failed.
+    // Until one arrives the request is repeated every KEYFRAME_REQUEST_TIMEOUT.
+    void requestKeyframeIfNeeded(u_int8_t nalUnitType);
+    
+    // Set by the receiving thread (see updateLoadShedding()), read by the decode strand
+    std::atomic<int>                      loadShedding;
+    // Only touched by the decode strand
+    bool                                  isDecodingFast;
+    // Moves up the ladder as frames pile up in pktBuffer and one step down whenever it is empty.
+    // SKIP_TO_IDR is left once an IDR frame made it into pktBuffer.
+    LoadShedding updateLoadShedding(size_t queueDepth);
+    // Whether a slice of pkt may be referred to by other frames
+    static bool isReferenceFrame(AVPacket* pkt);
 };
 
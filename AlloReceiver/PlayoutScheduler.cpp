@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "PlayoutScheduler.hpp"
+
+static int64_t toMicroseconds(std::chrono::steady_clock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+}
+
+PlayoutScheduler::PlayoutScheduler(size_t facesCount, double lateRate, std::chrono::microseconds maxDelay)
+    :
+    lateRate((std::min)((std::max)(lateRate, 0.0), 1.0)), maxDelay(maxDelay.count()),
+    faceJitters(facesCount, 0), lastFaceTransits(facesCount, 0), hasLastFaceTransit(facesCount, false),
+    transits(WINDOW_SIZE), sortedTransits(WINDOW_SIZE), nextTransit(0), transitsCount(0),
+    baseTransit(0), delay(0), lastCaptureTime(0), frameInterval(0)
+{
+    memset(pendingCubemaps, 0, sizeof(pendingCubemaps));
+}
+
+void PlayoutScheduler::addFrame(size_t                                face,
+                                uint32_t                              frameId,
+                                int64_t                               captureTime,
+                                std::chrono::steady_clock::time_point arrival,
+                                size_t                                facesInCubemap)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    int64_t transit = toMicroseconds(arrival) - captureTime;
+
+    if (face < faceJitters.size())
+    {
+        if (hasLastFaceTransit[face])
+        {
+            int64_t difference = std::abs(transit - lastFaceTransits[face]);
+            faceJitters[face] += (difference - faceJitters[face]) / 16;
+        }
+        lastFaceTransits[face]   = transit;
+        hasLastFaceTransit[face] = true;
+    }
+
+    PendingCubemap& cubemap = pendingCubemaps[frameId % PENDING_CUBEMAPS];
+    if (cubemap.isValid && cubemap.frameId == frameId)
+    {
+        if (cubemap.isComplete)
+        {
+            // Accounted for already
+            return;
+        }
+        cubemap.transit = (std::max)(cubemap.transit, transit);
+        cubemap.facesCount++;
+    }
+    else
+    {
+        // A cubemap that never completed takes the transit time of its last face that came
+        if (cubemap.isValid && !cubemap.isComplete)
+        {
+            addTransit(cubemap.transit);
+        }
+
+        cubemap.isValid     = true;
+        cubemap.isComplete  = false;
+        cubemap.frameId     = frameId;
+        cubemap.captureTime = captureTime;
+        cubemap.transit     = transit;
+        cubemap.facesCount  = 1;
+
+        if (lastCaptureTime != 0 && captureTime > lastCaptureTime)
+        {
+            int64_t interval = captureTime - lastCaptureTime;
+            frameInterval = (frameInterval == 0) ? interval : frameInterval + (interval - frameInterval) / 16;
+        }
+        lastCaptureTime = (std::max)(lastCaptureTime, captureTime);
+    }
+
+    if (cubemap.facesCount >= facesInCubemap)
+    {
+        cubemap.isComplete = true;
+        addTransit(cubemap.transit);
+    }
+}
+
+void PlayoutScheduler::addTransit(int64_t transit)
+{
+    transits[nextTransit] = transit;
+    nextTransit = (nextTransit + 1) % transits.size();
+    transitsCount = (std::min)(transitsCount + 1, transits.size());
+
+    // The smallest transit time is as close as we get to the clock offset
+    std::copy(transits.begin(), transits.begin() + transitsCount, sortedTransits.begin());
+    baseTransit = *std::min_element(sortedTransits.begin(), sortedTransits.begin() + transitsCount);
+
+    // The delay that lets all but lateRate of the cubemaps arrive in time
+    size_t quantile = (size_t)((transitsCount - 1) * (1.0 - lateRate));
+    std::nth_element(sortedTransits.begin(), sortedTransits.begin() + quantile, sortedTransits.begin() + transitsCount);
+    int64_t targetDelay = (std::min)(sortedTransits[quantile] - baseTransit, maxDelay);
+
+    // Grow at once to stop late frames but shrink slowly to not skip cubemaps
+    if (targetDelay > delay)
+    {
+        delay = targetDelay;
+    }
+    else
+    {
+        delay -= (delay - targetDelay) / 64;
+    }
+}
+
+bool PlayoutScheduler::getPlayoutTime(uint32_t frameId, std::chrono::steady_clock::time_point& playoutTime)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    const PendingCubemap& cubemap = pendingCubemaps[frameId % PENDING_CUBEMAPS];
+    if (transitsCount == 0 || !cubemap.isValid || cubemap.frameId != frameId)
+    {
+        return false;
+    }
+
+    playoutTime = std::chrono::steady_clock::time_point(std::chrono::microseconds(cubemap.captureTime + baseTransit + delay));
+    return true;
+}
+
+std::chrono::microseconds PlayoutScheduler::getDelay()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return std::chrono::microseconds(delay);
+}
+
+std::chrono::microseconds PlayoutScheduler::getJitter()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    int64_t jitter = 0;
+    for (int64_t faceJitter : faceJitters)
+    {
+        jitter = (std::max)(jitter, faceJitter);
+    }
+    return std::chrono::microseconds(jitter);
+}
+
+std::chrono::microseconds PlayoutScheduler::getFrameInterval()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return std::chrono::microseconds(frameInterval);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+#include "AlloReceiver.h"
+
+// Decides when a cubemap is shown so that the display follows the capture
+// clock instead of network jitter.
+// The transit time of a frame is its arrival (local steady clock) minus its
+// capture time (server clock). A cubemap's transit time is the one of its last
+// face. The playout delay is picked from the recent cubemaps' transit times so
+// that only about lateRate of them arrive after they are due.
+// The constant offset between the clocks cancels out since only differences
+// to the smallest transit time matter.
+// Frames are added from one thread, playout times may be asked for from another.
+class ALLORECEIVER_API PlayoutScheduler
+{
+public:
+    PlayoutScheduler(size_t facesCount, double lateRate, std::chrono::microseconds maxDelay);
+
+    // The frame of face for cubemap frameId, captured at captureTime (microseconds), arrived.
+    // facesInCubemap is the number of faces the server streams.
+    void addFrame(size_t                                face,
+                  uint32_t                              frameId,
+                  int64_t                               captureTime,
+                  std::chrono::steady_clock::time_point arrival,
+                  size_t                                facesInCubemap);
+
+    // When cubemap frameId is due. Returns false if nothing is known about it yet.
+    bool getPlayoutTime(uint32_t frameId, std::chrono::steady_clock::time_point& playoutTime);
+
+    // Playout delay on top of the smallest transit time
+    std::chrono::microseconds getDelay();
+    // Largest interarrival jitter of the faces (RFC 3550)
+    std::chrono::microseconds getJitter();
+    // Mean time between cubemaps
+    std::chrono::microseconds getFrameInterval();
+
+private:
+    enum { WINDOW_SIZE = 512, PENDING_CUBEMAPS = 64 };
+
+    // A cubemap whose faces are still arriving
+    struct PendingCubemap
+    {
+        bool     isValid;
+        bool     isComplete;
+        uint32_t frameId;
+        int64_t  captureTime;
+        int64_t  transit;     // largest of its faces
+        size_t   facesCount;
+    };
+
+    void addTransit(int64_t transit);
+
+    std::mutex mutex;
+
+    double  lateRate;
+    int64_t maxDelay;
+
+    std::vector<int64_t> faceJitters;
+    std::vector<int64_t> lastFaceTransits;
+    std::vector<bool>    hasLastFaceTransit;
+
+    PendingCubemap pendingCubemaps[PENDING_CUBEMAPS]; // indexed by frame id
+
+    std::vector<int64_t> transits; // ring buffer of the last cubemaps' transit times
+    std::vector<int64_t> sortedTransits;
+    size_t               nextTransit;
+    size_t               transitsCount;
+
+    int64_t baseTransit;
+    int64_t delay;
+
+    int64_t lastCaptureTime;
+    int64_t frameInterval;
+};
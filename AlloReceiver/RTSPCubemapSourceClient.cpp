@@ -4,36 +4,263 @@
 #include "H264NALUSink.hpp"
 #include "H264CubemapSource.h"
 #include "RTSPCubemapSourceClient.hpp"
+#include "BatchingReceiveTaskScheduler.hpp"
+#include "BatchingReceiveMediaSession.hpp"
+#include "BatchingReceiveGroupsock.hpp"
 
 #include <iomanip>
 #include <iostream>
+#include <cstring>
+#include <cerrno>
+
+#if defined(__linux__)
+    #include <sys/socket.h>
+    
+    #ifndef SO_BUSY_POLL
+        #define SO_BUSY_POLL 46
+    #endif
+#endif
+
+// How long to wait before setting up a session again after it failed or ended
+static const unsigned RETRY_CONNECT_DELAY = 1000000; // microseconds
+static const unsigned RECEIVE_TIMEOUT_CHECK_INTERVAL = 1000000; // microseconds
+
+// Lets the kernel poll the device queue for packets instead of waiting for an interrupt
+static void setBusyPoll(int socket, int microseconds)
+{
+#if defined(__linux__)
+    if (setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof(microseconds)) != 0)
+    {
+        std::cout << "Could not busy poll socket (" << strerror(errno) << ")" << std::endl;
+    }
+#else
+    std::cout << "Busy polling is not supported on this platform" << std::endl;
+#endif
+}
 
 void RTSPCubemapSourceClient::setOnDidConnect(const std::function<void (RTSPCubemapSourceClient*, CubemapSource*)>& onDidConnect)
 {
     this->onDidConnect = onDidConnect;
 }
 
+void RTSPCubemapSourceClient::setOnDidDisconnect(const OnDidDisconnect& callback)
+{
+    onDidDisconnect = callback;
+}
+
+void RTSPCubemapSourceClient::setOnReceivedBatch(const OnReceivedBatch& callback)
+{
+    onReceivedBatch = callback;
+}
+
+void RTSPCubemapSourceClient::setBatchedReceive(bool batchedReceive)
+{
+    this->batchedReceive = batchedReceive;
+}
+
+void RTSPCubemapSourceClient::setBusyPoll(int microseconds)
+{
+    busyPollMicroseconds = microseconds;
+}
+
+void RTSPCubemapSourceClient::setCubemapDeadline(std::chrono::microseconds deadline)
+{
+    cubemapDeadline = deadline;
+}
+
+void RTSPCubemapSourceClient::setLateRate(double lateRate)
+{
+    this->lateRate = lateRate;
+}
+
+void RTSPCubemapSourceClient::setConcealmentPolicy(FaceConcealer::Policy policy)
+{
+    concealmentPolicy = policy;
+}
+
+void RTSPCubemapSourceClient::setReceiveTimeout(std::chrono::microseconds timeout)
+{
+    receiveTimeout = timeout;
+}
+
+void RTSPCubemapSourceClient::setDecoderThreading(H264NALUSink::DecoderThreading threading)
+{
+    decoderThreading = threading;
+}
+
+void RTSPCubemapSourceClient::setDecoderCoreBudget(unsigned int cores)
+{
+    decoderCoreBudget = cores;
+}
+
+void RTSPCubemapSourceClient::setWorkerThreadsCount(size_t count)
+{
+    workerThreadsCount = count;
+}
+
+void RTSPCubemapSourceClient::setFacesReferencePlanes(bool referencePlanes)
+{
+    facesReferencePlanes = referencePlanes;
+}
+
+void RTSPCubemapSourceClient::setFrameBufferProvider(FrameBufferProvider* provider)
+{
+    frameBufferProvider = provider;
+}
+
 void RTSPCubemapSourceClient::shutdown(int exitCode)
 {
+    disconnect();
+    
+    // The server may be restarting, so we keep trying until it is back
+    envir() << "Setting up the session again in " << (int)(RETRY_CONNECT_DELAY / 1000) << "ms\n";
+    envir().taskScheduler().unscheduleDelayedTask(retryConnectTask);
+    retryConnectTask = envir().taskScheduler().scheduleDelayedTask(RETRY_CONNECT_DELAY,
+                                                                   (TaskFunc*)RTSPCubemapSourceClient::retryConnect,
+                                                                   this);
 }
 
-void RTSPCubemapSourceClient::subsessionAfterPlaying(void* clientData)
+void RTSPCubemapSourceClient::disconnect()
 {
-	// Begin by closing this media subsession's stream:
-	MediaSubsession* subsession = (MediaSubsession*)clientData;
-	Medium::close(subsession->sink);
-	subsession->sink = NULL;
+    isPlaying = false;
+    envir().taskScheduler().unscheduleDelayedTask(receiveTimeoutTask);
+    
+    // Nothing touches the sessions and sinks from now on but this thread
+    // The triggers set the watch variables on the loops' threads and wake them up
+    for (size_t i = 0; i < sessionLoops.size(); i++)
+    {
+        envs[i]->taskScheduler().triggerEvent(sessionLoops[i]->stopTrigger, &sessionLoops[i]->stop);
+    }
+    for (size_t i = 0; i < sessionLoops.size(); i++)
+    {
+        sessionLoops[i]->thread.join();
+        envs[i]->taskScheduler().deleteEventTrigger(sessionLoops[i]->stopTrigger);
+    }
+    sessionLoops.clear();
+    
+    for (std::thread& thread : openDecoderThreads)
+    {
+        thread.join();
+    }
+    openDecoderThreads.clear();
+    
+    for (H264NALUSink* sink : sinks)
+    {
+        sink->stop();
+    }
+    
+    if (cubemapSource)
+    {
+        if (onDidDisconnect) onDidDisconnect(this, cubemapSource);
+        // The sinks are stopped, so it can go now
+        delete cubemapSource;
+        cubemapSource = nullptr;
+    }
+    
+    // Let the server know in case it is still there
+    for (MediaSubsession* subsession : subsessions)
+    {
+        if (subsession->sessionId())
+        {
+            sendTeardownCommand(subsession->parentSession(), continueAfterTEARDOWN);
+            break;
+        }
+    }
+    
+    for (MediaSubsession* subsession : subsessions)
+    {
+        subsession->sink = NULL;
+    }
+    for (H264NALUSink* sink : sinks)
+    {
+        Medium::close(sink);
+    }
+    sinks.clear();
+    subsessions.clear();
+    pendingSetups.clear();
+    nextSetup = 0;
+    
+    for (MediaSession* session : sessions)
+    {
+        Medium::close(session);
+    }
+    sessions.clear();
+    for (BasicUsageEnvironment* env : envs)
+    {
+        TaskScheduler* scheduler = &env->taskScheduler();
+        env->reclaim();
+        delete scheduler;
+    }
+    envs.clear();
+    
+    // The new sources count from zero
+    lastTotalKBytes          = 0.0;
+    lastTotalPacketsReceived = 0;
+    lastTotalPacketsExpected = 0;
+}
 
-	// Next, check whether *all* subsessions' streams have now been closed:
-	MediaSession& session = subsession->parentSession();
-	MediaSubsessionIterator iter(session);
-	while ((subsession = iter.next()) != NULL)
-	{
-		if (subsession->sink != NULL) return; // this subsession is still active
-	}
+void RTSPCubemapSourceClient::retryConnect(void* self_)
+{
+    RTSPCubemapSourceClient* self = (RTSPCubemapSourceClient*)self_;
+    self->retryConnectTask = NULL;
+    
+    // Forget the old connection and session id
+    self->reset();
+    self->setBaseURL(self->rtspURL.c_str());
+    self->connectSession();
+}
+
+void RTSPCubemapSourceClient::stopSessionLoop(void* stop)
+{
+    // Runs on the session's own event loop thread
+    *(char*)stop = 1;
+}
+
+void RTSPCubemapSourceClient::handleSessionEnded(void* self_)
+{
+    RTSPCubemapSourceClient* self = (RTSPCubemapSourceClient*)self_;
+    
+    // Every face reports it, and the session may have been torn down already
+    if (!self->isPlaying)
+    {
+        return;
+    }
+    
+    self->envir() << "The server ended the session\n";
+    self->shutdown();
+}
 
-	// All subsessions' streams have now been closed
-	//sessionAfterPlaying();
+void RTSPCubemapSourceClient::checkReceiveTimeout(void* self_)
+{
+    RTSPCubemapSourceClient* self = (RTSPCubemapSourceClient*)self_;
+    self->receiveTimeoutTask = NULL;
+    
+    std::chrono::steady_clock::time_point lastReceiveTime = self->playTime;
+    for (H264NALUSink* sink : self->sinks)
+    {
+        lastReceiveTime = (std::max)(lastReceiveTime, sink->getLastReceiveTime());
+    }
+    
+    std::chrono::steady_clock::duration silence = std::chrono::steady_clock::now() - lastReceiveTime;
+    if (silence > self->receiveTimeout)
+    {
+        self->envir() << "Received nothing for "
+            << (int)std::chrono::duration_cast<std::chrono::milliseconds>(silence).count() << "ms\n";
+        self->shutdown();
+        return;
+    }
+    
+    self->receiveTimeoutTask = self->envir().taskScheduler().scheduleDelayedTask(RECEIVE_TIMEOUT_CHECK_INTERVAL,
+                                                                                 (TaskFunc*)RTSPCubemapSourceClient::checkReceiveTimeout,
+                                                                                 self);
+}
+
+void RTSPCubemapSourceClient::subsessionAfterPlaying(void* clientData)
+{
+	// The subsession's stream was closed. Its session thread must not tear it down, the network thread does.
+	MediaSubsession* subsession = (MediaSubsession*)clientData;
+	RTSPCubemapSourceClient* self = (RTSPCubemapSourceClient*)subsession->miscPtr;
+	self->envir().taskScheduler().triggerEvent(self->sessionEndedTrigger, self);
 }
 
 void RTSPCubemapSourceClient::checkForPacketArrival(void* self_)
@@ -79,20 +306,6 @@ void RTSPCubemapSourceClient::checkForPacketArrival(void* self_)
 	//	(TaskFunc*)checkForPacketArrival, self);
 }
 
-void RTSPCubemapSourceClient::continueAfterDESCRIBE2(RTSPClient* self_, int resultCode, char* resultString)
-{
-    RTSPCubemapSourceClient* self = (RTSPCubemapSourceClient*)self_;
-    
-	static int count = 0;
-	char* sdpDescription = resultString;
-	//self->envir() << "Opened URL \"" << self->url() << "\", returning a SDP description:\n" << sdpDescription << "\n";
-	if (count == 0)
-	{
-		self->sendDescribeCommand(continueAfterDESCRIBE2);
-	}
-	count++;
-}
-
 void RTSPCubemapSourceClient::continueAfterPLAY(RTSPClient* self_, int resultCode, char* resultString)
 {
     RTSPCubemapSourceClient* self = (RTSPCubemapSourceClient*)self_;
@@ -106,9 +319,18 @@ void RTSPCubemapSourceClient::continueAfterPLAY(RTSPClient* self_, int resultCod
 	}
 	else
 	{
-		self->envir() << "Started playing session\n";
+		self->playTime = std::chrono::steady_clock::now();
+		self->envir() << "Started playing session "
+			<< (int)std::chrono::duration_cast<std::chrono::milliseconds>(self->playTime - self->connectTime).count()
+			<< "ms after connecting\n";
 	}
 	delete[] resultString;
+	
+	// The session is set up again if the server goes away without a BYE
+	self->isPlaying = true;
+	self->receiveTimeoutTask = self->envir().taskScheduler().scheduleDelayedTask(RECEIVE_TIMEOUT_CHECK_INTERVAL,
+	                                                                             (TaskFunc*)RTSPCubemapSourceClient::checkReceiveTimeout,
+	                                                                             self);
 
 	// Figure out how long to delay (if at all) before shutting down, or
 	// repeating the playing
@@ -119,8 +341,6 @@ void RTSPCubemapSourceClient::continueAfterPLAY(RTSPClient* self_, int resultCod
 	// Watch for incoming packets (if desired):
 	checkForPacketArrival(self);
 	//checkInterPacketGaps(NULL);
-
-	//ourClient->sendDescribeCommand(continueAfterDESCRIBE2);
 }
 
 void RTSPCubemapSourceClient::periodicQOSMeasurement(void* self_)
@@ -132,6 +352,7 @@ void RTSPCubemapSourceClient::periodicQOSMeasurement(void* self_)
     for (MediaSubsession* subsession : self->subsessions)
     {
         RTPSource* src = subsession->rtpSource();
+        if (src == NULL) continue;
         RTPReceptionStatsDB::Iterator statsIter(src->receptionStatsDB());
         RTPReceptionStats* stats;
         while ((stats = statsIter.next(True)) != NULL)
@@ -169,69 +390,32 @@ void RTSPCubemapSourceClient::subsessionByeHandler(void* clientData)
 		<< "/" << subsession->codecName()
 		<< "\" subsession\n";
 
-	// Act now as if the subsession had closed:
+	// Act now as if the subsession had closed.
+	// The server sends it when it shuts down, so we set up the session again once it is back.
 	subsessionAfterPlaying(subsession);
 }
 
-void RTSPCubemapSourceClient::createOutputFiles(char const* periodicFilenameSuffix)
+void RTSPCubemapSourceClient::startSinks()
 {
-	char outFileName[1000];
-
-	// Create and start "FileSink"s for each subsession:
-    
-    /*std::vector<MediaSubsession*> subsessions;
-	for (MediaSession* session : sessions)
-	{
-		MediaSubsessionIterator iter(*session);
-		MediaSubsession* subsession = iter.next();
-		if (subsession->readSource() == NULL) continue; // was not initiated
-
-		// Create an output file for each desired stream:
-		// Output file name is
-		//     "<filename-prefix><medium_name>-<codec_name>-<counter><periodicFilenameSuffix>"
-		static unsigned streamCounter = 0;
-		sprintf(outFileName, "%s-%s-%d%s", subsession->mediumName(),
-			subsession->codecName(), ++streamCounter, periodicFilenameSuffix);
-        
-        subsessions.push_back(subsession);
-    }*/
-    
-    // Create CubemapSource based on discovered stream
-    bool isH264 = true;
-    for (MediaSubsession* subsession : subsessions)
+    // Create CubemapSource based on discovered stream.
+    // The sinks were created by openDecoders().
+    if (!sinks.empty())
     {
-        if (strcmp(subsession->mediumName(), "video") != 0 ||
-            strcmp(subsession->codecName(), "H264") != 0)
+        for (int i = 0; i < sinks.size(); i++)
         {
-            isH264 = false;
-        }
-    }
-    
-    if (isH264)
-    {
-        std::vector<H264NALUSink*> h264Sinks;
-        std::vector<MediaSink*> sinks;
-        for (int i = 0; i < (std::min)(subsessions.size(), (size_t)(StereoCubemap::MAX_EYES_COUNT * Cubemap::MAX_FACES_COUNT)); i++)
-        {
-            H264NALUSink* sink = H264NALUSink::createNew(envir(),
-                                                         sinkBufferSize,
-                                                         format,
-                                                         subsessions[i],
-                                                         robustSyncing);
-            subsessions[i]->sink = sink;
-            
-            h264Sinks.push_back(sink);
-            sinks.push_back(sink);
+            subsessions[i]->sink = sinks[i];
         }
         
         if (onDidConnect)
         {
-            onDidConnect(this,
-                         new H264CubemapSource(h264Sinks,
-                                               format,
-                                               matchStereoPairs,
-                                               robustSyncing,
-                                               maxFrameMapSize));
+            cubemapSource = new H264CubemapSource(sinks,
+                                                  format,
+                                                  matchStereoPairs ? FaceConcealer::FREEZE_STEREO_PAIR : concealmentPolicy,
+                                                  cubemapDeadline,
+                                                  maxFrameMapSize,
+                                                  lateRate,
+                                                  facesReferencePlanes);
+            onDidConnect(this, cubemapSource);
         }
     }
     
@@ -239,14 +423,15 @@ void RTSPCubemapSourceClient::createOutputFiles(char const* periodicFilenameSuff
     {
 		if (subsession->sink == NULL)
 		{
-			envir() << "Failed to create FileSink for \"" << outFileName
-				<< "\": " << subsession->parentSession().envir().getResultMsg() << "\n";
+			envir() << "No decoder for the \"" << subsession->mediumName()
+				<< "/" << subsession->codecName()
+				<< "\" subsession: " << subsession->parentSession().envir().getResultMsg() << "\n";
 		}
 		else
 		{
-			envir() << "Outputting data from the \"" << subsession->mediumName()
+			envir() << "Decoding the \"" << subsession->mediumName()
 				<< "/" << subsession->codecName()
-				<< "\" subsession to \"" << outFileName << "\"\n";
+				<< "\" subsession\n";
 
 			subsession->sink->startPlaying(*(subsession->readSource()),
 				subsessionAfterPlaying,
@@ -264,94 +449,192 @@ void RTSPCubemapSourceClient::createOutputFiles(char const* periodicFilenameSuff
 
 
 
-void RTSPCubemapSourceClient::setupStreams()
+void RTSPCubemapSourceClient::openDecoders()
 {
-	//static MediaSubsessionIterator* setupIter = NULL;
-	static std::vector<MediaSubsession*>::iterator setupIter = subsessions.begin();
-	//if (setupIter == NULL) setupIter = new MediaSubsessionIterator(*session);
+    bool isH264 = true;
+    for (MediaSubsession* subsession : subsessions)
+    {
+        if (strcmp(subsession->mediumName(), "video") != 0 ||
+            strcmp(subsession->codecName(), "H264") != 0)
+        {
+            isH264 = false;
+        }
+    }
+    
+    if (!isH264)
+    {
+        return;
+    }
+    
+    // Opening a decoder does not need the SETUP replies, so it happens while they are under way.
+    // Every sink lives in the environment of its own session, so the threads share nothing.
+    sinks.resize((std::min)(subsessions.size(), (size_t)(StereoCubemap::MAX_EYES_COUNT * Cubemap::MAX_FACES_COUNT)));
+    
+    // The faces share the core budget
+    unsigned int cores = (decoderCoreBudget > 0) ? decoderCoreBudget : std::thread::hardware_concurrency();
+    int threadsCount = (std::max)((int)(cores / sinks.size()), 1);
+    if (decoderThreading != H264NALUSink::NO_THREADING)
+    {
+        envir() << "Decoding every face with " << threadsCount << " threads\n";
+    }
+    
+    // It outlives the sessions, so that reconnecting does not start new threads
+    if (!workerPool)
+    {
+        workerPool.reset(new WorkerPool(workerThreadsCount));
+        envir() << "Decoding and converting all faces on " << (int)workerPool->getThreadsCount() << " worker threads\n";
+    }
+    
+    for (size_t i = 0; i < sinks.size(); i++)
+    {
+        openDecoderThreads.push_back(std::thread([this, i, threadsCount]()
+        {
+            sinks[i] = H264NALUSink::createNew(subsessions[i]->parentSession().envir(),
+                                               sinkBufferSize,
+                                               format,
+                                               subsessions[i],
+                                               *workerPool,
+                                               decoderThreading,
+                                               threadsCount,
+                                               frameBufferProvider);
+        }));
+    }
+}
 
-	//for (MediaSubsession* subsession : subsessions)
-//	{
-		while (setupIter != subsessions.end())
-		{
-			subsession = *setupIter;
-		// We have another subsession left to set up:
+void RTSPCubemapSourceClient::setupStreams()
+{
+	// The first SETUP creates the session on the server. The others carry its id,
+	// so they go out together once it is known and the replies come back in one round trip.
+	bool isFirst = nextSetup == 0;
+	bool sentSetup = false;
+	while (nextSetup < subsessions.size())
+	{
+		MediaSubsession* subsession = subsessions[nextSetup++];
 		if (subsession->clientPortNum() == 0) continue; // port # was not set
 
-		//this->subsession = subsession;
+		// The reply may come right away if the request fails
+		pendingSetups.push_back(subsession);
 		sendSetupCommand(*subsession, continueAfterSETUP);
-			
-		setupIter++;
+		sentSetup = true;
 
-			return;
-		}
+		if (isFirst) return;
+	}
 
+	if (!sentSetup && pendingSetups.empty())
+	{
 		// We're done setting up subsessions.
-		//delete setupIter;
+		playStreams();
+	}
+}
 
-//	}
+void RTSPCubemapSourceClient::playStreams()
+{
+	for (std::thread& thread : openDecoderThreads)
+	{
+		thread.join();
+	}
+	openDecoderThreads.clear();
 
-			// Create output files:
-			createOutputFiles("");
+	envir() << "Set up " << (int)subsessions.size() << " subsessions "
+		<< (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - connectTime).count()
+		<< "ms after connecting\n";
 
-			for (MediaSubsession* subsession : subsessions)
+	// Time to the first frame of a face and to the first frame of all of them
+	size_t facesCount = sinks.size();
+	for (H264NALUSink* sink : sinks)
+	{
+		sink->setOnFirstFrame([this, facesCount](H264NALUSink*)
+		{
+			size_t count = ++firstFramesCount;
+			if (count == 1 || count == facesCount)
 			{
-				// Finally, start playing each subsession, to start the data flow:
-				double initialSeekTime = 0.0f;
-				double duration = subsession->parentSession().playEndTime() - initialSeekTime; // use SDP end time
+				std::cout << ((count == 1) ? "First face" : "All faces") << " decoded "
+					<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - connectTime).count()
+					<< "ms after connecting" << std::endl;
+			}
+		});
+	}
 
-				double endTime;
-				endTime = initialSeekTime;
-				endTime = -1.0f;
+	startSinks();
 
-				char* initialAbsoluteSeekTime = NULL;
-				char const* absStartTime = initialAbsoluteSeekTime != NULL ? initialAbsoluteSeekTime : subsession->parentSession().absStartTime();
-				if (absStartTime != NULL)
-				{
-					// Either we or the server have specified that seeking should be done by 'absolute' time:
-					sendPlayCommand(subsession->parentSession(), continueAfterPLAY, absStartTime, subsession->parentSession().absEndTime(), 1.0);
-				}
-				else
-				{
-					// Normal case: Seek by relative time (NPT):
-					sendPlayCommand(subsession->parentSession(), continueAfterPLAY, initialSeekTime, endTime, 1.0);
-				}
-			}
+	// Finally, start playing. The faces are subsessions of the same session on the server,
+	// so a single PLAY starts all of them.
+	MediaSession& session = subsessions[0]->parentSession();
+	double initialSeekTime = 0.0f;
+	double endTime = -1.0f;
+
+	char* initialAbsoluteSeekTime = NULL;
+	char const* absStartTime = initialAbsoluteSeekTime != NULL ? initialAbsoluteSeekTime : session.absStartTime();
+	if (absStartTime != NULL)
+	{
+		// Either we or the server have specified that seeking should be done by 'absolute' time:
+		sendPlayCommand(session, continueAfterPLAY, absStartTime, session.absEndTime(), 1.0);
+	}
+	else
+	{
+		// Normal case: Seek by relative time (NPT):
+		sendPlayCommand(session, continueAfterPLAY, initialSeekTime, endTime, 1.0);
+	}
+
+	// The sinks are started, so the sessions may receive on their own threads now
+	for (int i = 0; i < envs.size(); i++)
+	{
+		std::unique_ptr<SessionLoop> loop(new SessionLoop);
+		loop->stop        = 0;
+		loop->stopTrigger = envs[i]->taskScheduler().createEventTrigger((TaskFunc*)RTSPCubemapSourceClient::stopSessionLoop);
+		loop->thread      = std::thread(std::bind(&TaskScheduler::doEventLoop, &envs[i]->taskScheduler(), &loop->stop));
+		sessionLoops.push_back(std::move(loop));
+	}
 }
 
 void RTSPCubemapSourceClient::continueAfterSETUP(RTSPClient* self_, int resultCode, char* resultString)
 {
-	static int setups = 0;
-	setups++;
-
     RTSPCubemapSourceClient* self = (RTSPCubemapSourceClient*)self_;
     
+	if (self->pendingSetups.empty())
+	{
+		// The session was torn down in the meantime
+		delete[] resultString;
+		return;
+	}
+	
+	// Replies come in the order of the requests
+	MediaSubsession* subsession = self->pendingSetups.front();
+	self->pendingSetups.pop_front();
+    
 	if (resultCode == 0)
 	{
-		self->envir() << "Setup \"" << self->subsession->mediumName()
-			<< "/" << self->subsession->codecName()
+		self->envir() << "Setup \"" << subsession->mediumName()
+			<< "/" << subsession->codecName()
 			<< "\" subsession (";
-		if (self->subsession->rtcpIsMuxed())
+		if (subsession->rtcpIsMuxed())
 		{
-			self->envir() << "client port " << self->subsession->clientPortNum();
+			self->envir() << "client port " << subsession->clientPortNum();
 		}
 		else
 		{
-			self->envir() << "client ports " << self->subsession->clientPortNum()
-				<< "-" << self->subsession->clientPortNum() + 1;
+			self->envir() << "client ports " << subsession->clientPortNum()
+				<< "-" << subsession->clientPortNum() + 1;
 		}
 		self->envir() << ")\n";
 	}
 	else
 	{
-        self->envir() << "Failed to setup \"" << self->subsession->mediumName()
-			<< "/" << self->subsession->codecName()
+        self->envir() << "Failed to setup \"" << subsession->mediumName()
+			<< "/" << subsession->codecName()
 			<< "\" subsession: " << resultString << "\n";
 	}
 	delete[] resultString;
 	
-	// Set up the next subsession, if any:
-	self->setupStreams();
+	if (self->nextSetup < self->subsessions.size())
+	{
+		// Set up the remaining subsessions
+		self->setupStreams();
+	}
+	else if (self->pendingSetups.empty())
+	{
+		self->playStreams();
+	}
 }
 
 void RTSPCubemapSourceClient::continueAfterDESCRIBE(RTSPClient* self_, int resultCode, char* resultString)
@@ -363,6 +646,7 @@ void RTSPCubemapSourceClient::continueAfterDESCRIBE(RTSPClient* self_, int resul
 		self->envir() << "Failed to get a SDP description for the URL \"" << self->url() << "\": " << resultString << "\n";
 		delete[] resultString;
 		self->shutdown();
+		return;
 	}
 
 	char* sdpDescription = resultString;
@@ -379,24 +663,26 @@ void RTSPCubemapSourceClient::continueAfterDESCRIBE(RTSPClient* self_, int resul
 	for (int i = 0; i < sdpLines.size(); i++)
 	{
 
-		// Create a media session object from this SDP description:
-		TaskScheduler* scheduler = BasicTaskScheduler::createNew();
+		// Create a media session object from this SDP description.
+		// Its RTP sockets report every read and drain the socket with one syscall if batchedReceive is set.
+		TaskScheduler* scheduler = BatchingReceiveTaskScheduler::createNew();
 		BasicUsageEnvironment* env = BasicUsageEnvironment::createNew(*scheduler);
 		self->envs.push_back(env);
-		MediaSession* session = MediaSession::createNew(*env, (header + sdpLines[i]).c_str());
-
-		std::cout << "created session" << std::endl;
+		MediaSession* session = BatchingReceiveMediaSession::createNew(*env, (header + sdpLines[i]).c_str(), self->batchedReceive);
 		
 		if (session == NULL)
 		{
 			self->envir() << "Failed to create a MediaSession object from the SDP description: "
 				<< env->getResultMsg() << "\n";
 			self->shutdown();
+			return;
 		}
-		else if (!session->hasSubsessions())
+		self->sessions.push_back(session);
+		if (!session->hasSubsessions())
 		{
 			self->envir() << "This session has no media subsessions (i.e., no \"m=\" lines)\n";
 			self->shutdown();
+			return;
 		}
 
 		// Then, setup the "RTPSource"s for the session:
@@ -406,6 +692,8 @@ void RTSPCubemapSourceClient::continueAfterDESCRIBE(RTSPClient* self_, int resul
 		while ((subsession = iter.next()) != NULL)
 		{
 			self->subsessions.push_back(subsession);
+			// Lets the handlers of the session's thread find us
+			subsession->miscPtr = self;
 
 			if (!subsession->initiate())
 			{
@@ -450,6 +738,20 @@ void RTSPCubemapSourceClient::continueAfterDESCRIBE(RTSPClient* self_, int resul
 						unsigned newBufferSize = self->sinkBufferSize;
 						newBufferSize = setReceiveBufferTo(*env, socketNum, newBufferSize);
 					}
+					
+					if (self->busyPollMicroseconds > 0)
+					{
+						::setBusyPoll(socketNum, self->busyPollMicroseconds);
+					}
+					
+					BatchingReceiveGroupsock* groupsock = dynamic_cast<BatchingReceiveGroupsock*>(subsession->rtpSource()->RTPgs());
+					if (groupsock)
+					{
+						groupsock->setOnReceivedBatch([self](BatchingReceiveGroupsock*, size_t datagramsCount, size_t syscallsCount)
+						{
+							if (self->onReceivedBatch) self->onReceivedBatch(self, datagramsCount, syscallsCount);
+						});
+					}
 				}
 				//		}
 				//	}
@@ -472,31 +774,60 @@ void RTSPCubemapSourceClient::continueAfterDESCRIBE(RTSPClient* self_, int resul
 
 	}
 
-	// Perform additional 'setup' on each subsession, before playing them:
-	self->setupStreams();
-    
-    self->envir().taskScheduler().scheduleDelayedTask(10000000, (TaskFunc*)RTSPCubemapSourceClient::periodicQOSMeasurement, self);
-
-	for (int i = 0; i < self->envs.size(); i++)
+	if (self->subsessions.empty())
 	{
-		std::thread* abc = new std::thread(std::bind(&TaskScheduler::doEventLoop, &self->envs[i]->taskScheduler(), nullptr));
-        self->sessionThreads.push_back(std::shared_ptr<std::thread>(abc));
+		// E.g. the server is up but Unity does not stream yet
+		self->envir() << "The SDP description has no media subsessions (i.e., no \"m=\" lines)\n";
+		self->shutdown();
+		return;
 	}
+
+	// Perform additional 'setup' on each subsession, before playing them.
+	// The decoders are opened meanwhile.
+	self->openDecoders();
+	self->setupStreams();
 }
 
 void RTSPCubemapSourceClient::continueAfterOPTIONS(RTSPClient* self_, int resultCode, char* resultString)
 {
     RTSPCubemapSourceClient* self = (RTSPCubemapSourceClient*)self_;
+    
+	if (resultCode != 0)
+	{
+		// E.g. the server is not up (yet)
+		self->envir() << "Failed to connect to \"" << self->url() << "\": " << resultString << "\n";
+		delete[] resultString;
+		self->shutdown();
+		return;
+	}
 	delete[] resultString;
 
 	// Next, get a SDP description for the stream:
 	self->sendDescribeCommand(continueAfterDESCRIBE);
 }
 
-void RTSPCubemapSourceClient::networkLoop()
+void RTSPCubemapSourceClient::continueAfterTEARDOWN(RTSPClient* self_, int resultCode, char* resultString)
 {
+	// The server may be gone, so there is nothing to do about failures
+	delete[] resultString;
+}
+
+void RTSPCubemapSourceClient::connectSession()
+{
+    connectTime = std::chrono::steady_clock::now();
+    firstFramesCount = 0;
+    
     // Begin by sending an "OPTIONS" command:
     sendOptionsCommand(continueAfterOPTIONS);
+}
+
+void RTSPCubemapSourceClient::networkLoop()
+{
+    // Session threads report the end of the session with it
+    sessionEndedTrigger = envir().taskScheduler().createEventTrigger((TaskFunc*)RTSPCubemapSourceClient::handleSessionEnded);
+    envir().taskScheduler().scheduleDelayedTask(10000000, (TaskFunc*)RTSPCubemapSourceClient::periodicQOSMeasurement, this);
+    
+    connectSession();
     
 	// All subsequent activity takes place within the event loop:
 	envir().taskScheduler().doEventLoop(); // does not return
@@ -511,7 +842,6 @@ RTSPCubemapSourceClient* RTSPCubemapSourceClient::create(char const* rtspURL,
                                                          unsigned int sinkBufferSize,
                                                          AVPixelFormat format,
                                                          bool matchStereoPairs,
-                                                         bool robustSyncing,
                                                          size_t maxFrameMapSize,
                                                          const char* interfaceAddress,
                                                          int verbosityLevel,
@@ -536,7 +866,6 @@ RTSPCubemapSourceClient* RTSPCubemapSourceClient::create(char const* rtspURL,
                                        sinkBufferSize,
                                        format,
                                        matchStereoPairs,
-                                       robustSyncing,
                                        maxFrameMapSize,
                                        verbosityLevel,
                                        applicationName,
@@ -549,7 +878,6 @@ RTSPCubemapSourceClient::RTSPCubemapSourceClient(UsageEnvironment& env,
                                                  unsigned int sinkBufferSize,
                                                  AVPixelFormat format,
                                                  bool matchStereoPairs,
-                                                 bool robustSyncing,
                                                  size_t maxFrameMapSize,
                                                  int verbosityLevel,
                                                  char const* applicationName,
@@ -557,7 +885,12 @@ RTSPCubemapSourceClient::RTSPCubemapSourceClient(UsageEnvironment& env,
                                                  int socketNumToServer)
     :
     RTSPClient(env, rtspURL, verbosityLevel, applicationName, tunnelOverHTTPPortNum, socketNumToServer),
+    nextSetup(0), workerThreadsCount(0), facesReferencePlanes(false), frameBufferProvider(nullptr),
+    cubemapSource(nullptr), rtspURL(rtspURL), isPlaying(false), firstFramesCount(0),
+    receiveTimeout(std::chrono::seconds(5)), sessionEndedTrigger(0), receiveTimeoutTask(NULL), retryConnectTask(NULL),
     sinkBufferSize(sinkBufferSize), format(format), lastTotalKBytes(0.0), lastTotalPacketsReceived(0), lastTotalPacketsExpected(0),
-    matchStereoPairs(matchStereoPairs), robustSyncing(robustSyncing), maxFrameMapSize(maxFrameMapSize)
+    matchStereoPairs(matchStereoPairs), maxFrameMapSize(maxFrameMapSize),
+    batchedReceive(false), busyPollMicroseconds(0), cubemapDeadline(std::chrono::milliseconds(50)), lateRate(0.01),
+    concealmentPolicy(FaceConcealer::HOLD_FACE), decoderThreading(H264NALUSink::NO_THREADING), decoderCoreBudget(0)
 {
 }
@@ -4,8 +4,16 @@
 #include <GroupsockHelper.hh>
 #include <liveMedia.hh>
 #include <thread>
+#include <chrono>
+#include <deque>
+#include <atomic>
+#include <memory>
 
 #include "AlloReceiver.h"
+#include "FaceConcealer.hpp"
+#include "H264NALUSink.hpp"
+#include "AlloShared/WorkerPool.hpp"
+
 
 class ALLORECEIVER_API RTSPCubemapSourceClient : public RTSPClient
 {
@@ -16,7 +24,6 @@ public:
                                            unsigned int sinkBufferSize,
                                            AVPixelFormat format,
                                            bool matchStereoPairs,
-                                           bool robustSyncing,
                                            size_t maxFrameMapSize,
                                            const char* interfaceAddress = "0.0.0.0",
                                            int verbosityLevel = 0,
@@ -26,22 +33,59 @@ public:
     
     void setOnDidConnect(const std::function<void (RTSPCubemapSourceClient*, CubemapSource*)>& onDidConnect);
     
+    // The session ended, e.g. since the server went away. The source is destroyed when this returns.
+    // The client connects again and calls OnDidConnect with a new source once the server is back.
+    typedef std::function<void (RTSPCubemapSourceClient* self, CubemapSource* source)> OnDidDisconnect;
+    
+    void setOnDidDisconnect(const OnDidDisconnect& callback);
+    
+    typedef std::function<void (RTSPCubemapSourceClient* self, size_t datagramsCount, size_t syscallsCount)> OnReceivedBatch;
+    
+    void setOnReceivedBatch(const OnReceivedBatch& callback);
+    
+    // Both have to be set before connect().
+    // Drain RTP sockets with recvmmsg() (and UDP GRO) instead of reading one datagram per wake-up
+    void setBatchedReceive(bool batchedReceive);
+    // Busy poll the device queue of RTP sockets for that long (SO_BUSY_POLL). 0 does not.
+    void setBusyPoll(int microseconds);
+    // Longest playout delay, and before the first complete cubemap how long a cubemap
+    // waits for missing faces before it is shown without them (see H264CubemapSource)
+    void setCubemapDeadline(std::chrono::microseconds deadline);
+    // Share of cubemaps that may miss faces at their playout time (see H264CubemapSource)
+    void setLateRate(double lateRate);
+    // What missing or damaged faces show (see FaceConcealer).
+    // matchStereoPairs always freezes both eyes of a face together.
+    void setConcealmentPolicy(FaceConcealer::Policy policy);
+    // The session is set up again if no face received anything for that long while playing
+    void setReceiveTimeout(std::chrono::microseconds timeout);
+    // How every face's decoder uses threads (see H264NALUSink::DecoderThreading)
+    void setDecoderThreading(H264NALUSink::DecoderThreading threading);
+    // Cores the decoders of all faces share. Every face gets an equal part, at least one thread.
+    // 0 uses all cores of the machine.
+    void setDecoderCoreBudget(unsigned int cores);
+    // Threads that decode and color convert the frames of all faces (see WorkerPool).
+    // 0 uses one per core. Has to be set before connect().
+    void setWorkerThreadsCount(size_t count);
+    // Whether the cubemap faces reference the decoded pictures instead of getting a copy of them
+    // (see CubemapFace::setPlanes()). Their content is not filled then.
+    void setFacesReferencePlanes(bool referencePlanes);
+    // Where the decoders of all faces put their pictures (see FrameBufferProvider), nullptr to let libavcodec allocate them.
+    // Faces whose pictures end up in a frame's pixels get that frame as content without a copy.
+    // It has to outlive the client. Has to be set before connect().
+    void setFrameBufferProvider(FrameBufferProvider* provider);
+    
 protected:
     RTSPCubemapSourceClient(UsageEnvironment& env,
                             char const* rtspURL,
                             unsigned int sinkBufferSize,
                             AVPixelFormat format,
                             bool matchStereoPairs,
-                            bool robustSyncing,
                             size_t maxFrameMapSize,
                             int verbosityLevel,
                             char const* applicationName,
                             portNumBits tunnelOverHTTPPortNum,
                             int socketNumToServer);
     
-    static void continueAfterDESCRIBE2 (RTSPClient* self,
-                                        int resultCode,
-                                        char* resultString);
     static void continueAfterPLAY      (RTSPClient* self,
                                         int resultCode,
                                         char* resultString);
@@ -54,32 +98,85 @@ protected:
     static void continueAfterOPTIONS   (RTSPClient* self,
                                         int resultCode,
                                         char* resultString);
+    static void continueAfterTEARDOWN  (RTSPClient* self,
+                                        int resultCode,
+                                        char* resultString);
     
     static void subsessionByeHandler   (void* self);
     static void subsessionAfterPlaying (void* self);
     static void checkForPacketArrival  (void* self);
     static void periodicQOSMeasurement (void* self);
+    static void checkReceiveTimeout    (void* self);
+    static void handleSessionEnded     (void* self);
+    static void retryConnect           (void* self);
+    static void stopSessionLoop        (void* stop);
     
     void networkLoop            ();
+    // Starts setting up a session, beginning with OPTIONS
+    void connectSession         ();
+    // Tears the session down and tries to set it up again after a while
     void shutdown               (int exitCode = 1);
+    void disconnect             ();
     
-    void createOutputFiles      (char const* periodicFilenameSuffix);
+    // Starts the sinks and hands the cubemap source to onDidConnect
+    void startSinks             ();
+    // Opens a decoder for every face on its own thread while the SETUPs are under way
+    void openDecoders           ();
     void setupStreams           ();
+    void playStreams            ();
     
     std::function<void (RTSPCubemapSourceClient*, CubemapSource*)> onDidConnect;
+    OnDidDisconnect onDidDisconnect;
+    OnReceivedBatch onReceivedBatch;
     
 private:
 	std::vector<BasicUsageEnvironment*> envs;
-    std::vector<std::shared_ptr<std::thread>> sessionThreads;
+    // One for every m= line, each in its own environment
+    std::vector<MediaSession*> sessions;
+    // The event loop of one session's environment.
+    // stop is its watch variable and only set on the loop's own thread by stopTrigger.
+    struct SessionLoop
+    {
+        std::thread    thread;
+        char           stop;
+        EventTriggerId stopTrigger;
+    };
+    std::vector<std::unique_ptr<SessionLoop>> sessionLoops;
     std::thread networkThread;
 	std::vector<MediaSubsession*> subsessions;
-    MediaSubsession* subsession;
+    // Subsessions whose SETUP is on its way, in the order the replies come
+    std::deque<MediaSubsession*> pendingSetups;
+    size_t nextSetup;
+    std::vector<H264NALUSink*> sinks;
+    std::vector<std::thread> openDecoderThreads;
+    // Shared by the sinks of all sessions, created with the first ones
+    std::unique_ptr<WorkerPool> workerPool;
+    size_t workerThreadsCount;
+    bool facesReferencePlanes;
+    FrameBufferProvider* frameBufferProvider;
+    CubemapSource* cubemapSource;
+    // The base URL is lost when the session is reset
+    std::string rtspURL;
+    bool isPlaying;
+    std::chrono::steady_clock::time_point connectTime;
+    std::chrono::steady_clock::time_point playTime;
+    std::atomic<size_t> firstFramesCount;
+    std::chrono::microseconds receiveTimeout;
+    EventTriggerId sessionEndedTrigger;
+    TaskToken receiveTimeoutTask;
+    TaskToken retryConnectTask;
     unsigned int sinkBufferSize;
     AVPixelFormat format;
     double lastTotalKBytes;
     unsigned int lastTotalPacketsReceived;
     unsigned int lastTotalPacketsExpected;
     bool matchStereoPairs;
-    bool robustSyncing;
     size_t maxFrameMapSize;
+    bool batchedReceive;
+    int busyPollMicroseconds;
+    std::chrono::microseconds cubemapDeadline;
+    double lateRate;
+    FaceConcealer::Policy concealmentPolicy;
+    H264NALUSink::DecoderThreading decoderThreading;
+    unsigned int decoderCoreBudget;
 };
@@ -21,7 +21,300 @@ namespace AlloReceiver
 		{
 			StatsUtils::cubemapsCount("cubemapsCount",
 			window,
-			now)/*,
+			now),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Transmission))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::Transmission>(datum.value).syscallsCount;
+                },
+                boost::accumulators::tag::sum(),
+                "sendSyscalls"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Transmission))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::Transmission>(datum.value).packetsCount;
+                },
+                boost::accumulators::tag::sum(),
+                "sentPackets"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::EncodeAllocations))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::EncodeAllocations>(datum.value).count;
+                },
+                boost::accumulators::tag::sum(),
+                "encodeAllocations"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Reception))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::Reception>(datum.value).syscallsCount;
+                },
+                boost::accumulators::tag::sum(),
+                "recvSyscalls"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Reception))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::Reception>(datum.value).packetsCount;
+                },
+                boost::accumulators::tag::sum(),
+                "receivedPackets"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::WakeUp))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "aggregatorWakeUps"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::WakeUp))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::WakeUp>(datum.value).cpuTime.count();
+                },
+                boost::accumulators::tag::sum(),
+                "aggregatorCPUTime"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::WakeUp)),
+                    [](Stats::TimeValueDatum datum)
+                    {
+                        // Only wake-ups that had to sleep
+                        return boost::any_cast<StatsUtils::WakeUp>(datum.value).latency.count() > 0;
+                    }
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::WakeUp>(datum.value).latency.count();
+                },
+                boost::accumulators::tag::mean(),
+                "aggregatorWakeUpLatency"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::WakeUp))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::WakeUp>(datum.value).latency.count();
+                },
+                boost::accumulators::tag::max(),
+                "aggregatorMaxWakeUpLatency"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Playout))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::Playout>(datum.value).delay.count();
+                },
+                boost::accumulators::tag::mean(),
+                "playoutDelay"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Playout))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "playouts"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Playout))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::Playout>(datum.value).jitter.count();
+                },
+                boost::accumulators::tag::mean(),
+                "playoutJitter"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Playout))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::Playout>(datum.value).concealedFaces;
+                },
+                boost::accumulators::tag::sum(),
+                "concealedFaces"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::LateFrame))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "lateFrames"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::FrameWithoutRoom))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "framesWithoutRoom"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::UnstampedFrame))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "unstampedFrames"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::KeyframeRequest))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "keyframeRequests"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Concealment))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "concealments"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Concealment))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::Concealment>(datum.value).duration.count();
+                },
+                boost::accumulators::tag::mean(),
+                "concealmentDuration"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::Concealment))
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return (double)boost::any_cast<StatsUtils::Concealment>(datum.value).duration.count();
+                },
+                boost::accumulators::tag::max(),
+                "maxConcealmentDuration"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::LoadShedding)),
+                    [](Stats::TimeValueDatum datum)
+                    {
+                        return boost::any_cast<StatsUtils::LoadShedding>(datum.value).step == StatsUtils::LoadShedding::FAST_DECODE;
+                    }
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "fastDecodedFrames"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::LoadShedding)),
+                    [](Stats::TimeValueDatum datum)
+                    {
+                        return boost::any_cast<StatsUtils::LoadShedding>(datum.value).step == StatsUtils::LoadShedding::DROP_NON_REFERENCE;
+                    }
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "droppedNonReferenceFrames"),
+            Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                {
+                    StatsUtils::timeFilter(window,
+                                           now),
+                    StatsUtils::typeFilter(typeid(StatsUtils::LoadShedding)),
+                    [](Stats::TimeValueDatum datum)
+                    {
+                        return boost::any_cast<StatsUtils::LoadShedding>(datum.value).step == StatsUtils::LoadShedding::SKIP_TO_IDR;
+                    }
+                }),
+                [](Stats::TimeValueDatum datum)
+                {
+                    return 0.0;
+                },
+                boost::accumulators::tag::count(),
+                "skippedFrames")/*,
 			StatsUtils::nalusBitSum("droppedNALUsBitSum",
 			-1,
 			StatsUtils::NALU::DROPPED,
@@ -140,7 +433,73 @@ namespace AlloReceiver
                         return 0.0;
                     },
                     boost::accumulators::tag::count(),
-                    "scheduledFacesCount" + faceStr)
+                    "scheduledFacesCount" + faceStr),
+                Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                    {
+                        [window, now, face](Stats::TimeValueDatum datum)
+                        {
+                            return (now - datum.time) < window && // time filter
+                                datum.value.type() == typeid(StatsUtils::Frame) && // type filter
+                                boost::any_cast<StatsUtils::Frame>(datum.value).status == StatsUtils::Frame::ENCODED && // status filter
+                                boost::any_cast<StatsUtils::Frame>(datum.value).type == 5 && // keyframes only
+                                (face == -1 || boost::any_cast<StatsUtils::Frame>(datum.value).face == face); // face filter
+                        }
+                    }),
+                    [](Stats::TimeValueDatum datum)
+                    {
+                        return 0.0;
+                    },
+                    boost::accumulators::tag::count(),
+                    "encodedKeyframes" + faceStr),
+                Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                    {
+                        [window, now, face](Stats::TimeValueDatum datum)
+                        {
+                            return (now - datum.time) < window && // time filter
+                                datum.value.type() == typeid(StatsUtils::Frame) && // type filter
+                                boost::any_cast<StatsUtils::Frame>(datum.value).status == StatsUtils::Frame::ENCODED && // status filter
+                                boost::any_cast<StatsUtils::Frame>(datum.value).type == 5 && // keyframes only
+                                (face == -1 || boost::any_cast<StatsUtils::Frame>(datum.value).face == face); // face filter
+                        }
+                    }),
+                    [](Stats::TimeValueDatum datum)
+                    {
+                        return boost::any_cast<StatsUtils::Frame>(datum.value).size / 1000.0;
+                    },
+                    boost::accumulators::tag::mean(),
+                    "keyframeSize" + faceStr),
+                Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                    {
+                        StatsUtils::timeFilter(window,
+                                               now),
+                        StatsUtils::typeFilter(typeid(StatsUtils::DecodeTime)),
+                        [face](Stats::TimeValueDatum datum)
+                        {
+                            return (face == -1) ? true : boost::any_cast<StatsUtils::DecodeTime>(datum.value).face == face;
+                        }
+                    }),
+                    [](Stats::TimeValueDatum datum)
+                    {
+                        return 0.0;
+                    },
+                    boost::accumulators::tag::count(),
+                    "decodeTimes" + faceStr),
+                Stats::StatVal::makeStatVal(StatsUtils::andFilter(
+                    {
+                        StatsUtils::timeFilter(window,
+                                               now),
+                        StatsUtils::typeFilter(typeid(StatsUtils::DecodeTime)),
+                        [face](Stats::TimeValueDatum datum)
+                        {
+                            return (face == -1) ? true : boost::any_cast<StatsUtils::DecodeTime>(datum.value).face == face;
+                        }
+                    }),
+                    [](Stats::TimeValueDatum datum)
+                    {
+                        return (double)boost::any_cast<StatsUtils::DecodeTime>(datum.value).duration.count();
+                    },
+                    boost::accumulators::tag::mean(),
+                    "decodeTime" + faceStr)
 				/*StatsUtils::nalusCount("droppedNALUsCount" + std::to_string(face),
 				face,
 				StatsUtils::NALU::DROPPED,
@@ -170,6 +529,38 @@ namespace AlloReceiver
 			unsigned long seconds = std::chrono::duration_cast<std::chrono::seconds>(window).count();
 
 			results["fps"] = results["cubemapsCount"] / seconds;
+			results["sendSyscallsPS"] = results["sendSyscalls"] / seconds;
+			results["packetsPerSyscall"] = (results["sendSyscalls"] > 0) ? results["sentPackets"] / results["sendSyscalls"] : 0.0;
+			results["encodeAllocationsPS"] = results["encodeAllocations"] / seconds;
+			results["recvSyscallsPS"] = results["recvSyscalls"] / seconds;
+			results["packetsPerRecvSyscall"] = (results["recvSyscalls"] > 0) ? results["receivedPackets"] / results["recvSyscalls"] : 0.0;
+			results["aggregatorWakeUpsPS"] = results["aggregatorWakeUps"] / seconds;
+			results["aggregatorCPU"] = results["aggregatorCPUTime"] / window.count() * 100.0;
+			results["lateFramesPS"] = results["lateFrames"] / seconds;
+			results["framesWithoutRoomPS"] = results["framesWithoutRoom"] / seconds;
+			results["concealedFacesPS"] = results["concealedFaces"] / seconds;
+			results["unstampedFramesPS"] = results["unstampedFrames"] / seconds;
+			results["keyframeRequestsPS"] = results["keyframeRequests"] / seconds;
+			results["concealmentsPS"] = results["concealments"] / seconds;
+			results["fastDecodedFramesPS"] = results["fastDecodedFrames"] / seconds;
+			results["droppedNonReferenceFramesPS"] = results["droppedNonReferenceFrames"] / seconds;
+			results["skippedFramesPS"] = results["skippedFrames"] / seconds;
+
+			// The mean of nothing is NaN
+			if (results["playouts"] == 0)
+			{
+				results["playoutDelay"] = 0;
+				results["playoutJitter"] = 0;
+			}
+			results["playoutDelay"] /= 1000.0;
+			results["playoutJitter"] /= 1000.0;
+			if (results["concealments"] == 0)
+			{
+				results["concealmentDuration"] = 0;
+				results["maxConcealmentDuration"] = 0;
+			}
+			results["concealmentDuration"] /= 1000.0;
+			results["maxConcealmentDuration"] /= 1000.0;
 
 			//results.insert(
 			//{
@@ -201,6 +592,17 @@ namespace AlloReceiver
 			{
 				std::string faceStr = std::to_string(face);
 
+				// The mean of nothing is NaN
+				if (results["encodedKeyframes" + faceStr] == 0)
+				{
+					results["keyframeSize" + faceStr] = 0;
+				}
+				if (results["decodeTimes" + faceStr] == 0)
+				{
+					results["decodeTime" + faceStr] = 0;
+				}
+				results["decodeTime" + faceStr] /= 1000.0;
+
 				results.insert(
 				{
 					{
@@ -238,6 +640,10 @@ namespace AlloReceiver
                     {
                         "scheduledFaces" + faceStr + "PS",
                         results["scheduledFacesCount" + faceStr] / seconds
+                    },
+                    {
+                        "encodedKeyframes" + faceStr + "PS",
+                        results["encodedKeyframes" + faceStr] / seconds
                     }
 				});
 			}
@@ -309,6 +715,18 @@ namespace AlloReceiver
             stream << ";" << std::endl;
         }
         
+        stream << "-------------------------------------------------------------------------------" << std::endl;
+        stream << "Decode time (ms): {decodeTime-1:0.1f}" << std::endl;
+        for (int j = 0; j < (std::min) (2, FACE_COUNT); j++)
+        {
+            stream << ((j == 0) ? "left" : "right") << ":";
+            for (int i = 0; i < (std::min) (6, FACE_COUNT - j * 6); i++)
+            {
+                stream << "\t{decodeTime" << j * 6 + i << ":0.1f}";
+            }
+            stream << ";" << std::endl;
+        }
+        
         stream << "-------------------------------------------------------------------------------" << std::endl;
         stream << "Color converted frames/s:" << std::endl;
         for (int j = 0; j < (std::min) (2, FACE_COUNT); j++)
@@ -352,6 +770,18 @@ namespace AlloReceiver
             stream << ";" << std::endl;
         }
         
+        stream << "-------------------------------------------------------------------------------" << std::endl;
+        stream << "Encoded keyframes/s (mean size in KB):" << std::endl;
+        for (int j = 0; j < (std::min) (2, FACE_COUNT); j++)
+        {
+            stream << ((j == 0) ? "left" : "right") << ":";
+            for (int i = 0; i < (std::min) (6, FACE_COUNT - j * 6); i++)
+            {
+                stream << "\t{encodedKeyframes" << j * 6 + i << "PS:0.1f} ({keyframeSize" << j * 6 + i << ":0.1f})";
+            }
+            stream << ";" << std::endl;
+        }
+        
         stream << "-------------------------------------------------------------------------------" << std::endl;
         stream << "cubemap face 0-5 (left ) fps:";
         for (int i = 0; i < 6; i++)
@@ -367,6 +797,15 @@ namespace AlloReceiver
         }
         stream << ";" << std::endl;
         stream << "fps: {fps:0.1f}" << std::endl;
+        stream << "send syscalls/s: {sendSyscallsPS:0.1f}; packets per syscall: {packetsPerSyscall:0.2f}" << std::endl;
+        stream << "encode path heap allocations/s: {encodeAllocationsPS:0.1f}" << std::endl;
+        stream << "recv syscalls/s: {recvSyscallsPS:0.1f}; packets per syscall: {packetsPerRecvSyscall:0.2f}" << std::endl;
+        stream << "frame aggregator: {aggregatorCPU:0.1f}% CPU; wake-ups/s: {aggregatorWakeUpsPS:0.1f}; wake-up latency: {aggregatorWakeUpLatency:0.0f}us (max {aggregatorMaxWakeUpLatency:0.0f}us)" << std::endl;
+        stream << "playout: delay {playoutDelay:0.1f}ms; jitter {playoutJitter:0.1f}ms; late frames/s: {lateFramesPS:0.1f}; frames without room/s: {framesWithoutRoomPS:0.1f}; concealed faces/s: {concealedFacesPS:0.1f}" << std::endl;
+        stream << "frames without cubemap stamp/s: {unstampedFramesPS:0.1f}" << std::endl;
+        stream << "keyframe requests/s: {keyframeRequestsPS:0.1f}" << std::endl;
+        stream << "concealments/s: {concealmentsPS:0.1f}; duration {concealmentDuration:0.1f}ms (max {maxConcealmentDuration:0.1f}ms)" << std::endl;
+        stream << "load shedding frames/s: fast decoded {fastDecodedFramesPS:0.1f}; dropped non-reference {droppedNonReferenceFramesPS:0.1f}; skipped to IDR {skippedFramesPS:0.1f}" << std::endl;
 
 		return stream.str();
 	};
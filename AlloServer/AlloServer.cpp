@@ -1,6 +1,9 @@
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/program_options.hpp>
+#include <algorithm>
+#include <climits>
+#include <atomic>
 #include <liveMedia.hh>
 #include <GroupsockHelper.hh>
 #define EventTime server_EventTime
@@ -25,12 +28,19 @@ extern "C"
 #include "AlloServer.h"
 #include "AlloReceiver/Stats.hpp"
 #include "DiscreteFlowControlFilter.hpp"
+#include "EncodeScheduler.hpp"
+#include "TokenBucket.hpp"
+#include "BatchingGroupsock.hpp"
+#include "H264FrameRTPSink.hpp"
+#include "KeyframeRequestGroupsock.hpp"
+#include "FaceServerMediaSubsession.hpp"
 
 static Stats stats;
 
 struct FrameStreamState
 {
     RTPSink*      sink;
+    RTCPInstance* rtcp;
     Frame*        content;
     FramedSource* source;
 };
@@ -46,7 +56,18 @@ static boost::uint16_t rtspPort;
 static int avgBitRate;
 
 static size_t bufferSize = 2000000000;
-static bool robustSyncing = false;
+static size_t encoderThreads = std::thread::hardware_concurrency();
+static EncodeScheduler* encodeScheduler = nullptr;
+static H264NALUSource::Backend encoderBackend = H264NALUSource::X264_BACKEND;
+static size_t encodersCount = 0;
+
+// Keyframe related
+static H264NALUSource::KeyframeSchedule::Mode keyframeMode = H264NALUSource::KeyframeSchedule::IDR;
+static int keyframeInterval = DEFAULT_KEYFRAME_INTERVAL;
+static int maxKeyframesPerFrame = DEFAULT_MAX_KEYFRAMES_PER_FRAME;
+static int keyframeRequestInterval = DEFAULT_KEYFRAME_REQUEST_INTERVAL;
+// Whether a client that starts to play gets an IDR frame of every face right away
+static bool keyframeOnJoin = false;
 
 // Cubemap related
 static StereoCubemap*                cubemap;
@@ -63,7 +84,13 @@ static EventTriggerId addBinularsSubstreamTriggerId;
 static EventTriggerId removeBinularsSubstreamTriggerId;
 static std::string binocularsStreamName = "binoculars";
 static FrameStreamState* binocularsStream = nullptr;
-static unsigned long bandwidth = 700 * boost::mega::num; // limit bandwidth to 700 MBit/s
+
+// Pacing related
+static unsigned long bandwidth = 700 * boost::mega::num; // limit bandwidth of all faces together to 700 MBit/s
+static unsigned long faceBandwidth = 0; // 0 means DEFAULT_FACE_BANDWIDTH_FACTOR times the average bit rate
+static bool kernelPacing = false;
+static TokenBucket* aggregateBucket = nullptr;
+static bool batchedSend = false;
 
 static void announceStream(RTSPServer* rtspServer, ServerMediaSession* sms, std::string& name)
 {
@@ -77,13 +104,77 @@ void onSentNALU(H264NALUSource*, uint8_t type, size_t size, int eye, int face)
 	//stats.store(StatsUtils::NALU(type, size, eye * 6 + face, StatsUtils::NALU::SENT));
 }
 
-void onEncodedFrame(H264NALUSource*, int eye, int face)
+void onSentBatch(BatchingGroupsock*, size_t packetsCount, size_t syscallsCount)
+{
+	stats.store(StatsUtils::Transmission(packetsCount, syscallsCount));
+}
+
+void onEncodedFrame(H264NALUSource*, bool keyframe, size_t size, int eye, int face)
 {
 	stats.store(StatsUtils::CubemapFace(eye * 6 + face, StatsUtils::CubemapFace::DISPLAYED));
+	stats.store(StatsUtils::Frame((keyframe) ? 5 : 1, size, eye * 6 + face, StatsUtils::Frame::ENCODED));
+
+	// The allocations of all arenas since the last encoder that reported them
+	static std::atomic<size_t> reportedEncodeAllocations(0);
+	size_t total    = EncodeArena::getTotalAllocationsCount();
+	size_t reported = reportedEncodeAllocations.load();
+	while (total > reported && !reportedEncodeAllocations.compare_exchange_weak(reported, total));
+	if (total > reported)
+	{
+		stats.store(StatsUtils::EncodeAllocations(total - reported));
+	}
+}
+
+// Encoders are put into groups of at most maxKeyframesPerFrame.
+// The groups' phases are spread evenly over the keyframe interval
+// so that the IDR frames of different groups never share a frame.
+static H264NALUSource::KeyframeSchedule makeKeyframeSchedule(size_t encoderIndex)
+{
+	size_t groupsCount = (encodersCount + maxKeyframesPerFrame - 1) / maxKeyframesPerFrame;
+
+	H264NALUSource::KeyframeSchedule schedule;
+	schedule.mode     = keyframeMode;
+	schedule.interval = keyframeInterval;
+	schedule.phase    = (int)((encoderIndex % groupsCount) * keyframeInterval / groupsCount);
+	schedule.minRequestInterval = keyframeRequestInterval;
+	return schedule;
+}
+
+// Lets the kernel (fq qdisc) space out the packets of the socket as well
+static void setKernelPacingRate(int socket, unsigned long rate)
+{
+#if defined(SO_MAX_PACING_RATE)
+	unsigned int bytesPerSecond = (unsigned int)(std::min)(rate / 8, (unsigned long)UINT_MAX);
+	if (setsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE, (const char*)&bytesPerSecond, sizeof(bytesPerSecond)) < 0)
+	{
+		std::cout << "Could not set the kernel pacing rate" << std::endl;
+	}
+#else
+	std::cout << "Kernel pacing is not supported on this platform" << std::endl;
+#endif
 }
 
 void addFaceSubstreams0(void*)
 {
+	// One bucket for all faces that keeps the multicast group below bandwidth
+	aggregateBucket = new TokenBucket(bandwidth,
+		DiscreteFlowControlFilter::getBucketDepth(bandwidth, std::chrono::microseconds(PACER_BURST_MICROSECONDS)));
+
+	// Identifies us in RTCP reports
+	unsigned char cname[101];
+	gethostname((char*)cname, sizeof(cname) - 1);
+	cname[sizeof(cname) - 1] = '\0';
+
+	// The receiver can tell from it when it has all faces of a cubemap
+	boost::uint32_t expectedFaces = 0;
+	for (int j = 0, stream = 0; j < cubemap->getEyesCount(); j++)
+	{
+		for (int i = 0; i < cubemap->getEye(j)->getFacesCount(); i++, stream++)
+		{
+			expectedFaces |= 1 << stream;
+		}
+	}
+
 	int portCounter = 0;
 	for (int j = 0; j < cubemap->getEyesCount(); j++)
 	{
@@ -97,39 +188,91 @@ void addFaceSubstreams0(void*)
 			state->content = eye->getFace(i)->getContent();
 
 			Port rtpPort(FACE0_RTP_PORT_NUM + portCounter);
+			Port rtcpPort(FACE0_RTP_PORT_NUM + portCounter + 1);
 			portCounter += 2;
-			Groupsock* rtpGroupsock = new Groupsock(*env, destinationAddress, rtpPort, TTL);
+			// Sends a frame's packets with one syscall if batchedSend is set.
+			// Counts the syscalls either way.
+			BatchingGroupsock* rtpGroupsock = new BatchingGroupsock(*env, destinationAddress, rtpPort, TTL, batchedSend);
+			rtpGroupsock->setOnSentBatch(&onSentBatch);
 			//rtpGroupsock->multicastSendOnly(); // we're a SSM source
 
 			setReceiveBufferTo(*env, rtpGroupsock->socketNum(), bufferSize);
+			if (kernelPacing)
+			{
+				setKernelPacingRate(rtpGroupsock->socketNum(), faceBandwidth);
+			}
 
-			// Create a 'H264 Video RTP' sink from the RTP 'groupsock':
-			state->sink = H264VideoRTPSink::createNew(*env, rtpGroupsock, 96);
-
-			ServerMediaSubsession* subsession = PassiveServerMediaSubsession::createNew(*state->sink);
-
-			cubemapSMS->addSubsession(subsession);
-
+			H264NALUSource::KeyframeSchedule keyframeSchedule = makeKeyframeSchedule(j * eye->getFacesCount() + i);
 			H264NALUSource* source = H264NALUSource::createNew(*env,
 				state->content,
 				avgBitRate,
-                robustSyncing);
+                *encodeScheduler,
+                keyframeSchedule,
+                encoderBackend);
+			source->setCubemapStamping(j * eye->getFacesCount() + i, expectedFaces);
+
+			// Create a 'H264 Video RTP' sink from the RTP 'groupsock'.
+			// It marks the last packet of each frame.
+			H264FrameRTPSink* sink = H264FrameRTPSink::createNew(*env, rtpGroupsock, 96, source);
+			state->sink = sink;
+
+			// Receivers that lost packets of the face ask for an IDR frame over RTCP
+			KeyframeRequestGroupsock* rtcpGroupsock = new KeyframeRequestGroupsock(*env,
+				destinationAddress,
+				rtcpPort,
+				TTL,
+				sink->SSRC());
+			int face = j * eye->getFacesCount() + i;
+			rtcpGroupsock->setOnKeyframeRequest([source, face](KeyframeRequestGroupsock*)
+			{
+				stats.store(StatsUtils::KeyframeRequest(face));
+				source->requestKeyframe();
+			});
+			state->rtcp = RTCPInstance::createNew(*env,
+				rtcpGroupsock,
+				avgBitRate / 1000, // kbit/s
+				cname,
+				state->sink,
+				NULL);
+
+			FaceServerMediaSubsession* subsession = FaceServerMediaSubsession::createNew(*state->sink, state->rtcp);
+			if (keyframeOnJoin)
+			{
+				// Without it the client waits for the face's next scheduled IDR frame
+				subsession->setOnStartedStream([source](FaceServerMediaSubsession*, unsigned)
+				{
+					source->requestKeyframe();
+				});
+			}
+
+			cubemapSMS->addSubsession(subsession);
 
             using namespace std::placeholders;
 
 			source->setOnSentNALU    (std::bind(&onSentNALU,     _1, _2, _3, j, i));
-			source->setOnEncodedFrame(std::bind(&onEncodedFrame, _1, j, i));
+			source->setOnEncodedFrame(std::bind(&onEncodedFrame, _1, _2, _3, j, i));
 
 			DiscreteFlowControlFilter* flowControlFilter = DiscreteFlowControlFilter::createNew(*env,
 				                                                                                source,
-																								bandwidth);
+																								faceBandwidth,
+																								aggregateBucket);
+			// The pacer decides when packets go out. A batch only holds what it released at once.
+			flowControlFilter->setOnHoldBack([rtpGroupsock](DiscreteFlowControlFilter*)
+			{
+				rtpGroupsock->flush();
+			});
 
 			state->source = H264VideoStreamDiscreteFramer::createNew(*env,
 				flowControlFilter);
 
 			state->sink->startPlaying(*state->source, NULL, NULL);
 
-			std::cout << "Streaming face " << i << " (" << ((j == 0) ? "left" : "right") << ") on port " << ntohs(rtpPort.num()) << " ..." << std::endl;
+			std::cout << "Streaming face " << i << " (" << ((j == 0) ? "left" : "right") << ") on port " << ntohs(rtpPort.num());
+			if (keyframeMode == H264NALUSource::KeyframeSchedule::IDR)
+			{
+				std::cout << " with keyframe phase " << keyframeSchedule.phase;
+			}
+			std::cout << " ..." << std::endl;
 		}
 	}
     
@@ -144,6 +287,9 @@ void removeFaceSubstreams0(void*)
         for (int i = 0; i < faceStreams.size(); i++)
         {
             FrameStreamState stream = faceStreams[i];
+            Groupsock* rtcpGroupsock = stream.rtcp->RTCPgs();
+            Medium::close(stream.rtcp);
+            delete rtcpGroupsock;
             stream.sink->stopPlaying();
             Medium::close(stream.sink);
             Medium::close(stream.source);
@@ -152,6 +298,8 @@ void removeFaceSubstreams0(void*)
         faceStreams.clear();
         cubemapSMS->deleteAllSubsessions();
     }
+    delete aggregateBucket;
+    aggregateBucket = nullptr;
     std::thread(std::bind(&boost::barrier::wait, &stopStreamingBarrier));
 }
 
@@ -164,18 +312,29 @@ void addBinocularsSubstream0(void*)
     Groupsock* rtpGroupsock = new Groupsock(*env, destinationAddress, rtpPort, TTL);
     //rtpGroupsock->multicastSendOnly(); // we're a SSM source
     
-    // Create a 'H264 Video RTP' sink from the RTP 'groupsock':
-    binocularsStream->sink = H264VideoRTPSink::createNew(*env, rtpGroupsock, 96);
+    H264NALUSource* source = H264NALUSource::createNew(*env,
+                                                       binocularsStream->content,
+                                                       avgBitRate,
+                                                       *encodeScheduler,
+                                                       makeKeyframeSchedule(encodersCount - 1),
+                                                       encoderBackend);
     
-    ServerMediaSubsession* subsession = PassiveServerMediaSubsession::createNew(*binocularsStream->sink);
+    // Create a 'H264 Video RTP' sink from the RTP 'groupsock'.
+    // It marks the last packet of each frame.
+    binocularsStream->sink = H264FrameRTPSink::createNew(*env, rtpGroupsock, 96, source);
+    
+    FaceServerMediaSubsession* subsession = FaceServerMediaSubsession::createNew(*binocularsStream->sink);
+    if (keyframeOnJoin)
+    {
+        subsession->setOnStartedStream([source](FaceServerMediaSubsession*, unsigned)
+        {
+            source->requestKeyframe();
+        });
+    }
     
     binocularsSMS->addSubsession(subsession);
     
-    binocularsStream->source = H264VideoStreamDiscreteFramer::createNew(*env,
-                                                                        H264NALUSource::createNew(*env,
-                                                                                                  binocularsStream->content,
-                                                                                                  avgBitRate,
-																								  robustSyncing));
+    binocularsStream->source = H264VideoStreamDiscreteFramer::createNew(*env, source);
     binocularsStream->sink->startPlaying(*binocularsStream->source, NULL, NULL);
     
     std::cout << "Streaming binoculars ..." << std::endl;
@@ -265,25 +424,50 @@ void startStreaming()
                                                          SHM_NAME);
 
     auto cubemapPair = shm->find<StereoCubemap::Ptr>("Cubemap");
-    if (cubemapPair.first)
+    cubemap = (cubemapPair.first) ? cubemapPair.first->get() : nullptr;
+
+    auto binocularsPair = shm->find<Binoculars::Ptr>("Binoculars");
+    binoculars = (binocularsPair.first) ? binocularsPair.first->get() : nullptr;
+
+    // All encoders share one pool of threads
+    encodersCount = (binoculars) ? 1 : 0;
+    if (cubemap)
     {
-        cubemap = cubemapPair.first->get();
-        env->taskScheduler().triggerEvent(addFaceSubstreamsTriggerId, NULL);
+        for (int j = 0; j < cubemap->getEyesCount(); j++)
+        {
+            encodersCount += cubemap->getEye(j)->getFacesCount();
+        }
+    }
+    encodeScheduler = new EncodeScheduler(encoderThreads,
+                                          encodersCount,
+                                          std::chrono::microseconds(1000000 / FPS));
+    std::cout << "Encoding with " << encodeScheduler->getWorkersCount() << " workers and "
+              << encodeScheduler->getThreadsPerEncoder() << " x264 thread(s) per encoder" << std::endl;
+
+    if (keyframeMode == H264NALUSource::KeyframeSchedule::IDR)
+    {
+        std::cout << "Sending an IDR frame every " << keyframeInterval << " frames, at most "
+                  << maxKeyframesPerFrame << " per frame" << std::endl;
+        if (encodersCount > (size_t)(keyframeInterval * maxKeyframesPerFrame))
+        {
+            std::cout << "Warning: " << encodersCount << " encoders do not fit into a keyframe interval of "
+                      << keyframeInterval << " frames. Some frames will carry more IDR frames." << std::endl;
+        }
     }
     else
     {
-        cubemap = nullptr;
+        std::cout << "Using periodic intra refresh every " << keyframeInterval << " frames" << std::endl;
     }
-    
-    auto binocularsPair = shm->find<Binoculars::Ptr>("Binoculars");
-    if (binocularsPair.first)
+    std::cout << "Sending an IDR frame on request of a receiver at most every "
+              << keyframeRequestInterval << " frames per face" << std::endl;
+
+    if (cubemap)
     {
-        binoculars = binocularsPair.first->get();
-        env->taskScheduler().triggerEvent(addBinularsSubstreamTriggerId, NULL);
+        env->taskScheduler().triggerEvent(addFaceSubstreamsTriggerId, NULL);
     }
-    else
+    if (binoculars)
     {
-        binoculars = nullptr;
+        env->taskScheduler().triggerEvent(addBinularsSubstreamTriggerId, NULL);
     }
 }
 
@@ -293,6 +477,9 @@ void stopStreaming()
     env->taskScheduler().triggerEvent(removeFaceSubstreamsTriggerId, NULL);
     env->taskScheduler().triggerEvent(removeBinularsSubstreamTriggerId, NULL);
     stopStreamingBarrier.wait();
+
+    delete encodeScheduler;
+    encodeScheduler = nullptr;
     
     delete shm;
 }
@@ -307,8 +494,17 @@ int main(int argc, char* argv[])
 		("avg-bit-rate",      boost::program_options::value<int>(),             "")
 		("buffer-size",       boost::program_options::value<size_t>(),          "")
 	    ("stats-interval",    boost::program_options::value<size_t>(),          "")
-		("robust-syncing",    "")
-		("bandwidth",         boost::program_options::value<unsigned long>(),   "");
+		("bandwidth",         boost::program_options::value<unsigned long>(),   "")
+		("face-bandwidth",    boost::program_options::value<unsigned long>(),   "")
+		("kernel-pacing",     "")
+		("batched-send",      "")
+		("encoder-threads",   boost::program_options::value<size_t>(),          "")
+		("encoder-backend",   boost::program_options::value<std::string>(),     "")
+		("keyframe-interval", boost::program_options::value<int>(),             "")
+		("max-keyframes-per-frame", boost::program_options::value<int>(),       "")
+		("intra-refresh",     "")
+		("keyframe-request-interval", boost::program_options::value<int>(),     "")
+		("keyframe-on-join",  "");
 		
     
     boost::program_options::variables_map vm;
@@ -383,14 +579,82 @@ int main(int argc, char* argv[])
 		statsInterval = DEFAULT_STATS_INTERVAL;
 	}
 
-	if (vm.count("robust-syncing"))
+	if (vm.count("bandwidth"))
 	{
-		robustSyncing = true;
+		bandwidth = vm["bandwidth"].as<unsigned long>();
 	}
 
-	if (vm.count("bandwidth"))
+	if (vm.count("face-bandwidth"))
 	{
-		bandwidth = vm["bandwidth"].as<unsigned long>();
+		faceBandwidth = vm["face-bandwidth"].as<unsigned long>();
+	}
+	if (faceBandwidth == 0)
+	{
+		faceBandwidth = (unsigned long)avgBitRate * DEFAULT_FACE_BANDWIDTH_FACTOR;
+	}
+	std::cout << "Pacing to " << to_human_readable_byte_count(bandwidth, true, false) << "/s in total and "
+	          << to_human_readable_byte_count(faceBandwidth, true, false) << "/s per face" << std::endl;
+
+	if (vm.count("kernel-pacing"))
+	{
+		kernelPacing = true;
+	}
+
+	if (vm.count("batched-send"))
+	{
+		batchedSend = true;
+		std::cout << "Sending batches of RTP packets (sendmmsg: "
+		          << ((BatchingGroupsock::isSendmmsgSupported()) ? "yes" : "no") << ", UDP GSO: "
+		          << ((BatchingGroupsock::isGSOSupported()) ? "yes" : "no") << ")" << std::endl;
+	}
+
+	if (vm.count("encoder-threads"))
+	{
+		encoderThreads = vm["encoder-threads"].as<size_t>();
+	}
+
+	if (vm.count("encoder-backend"))
+	{
+		std::string backend = vm["encoder-backend"].as<std::string>();
+		if (backend == "x264")
+		{
+			encoderBackend = H264NALUSource::X264_BACKEND;
+		}
+		else if (backend == "avcodec")
+		{
+			encoderBackend = H264NALUSource::AVCODEC_BACKEND;
+		}
+		else
+		{
+			std::cout << "Unknown encoder backend \"" << backend << "\" (use x264 or avcodec)" << std::endl;
+			return -1;
+		}
+	}
+
+	if (vm.count("keyframe-interval"))
+	{
+		keyframeInterval = (std::max)(vm["keyframe-interval"].as<int>(), 1);
+	}
+
+	if (vm.count("max-keyframes-per-frame"))
+	{
+		maxKeyframesPerFrame = (std::max)(vm["max-keyframes-per-frame"].as<int>(), 1);
+	}
+
+	if (vm.count("intra-refresh"))
+	{
+		keyframeMode = H264NALUSource::KeyframeSchedule::INTRA_REFRESH;
+	}
+
+	if (vm.count("keyframe-request-interval"))
+	{
+		keyframeRequestInterval = (std::max)(vm["keyframe-request-interval"].as<int>(), 1);
+	}
+
+	if (vm.count("keyframe-on-join"))
+	{
+		keyframeOnJoin = true;
+		std::cout << "Sending IDR frames to clients that start to play" << std::endl;
 	}
 
     av_log_set_level(AV_LOG_WARNING);
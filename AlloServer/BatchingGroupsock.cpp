@@ -0,0 +1,309 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <GroupsockHelper.hh>
+
+#if defined(__linux__)
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <netinet/udp.h>
+    #include <unistd.h>
+#endif
+
+#include "BatchingGroupsock.hpp"
+
+#if defined(__linux__)
+
+// Older headers do not know UDP GSO yet
+#ifndef SOL_UDP
+    #define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+    #define UDP_SEGMENT 103
+#endif
+
+// The kernel does not take more segments in one GSO message
+static const size_t MAX_GSO_SEGMENTS = 64;
+// nor more payload than fits into one UDP datagram
+static const size_t MAX_GSO_PAYLOAD = 65507;
+
+static bool detectSendmmsg()
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // Sending nothing only fails if the syscall is missing
+    bool supported = sendmmsg(fd, NULL, 0, 0) >= 0 || errno != ENOSYS;
+    close(fd);
+    return supported;
+}
+
+static bool detectGSO()
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    int segmentSize = 1400;
+    bool supported = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &segmentSize, sizeof(segmentSize)) == 0;
+    close(fd);
+    return supported;
+}
+
+#else
+
+static bool detectSendmmsg()
+{
+    return false;
+}
+
+static bool detectGSO()
+{
+    return false;
+}
+
+#endif
+
+bool BatchingGroupsock::isSendmmsgSupported()
+{
+    static bool supported = detectSendmmsg();
+    return supported;
+}
+
+bool BatchingGroupsock::isGSOSupported()
+{
+    static bool supported = detectGSO();
+    return supported;
+}
+
+BatchingGroupsock::BatchingGroupsock(UsageEnvironment& env, const struct in_addr& groupAddr, Port port, u_int8_t ttl,
+                                     bool isBatching)
+    :
+    Groupsock(env, groupAddr, port, ttl),
+    buffer((isBatching) ? MAX_BATCH_PACKETS * MAX_PACKET_SIZE : 0), bufferSize(0),
+    address(0), portNum(0), isBatching(isBatching), hasSentFirstPacket(false), useGSO(isSendmmsgSupported() && isGSOSupported()), gsoFailuresCount(0), flushTask(NULL)
+{
+    packets.reserve(MAX_BATCH_PACKETS);
+}
+
+BatchingGroupsock::~BatchingGroupsock()
+{
+    env().taskScheduler().unscheduleDelayedTask(flushTask);
+    flush();
+}
+
+void BatchingGroupsock::setOnSentBatch(const OnSentBatch& callback)
+{
+    onSentBatch = callback;
+}
+
+Boolean BatchingGroupsock::write(netAddressBits address, portNumBits portNum, u_int8_t ttl,
+                                 unsigned char* buffer, unsigned bufferSize)
+{
+#if defined(__linux__)
+    // The first packet takes the usual path which sets up TTL and source port for us.
+    // Packets that do not fit into a slot do so as well.
+    if (!isBatching || !hasSentFirstPacket || bufferSize > MAX_PACKET_SIZE ||
+        address != this->address || portNum != this->portNum)
+    {
+        flush();
+        hasSentFirstPacket = true;
+        this->address = address;
+        this->portNum = portNum;
+        Boolean result = OutputSocket::write(address, portNum, ttl, buffer, bufferSize);
+        if (onSentBatch) onSentBatch(this, 1, 1);
+        return result;
+    }
+
+    Packet packet = { this->bufferSize, bufferSize };
+    memcpy(this->buffer.data() + packet.offset, buffer, bufferSize);
+    this->bufferSize += bufferSize;
+    packets.push_back(packet);
+
+    // RTP marker bit: last packet of a frame
+    bool isEndOfFrame = bufferSize >= 2 && (buffer[1] & 0x80);
+    if (isEndOfFrame || packets.size() == MAX_BATCH_PACKETS)
+    {
+        flush();
+    }
+    else if (!flushTask)
+    {
+        // Don't hold back packets of a frame whose end gets lost somewhere
+        flushTask = env().taskScheduler().scheduleDelayedTask(BATCH_TIMEOUT_MICROSECONDS, flush0, this);
+    }
+    return True;
+#else
+    Boolean result = OutputSocket::write(address, portNum, ttl, buffer, bufferSize);
+    if (onSentBatch) onSentBatch(this, 1, 1);
+    return result;
+#endif
+}
+
+void BatchingGroupsock::flush0(void* clientData)
+{
+    BatchingGroupsock* self = (BatchingGroupsock*)clientData;
+    self->flushTask = NULL;
+    self->flush();
+}
+
+void BatchingGroupsock::flush()
+{
+    env().taskScheduler().unscheduleDelayedTask(flushTask);
+
+    if (packets.empty())
+    {
+        return;
+    }
+
+    size_t syscallsCount = 0;
+
+#if defined(__linux__)
+    if (!isSendmmsgSupported())
+    {
+        syscallsCount = sendOneByOne();
+    }
+    else
+    {
+        struct sockaddr_in destination;
+        memset(&destination, 0, sizeof(destination));
+        destination.sin_family      = AF_INET;
+        destination.sin_addr.s_addr = address;
+        destination.sin_port        = portNum;
+
+        struct mmsghdr messages[MAX_BATCH_PACKETS];
+        struct iovec   iovecs[MAX_BATCH_PACKETS];
+        size_t         messagePacketsCounts[MAX_BATCH_PACKETS];
+        union
+        {
+            char           buffer[CMSG_SPACE(sizeof(uint16_t))];
+            struct cmsghdr alignment;
+        }                  controls[MAX_BATCH_PACKETS];
+
+        // Turned off for the rest of the batch if the kernel refuses a GSO message
+        bool isSegmenting = useGSO;
+        bool hasSegmented = false;
+
+        size_t sentPacketsCount = 0;
+        while (sentPacketsCount < packets.size())
+        {
+            // One message per packet or per run of packets for GSO
+            unsigned int messagesCount = 0;
+            for (size_t i = sentPacketsCount; i < packets.size(); messagesCount++)
+            {
+                size_t segmentSize = packets[i].size;
+                size_t runLength = 1;
+                if (isSegmenting)
+                {
+                    // All segments but the last one must have the same size
+                    size_t maxRunLength = (std::min)(MAX_GSO_SEGMENTS, MAX_GSO_PAYLOAD / segmentSize);
+                    while (i + runLength < packets.size() &&
+                           runLength < maxRunLength &&
+                           packets[i + runLength - 1].size == segmentSize &&
+                           packets[i + runLength].size <= segmentSize)
+                    {
+                        runLength++;
+                    }
+                }
+
+                const Packet& last = packets[i + runLength - 1];
+                iovecs[messagesCount].iov_base = buffer.data() + packets[i].offset;
+                iovecs[messagesCount].iov_len  = last.offset + last.size - packets[i].offset;
+
+                struct msghdr& header = messages[messagesCount].msg_hdr;
+                memset(&header, 0, sizeof(header));
+                header.msg_name    = &destination;
+                header.msg_namelen = sizeof(destination);
+                header.msg_iov     = &iovecs[messagesCount];
+                header.msg_iovlen  = 1;
+
+                if (runLength > 1)
+                {
+                    hasSegmented = true;
+                    header.msg_control    = controls[messagesCount].buffer;
+                    header.msg_controllen = sizeof(controls[messagesCount].buffer);
+                    struct cmsghdr* control = CMSG_FIRSTHDR(&header);
+                    control->cmsg_level = SOL_UDP;
+                    control->cmsg_type  = UDP_SEGMENT;
+                    control->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t gsoSize = (uint16_t)segmentSize;
+                    memcpy(CMSG_DATA(control), &gsoSize, sizeof(gsoSize));
+                }
+
+                messagePacketsCounts[messagesCount] = runLength;
+                i += runLength;
+            }
+
+            int sentMessagesCount = sendmmsg(socketNum(), messages, messagesCount, 0);
+            syscallsCount++;
+
+            if (sentMessagesCount < 0)
+            {
+                if (hasSegmented && (errno == EIO || errno == ENOPROTOOPT))
+                {
+                    // The device or kernel cannot segment. Try again without GSO.
+                    std::cout << "UDP GSO failed (" << strerror(errno) << "), sending without it" << std::endl;
+                    useGSO       = false;
+                    isSegmenting = false;
+                    hasSegmented = false;
+                    continue;
+                }
+                if (hasSegmented && errno == EINVAL)
+                {
+                    // The kernel refused this message (e.g. more segments than the device takes).
+                    // The batch goes out without GSO, but later ones try again
+                    // unless it keeps happening.
+                    isSegmenting = false;
+                    hasSegmented = false;
+                    if (++gsoFailuresCount == MAX_GSO_FAILURES)
+                    {
+                        std::cout << "UDP GSO failed repeatedly (" << strerror(errno) << "), sending without it" << std::endl;
+                        useGSO = false;
+                    }
+                    continue;
+                }
+                // Like a lost datagram. RTP copes with it.
+                env().setResultErrMsg("sendmmsg() error: ");
+                break;
+            }
+            if (sentMessagesCount == 0)
+            {
+                break;
+            }
+
+            for (int m = 0; m < sentMessagesCount; m++)
+            {
+                sentPacketsCount += messagePacketsCounts[m];
+            }
+            if (hasSegmented)
+            {
+                gsoFailuresCount = 0;
+            }
+        }
+    }
+#endif
+
+    if (onSentBatch) onSentBatch(this, packets.size(), syscallsCount);
+
+    packets.clear();
+    bufferSize = 0;
+}
+
+size_t BatchingGroupsock::sendOneByOne()
+{
+    struct in_addr destination;
+    destination.s_addr = address;
+
+    size_t syscallsCount = 0;
+    for (size_t i = 0; i < packets.size(); i++)
+    {
+        writeSocket(env(), socketNum(), destination, portNum,
+                    buffer.data() + packets[i].offset, (unsigned)packets[i].size);
+        syscallsCount++;
+    }
+    return syscallsCount;
+}
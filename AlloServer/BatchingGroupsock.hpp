@@ -0,0 +1,73 @@
+#pragma once
+
+#include <Groupsock.hh>
+#include <functional>
+#include <vector>
+#include <cstdint>
+
+// A Groupsock that does not send every RTP packet on its own.
+// Packets are queued until the packet with the RTP marker bit (the end of a frame)
+// is written, the queue is full, BATCH_TIMEOUT_MICROSECONDS passed or flush() is called.
+// A pacer in front of it has to call flush() whenever it holds a NALU back
+// (see DiscreteFlowControlFilter::setOnHoldBack()), so that a batch never spans
+// more than the pacer released at once and the pacing is kept.
+// The queue then goes out with one sendmmsg() call, with runs of equally sized
+// packets merged into UDP_SEGMENT (GSO) messages.
+// Without sendmmsg or GSO support in the kernel it falls back to fewer tricks.
+// On other platforms than Linux packets are sent right away like Groupsock does.
+// With isBatching false it does so everywhere but still reports every send
+// so that both paths can be compared.
+class BatchingGroupsock : public Groupsock
+{
+public:
+    BatchingGroupsock(UsageEnvironment& env, const struct in_addr& groupAddr, Port port, u_int8_t ttl,
+                      bool isBatching = true);
+    virtual ~BatchingGroupsock();
+
+    // Sends all queued packets now
+    void flush();
+
+    typedef std::function<void(BatchingGroupsock* self,
+                               size_t packetsCount,
+                               size_t syscallsCount)> OnSentBatch;
+
+    void setOnSentBatch(const OnSentBatch& callback);
+
+    // Whether the kernel supports the respective feature (detected once per process)
+    static bool isSendmmsgSupported();
+    static bool isGSOSupported();
+
+protected:
+    virtual Boolean write(netAddressBits address, portNumBits portNum, u_int8_t ttl,
+                          unsigned char* buffer, unsigned bufferSize);
+
+private:
+    enum { MAX_BATCH_PACKETS = 64, MAX_PACKET_SIZE = 2048, BATCH_TIMEOUT_MICROSECONDS = 1000 };
+    // Batches in a row whose GSO messages the kernel refused before GSO is turned off
+    enum { MAX_GSO_FAILURES = 3 };
+
+    struct Packet
+    {
+        size_t offset;
+        size_t size;
+    };
+
+    static void flush0(void* clientData);
+    // Sends the queued packets one by one. Returns the number of syscalls.
+    size_t sendOneByOne();
+
+    OnSentBatch onSentBatch;
+
+    // Packets are stored back to back so that runs of them can be sent as one GSO buffer
+    std::vector<uint8_t> buffer;
+    size_t               bufferSize;
+    std::vector<Packet>  packets;
+
+    netAddressBits address;
+    portNumBits    portNum;
+    bool           isBatching;
+    bool           hasSentFirstPacket;
+    bool           useGSO;
+    size_t         gsoFailuresCount;
+    TaskToken      flushTask;
+};
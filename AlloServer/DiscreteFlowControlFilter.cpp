@@ -1,23 +1,44 @@
 #include <chrono>
-#include <boost/predef.h>
+#include <algorithm>
 
+#include "config.h"
 #include "DiscreteFlowControlFilter.hpp"
 
 DiscreteFlowControlFilter* DiscreteFlowControlFilter::createNew(UsageEnvironment& env,
 	                                                            FramedSource* inputSource,
-																unsigned long bandwidth)
+																unsigned long bandwidth,
+																TokenBucket* aggregateBucket)
 {
-	return new DiscreteFlowControlFilter(env, inputSource, bandwidth);
+	return new DiscreteFlowControlFilter(env, inputSource, bandwidth, aggregateBucket);
+}
+
+size_t DiscreteFlowControlFilter::getBucketDepth(unsigned long bandwidth, std::chrono::microseconds burstDuration)
+{
+	// At least one full RTP packet has to fit
+	return (std::max)((size_t)(bandwidth / 8.0 * burstDuration.count() / 1000000.0), (size_t)1500);
 }
 
 DiscreteFlowControlFilter::DiscreteFlowControlFilter(UsageEnvironment& env,
 	                                                FramedSource* inputSource,
-													unsigned long bandwidth)
+													unsigned long bandwidth,
+													TokenBucket* aggregateBucket)
 	:
-	FramedFilter(env, inputSource), bandwidth(bandwidth)
+	FramedFilter(env, inputSource),
+	faceBucket(bandwidth, getBucketDepth(bandwidth, std::chrono::microseconds(PACER_BURST_MICROSECONDS))),
+	aggregateBucket(aggregateBucket), releaseTask(NULL)
 {
 }
 
+DiscreteFlowControlFilter::~DiscreteFlowControlFilter()
+{
+	envir().taskScheduler().unscheduleDelayedTask(releaseTask);
+}
+
+void DiscreteFlowControlFilter::setOnHoldBack(const OnHoldBack& callback)
+{
+	onHoldBack = callback;
+}
+
 void DiscreteFlowControlFilter::doGetNextFrame()
 {
 	// Read directly from our input source into our client's buffer:
@@ -30,6 +51,12 @@ void DiscreteFlowControlFilter::doGetNextFrame()
 							   this);
 }
 
+void DiscreteFlowControlFilter::doStopGettingFrames()
+{
+	envir().taskScheduler().unscheduleDelayedTask(releaseTask);
+	FramedFilter::doStopGettingFrames();
+}
+
 void DiscreteFlowControlFilter::afterGettingFrame0(void* clientData,
 	                                               unsigned frameSize,
                                                    unsigned numTruncatedBytes,
@@ -46,49 +73,39 @@ void DiscreteFlowControlFilter::afterGettingFrame(unsigned frameSize,
 	fFrameSize = frameSize;
 	fPresentationTime = presentationTime;
 
-#if BOOST_OS_WINDOWS
-	auto durationPerKBit = std::chrono::nanoseconds(boost::ratio_multiply<boost::giga, boost::kilo>::num / bandwidth);
+	releaseFrame();
+}
 
-	LARGE_INTEGER StartingTime, EndingTime, ElapsedMicroseconds;
-	LARGE_INTEGER Frequency;
+void DiscreteFlowControlFilter::releaseFrame0(void* clientData)
+{
+	DiscreteFlowControlFilter* filter = (DiscreteFlowControlFilter*)clientData;
+	filter->releaseTask = NULL;
+	filter->releaseFrame();
+}
 
-	QueryPerformanceFrequency(&Frequency);
-	QueryPerformanceCounter(&StartingTime);
-#endif
+void DiscreteFlowControlFilter::releaseFrame()
+{
+	std::chrono::microseconds delay = faceBucket.getDelay();
+	if (aggregateBucket)
+	{
+		delay = (std::max)(delay, aggregateBucket->getDelay());
+	}
 
-	// Activity to be timed
-	afterGetting(this);
+	if (delay.count() > 0)
+	{
+		if (onHoldBack) onHoldBack(this);
+
+		// Other faces may drain the aggregate bucket in the meantime,
+		// so the buckets are checked again when the task runs
+		releaseTask = envir().taskScheduler().scheduleDelayedTask(delay.count(), releaseFrame0, this);
+		return;
+	}
 
-#if BOOST_OS_WINDOWS
-	QueryPerformanceCounter(&EndingTime);
-	ElapsedMicroseconds.QuadPart = EndingTime.QuadPart - StartingTime.QuadPart;
-
-	//
-	// We now have the elapsed number of ticks, along with the
-	// number of ticks-per-second. We use these values
-	// to convert to the number of elapsed microseconds.
-	// To guard against loss-of-precision, we convert
-	// to microseconds *before* dividing by ticks-per-second.
-	//
-
-	ElapsedMicroseconds.QuadPart *= 1000000;
-	ElapsedMicroseconds.QuadPart /= Frequency.QuadPart;
-
-	auto isDuration = std::chrono::microseconds(ElapsedMicroseconds.QuadPart);
-	auto shouldDuration = durationPerKBit * fFrameSize * 8 / 1000;
-	auto coolDownDuration = shouldDuration - isDuration;
-
-	// Let network cool down
-	QueryPerformanceCounter(&StartingTime);
-	std::chrono::microseconds elapsedCoolDownDuration;
-	do
+	faceBucket.consume(fFrameSize);
+	if (aggregateBucket)
 	{
-		QueryPerformanceCounter(&EndingTime);
-		ElapsedMicroseconds.QuadPart = EndingTime.QuadPart - StartingTime.QuadPart;
-		ElapsedMicroseconds.QuadPart *= 1000000;
-		ElapsedMicroseconds.QuadPart /= Frequency.QuadPart;
-		elapsedCoolDownDuration = std::chrono::microseconds(ElapsedMicroseconds.QuadPart);
+		aggregateBucket->consume(fFrameSize);
 	}
-	while (elapsedCoolDownDuration < coolDownDuration);
-#endif
-}
\ No newline at end of file
+
+	afterGetting(this);
+}
@@ -1,18 +1,39 @@
 #pragma once
 
 #include <FramedFilter.hh>
+#include <functional>
 
+#include "TokenBucket.hpp"
+
+// Paces the NALUs of one face.
+// A NALU is passed on once both the face's own bucket and the bucket shared by
+// all faces allow it. Otherwise its release is scheduled on the live555 event loop
+// for the time the buckets will allow it, so no thread ever spins.
 class DiscreteFlowControlFilter : public FramedFilter
 {
 public:
+	// bandwidth is in bit per second.
+	// aggregateBucket may be shared by several filters and may be NULL.
 	static DiscreteFlowControlFilter* createNew(UsageEnvironment& env,
 		                                        FramedSource* inputSource,
-												unsigned long bandwidth);
+												unsigned long bandwidth,
+												TokenBucket* aggregateBucket = NULL);
+
+	// Bucket depth that lets bandwidth send bursts of burstDuration
+	static size_t getBucketDepth(unsigned long bandwidth, std::chrono::microseconds burstDuration);
+
+	typedef std::function<void(DiscreteFlowControlFilter* self)> OnHoldBack;
+
+	// Called when a NALU has to wait for the buckets. Everything released before
+	// is within the buckets' budget and should go out now (see BatchingGroupsock::flush()).
+	void setOnHoldBack(const OnHoldBack& callback);
 
 protected:
 	DiscreteFlowControlFilter(UsageEnvironment& env, 
 		                      FramedSource* inputSource,
-							  unsigned long bandwidth);
+							  unsigned long bandwidth,
+							  TokenBucket* aggregateBucket);
+	virtual ~DiscreteFlowControlFilter();
 
 private:
 	static void afterGettingFrame0(void* clientData,
@@ -23,6 +44,14 @@ private:
 	void afterGettingFrame(unsigned frameSize,
 	                       struct timeval presentationTime);
 	virtual void doGetNextFrame();
+	virtual void doStopGettingFrames();
+
+	// Passes the current NALU on or schedules itself for when the buckets allow it
+	static void releaseFrame0(void* clientData);
+	void releaseFrame();
 
-	unsigned long bandwidth; // bandwidth is in bit per second
+	TokenBucket  faceBucket;
+	TokenBucket* aggregateBucket;
+	TaskToken    releaseTask;
+	OnHoldBack   onHoldBack;
 };
@@ -0,0 +1,212 @@
+#include <cstdio>
+#include <cstdlib>
+
+extern "C"
+{
+    #include <libavutil/imgutils.h>
+}
+
+#include "EncodeArena.hpp"
+
+std::atomic<size_t> EncodeArena::totalAllocationsCount(0);
+
+EncodeArena::EncodeArena(int width, int height, size_t packetsCount, bool allocatePacketBuffers)
+    :
+    packets(packetsCount), acquiredPacket(packetsCount), slices(256), slicesHead(0), slicesCount(0), allocationsCount(0)
+{
+    countAllocation(); // packets
+    countAllocation(); // slices
+
+    conversionFrame = av_frame_alloc();
+    if (!conversionFrame)
+    {
+        fprintf(stderr, "Could not allocate video frame\n");
+        exit(1);
+    }
+    countAllocation();
+    conversionFrame->format = AV_PIX_FMT_YUV420P;
+    conversionFrame->width  = width;
+    conversionFrame->height = height;
+    if (av_image_alloc(conversionFrame->data, conversionFrame->linesize, width, height,
+        AV_PIX_FMT_YUV420P, 32) < 0)
+    {
+        fprintf(stderr, "Could not allocate raw picture buffer\n");
+        abort();
+    }
+    countAllocation();
+
+    // An encoded frame is practically never larger than the raw frame
+    for (PacketEntry& entry : packets)
+    {
+        av_init_packet(&entry.packet);
+        entry.packet.data = NULL;
+        entry.packet.size = 0;
+        entry.buffer      = NULL;
+        entry.capacity    = 0;
+        entry.refCount    = 0;
+        if (!allocatePacketBuffers)
+        {
+            continue;
+        }
+
+        entry.capacity = width * height * 3 / 2;
+        entry.buffer   = av_buffer_alloc(entry.capacity + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (!entry.buffer)
+        {
+            fprintf(stderr, "Could not allocate packet buffer\n");
+            abort();
+        }
+        countAllocation();
+        entry.packet.data = entry.buffer->data;
+        entry.packet.size = (int)entry.capacity;
+    }
+}
+
+EncodeArena::~EncodeArena()
+{
+    for (PacketEntry& entry : packets)
+    {
+        av_buffer_unref(&entry.buffer);
+    }
+    av_freep(&conversionFrame->data[0]);
+    av_frame_free(&conversionFrame);
+}
+
+AVFrame* EncodeArena::getConversionFrame()
+{
+    return conversionFrame;
+}
+
+bool EncodeArena::hasFreePacket()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (PacketEntry& entry : packets)
+    {
+        if (entry.refCount == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+AVPacket* EncodeArena::acquirePacket()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (size_t i = 0; i < packets.size(); i++)
+    {
+        PacketEntry& entry = packets[i];
+        if (entry.refCount == 0)
+        {
+            // The encoder holds one reference until releasePacket()
+            entry.refCount    = 1;
+            entry.packet.data = (entry.buffer) ? entry.buffer->data : NULL;
+            entry.packet.size = (int)entry.capacity;
+            acquiredPacket    = i;
+            return &entry.packet;
+        }
+    }
+    return nullptr;
+}
+
+void EncodeArena::growPacket()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    PacketEntry& entry = packets[acquiredPacket];
+
+    // No slice references the packet yet
+    av_buffer_unref(&entry.buffer);
+    entry.capacity *= 2;
+    entry.buffer = av_buffer_alloc(entry.capacity + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (!entry.buffer)
+    {
+        fprintf(stderr, "Could not allocate packet buffer\n");
+        abort();
+    }
+    countAllocation();
+    entry.packet.data = entry.buffer->data;
+    entry.packet.size = (int)entry.capacity;
+}
+
+void EncodeArena::pushSlice(uint8_t* data, int size, int64_t pts, uint64_t frameId, bool isEndOfFrame)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (slicesCount == slices.size())
+    {
+        // Unroll the ring into a larger one
+        std::vector<NALUSlice> largerSlices(slices.size() * 2);
+        for (size_t i = 0; i < slicesCount; i++)
+        {
+            largerSlices[i] = slices[(slicesHead + i) % slices.size()];
+        }
+        slices.swap(largerSlices);
+        slicesHead = 0;
+        countAllocation();
+    }
+
+    NALUSlice& slice = slices[(slicesHead + slicesCount) % slices.size()];
+    slice.packet = acquiredPacket;
+    slice.data   = data;
+    slice.size   = size;
+    slice.pts    = pts;
+    slice.frameId = frameId;
+    slice.isEndOfFrame = isEndOfFrame;
+    slicesCount++;
+
+    packets[acquiredPacket].refCount++;
+}
+
+void EncodeArena::releasePacket()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    unref(acquiredPacket);
+    acquiredPacket = packets.size();
+}
+
+bool EncodeArena::isEmpty()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return slicesCount == 0;
+}
+
+bool EncodeArena::tryPopSlice(NALUSlice& slice)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (slicesCount == 0)
+    {
+        return false;
+    }
+
+    slice = slices[slicesHead];
+    slicesHead = (slicesHead + 1) % slices.size();
+    slicesCount--;
+    return true;
+}
+
+void EncodeArena::releaseSlice(const NALUSlice& slice)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    unref(slice.packet);
+}
+
+size_t EncodeArena::getAllocationsCount()
+{
+    return allocationsCount;
+}
+
+size_t EncodeArena::getTotalAllocationsCount()
+{
+    return totalAllocationsCount;
+}
+
+void EncodeArena::countAllocation()
+{
+    allocationsCount++;
+    totalAllocationsCount++;
+}
+
+void EncodeArena::unref(size_t packet)
+{
+    packets[packet].refCount--;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+// Preallocated memory of one H264NALUSource.
+// Holds the YUV420P conversion frame, the packets the encoder writes into
+// and the NALU slices that point into those packets.
+// After warm-up encoding a frame and delivering its NALUs does not allocate
+// anything on the heap. Every allocation that happens anyway is counted.
+class EncodeArena
+{
+public:
+    // A NALU inside of one of the arena's packets
+    struct NALUSlice
+    {
+        size_t   packet; // index of the packet that is referenced
+        uint8_t* data;
+        int      size;
+        int64_t  pts;
+        uint64_t frameId;      // sequence number of the frame the NALU belongs to
+        bool     isEndOfFrame; // last NALU of its access unit
+    };
+
+    // Without packet buffers the packets only serve as reference counted tokens
+    // for memory that is owned by the encoder (see H264NALUSource::X264_BACKEND)
+    EncodeArena(int width, int height, size_t packetsCount, bool allocatePacketBuffers = true);
+    ~EncodeArena();
+
+    // Encoder side
+    AVFrame*  getConversionFrame();
+    // Returns false if all packets are still referenced by undelivered slices
+    bool      hasFreePacket();
+    // Hands out a free packet which is ready to be passed to the encoder
+    AVPacket* acquirePacket();
+    // Enlarges the acquired packet after the encoder told us it is too small
+    void      growPacket();
+    void      pushSlice(uint8_t* data, int size, int64_t pts, uint64_t frameId, bool isEndOfFrame);
+    // Gives the acquired packet back. It becomes free when the last slice of it was released.
+    void      releasePacket();
+
+    // Delivery side
+    bool      isEmpty();
+    bool      tryPopSlice(NALUSlice& slice);
+    void      releaseSlice(const NALUSlice& slice);
+
+    size_t    getAllocationsCount();
+    // Sum of all arenas
+    static size_t getTotalAllocationsCount();
+
+private:
+    struct PacketEntry
+    {
+        // Handed to the encoder without a buffer reference. On errors and empty output
+        // avcodec_encode_video2() frees the packet, which then only resets its data.
+        AVPacket     packet;
+        // The arena's reference to the packet's memory
+        AVBufferRef* buffer;
+        size_t       capacity;
+        int          refCount;
+    };
+
+    void countAllocation();
+    void unref(size_t packet);
+
+    AVFrame*                 conversionFrame;
+    std::vector<PacketEntry> packets;
+    size_t                   acquiredPacket;
+    std::vector<NALUSlice>   slices; // ring buffer
+    size_t                   slicesHead;
+    size_t                   slicesCount;
+    std::mutex               mutex;
+    std::atomic<size_t>      allocationsCount;
+
+    static std::atomic<size_t> totalAllocationsCount;
+};
@@ -0,0 +1,171 @@
+#include <algorithm>
+
+#include "EncodeScheduler.hpp"
+#include "H264NALUSource.hpp"
+
+EncodeScheduler::EncodeScheduler(size_t                    threadBudget,
+                                 size_t                    encodersCount,
+                                 std::chrono::microseconds frameInterval)
+    :
+    frameInterval(frameInterval), pollInterval(frameInterval / 8), stopping(false)
+{
+    threadBudget  = (std::max)(threadBudget,  (size_t)1);
+    encodersCount = (std::max)(encodersCount, (size_t)1);
+
+    // Every encoder is only ever encoded by one worker at a time.
+    // So we need at most one worker per encoder and
+    // the remaining budget is given to x264.
+    size_t workersCount;
+    if (threadBudget >= encodersCount)
+    {
+        workersCount      = encodersCount;
+        threadsPerEncoder = (int)(threadBudget / encodersCount);
+    }
+    else
+    {
+        workersCount      = threadBudget;
+        threadsPerEncoder = 1;
+    }
+
+    candidates.reserve(encodersCount);
+
+    for (size_t i = 0; i < workersCount; i++)
+    {
+        workers.push_back(std::thread(std::bind(&EncodeScheduler::workerLoop, this)));
+    }
+}
+
+EncodeScheduler::~EncodeScheduler()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+int EncodeScheduler::getThreadsPerEncoder()
+{
+    return threadsPerEncoder;
+}
+
+size_t EncodeScheduler::getWorkersCount()
+{
+    return workers.size();
+}
+
+void EncodeScheduler::addSource(H264NALUSource* source)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        tasks.push_back({source, std::chrono::steady_clock::now(), false});
+    }
+    condition.notify_all();
+}
+
+void EncodeScheduler::removeSource(H264NALUSource* source)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    auto it = std::find_if(tasks.begin(), tasks.end(), [source](const Task& task)
+    {
+        return task.source == source;
+    });
+    if (it == tasks.end())
+    {
+        return;
+    }
+
+    // Don't pull the source out from under a worker
+    while (it->isClaimed)
+    {
+        condition.wait(lock);
+    }
+    tasks.erase(it);
+}
+
+EncodeScheduler::Task* EncodeScheduler::claimNextTask(std::unique_lock<std::mutex>& lock)
+{
+    while (!stopping)
+    {
+        // Order the faces no worker is busy with by their deadline
+        candidates.clear();
+        for (Task& task : tasks)
+        {
+            if (!task.isClaimed)
+            {
+                candidates.push_back(&task);
+            }
+        }
+
+        if (candidates.empty())
+        {
+            condition.wait(lock);
+            continue;
+        }
+
+        std::sort(candidates.begin(), candidates.end(), [](const Task* a, const Task* b)
+        {
+            return a->deadline < b->deadline;
+        });
+
+        // Take the most urgent face that already has a frame to encode
+        for (Task* task : candidates)
+        {
+            if (task->source->tryAcquireFrame())
+            {
+                task->isClaimed = true;
+                return task;
+            }
+        }
+
+        // Nothing is ready yet.
+        // Wait a short while for the most urgent face and then look at all faces again.
+        Task* task = candidates.front();
+        task->isClaimed = true;
+        lock.unlock();
+        bool acquired = task->source->waitForFrame(pollInterval);
+        lock.lock();
+
+        if (acquired)
+        {
+            return task;
+        }
+
+        task->isClaimed = false;
+        condition.notify_all();
+    }
+
+    return nullptr;
+}
+
+void EncodeScheduler::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true)
+    {
+        Task* task = claimNextTask(lock);
+        if (!task)
+        {
+            // scheduler is stopping
+            return;
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        lock.unlock();
+        task->source->encodeFrame();
+        lock.lock();
+
+        // The next frame of this face is due one frame interval later
+        task->deadline  = start + frameInterval;
+        task->isClaimed = false;
+        condition.notify_all();
+    }
+}
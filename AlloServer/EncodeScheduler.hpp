@@ -0,0 +1,55 @@
+#pragma once
+
+#include <list>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+class H264NALUSource;
+
+// Owns the threads that encode all faces (and the binoculars).
+// Instead of every H264NALUSource running its own threads, a fixed number of workers
+// encode whichever face is due next (earliest deadline first).
+// The thread budget is split between the workers and the x264 threads of every encoder
+// so that the encode machine is never oversubscribed.
+class EncodeScheduler
+{
+public:
+    EncodeScheduler(size_t                    threadBudget,
+                    size_t                    encodersCount,
+                    std::chrono::microseconds frameInterval);
+    ~EncodeScheduler();
+
+    // x264 threads every encoder context should use
+    int getThreadsPerEncoder();
+    size_t getWorkersCount();
+
+    // Sources register themselves on construction and unregister on destruction.
+    // removeSource() waits until no worker is encoding the source anymore.
+    void addSource   (H264NALUSource* source);
+    void removeSource(H264NALUSource* source);
+
+private:
+    struct Task
+    {
+        H264NALUSource*                       source;
+        std::chrono::steady_clock::time_point deadline;
+        bool                                  isClaimed;
+    };
+
+    void workerLoop();
+    Task* claimNextTask(std::unique_lock<std::mutex>& lock);
+
+    std::list<Task>           tasks;
+    std::vector<Task*>        candidates; // only used while holding mutex
+    std::vector<std::thread>  workers;
+    std::mutex                mutex;
+    std::condition_variable   condition;
+    std::chrono::microseconds frameInterval;
+    std::chrono::microseconds pollInterval;
+    int                       threadsPerEncoder;
+    bool                      stopping;
+};
@@ -0,0 +1,47 @@
+#include "FaceServerMediaSubsession.hpp"
+
+FaceServerMediaSubsession* FaceServerMediaSubsession::createNew(RTPSink& rtpSink, RTCPInstance* rtcpInstance)
+{
+	return new FaceServerMediaSubsession(rtpSink, rtcpInstance);
+}
+
+FaceServerMediaSubsession::FaceServerMediaSubsession(RTPSink& rtpSink, RTCPInstance* rtcpInstance)
+	:
+	PassiveServerMediaSubsession(rtpSink, rtcpInstance), rtpSink(rtpSink), hasCompleteSDPLines(false)
+{
+}
+
+void FaceServerMediaSubsession::setOnStartedStream(const OnStartedStream& callback)
+{
+	onStartedStream = callback;
+}
+
+char const* FaceServerMediaSubsession::sdpLines()
+{
+	if (!hasCompleteSDPLines)
+	{
+		// H264VideoRTPSink takes the fmtp line with the SPS and PPS from its framer,
+		// which only knows them once the first ones went through
+		hasCompleteSDPLines = rtpSink.auxSDPLine() != NULL;
+		delete[] fSDPLines;
+		fSDPLines = NULL;
+	}
+	return PassiveServerMediaSubsession::sdpLines();
+}
+
+void FaceServerMediaSubsession::startStream(unsigned clientSessionId, void* streamToken,
+                                            TaskFunc* rtcpRRHandler,
+                                            void* rtcpRRHandlerClientData,
+                                            unsigned short& rtpSeqNum,
+                                            unsigned& rtpTimestamp,
+                                            ServerRequestAlternativeByteHandler* serverRequestAlternativeByteHandler,
+                                            void* serverRequestAlternativeByteHandlerClientData)
+{
+	PassiveServerMediaSubsession::startStream(clientSessionId, streamToken,
+	                                          rtcpRRHandler, rtcpRRHandlerClientData,
+	                                          rtpSeqNum, rtpTimestamp,
+	                                          serverRequestAlternativeByteHandler,
+	                                          serverRequestAlternativeByteHandlerClientData);
+
+	if (onStartedStream) onStartedStream(this, clientSessionId);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <PassiveServerMediaSubsession.hh>
+#include <functional>
+
+// A PassiveServerMediaSubsession for the multicast stream of a face.
+// PassiveServerMediaSubsession keeps the first SDP it generates. If a client asks
+// before the encoder produced its first SPS and PPS, that SDP lacks sprop-parameter-sets
+// for good. We generate it again until the sink can describe the parameter sets.
+// Late-joining clients can then set up their decoder right away.
+class FaceServerMediaSubsession : public PassiveServerMediaSubsession
+{
+public:
+	static FaceServerMediaSubsession* createNew(RTPSink& rtpSink, RTCPInstance* rtcpInstance = NULL);
+
+	// A client starts to play the stream (it joined the multicast group before)
+	typedef std::function<void(FaceServerMediaSubsession* self, unsigned clientSessionId)> OnStartedStream;
+
+	void setOnStartedStream(const OnStartedStream& callback);
+
+protected:
+	FaceServerMediaSubsession(RTPSink& rtpSink, RTCPInstance* rtcpInstance);
+
+	virtual char const* sdpLines();
+	virtual void startStream(unsigned clientSessionId, void* streamToken,
+	                         TaskFunc* rtcpRRHandler,
+	                         void* rtcpRRHandlerClientData,
+	                         unsigned short& rtpSeqNum,
+	                         unsigned& rtpTimestamp,
+	                         ServerRequestAlternativeByteHandler* serverRequestAlternativeByteHandler,
+	                         void* serverRequestAlternativeByteHandlerClientData);
+
+private:
+	RTPSink&        rtpSink;
+	// Whether fSDPLines were generated with the sink's fmtp line
+	bool            hasCompleteSDPLines;
+	OnStartedStream onStartedStream;
+};
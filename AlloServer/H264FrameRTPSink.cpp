@@ -0,0 +1,71 @@
+#include "H264FrameRTPSink.hpp"
+
+H264FrameRTPSink* H264FrameRTPSink::createNew(UsageEnvironment& env,
+                                              Groupsock* RTPgs,
+                                              unsigned char rtpPayloadFormat,
+                                              H264NALUSource* source)
+{
+	return new H264FrameRTPSink(env, RTPgs, rtpPayloadFormat, source);
+}
+
+H264FrameRTPSink::H264FrameRTPSink(UsageEnvironment& env,
+                                   Groupsock* RTPgs,
+                                   unsigned char rtpPayloadFormat,
+                                   H264NALUSource* source)
+	:
+	H264VideoRTPSink(env, RTPgs, rtpPayloadFormat), source(source), packetStartsFrame(true)
+{
+}
+
+unsigned H264FrameRTPSink::specialHeaderSize() const
+{
+	// A stamping source starts every frame with an access unit delimiter of 2 bytes,
+	// so the frame's first packet has room for the extension although live555's
+	// fragmenter fills the other packets up to ourMaxPacketSize()
+	CubemapFrameStamp stamp;
+	return (packetStartsFrame && source->getCubemapFrameStamp(stamp)) ? CubemapFrameStamp::RTP_HEADER_EXTENSION_SIZE : 0;
+}
+
+void H264FrameRTPSink::doSpecialFrameHandling(unsigned fragmentationOffset,
+                                              unsigned char* frameStart,
+                                              unsigned numBytesInFrame,
+                                              struct timeval framePresentationTime,
+                                              unsigned numRemainingBytes)
+{
+	// The fragmenter hands us either a whole NALU or a FU-A fragment (type 28)
+	// whose header has the E bit set if it is the NALU's last one
+	bool completesNALU = numBytesInFrame < 2 ||
+	                     (frameStart[0] & 0x1F) != 28 ||
+	                     (frameStart[1] & 0x40);
+
+	if (specialHeaderSize() > 0)
+	{
+		// The fragmenter only asks for the next NALU once this one is sent,
+		// so the source's stamp belongs to the NALU we are looking at
+		CubemapFrameStamp stamp;
+		source->getCubemapFrameStamp(stamp);
+
+		uint8_t extension[CubemapFrameStamp::RTP_HEADER_EXTENSION_SIZE];
+		stamp.writeRTPHeaderExtension(extension);
+		setSpecialHeaderBytes(extension, sizeof(extension));
+
+		// The frame is the packet's only one and has no frame specific header,
+		// so the fixed RTP header lies right in front of the special header.
+		// Its first byte holds the X bit.
+		unsigned char* rtpHeader = frameStart - specialHeaderSize() - 12;
+		rtpHeader[0] |= 0x10;
+	}
+
+	// Every packet holds one NALU or fragment (H264VideoRTPSink does not aggregate)
+	if (completesNALU && source->isEndOfFrame())
+	{
+		setMarkerBit();
+		packetStartsFrame = true;
+	}
+	else
+	{
+		packetStartsFrame = false;
+	}
+
+	setTimestamp(framePresentationTime);
+}
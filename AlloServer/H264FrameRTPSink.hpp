@@ -0,0 +1,44 @@
+#pragma once
+
+#include <H264VideoRTPSink.hh>
+
+#include "H264NALUSource.hpp"
+#include "AlloShared/CubemapFrameStamp.hpp"
+
+// A H264VideoRTPSink that sets the RTP marker bit on the last packet of every frame.
+// live555's framer can only guess where an access unit ends.
+// The H264NALUSource knows since it got all NALUs of a frame from the encoder at once.
+// Receivers can then hand a frame to the decoder without waiting for the next one.
+// If the source stamps its frames, the first packet of every frame carries the
+// CubemapFrameStamp in an RTP header extension (see CubemapFrameStamp).
+class H264FrameRTPSink : public H264VideoRTPSink
+{
+public:
+	// source has to be the H264NALUSource at the bottom of the chain this sink plays
+	static H264FrameRTPSink* createNew(UsageEnvironment& env,
+	                                   Groupsock* RTPgs,
+	                                   unsigned char rtpPayloadFormat,
+	                                   H264NALUSource* source);
+
+	// live555 keeps it to itself but receivers name it in their RTCP feedback
+	using RTPSink::SSRC;
+
+protected:
+	H264FrameRTPSink(UsageEnvironment& env,
+	                 Groupsock* RTPgs,
+	                 unsigned char rtpPayloadFormat,
+	                 H264NALUSource* source);
+
+	virtual void doSpecialFrameHandling(unsigned fragmentationOffset,
+	                                    unsigned char* frameStart,
+	                                    unsigned numBytesInFrame,
+	                                    struct timeval framePresentationTime,
+	                                    unsigned numRemainingBytes);
+	// live555 puts the special header right behind the fixed RTP header, where the header extension goes
+	virtual unsigned specialHeaderSize() const;
+
+private:
+	H264NALUSource* source;
+	// Whether the packet being built is the first one of its frame
+	bool            packetStartsFrame;
+};
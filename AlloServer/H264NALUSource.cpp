@@ -6,49 +6,67 @@
 #include <thread>
 #include <chrono>
 #include <iomanip>
+#include <algorithm>
 
 #include "config.h"
 #include "H264NALUSource.hpp"
+#include "AlloShared/StartCodeScanner.hpp"
 
 std::mutex H264NALUSource::triggerEventMutex;
 std::vector<H264NALUSource*> H264NALUSource::sourcesReadyForDelivery;
 
 int H264NALUSource::x2yuv(AVFrame *xFrame, AVFrame *yuvFrame, AVCodecContext *c)
 {
-	char *err = NULL;
+	// Frames come bottom-up from OpenGL so they are flipped while converting
+	if (colorConverter.convert(xFrame->data, xFrame->linesize, (AVPixelFormat)xFrame->format,
+		                       yuvFrame->data, yuvFrame->linesize, c->pix_fmt,
+		                       c->width, c->height, true))
+	{
+		return c->height;
+	}
+
+	// Fall back to swscale for formats ColorConverter does not know
 	if (img_convert_ctx == NULL)
 	{
-		// MUST BE IMPLMENTED
 		int w = xFrame->width;
-		int h = xFrame->width;
-		img_convert_ctx = sws_getContext(w, h, (AVPixelFormat)xFrame->format, w, h,
+		int h = xFrame->height;
+		img_convert_ctx = sws_getContext(w, h, (AVPixelFormat)xFrame->format, c->width, c->height,
 			c->pix_fmt, SWS_BICUBIC,
 			NULL, NULL, NULL);
 		if (img_convert_ctx == NULL)
 		{
-			sprintf(err, "Cannot initialize the conversion context!\n");
+			fprintf(stderr, "Cannot initialize the conversion context!\n");
 			return -1;
 		}
 	}
+
+	// Flip by starting at the last row with negative line sizes.
+	// xFrame itself stays untouched.
+	uint8_t* data[4];
+	int linesize[4];
 	for (int i = 0; i < 4; i++)
 	{
-		if (xFrame->linesize[i] > 0)
+		data[i]     = xFrame->data[i];
+		linesize[i] = xFrame->linesize[i];
+		if (linesize[i] > 0)
 		{
-			xFrame->data[i] += xFrame->linesize[i] * (c->height - 1);
-			xFrame->linesize[i] = -xFrame->linesize[i];
+			data[i]    += linesize[i] * (xFrame->height - 1);
+			linesize[i] = -linesize[i];
 		}
 	}
-	return sws_scale(img_convert_ctx, xFrame->data,
-		xFrame->linesize, 0, c->height,
+	return sws_scale(img_convert_ctx, data,
+		linesize, 0, xFrame->height,
 		yuvFrame->data, yuvFrame->linesize);
 }
 
 H264NALUSource* H264NALUSource::createNew(UsageEnvironment& env,
                                           Frame* content,
                                           int avgBitRate,
-										  bool robustSyncing)
+                                          EncodeScheduler& scheduler,
+                                          const KeyframeSchedule& keyframeSchedule,
+                                          Backend backend)
 {
-	return new H264NALUSource(env, content, avgBitRate, robustSyncing);
+	return new H264NALUSource(env, content, avgBitRate, scheduler, keyframeSchedule, backend);
 }
 
 unsigned H264NALUSource::referenceCount = 0;
@@ -58,9 +76,17 @@ struct timeval prevtime;
 H264NALUSource::H264NALUSource(UsageEnvironment& env,
                                Frame* content,
 							   int avgBitRate,
-							   bool robustSyncing)
+                               EncodeScheduler& scheduler,
+                               const KeyframeSchedule& keyframeSchedule,
+                               Backend backend)
 	:
-	FramedSource(env), img_convert_ctx(NULL), content(content), /*encodeBarrier(2),*/ destructing(false), lastPTS(0), robustSyncing(robustSyncing)
+	FramedSource(env), img_convert_ctx(NULL), colorConverter(scheduler.getThreadsPerEncoder()),
+	// x264 owns the NALUs it returns until the next frame is encoded.
+	// So with the x264 backend one packet is in flight only.
+	arena(content->getWidth(), content->getHeight(), (backend == X264_BACKEND) ? 1 : 2, backend == AVCODEC_BACKEND),
+	content(content), scheduler(scheduler), backend(backend), x264Encoder(NULL), /*encodeBarrier(2),*/ keyframeSchedule(keyframeSchedule), sequenceNumber(0), nextKeyframeNumber(keyframeSchedule.phase),
+	keyframeRequested(false), lastKeyframeNumber(0),
+	destructing(false), lastPTS(0), deliveredEndOfFrame(false), cubemapStamping(false)
 {
 
 	gettimeofday(&prevtime, NULL); // If you have a more accurate time - e.g., from an encoder - then use that instead.
@@ -75,37 +101,17 @@ H264NALUSource::H264NALUSource(UsageEnvironment& env,
 	++referenceCount;
 	//myfile = fopen("/Users/tiborgoldschwendt/Desktop/Logs/deviceglxgears.log", "w");
 
-	// initialize frame pool
-	for (int i = 0; i < 2; i++)
-	{
-		AVFrame* frame = av_frame_alloc();
-		if (!frame)
-		{
-			fprintf(stderr, "Could not allocate video frame\n");
-			exit(1);
-		}
-		frame->format = content->getFormat();
-		frame->width  = content->getWidth();
-		frame->height = content->getHeight();
-
-		/* the image can be allocated by any means and av_image_alloc() is
-		* just the most convenient way if av_malloc() is to be used */
-		if (av_image_alloc(frame->data, frame->linesize, frame->width, frame->height,
-			content->getFormat(), 32) < 0)
-		{
-			fprintf(stderr, "Could not allocate raw picture buffer\n");
-			abort();
-		}
-
-		framePool.push(frame);
-	}
-
-	for (int i = 0; i < 2; i++)
+	// Only one frame may be in flight since it points directly into the slot
+	// we hold in content. Holding a second slot would let the producer overwrite it.
+	frame = av_frame_alloc();
+	if (!frame)
 	{
-		AVPacket pkt;
-		av_init_packet(&pkt);
-		pktPool.push(pkt);
+		fprintf(stderr, "Could not allocate video frame\n");
+		exit(1);
 	}
+	frame->format = content->getFormat();
+	frame->width  = content->getWidth();
+	frame->height = content->getHeight();
 
 	// Initialize codec and encoder
 	AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
@@ -130,20 +136,83 @@ H264NALUSource::H264NALUSource(UsageEnvironment& env,
 	codecContext->height = content->getHeight();
 	/* frames per second */
 	codecContext->time_base = av_make_q(1, FPS);
-	codecContext->gop_size = 20; /* emit one intra frame every ten frames */
+	// Turns the I frames we force (scheduled or requested by receivers) into IDR frames
+	av_opt_set(codecContext->priv_data, "forced-idr", "1", 0);
+	if (keyframeSchedule.mode == KeyframeSchedule::IDR)
+	{
+		// We force the IDR frames ourselves so that they stay at our phase.
+		// Scene cuts must not add any either.
+		codecContext->gop_size = X264_KEYINT_MAX_INFINITE;
+		av_opt_set(codecContext->priv_data, "x264-params", "scenecut=0", 0);
+	}
+	else
+	{
+		// The refresh wave sweeps over the picture once per GOP
+		codecContext->gop_size = keyframeSchedule.interval;
+		av_opt_set(codecContext->priv_data, "intra-refresh", "1", 0);
+	}
 	codecContext->max_b_frames = 0;
 	codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
 	//codecContext->flags |= CODEC_FLAG_GLOBAL_HEADER;
+	// x264 gets its share of the thread budget. The remaining cores run other faces.
+	// Slice threads do not add frames of latency like frame threads do.
+	codecContext->thread_count = scheduler.getThreadsPerEncoder();
+	codecContext->thread_type = FF_THREAD_SLICE;
 
 	av_opt_set(codecContext->priv_data, "preset", PRESET_VAL, 0);
 	av_opt_set(codecContext->priv_data, "tune", TUNE_VAL, 0);
 	av_opt_set(codecContext->priv_data, "slice-max-size", "2000", 0);
 
-	/* open it */
-	if (avcodec_open2(codecContext, codec, NULL) < 0)
+	if (backend == X264_BACKEND)
 	{
-		fprintf(stderr, "could not open codec\n");
-		exit(1);
+		// Same parameters as above but for libx264 itself
+		x264_param_t param;
+		if (x264_param_default_preset(&param, PRESET_VAL, TUNE_VAL) < 0)
+		{
+			fprintf(stderr, "could not set x264 preset\n");
+			exit(1);
+		}
+		param.i_width           = content->getWidth();
+		param.i_height          = content->getHeight();
+		param.i_csp             = X264_CSP_I420;
+		param.i_fps_num         = FPS;
+		param.i_fps_den         = 1;
+		param.i_timebase_num    = 1;
+		param.i_timebase_den    = 1000000; // pts are in microseconds
+		if (keyframeSchedule.mode == KeyframeSchedule::IDR)
+		{
+			param.i_keyint_max         = X264_KEYINT_MAX_INFINITE;
+			param.i_scenecut_threshold = 0;
+		}
+		else
+		{
+			param.i_keyint_max         = keyframeSchedule.interval;
+			param.b_intra_refresh      = 1;
+		}
+		param.i_bframe          = 0;
+		param.i_slice_max_size  = 2000;
+		param.i_threads         = scheduler.getThreadsPerEncoder();
+		param.b_sliced_threads  = 1;
+		param.b_annexb          = 1;
+		param.b_repeat_headers  = 1;
+		param.rc.i_rc_method    = X264_RC_ABR;
+		param.rc.i_bitrate      = avgBitRate / 1000; // kbit/s
+
+		x264Encoder = x264_encoder_open(&param);
+		if (!x264Encoder)
+		{
+			fprintf(stderr, "could not open x264 encoder\n");
+			exit(1);
+		}
+	}
+	else
+	{
+		/* open it */
+		if (avcodec_open2(codecContext, codec, NULL) < 0)
+		{
+			fprintf(stderr, "could not open codec\n");
+			exit(1);
+		}
 	}
 
 
@@ -163,13 +232,10 @@ H264NALUSource::H264NALUSource(UsageEnvironment& env,
 
 	//std::cout << this << ": eventTriggerId: " << eventTriggerId  << std::endl;
 
-    frameContentThread = std::thread(std::bind(&H264NALUSource::frameContentLoop, this));
-
-    encodeFrameThread  = std::thread(std::bind(&H264NALUSource::encodeFrameLoop,  this));
-
-    //eventThread        = std::thread(std::bind(&H264NALUSource::eventLoop, this));
-
 	lastFrameTime = av_gettime();
+
+	// From now on the scheduler's workers encode our frames
+	scheduler.addSource(this);
 }
 
 H264NALUSource::~H264NALUSource()
@@ -177,14 +243,19 @@ H264NALUSource::~H264NALUSource()
 	// Any instance-specific 'destruction' (i.e., resetting) of the device would be done here:
 	//std::cout << this << ": deconstructing..." << std::endl;
 
+	// Waits until no worker is encoding us anymore
+	scheduler.removeSource(this);
+
 	this->destructing = true;
-	frameBuffer.close();
-	pktBuffer.close();
-	framePool.close();
-	pktPool.close();
 
-	frameContentThread.join();
-	encodeFrameThread.join();
+	if (x264Encoder)
+	{
+		x264_encoder_close(x264Encoder);
+	}
+	avcodec_close(codecContext);
+	av_free(codecContext);
+	av_frame_free(&frame);
+	sws_freeContext(img_convert_ctx);
 
 	--referenceCount;
 	if (referenceCount == 0)
@@ -212,79 +283,90 @@ void H264NALUSource::setOnEncodedFrame(const OnEncodedFrame& callback)
 	onEncodedFrame = callback;
 }
 
-void H264NALUSource::frameContentLoop()
+bool H264NALUSource::tryAcquireFrame()
 {
-
-	while (!destructing)
+	// Don't encode ahead if live555 hasn't sent the previous frames yet
+	if (!arena.hasFreePacket())
 	{
+		return false;
+	}
 
-		AVFrame* frame;
-		if (!framePool.waitAndPop(frame))
-		{
-			return;
-		}
+	// Take the newest slot CubemapExtractionPlugin published.
+	// Slots that were published in the meantime are skipped.
+	return content->acquireNewestSlot();
+}
 
-		// End this thread when CubemapExtractionPlugin closes
-		while (!content->getBarrier().timedWait(std::chrono::milliseconds(1000)))
-		{
-			if (destructing)
-			{
-				return;
-			}
-		}
+bool H264NALUSource::waitForFrame(std::chrono::microseconds timeout)
+{
+	if (!arena.hasFreePacket())
+	{
+		// Waiting for live555 is not worth a worker.
+		// Just give the scheduler a break before it looks again.
+		std::this_thread::sleep_for(timeout);
+		return false;
+	}
 
-		//content->getBarrier().wait();
+	return content->waitForNewestSlot(timeout);
+}
 
-		AVRational microSecBase = { 1, 1000000 };
-        std::chrono::microseconds presentationTimeSinceEpochMicroSec;
+size_t H264NALUSource::getAllocationsCount()
+{
+	return arena.getAllocationsCount();
+}
 
-		int_least64_t x;
-		{
-			boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(content->getMutex());
-
-			// Fill frame
-			avpicture_fill((AVPicture*)frame,
-				(uint8_t*)content->getPixels(),
-				content->getFormat(),
-				content->getWidth(),
-				content->getHeight());
-
-			// Set the actual presentation time
-			// It is in the past probably but we will try our best
-			
-			presentationTimeSinceEpochMicroSec =
-                std::chrono::duration_cast<std::chrono::microseconds>(content->getPresentationTime().time_since_epoch());
-
-			x = content->getPresentationTime().time_since_epoch().count();
-		}
-        
-		
+bool H264NALUSource::isEndOfFrame()
+{
+	return deliveredEndOfFrame;
+}
 
-//        const time_t time = std::chrono::system_clock::to_time_t(face->getPresentationTime());
-//
-//        // Maybe the put_time will be implemented later?
-//        struct tm* tm = localtime(&time);
-//        char timeStr[128];
-//        strftime (timeStr, sizeof(timeStr), "%c",tm);
-        
-        //std::cout << this << " presentation time: " << timeStr << std::endl;
-        //std::cout << this << " frame" << std::endl;
+void H264NALUSource::setCubemapStamping(boost::uint8_t face, boost::uint32_t expectedFaces)
+{
+	deliveredStamp.face          = face;
+	deliveredStamp.expectedFaces = expectedFaces;
+	cubemapStamping = true;
+}
 
+bool H264NALUSource::getCubemapFrameStamp(CubemapFrameStamp& stamp)
+{
+	stamp = deliveredStamp;
+	return cubemapStamping;
+}
 
-		frame->pts = presentationTimeSinceEpochMicroSec.count();// av_rescale_q(presentationTimeSinceEpochMicroSec.count(), microSecBase, codecContext->time_base);
+void H264NALUSource::fillFrame()
+{
+	AVRational microSecBase = { 1, 1000000 };
+	std::chrono::microseconds presentationTimeSinceEpochMicroSec;
 
-		if (x == lastPTS)
-		{
-			std::cout << "match!?" << std::endl;
-		}
+	int_least64_t x;
+	{
+		Frame::Slot* slot = content->getReadSlot();
+		sequenceNumber = slot->getSequenceNumber();
+
+		// Fill frame
+		// The slot stays ours until we acquire the next one
+		avpicture_fill((AVPicture*)frame,
+			(uint8_t*)slot->getPixels(),
+			content->getFormat(),
+			content->getWidth(),
+			content->getHeight());
+
+		// Set the actual presentation time
+		// It is in the past probably but we will try our best
+		
+		presentationTimeSinceEpochMicroSec =
+            std::chrono::duration_cast<std::chrono::microseconds>(slot->getPresentationTime().time_since_epoch());
 
-		lastPTS = frame->pts;
+		x = slot->getPresentationTime().time_since_epoch().count();
+	}
 
-		//std::cout << presentationTimeSinceEpochMicroSec.count() << " " << x << " " << frame->pts << std::endl;
+	frame->pts = presentationTimeSinceEpochMicroSec.count();// av_rescale_q(presentationTimeSinceEpochMicroSec.count(), microSecBase, codecContext->time_base);
 
-        // Make frame available to the encoder
-        frameBuffer.push(frame);
+	if (x == lastPTS)
+	{
+		std::cout << "match!?" << std::endl;
 	}
+
+	lastPTS = frame->pts;
 }
 
 void H264NALUSource::doGetNextFrame()
@@ -299,7 +381,7 @@ void H264NALUSource::doGetNextFrame()
 	}
 
 	// If a new frame of data is immediately available to be delivered, then do this now:
-	if (!pktBuffer.empty())
+	if (!arena.isEmpty())
 	{
 		deliverFrame();
 	}
@@ -320,159 +402,208 @@ void H264NALUSource::deliverFrame0(void* clientData)
 	//std::cout << "deliver frame: " << ((CubemapFaceSource*)clientData)->face->index << std::endl;
 }
 
-void H264NALUSource::encodeFrameLoop()
+void H264NALUSource::encodeFrame()
 {
-	while (!this->destructing)
+	if (this->destructing)
 	{
-		AVPacket pkt;
-		int64_t pts;
+		return;
+	}
 
-		{
-			// Pop frame ptr from buffer
-			AVFrame* xFrame;
-			AVFrame* yuv420pFrame;
+	fillFrame();
 
-			if (!frameBuffer.waitAndPop(xFrame))
-			{
-				// queue did close
-				return;
-			}
+	AVFrame* xFrame = frame;
+	AVFrame* yuv420pFrame;
+	int64_t pts = xFrame->pts;
 
-			pts = xFrame->pts;
+	//std::cout << this << " encode" << std::endl;
 
-			//std::cout << this << " encode" << std::endl;
+	if (xFrame->format != AV_PIX_FMT_YUV420P)
+	{
+		yuv420pFrame = arena.getConversionFrame();
+		x2yuv(xFrame, yuv420pFrame, codecContext);
+	}
+	else
+	{
+		yuv420pFrame = xFrame;
+	}
 
-			if (xFrame->format != AV_PIX_FMT_YUV420P)
-			{
-				yuv420pFrame = av_frame_alloc();
-				if (!yuv420pFrame)
-				{
-					fprintf(stderr, "Could not allocate video frame\n");
-					return;
-				}
-				yuv420pFrame->format = AV_PIX_FMT_YUV420P;
-				yuv420pFrame->width = xFrame->width;
-				yuv420pFrame->height = xFrame->height;
-
-				/* the image can be allocated by any means and av_image_alloc() is
-				* just the most convenient way if av_malloc() is to be used */
-				if (av_image_alloc(yuv420pFrame->data, yuv420pFrame->linesize, yuv420pFrame->width, yuv420pFrame->height,
-					AV_PIX_FMT_YUV420P, 32) < 0)
-				{
-					fprintf(stderr, "Could not allocate raw picture buffer\n");
-					abort();
-				}
-
-				x2yuv(xFrame, yuv420pFrame, codecContext);
-			}
-			else
-			{
-				yuv420pFrame = xFrame;
-			}
+	// Frames of our phase may have been skipped so we send the IDR frame
+	// with the first frame at or after it
+	bool forceKeyframe = keyframeSchedule.mode == KeyframeSchedule::IDR && sequenceNumber >= nextKeyframeNumber;
+	if (forceKeyframe)
+	{
+		scheduleNextKeyframe();
+	}
 
-			av_init_packet(&pkt);
-			pkt.data = NULL; // packet data will be allocated by the encoder
-			pkt.size = 0;
-			int got_output = 0;
+	// Many receivers asking at once get one IDR frame.
+	// More requests have to wait for minRequestInterval so that lossy receivers
+	// cannot make us send nothing but IDR frames.
+	if (keyframeRequested.load() && sequenceNumber >= lastKeyframeNumber + keyframeSchedule.minRequestInterval)
+	{
+		forceKeyframe = true;
+	}
+	if (forceKeyframe)
+	{
+		// A scheduled IDR frame serves pending requests as well
+		keyframeRequested.store(false);
+	}
 
-			//mutex.lock();
-			int ret = avcodec_encode_video2(codecContext, &pkt, yuv420pFrame, &got_output);
-			if (ret < 0)
-			{
-				fprintf(stderr, "Error encoding frame\n");
-				abort();
-			}
+	bool keyframe;
+	size_t size = 0;
+	if (backend == X264_BACKEND)
+	{
+		keyframe = encodeWithX264(yuv420pFrame, pts, forceKeyframe, size);
+	}
+	else
+	{
+		keyframe = encodeWithAVCodec(yuv420pFrame, pts, forceKeyframe, size);
+	}
 
-			if (onEncodedFrame) onEncodedFrame(this);
+	if (keyframe)
+	{
+		lastKeyframeNumber = sequenceNumber;
+	}
 
-			framePool.push(xFrame);
+	if (onEncodedFrame) onEncodedFrame(this, keyframe, size);
+}
 
-			if (xFrame->format != AV_PIX_FMT_YUV420P)
-			{
-				av_freep(&yuv420pFrame->data[0]);
-				av_frame_free(&yuv420pFrame);
-			}
-		}
-	
-		{
-			// pair.first: pos if first byte of NALU; pair.second: pos of last byte of NALU
-			std::queue<std::pair<size_t, size_t> > naluPoses;
+void H264NALUSource::requestKeyframe()
+{
+	keyframeRequested.store(true);
+}
 
-			// Parse package for all NALUs
-			size_t naluStartPos = 0;
-			for (size_t i = 0; i < pkt.size - 3; i++)
-			{
-				if (pkt.data[i] == 0 &&
-					pkt.data[i + 1] == 0)
-				{
-					if (pkt.data[i + 2] == 0 &&
-						pkt.data[i + 3] == 1)
-					{
-						if (i != 0)
-						{
-							naluPoses.push(std::make_pair(naluStartPos, i - 1));
-						}
-
-						naluStartPos = i + 4;
-						i += 3;
-					}
-					else if (pkt.data[i + 2] == 1)
-					{
-						if (i != 0)
-						{
-							naluPoses.push(std::make_pair(naluStartPos, i - 1));
-						}
-
-						naluStartPos = i + 3;
-						i += 2;
-					}
-				}
-			}
-			naluPoses.push(std::make_pair(naluStartPos, pkt.size - 1));
+void H264NALUSource::scheduleNextKeyframe()
+{
+	boost::uint64_t interval = keyframeSchedule.interval;
+	nextKeyframeNumber = (sequenceNumber / interval) * interval + keyframeSchedule.phase;
+	if (nextKeyframeNumber <= sequenceNumber)
+	{
+		nextKeyframeNumber += interval;
+	}
+}
 
+bool H264NALUSource::encodeWithX264(AVFrame* yuv420pFrame, int64_t pts, bool forceKeyframe, size_t& encodedSize)
+{
+	x264_picture_t inPicture;
+	x264_picture_t outPicture;
+	x264_picture_init(&inPicture);
+	inPicture.img.i_csp   = X264_CSP_I420;
+	inPicture.img.i_plane = 3;
+	for (int i = 0; i < 3; i++)
+	{
+		inPicture.img.plane[i]    = yuv420pFrame->data[i];
+		inPicture.img.i_stride[i] = yuv420pFrame->linesize[i];
+	}
+	inPicture.i_pts = pts;
+	inPicture.i_type = (forceKeyframe) ? X264_TYPE_IDR : X264_TYPE_AUTO;
 
-			size_t naluCount = naluPoses.size();
+	// The packet only guards the NALUs x264 hands us
+	arena.acquirePacket();
+
+	x264_nal_t* nals;
+	int nalsCount;
+	if (x264_encoder_encode(x264Encoder, &nals, &nalsCount, &inPicture, &outPicture) < 0)
+	{
+		fprintf(stderr, "Error encoding frame\n");
+		abort();
+	}
 
+	if (nalsCount > 0)
+	{
+		pushAccessUnitDelimiter(pts);
+	}
 
-			AVPacket dummy;
-			if (!pktPool.waitAndPop(dummy))
-			{
-				// queue did close
-				return;
-			}
+	// x264 tells us where the NALUs are. No need to look for start codes.
+	for (int i = 0; i < nalsCount; i++)
+	{
+		int startCodeSize = (nals[i].b_long_startcode) ? 4 : 3;
+		pushNALU(nals[i].p_payload + startCodeSize, nals[i].i_payload - startCodeSize, pts, i == nalsCount - 1);
+		encodedSize += nals[i].i_payload;
+	}
+
+	arena.releasePacket();
+
+	// Also set for the frames that start an intra refresh wave
+	return nalsCount > 0 && outPicture.b_keyframe;
+}
+
+bool H264NALUSource::encodeWithAVCodec(AVFrame* yuv420pFrame, int64_t pts, bool forceKeyframe, size_t& encodedSize)
+{
+	// "forced-idr" turns a forced I frame into an IDR frame
+	yuv420pFrame->pict_type = (forceKeyframe) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+	// The encoder writes directly into one of the arena's packets
+	AVPacket* pkt = arena.acquirePacket();
+	int got_output = 0;
+
+	int ret = avcodec_encode_video2(codecContext, pkt, yuv420pFrame, &got_output);
+	if (ret < 0)
+	{
+		// Most likely the packet was too small.
+		// x264 took the frame into its references already, so the receivers would drift
+		// if we encoded it again as a P frame. It becomes an IDR frame instead.
+		arena.growPacket();
+		yuv420pFrame->pict_type = AV_PICTURE_TYPE_I;
+		ret = avcodec_encode_video2(codecContext, pkt, yuv420pFrame, &got_output);
+		if (ret < 0)
+		{
+			fprintf(stderr, "Error encoding frame\n");
+			abort();
+		}
+	}
 
-			for (size_t i = 0; i < naluCount; i++)
+	if (got_output && pkt->size > 0)
+	{
+		pushAccessUnitDelimiter(pts);
+
+		// Hand out slices of the package for all NALUs without their start codes.
+		// Each one is pushed once the next one was found so that the last one can be marked.
+		const uint8_t* previousNALU = NULL;
+		size_t previousSize = 0;
+		StartCodeScanner::forEachNALU(pkt->data, pkt->data + pkt->size, [this, pts, &previousNALU, &previousSize](const uint8_t* nalu, size_t size)
+		{
+			if (previousNALU)
 			{
-				std::pair<size_t, size_t> naluPos = naluPoses.front();
-				naluPoses.pop();
-
-				AVPacket naluPkt;
-				int naluPktSize = naluPos.second - naluPos.first + 1;
-				if (robustSyncing)
-				{
-					naluPktSize += sizeof(int64_t);
-				}
-				av_new_packet(&naluPkt, naluPktSize);
-				memcpy(naluPkt.data, pkt.data + naluPos.first, naluPos.second - naluPos.first + 1);
-				if (robustSyncing)
-				{
-					*((int64_t*)(naluPkt.data + naluPos.second - naluPos.first + 1)) = pts;
-				}
-				//std::cout << *((int64_t*)(naluPkt.data + naluPos.second - naluPos.first + 1)) << std::endl;
-				naluPkt.pts = pts;
-
-				pktBuffer.push(naluPkt);
-
-				{
-                    std::unique_lock<std::mutex> lock(triggerEventMutex);
-					sourcesReadyForDelivery.push_back(this);
-					envir().taskScheduler().triggerEvent(eventTriggerId, nullptr);
-				}
+				pushNALU((uint8_t*)previousNALU, previousSize, pts, false);
 			}
-
-			av_free_packet(&pkt);
+			previousNALU = nalu;
+			previousSize = size;
+		});
+		if (previousNALU)
+		{
+			pushNALU((uint8_t*)previousNALU, previousSize, pts, true);
 		}
+		encodedSize = pkt->size;
 	}
+
+	// The packet lives on until live555 delivered all its NALUs
+	arena.releasePacket();
+
+	return got_output && (pkt->flags & AV_PKT_FLAG_KEY);
+}
+
+void H264NALUSource::pushNALU(uint8_t* data, size_t size, int64_t pts, bool isEndOfFrame)
+{
+	arena.pushSlice(data, (int)size, pts, sequenceNumber, isEndOfFrame);
+
+	{
+        std::unique_lock<std::mutex> lock(triggerEventMutex);
+		sourcesReadyForDelivery.push_back(this);
+		envir().taskScheduler().triggerEvent(eventTriggerId, nullptr);
+	}
+}
+
+void H264NALUSource::pushAccessUnitDelimiter(int64_t pts)
+{
+	if (!cubemapStamping)
+	{
+		return;
+	}
+
+	// primary_pic_type 7 (any slice type) followed by the stop bit.
+	// It points to static memory, so it keeps no packet alive that the acquired one does not.
+	static const uint8_t accessUnitDelimiter[] = { 9, 0xF0 };
+	pushNALU((uint8_t*)accessUnitDelimiter, sizeof(accessUnitDelimiter), pts, false);
 }
 
 void H264NALUSource::deliverFrame()
@@ -522,18 +653,12 @@ void H264NALUSource::deliverFrame()
 
 	//std::cout << this << ": pktBuffer size: " << pktBuffer.size() << std::endl;
 
-	AVPacket pkt;
-	if (!pktBuffer.waitAndPop(pkt))
+	EncodeArena::NALUSlice pkt;
+	if (!arena.tryPopSlice(pkt))
 	{
-		// queue did close
+		// nothing left to deliver
 		return;
 	}
-
-	if (pktBuffer.size() == 0)
-	{
-		AVPacket dummy;
-		pktPool.push(dummy);
-	}
     
     //std::cout << this << " send" << std::endl;
 
@@ -546,27 +671,9 @@ void H264NALUSource::deliverFrame()
 	//std::cout << fPresentationTime.tv_sec << " " << fPresentationTime.tv_usec << std::endl;
 
 	// Live555 does not like start codes.
-	// So, we remove the start code which is there in front of every nal unit.  
-	// the start code might be 0x00000001 or 0x000001. so detect it and remove it.
-	int truncateBytes = 0;
-	if (pkt.size >= 4 &&
-		pkt.data[0] == 0 &&
-		pkt.data[1] == 0 &&
-		pkt.data[2] == 0 &&
-		pkt.data[3] == 1)
-	{
-		truncateBytes = 4;
-	}
-	else if (pkt.size >= 3 &&
-		pkt.data[0] == 0 &&
-		pkt.data[1] == 0 &&
-		pkt.data[2] == 1)
-	{
-		truncateBytes = 3;
-	}
-
-	u_int8_t* newFrameDataStart = (u_int8_t*)(pkt.data /*+ truncateBytes*/);
-	unsigned newFrameSize = pkt.size/* - truncateBytes*/;
+	// Slices never contain them since they were cut out when the packet was split.
+	u_int8_t* newFrameDataStart = (u_int8_t*)pkt.data;
+	unsigned newFrameSize = pkt.size;
 
 	if ((int)(pkt.data[0] & 0x1F) == 5)
 	{
@@ -610,11 +717,15 @@ void H264NALUSource::deliverFrame()
 		//
 	}
 
-	memmove(fTo, newFrameDataStart, fFrameSize);
-
+	// The only copy between encoder and RTP sink
+	memcpy(fTo, newFrameDataStart, fFrameSize);
 
-	av_free_packet(&pkt);
-	//pktPool.push(pkt);
+	deliveredEndOfFrame = pkt.isEndOfFrame;
+	// The sequence number counts the cubemaps CubemapExtractionPlugin published
+	// so it is the same for all faces of a cubemap
+	deliveredStamp.frameId     = (boost::uint32_t)pkt.frameId;
+	deliveredStamp.captureTime = pkt.pts;
+	arena.releaseSlice(pkt);
 
 	if (fNumTruncatedBytes > 0)
 	{
@@ -5,6 +5,7 @@
 #include <boost/thread/synchronized_value.hpp>
 //#include <boost/thread/condition.hpp>
 #include <thread>
+#include <atomic>
 
 extern "C"
 {
@@ -19,28 +20,81 @@ extern "C"
 
 #include "AlloShared/ConcurrentQueue.hpp"
 #include "AlloShared/Cubemap.hpp"
+#include "AlloShared/ColorConverter.hpp"
+#include "AlloShared/CubemapFrameStamp.hpp"
+#include "EncodeScheduler.hpp"
+#include "EncodeArena.hpp"
 
 class H264NALUSource : public FramedSource
 {
 public:
+	// AVCODEC_BACKEND encodes through libavcodec and searches the packet for NALUs.
+	// X264_BACKEND drives libx264 directly and takes the NALUs x264 reports.
+	enum Backend { AVCODEC_BACKEND, X264_BACKEND };
+
+	// When an encoder sends its keyframes.
+	// Giving the faces different phases keeps their IDR frames out of the same frame.
+	struct KeyframeSchedule
+	{
+		// IDR: an IDR frame every interval frames at the given phase.
+		// INTRA_REFRESH: x264 periodic intra refresh with a wave every interval frames (phase is unused).
+		enum Mode { IDR, INTRA_REFRESH };
+
+		Mode mode;
+		int  interval;
+		int  phase;
+		// Keyframes receivers request come at most every minRequestInterval frames
+		int  minRequestInterval;
+	};
+
 	static H264NALUSource* createNew(UsageEnvironment& env,
                                      Frame* content,
                                      int avgBitRate,
-									 bool robustSyncing);
+                                     EncodeScheduler& scheduler,
+                                     const KeyframeSchedule& keyframeSchedule,
+                                     Backend backend = X264_BACKEND);
 
 	typedef std::function<void(H264NALUSource* self,
 		                       uint8_t type,
 		                       size_t size)> OnSentNALU;
-	typedef std::function<void(H264NALUSource* self)> OnEncodedFrame;
+	typedef std::function<void(H264NALUSource* self,
+		                       bool keyframe,
+		                       size_t size)> OnEncodedFrame;
 
 	void setOnSentNALU    (const OnSentNALU&     callback);
 	void setOnEncodedFrame(const OnEncodedFrame& callback);
 
+	// Called by the EncodeScheduler.
+	// A frame has to be acquired (without blocking or with a timeout) before it can be encoded.
+	bool tryAcquireFrame();
+	bool waitForFrame(std::chrono::microseconds timeout);
+	void encodeFrame();
+
+	// Heap allocations of the encode path (should stop growing after warm-up)
+	size_t getAllocationsCount();
+
+	// Whether the NALU delivered last is the last one of its frame
+	bool isEndOfFrame();
+
+	// Gives every frame a CubemapFrameStamp so that the receiver knows which faces belong together.
+	// Call it before the sink starts playing.
+	// Every frame then starts with an access unit delimiter that carries the stamp.
+	// face is our stream's index, expectedFaces has bit i set for every face stream i of the cubemap.
+	void setCubemapStamping(boost::uint8_t face, boost::uint32_t expectedFaces);
+	// Stamp of the NALU delivered last. Returns false without cubemap stamping.
+	bool getCubemapFrameStamp(CubemapFrameStamp& stamp);
+
+	// A receiver lost packets and asks for an IDR frame. May be called from any thread.
+	// Requests that come in before the next frame is encoded are merged into one.
+	void requestKeyframe();
+
 protected:
 	H264NALUSource(UsageEnvironment& env,
                    Frame* content,
                    int avgBitRate,
-				   bool robustSyncing);
+                   EncodeScheduler& scheduler,
+                   const KeyframeSchedule& keyframeSchedule,
+                   Backend backend);
 	// called only by createNew(), or by subclass constructors
 	virtual ~H264NALUSource();
 
@@ -60,32 +114,50 @@ private:
 
 	int x2yuv(AVFrame *xFrame, AVFrame *yuvFrame, AVCodecContext *c);
 	SwsContext *img_convert_ctx;
+	ColorConverter colorConverter;
 
-	// Stores unencoded frames
-	ConcurrentQueue<AVFrame*> frameBuffer;
-	// Here unused frames are stored. Included so that we can allocate all the frames at startup
-	// and reuse them during runtime
-	ConcurrentQueue<AVFrame*> framePool;
+	// Points into the slot of content we currently hold
+	AVFrame* frame;
 
-	// Stores encoded frames
-	ConcurrentQueue<AVPacket> pktBuffer;
-	ConcurrentQueue<AVPacket> pktPool;
+	// Stores conversion frame, encoded frames and the NALUs in them
+	EncodeArena arena;
 
 	static unsigned referenceCount; // used to count how many instances of this class currently exist
 
 	Frame* content;
 	AVCodecContext* codecContext;
-
-	std::thread frameContentThread;
-	std::thread encodeFrameThread;
-
-	void frameContentLoop();
-	void encodeFrameLoop();
+	EncodeScheduler& scheduler;
+	Backend backend;
+	x264_t* x264Encoder;
+
+	void fillFrame();
+	void pushNALU(uint8_t* data, size_t size, int64_t pts, bool isEndOfFrame);
+	// With cubemap stamping every frame starts with an access unit delimiter.
+	// It is the frame's first RTP packet and leaves room for the stamp in the header extension.
+	void pushAccessUnitDelimiter(int64_t pts);
+	// Return whether the encoded frame is a keyframe
+	bool encodeWithAVCodec(AVFrame* yuv420pFrame, int64_t pts, bool forceKeyframe, size_t& encodedSize);
+	bool encodeWithX264   (AVFrame* yuv420pFrame, int64_t pts, bool forceKeyframe, size_t& encodedSize);
+
+	KeyframeSchedule keyframeSchedule;
+	// Sequence number of the content slot we currently hold
+	boost::uint64_t  sequenceNumber;
+	// The first sequence number that has to be encoded as IDR frame
+	boost::uint64_t  nextKeyframeNumber;
+	// Sets nextKeyframeNumber to the next frame of our phase after sequenceNumber
+	void scheduleNextKeyframe();
+	// Set by requestKeyframe() until the encoder serves it
+	std::atomic<bool> keyframeRequested;
+	// Sequence number of the last keyframe
+	boost::uint64_t   lastKeyframeNumber;
 
 	bool destructing;
 
 	int64_t lastFrameTime;
 
 	int_least64_t lastPTS;
-	bool robustSyncing;
+	bool deliveredEndOfFrame;
+
+	bool              cubemapStamping;
+	CubemapFrameStamp deliveredStamp;
 };
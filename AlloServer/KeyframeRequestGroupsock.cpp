@@ -0,0 +1,25 @@
+#include "AlloShared/RTCPKeyframeRequest.hpp"
+#include "KeyframeRequestGroupsock.hpp"
+
+KeyframeRequestGroupsock::KeyframeRequestGroupsock(UsageEnvironment& env, const struct in_addr& groupAddr, Port port,
+                                                   u_int8_t ttl, u_int32_t mediaSSRC)
+    :
+    Groupsock(env, groupAddr, port, ttl), mediaSSRC(mediaSSRC)
+{
+}
+
+void KeyframeRequestGroupsock::setOnKeyframeRequest(const OnKeyframeRequest& callback)
+{
+    onKeyframeRequest = callback;
+}
+
+Boolean KeyframeRequestGroupsock::handleRead(unsigned char* buffer, unsigned bufferMaxSize,
+                                             unsigned& bytesRead, struct sockaddr_in& fromAddressAndPort)
+{
+    Boolean result = Groupsock::handleRead(buffer, bufferMaxSize, bytesRead, fromAddressAndPort);
+    if (result && bytesRead > 0 && RTCPKeyframeRequest::read(buffer, bytesRead, mediaSSRC))
+    {
+        if (onKeyframeRequest) onKeyframeRequest(this);
+    }
+    return result;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <Groupsock.hh>
+#include <functional>
+
+// The RTCP groupsock of a face's stream.
+// It hands every RTCP packet on to the RTCPInstance as Groupsock does but
+// also looks for keyframe requests (PLI or FIR) for mediaSSRC in it first.
+// live555 does not know RTCP feedback and would skip them.
+class KeyframeRequestGroupsock : public Groupsock
+{
+public:
+    KeyframeRequestGroupsock(UsageEnvironment& env, const struct in_addr& groupAddr, Port port, u_int8_t ttl,
+                             u_int32_t mediaSSRC);
+
+    typedef std::function<void(KeyframeRequestGroupsock* self)> OnKeyframeRequest;
+
+    void setOnKeyframeRequest(const OnKeyframeRequest& callback);
+
+    virtual Boolean handleRead(unsigned char* buffer, unsigned bufferMaxSize,
+                               unsigned& bytesRead, struct sockaddr_in& fromAddressAndPort);
+
+private:
+    OnKeyframeRequest onKeyframeRequest;
+    u_int32_t         mediaSSRC;
+};
@@ -0,0 +1,41 @@
+#include <algorithm>
+#include <cmath>
+
+#include "TokenBucket.hpp"
+
+TokenBucket::TokenBucket(unsigned long rate, size_t depth)
+    :
+    rate(rate), bytesPerMicrosecond(rate / 8.0 / 1000000.0), depth((double)depth), level((double)depth),
+    lastRefill(std::chrono::steady_clock::now())
+{
+}
+
+std::chrono::microseconds TokenBucket::getDelay()
+{
+    refill();
+    if (level >= 0.0)
+    {
+        return std::chrono::microseconds(0);
+    }
+    return std::chrono::microseconds((long long)std::ceil(-level / bytesPerMicrosecond));
+}
+
+void TokenBucket::consume(size_t size)
+{
+    refill();
+    level -= size;
+}
+
+unsigned long TokenBucket::getRate()
+{
+    return rate;
+}
+
+void TokenBucket::refill()
+{
+    auto now = std::chrono::steady_clock::now();
+    // Fractions of a microsecond would be lost on every call and make the bucket slow
+    std::chrono::duration<double, std::micro> elapsed = now - lastRefill;
+    level = (std::min)(depth, level + elapsed.count() * bytesPerMicrosecond);
+    lastRefill = now;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+// Classic token bucket: tokens (bytes) flow in at a fixed rate up to the bucket's depth.
+// A packet may go out as soon as the level is not negative and then takes its size
+// out of the bucket, so packets larger than the bucket just put it into debt.
+// Not thread-safe. Buckets are only touched from the live555 event loop.
+class TokenBucket
+{
+public:
+    // rate is in bit per second, depth in bytes
+    TokenBucket(unsigned long rate, size_t depth);
+
+    // Time until the next packet may go out (zero if it may go out now)
+    std::chrono::microseconds getDelay();
+    void consume(size_t size);
+
+    unsigned long getRate();
+
+private:
+    void refill();
+
+    unsigned long                         rate;
+    double                                bytesPerMicrosecond;
+    double                                depth;
+    double                                level;
+    std::chrono::steady_clock::time_point lastRefill;
+};
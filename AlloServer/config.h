@@ -12,3 +12,13 @@
 #define PRESET_VAL				"ultrafast"
 #define TUNE_VAL				"zerolatency:fastdecode"
 #define FPS						60
+#define DEFAULT_KEYFRAME_INTERVAL        20
+#define DEFAULT_MAX_KEYFRAMES_PER_FRAME  1
+// Receivers that lost packets get an IDR frame of the face at most this often
+#define DEFAULT_KEYFRAME_REQUEST_INTERVAL 10
+
+// Pacing params
+// Bursts of this length may go out at once
+#define PACER_BURST_MICROSECONDS         1000
+// A face may send this many times its average bit rate so that keyframes go out within a frame
+#define DEFAULT_FACE_BANDWIDTH_FACTOR    4
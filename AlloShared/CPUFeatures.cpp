@@ -0,0 +1,53 @@
+#include "CPUFeatures.hpp"
+
+#if defined(ALLOSHARED_X86) && defined(_MSC_VER)
+    #include <intrin.h>
+    #include <immintrin.h>
+#endif
+
+// GCC's cpu builtins need __builtin_cpu_init() since we may run before constructors
+
+bool CPUFeatures::hasSSE2()
+{
+#if !defined(ALLOSHARED_X86)
+    return false;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool CPUFeatures::hasSSE41()
+{
+#if !defined(ALLOSHARED_X86)
+    return false;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 19)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+bool CPUFeatures::hasAVX2()
+{
+#if !defined(ALLOSHARED_X86)
+    return false;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    // The OS has to save the YMM registers
+    bool osSavesYMM = (info[2] & (1 << 27)) && ((_xgetbv(0) & 0x6) == 0x6);
+    __cpuidex(info, 7, 0);
+    return osSavesYMM && (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+// Instruction set extensions of the CPU we run on.
+// Used to pick SIMD implementations at runtime.
+class CPUFeatures
+{
+public:
+    static bool hasSSE2();
+    static bool hasSSE41();
+    static bool hasAVX2();
+};
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define ALLOSHARED_X86
+#endif
+
+// GCC and clang only emit SSE4/AVX2 instructions in functions that ask for them.
+// MSVC emits them anywhere.
+#if defined(ALLOSHARED_X86) && (defined(__GNUC__) || defined(__clang__))
+    #define ALLOSHARED_TARGET_SSE41 __attribute__((target("sse4.1")))
+    #define ALLOSHARED_TARGET_AVX2  __attribute__((target("avx2")))
+#else
+    #define ALLOSHARED_TARGET_SSE41
+    #define ALLOSHARED_TARGET_AVX2
+#endif
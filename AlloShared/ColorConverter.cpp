@@ -0,0 +1,859 @@
+#include <algorithm>
+
+#include "ColorConverter.hpp"
+#include "CPUFeatures.hpp"
+
+#if defined(ALLOSHARED_X86)
+    #include <smmintrin.h>
+    #include <immintrin.h>
+#endif
+
+// All implementations produce exactly the same output:
+// RGB -> YUV uses 8 bit coefficients with chroma averaged over 2x2 pixels,
+// YUV -> RGB uses 6 bit coefficients and 16 bit saturating sums.
+
+namespace
+{
+    inline uint8_t clampToByte(int value)
+    {
+        return (uint8_t)((value < 0) ? 0 : ((value > 255) ? 255 : value));
+    }
+
+    inline uint8_t rgbToY(int r, int g, int b)
+    {
+        return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    }
+
+    inline uint8_t rgbToU(int r, int g, int b)
+    {
+        return (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+    }
+
+    inline uint8_t rgbToV(int r, int g, int b)
+    {
+        return (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+
+    template<int BPP>
+    inline void yuvToRGB(int y, int redChroma, int greenChroma, int blueChroma, uint8_t* rgb)
+    {
+        int luma = 74 * (y - 16) + 32;
+        rgb[0] = clampToByte((luma + redChroma)   >> 6);
+        rgb[1] = clampToByte((luma + greenChroma) >> 6);
+        rgb[2] = clampToByte((luma + blueChroma)  >> 6);
+        if (BPP == 4)
+        {
+            rgb[3] = 255;
+        }
+    }
+
+    // ###### SCALAR ######
+
+    // Converts the pixels from x on
+    template<int BPP, bool NV12>
+    void encodeRowsTail(const uint8_t* rgb0, const uint8_t* rgb1,
+                        uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+                        int x, int width)
+    {
+        for (; x < width; x += 2)
+        {
+            const uint8_t* p00 = rgb0 + x * BPP;
+            const uint8_t* p10 = rgb1 + x * BPP;
+            y0[x] = rgbToY(p00[0], p00[1], p00[2]);
+            y1[x] = rgbToY(p10[0], p10[1], p10[2]);
+
+            int r, g, b;
+            if (x + 1 < width)
+            {
+                const uint8_t* p01 = p00 + BPP;
+                const uint8_t* p11 = p10 + BPP;
+                y0[x + 1] = rgbToY(p01[0], p01[1], p01[2]);
+                y1[x + 1] = rgbToY(p11[0], p11[1], p11[2]);
+                r = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+                g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+                b = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+            }
+            else
+            {
+                r = (p00[0] + p10[0] + 1) >> 1;
+                g = (p00[1] + p10[1] + 1) >> 1;
+                b = (p00[2] + p10[2] + 1) >> 1;
+            }
+
+            if (NV12)
+            {
+                u[x]     = rgbToU(r, g, b);
+                u[x + 1] = rgbToV(r, g, b);
+            }
+            else
+            {
+                u[x / 2] = rgbToU(r, g, b);
+                v[x / 2] = rgbToV(r, g, b);
+            }
+        }
+    }
+
+    template<int BPP, bool NV12>
+    void decodeRowsTail(const uint8_t* y0, const uint8_t* y1, const uint8_t* u, const uint8_t* v,
+                        uint8_t* rgb0, uint8_t* rgb1,
+                        int x, int width)
+    {
+        for (; x < width; x += 2)
+        {
+            int d, e;
+            if (NV12)
+            {
+                d = u[x]     - 128;
+                e = u[x + 1] - 128;
+            }
+            else
+            {
+                d = u[x / 2] - 128;
+                e = v[x / 2] - 128;
+            }
+            int redChroma   = 102 * e;
+            int greenChroma = -25 * d - 52 * e;
+            int blueChroma  = 129 * d;
+
+            yuvToRGB<BPP>(y0[x], redChroma, greenChroma, blueChroma, rgb0 + x * BPP);
+            yuvToRGB<BPP>(y1[x], redChroma, greenChroma, blueChroma, rgb1 + x * BPP);
+            if (x + 1 < width)
+            {
+                yuvToRGB<BPP>(y0[x + 1], redChroma, greenChroma, blueChroma, rgb0 + (x + 1) * BPP);
+                yuvToRGB<BPP>(y1[x + 1], redChroma, greenChroma, blueChroma, rgb1 + (x + 1) * BPP);
+            }
+        }
+    }
+
+    template<int BPP, bool NV12>
+    void encodeRowsScalar(const uint8_t* rgb0, const uint8_t* rgb1,
+                          uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+                          int width)
+    {
+        encodeRowsTail<BPP, NV12>(rgb0, rgb1, y0, y1, u, v, 0, width);
+    }
+
+    template<int BPP, bool NV12>
+    void decodeRowsScalar(const uint8_t* y0, const uint8_t* y1, const uint8_t* u, const uint8_t* v,
+                          uint8_t* rgb0, uint8_t* rgb1,
+                          int width)
+    {
+        decodeRowsTail<BPP, NV12>(y0, y1, u, v, rgb0, rgb1, 0, width);
+    }
+
+#if defined(ALLOSHARED_X86)
+
+    // ###### SSE4.1 ######
+    // 16 pixels per iteration with 8 pixels per 16 bit register
+
+    // Loads 8 pixels into 16 bit lanes. RGB24 reads 4 bytes beyond the pixels.
+    template<int BPP>
+    ALLOSHARED_TARGET_SSE41
+    inline void loadRGB(const uint8_t* p, __m128i& r, __m128i& g, __m128i& b)
+    {
+        __m128i p0, p1;
+        if (BPP == 4)
+        {
+            p0 = _mm_loadu_si128((const __m128i*)p);
+            p1 = _mm_loadu_si128((const __m128i*)(p + 16));
+        }
+        else
+        {
+            // RGB -> RGBx
+            const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+            p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p),        shuffle);
+            p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), shuffle);
+        }
+        const __m128i mask = _mm_set1_epi32(0xFF);
+        r = _mm_packs_epi32(_mm_and_si128(p0, mask),                     _mm_and_si128(p1, mask));
+        g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8),  mask), _mm_and_si128(_mm_srli_epi32(p1, 8),  mask));
+        b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask), _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+    }
+
+    // Stores 16 pixels. RGB24 writes 4 bytes beyond the pixels.
+    template<int BPP>
+    ALLOSHARED_TARGET_SSE41
+    inline void storeRGB(uint8_t* p, __m128i r, __m128i g, __m128i b)
+    {
+        const __m128i alpha = _mm_set1_epi8(-1);
+        __m128i rgLo = _mm_unpacklo_epi8(r, g);
+        __m128i rgHi = _mm_unpackhi_epi8(r, g);
+        __m128i baLo = _mm_unpacklo_epi8(b, alpha);
+        __m128i baHi = _mm_unpackhi_epi8(b, alpha);
+        __m128i q[4] =
+        {
+            _mm_unpacklo_epi16(rgLo, baLo),
+            _mm_unpackhi_epi16(rgLo, baLo),
+            _mm_unpacklo_epi16(rgHi, baHi),
+            _mm_unpackhi_epi16(rgHi, baHi)
+        };
+        if (BPP == 4)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                _mm_storeu_si128((__m128i*)(p + 16 * i), q[i]);
+            }
+        }
+        else
+        {
+            // RGBA -> RGB
+            const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+            for (int i = 0; i < 4; i++)
+            {
+                _mm_storeu_si128((__m128i*)(p + 12 * i), _mm_shuffle_epi8(q[i], shuffle));
+            }
+        }
+    }
+
+    ALLOSHARED_TARGET_SSE41
+    inline __m128i computeY(__m128i r, __m128i g, __m128i b)
+    {
+        // Products and sum stay below 2^16 so unsigned wrap-around arithmetic is exact
+        __m128i y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+                                                _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+                                  _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)),
+                                                _mm_set1_epi16(128)));
+        return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+    }
+
+    ALLOSHARED_TARGET_SSE41
+    inline __m128i computeChroma(__m128i r, __m128i g, __m128i b, short rFactor, short gFactor, short bFactor)
+    {
+        // |sum| < 2^15
+        __m128i c = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(rFactor)),
+                                                _mm_mullo_epi16(g, _mm_set1_epi16(gFactor))),
+                                  _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(bFactor)),
+                                                _mm_set1_epi16(128)));
+        return _mm_add_epi16(_mm_srai_epi16(c, 8), _mm_set1_epi16(128));
+    }
+
+    // Averages 2x2 blocks of 16 pixels (two rows of 8 + 8) into 8 values
+    ALLOSHARED_TARGET_SSE41
+    inline __m128i average2x2(__m128i row0a, __m128i row1a, __m128i row0b, __m128i row1b)
+    {
+        const __m128i ones = _mm_set1_epi16(1);
+        __m128i sumsA = _mm_madd_epi16(_mm_add_epi16(row0a, row1a), ones);
+        __m128i sumsB = _mm_madd_epi16(_mm_add_epi16(row0b, row1b), ones);
+        return _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(sumsA, sumsB), _mm_set1_epi16(2)), 2);
+    }
+
+    template<int BPP, bool NV12>
+    ALLOSHARED_TARGET_SSE41
+    void encodeRowsSSE41(const uint8_t* rgb0, const uint8_t* rgb1,
+                         uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+                         int width)
+    {
+        const __m128i zero = _mm_setzero_si128();
+
+        int x = 0;
+        for (; x + 18 <= width; x += 16)
+        {
+            __m128i r0a, g0a, b0a, r0b, g0b, b0b, r1a, g1a, b1a, r1b, g1b, b1b;
+            loadRGB<BPP>(rgb0 + x * BPP,       r0a, g0a, b0a);
+            loadRGB<BPP>(rgb0 + (x + 8) * BPP, r0b, g0b, b0b);
+            loadRGB<BPP>(rgb1 + x * BPP,       r1a, g1a, b1a);
+            loadRGB<BPP>(rgb1 + (x + 8) * BPP, r1b, g1b, b1b);
+
+            _mm_storeu_si128((__m128i*)(y0 + x), _mm_packus_epi16(computeY(r0a, g0a, b0a), computeY(r0b, g0b, b0b)));
+            _mm_storeu_si128((__m128i*)(y1 + x), _mm_packus_epi16(computeY(r1a, g1a, b1a), computeY(r1b, g1b, b1b)));
+
+            __m128i r = average2x2(r0a, r1a, r0b, r1b);
+            __m128i g = average2x2(g0a, g1a, g0b, g1b);
+            __m128i b = average2x2(b0a, b1a, b0b, b1b);
+            __m128i u8 = _mm_packus_epi16(computeChroma(r, g, b, -38, -74, 112), zero);
+            __m128i v8 = _mm_packus_epi16(computeChroma(r, g, b, 112, -94, -18), zero);
+
+            if (NV12)
+            {
+                _mm_storeu_si128((__m128i*)(u + x), _mm_unpacklo_epi8(u8, v8));
+            }
+            else
+            {
+                _mm_storel_epi64((__m128i*)(u + x / 2), u8);
+                _mm_storel_epi64((__m128i*)(v + x / 2), v8);
+            }
+        }
+
+        encodeRowsTail<BPP, NV12>(rgb0, rgb1, y0, y1, u, v, x, width);
+    }
+
+    template<int BPP, bool NV12>
+    ALLOSHARED_TARGET_SSE41
+    void decodeRowsSSE41(const uint8_t* y0, const uint8_t* y1, const uint8_t* u, const uint8_t* v,
+                         uint8_t* rgb0, uint8_t* rgb1,
+                         int width)
+    {
+        const __m128i zero = _mm_setzero_si128();
+
+        int x = 0;
+        for (; x + 18 <= width; x += 16)
+        {
+            // 8 chroma samples
+            __m128i d, e;
+            if (NV12)
+            {
+                __m128i uv = _mm_loadu_si128((const __m128i*)(u + x));
+                d = _mm_and_si128(uv, _mm_set1_epi16(0xFF));
+                e = _mm_srli_epi16(uv, 8);
+            }
+            else
+            {
+                d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x / 2)), zero);
+                e = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(v + x / 2)), zero);
+            }
+            d = _mm_sub_epi16(d, _mm_set1_epi16(128));
+            e = _mm_sub_epi16(e, _mm_set1_epi16(128));
+
+            __m128i redChroma   = _mm_mullo_epi16(e, _mm_set1_epi16(102));
+            __m128i greenChroma = _mm_add_epi16(_mm_mullo_epi16(d, _mm_set1_epi16(-25)),
+                                                _mm_mullo_epi16(e, _mm_set1_epi16(-52)));
+            __m128i blueChroma  = _mm_mullo_epi16(d, _mm_set1_epi16(129));
+
+            // Every chroma sample covers two pixels of a row
+            __m128i chroma[3][2] =
+            {
+                { _mm_unpacklo_epi16(redChroma,   redChroma),   _mm_unpackhi_epi16(redChroma,   redChroma)   },
+                { _mm_unpacklo_epi16(greenChroma, greenChroma), _mm_unpackhi_epi16(greenChroma, greenChroma) },
+                { _mm_unpacklo_epi16(blueChroma,  blueChroma),  _mm_unpackhi_epi16(blueChroma,  blueChroma)  }
+            };
+
+            const uint8_t* yRows[2]   = { y0,   y1   };
+            uint8_t*       rgbRows[2] = { rgb0, rgb1 };
+            for (int row = 0; row < 2; row++)
+            {
+                __m128i yv = _mm_loadu_si128((const __m128i*)(yRows[row] + x));
+                __m128i luma[2] =
+                {
+                    _mm_sub_epi16(_mm_unpacklo_epi8(yv, zero), _mm_set1_epi16(16)),
+                    _mm_sub_epi16(_mm_unpackhi_epi8(yv, zero), _mm_set1_epi16(16))
+                };
+                for (int i = 0; i < 2; i++)
+                {
+                    luma[i] = _mm_add_epi16(_mm_mullo_epi16(luma[i], _mm_set1_epi16(74)), _mm_set1_epi16(32));
+                }
+
+                __m128i channels[3];
+                for (int c = 0; c < 3; c++)
+                {
+                    channels[c] = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(luma[0], chroma[c][0]), 6),
+                                                   _mm_srai_epi16(_mm_adds_epi16(luma[1], chroma[c][1]), 6));
+                }
+                storeRGB<BPP>(rgbRows[row] + x * BPP, channels[0], channels[1], channels[2]);
+            }
+        }
+
+        decodeRowsTail<BPP, NV12>(y0, y1, u, v, rgb0, rgb1, x, width);
+    }
+
+    // ###### AVX2 ######
+    // 32 pixels per iteration with 16 pixels per 16 bit register.
+    // Packing works per 128 bit lane so results are put back in order with permutes.
+
+    template<int BPP>
+    ALLOSHARED_TARGET_AVX2
+    inline void loadRGB(const uint8_t* p, __m256i& r, __m256i& g, __m256i& b)
+    {
+        __m256i p0, p1;
+        if (BPP == 4)
+        {
+            p0 = _mm256_loadu_si256((const __m256i*)p);
+            p1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+        }
+        else
+        {
+            const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                                     0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+            p0 = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+                                                             _mm_loadu_si128((const __m128i*)(p + 12)), 1),
+                                     shuffle);
+            p1 = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + 24))),
+                                                             _mm_loadu_si128((const __m128i*)(p + 36)), 1),
+                                     shuffle);
+        }
+        const __m256i mask = _mm256_set1_epi32(0xFF);
+        r = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(p0, mask),
+                                                        _mm256_and_si256(p1, mask)), 0xD8);
+        g = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 8), mask),
+                                                        _mm256_and_si256(_mm256_srli_epi32(p1, 8), mask)), 0xD8);
+        b = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 16), mask),
+                                                        _mm256_and_si256(_mm256_srli_epi32(p1, 16), mask)), 0xD8);
+    }
+
+    template<int BPP>
+    ALLOSHARED_TARGET_AVX2
+    inline void storeRGB(uint8_t* p, __m256i r, __m256i g, __m256i b)
+    {
+        const __m256i alpha = _mm256_set1_epi8(-1);
+        __m256i rgLo = _mm256_unpacklo_epi8(r, g);     // pixels 0-7  | 16-23
+        __m256i rgHi = _mm256_unpackhi_epi8(r, g);     // pixels 8-15 | 24-31
+        __m256i baLo = _mm256_unpacklo_epi8(b, alpha);
+        __m256i baHi = _mm256_unpackhi_epi8(b, alpha);
+        __m256i q0 = _mm256_unpacklo_epi16(rgLo, baLo); // pixels 0-3   | 16-19
+        __m256i q1 = _mm256_unpackhi_epi16(rgLo, baLo); // pixels 4-7   | 20-23
+        __m256i q2 = _mm256_unpacklo_epi16(rgHi, baHi); // pixels 8-11  | 24-27
+        __m256i q3 = _mm256_unpackhi_epi16(rgHi, baHi); // pixels 12-15 | 28-31
+        __m256i o[4] =
+        {
+            _mm256_permute2x128_si256(q0, q1, 0x20),
+            _mm256_permute2x128_si256(q2, q3, 0x20),
+            _mm256_permute2x128_si256(q0, q1, 0x31),
+            _mm256_permute2x128_si256(q2, q3, 0x31)
+        };
+        if (BPP == 4)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                _mm256_storeu_si256((__m256i*)(p + 32 * i), o[i]);
+            }
+        }
+        else
+        {
+            const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                                     0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+            for (int i = 0; i < 4; i++)
+            {
+                __m256i packed = _mm256_shuffle_epi8(o[i], shuffle);
+                _mm_storeu_si128((__m128i*)(p + 24 * i),      _mm256_castsi256_si128(packed));
+                _mm_storeu_si128((__m128i*)(p + 24 * i + 12), _mm256_extracti128_si256(packed, 1));
+            }
+        }
+    }
+
+    ALLOSHARED_TARGET_AVX2
+    inline __m256i computeY(__m256i r, __m256i g, __m256i b)
+    {
+        __m256i y = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)),
+                                                      _mm256_mullo_epi16(g, _mm256_set1_epi16(129))),
+                                     _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(25)),
+                                                      _mm256_set1_epi16(128)));
+        return _mm256_add_epi16(_mm256_srli_epi16(y, 8), _mm256_set1_epi16(16));
+    }
+
+    ALLOSHARED_TARGET_AVX2
+    inline __m256i computeChroma(__m256i r, __m256i g, __m256i b, short rFactor, short gFactor, short bFactor)
+    {
+        __m256i c = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(rFactor)),
+                                                      _mm256_mullo_epi16(g, _mm256_set1_epi16(gFactor))),
+                                     _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(bFactor)),
+                                                      _mm256_set1_epi16(128)));
+        return _mm256_add_epi16(_mm256_srai_epi16(c, 8), _mm256_set1_epi16(128));
+    }
+
+    ALLOSHARED_TARGET_AVX2
+    inline __m256i average2x2(__m256i row0a, __m256i row1a, __m256i row0b, __m256i row1b)
+    {
+        const __m256i ones = _mm256_set1_epi16(1);
+        __m256i sumsA = _mm256_madd_epi16(_mm256_add_epi16(row0a, row1a), ones);
+        __m256i sumsB = _mm256_madd_epi16(_mm256_add_epi16(row0b, row1b), ones);
+        __m256i sums  = _mm256_permute4x64_epi64(_mm256_packs_epi32(sumsA, sumsB), 0xD8);
+        return _mm256_srli_epi16(_mm256_add_epi16(sums, _mm256_set1_epi16(2)), 2);
+    }
+
+    // 16 16 bit values -> 16 bytes
+    ALLOSHARED_TARGET_AVX2
+    inline __m128i packToBytes(__m256i values)
+    {
+        return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(values, _mm256_setzero_si256()), 0xD8));
+    }
+
+    template<int BPP, bool NV12>
+    ALLOSHARED_TARGET_AVX2
+    void encodeRowsAVX2(const uint8_t* rgb0, const uint8_t* rgb1,
+                        uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+                        int width)
+    {
+        int x = 0;
+        for (; x + 34 <= width; x += 32)
+        {
+            __m256i r0a, g0a, b0a, r0b, g0b, b0b, r1a, g1a, b1a, r1b, g1b, b1b;
+            loadRGB<BPP>(rgb0 + x * BPP,        r0a, g0a, b0a);
+            loadRGB<BPP>(rgb0 + (x + 16) * BPP, r0b, g0b, b0b);
+            loadRGB<BPP>(rgb1 + x * BPP,        r1a, g1a, b1a);
+            loadRGB<BPP>(rgb1 + (x + 16) * BPP, r1b, g1b, b1b);
+
+            _mm256_storeu_si256((__m256i*)(y0 + x),
+                                _mm256_permute4x64_epi64(_mm256_packus_epi16(computeY(r0a, g0a, b0a),
+                                                                             computeY(r0b, g0b, b0b)), 0xD8));
+            _mm256_storeu_si256((__m256i*)(y1 + x),
+                                _mm256_permute4x64_epi64(_mm256_packus_epi16(computeY(r1a, g1a, b1a),
+                                                                             computeY(r1b, g1b, b1b)), 0xD8));
+
+            __m256i r = average2x2(r0a, r1a, r0b, r1b);
+            __m256i g = average2x2(g0a, g1a, g0b, g1b);
+            __m256i b = average2x2(b0a, b1a, b0b, b1b);
+            __m128i u8 = packToBytes(computeChroma(r, g, b, -38, -74, 112));
+            __m128i v8 = packToBytes(computeChroma(r, g, b, 112, -94, -18));
+
+            if (NV12)
+            {
+                _mm_storeu_si128((__m128i*)(u + x),      _mm_unpacklo_epi8(u8, v8));
+                _mm_storeu_si128((__m128i*)(u + x + 16), _mm_unpackhi_epi8(u8, v8));
+            }
+            else
+            {
+                _mm_storeu_si128((__m128i*)(u + x / 2), u8);
+                _mm_storeu_si128((__m128i*)(v + x / 2), v8);
+            }
+        }
+
+        encodeRowsTail<BPP, NV12>(rgb0, rgb1, y0, y1, u, v, x, width);
+    }
+
+    template<int BPP, bool NV12>
+    ALLOSHARED_TARGET_AVX2
+    void decodeRowsAVX2(const uint8_t* y0, const uint8_t* y1, const uint8_t* u, const uint8_t* v,
+                        uint8_t* rgb0, uint8_t* rgb1,
+                        int width)
+    {
+        int x = 0;
+        for (; x + 34 <= width; x += 32)
+        {
+            // 16 chroma samples
+            __m256i d, e;
+            if (NV12)
+            {
+                __m256i uv = _mm256_loadu_si256((const __m256i*)(u + x));
+                d = _mm256_and_si256(uv, _mm256_set1_epi16(0xFF));
+                e = _mm256_srli_epi16(uv, 8);
+            }
+            else
+            {
+                d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(u + x / 2)));
+                e = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(v + x / 2)));
+            }
+            d = _mm256_sub_epi16(d, _mm256_set1_epi16(128));
+            e = _mm256_sub_epi16(e, _mm256_set1_epi16(128));
+
+            __m256i chromas[3] =
+            {
+                _mm256_mullo_epi16(e, _mm256_set1_epi16(102)),
+                _mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_set1_epi16(-25)),
+                                 _mm256_mullo_epi16(e, _mm256_set1_epi16(-52))),
+                _mm256_mullo_epi16(d, _mm256_set1_epi16(129))
+            };
+
+            // Every chroma sample covers two pixels of a row
+            __m256i chroma[3][2];
+            for (int c = 0; c < 3; c++)
+            {
+                __m256i lo = _mm256_unpacklo_epi16(chromas[c], chromas[c]); // pixels 0-7  | 16-23
+                __m256i hi = _mm256_unpackhi_epi16(chromas[c], chromas[c]); // pixels 8-15 | 24-31
+                chroma[c][0] = _mm256_permute2x128_si256(lo, hi, 0x20);
+                chroma[c][1] = _mm256_permute2x128_si256(lo, hi, 0x31);
+            }
+
+            const uint8_t* yRows[2]   = { y0,   y1   };
+            uint8_t*       rgbRows[2] = { rgb0, rgb1 };
+            for (int row = 0; row < 2; row++)
+            {
+                __m256i luma[2] =
+                {
+                    _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(yRows[row] + x))),
+                    _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(yRows[row] + x + 16)))
+                };
+                for (int i = 0; i < 2; i++)
+                {
+                    luma[i] = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(luma[i], _mm256_set1_epi16(16)),
+                                                                  _mm256_set1_epi16(74)),
+                                               _mm256_set1_epi16(32));
+                }
+
+                __m256i channels[3];
+                for (int c = 0; c < 3; c++)
+                {
+                    channels[c] = _mm256_permute4x64_epi64(
+                        _mm256_packus_epi16(_mm256_srai_epi16(_mm256_adds_epi16(luma[0], chroma[c][0]), 6),
+                                            _mm256_srai_epi16(_mm256_adds_epi16(luma[1], chroma[c][1]), 6)),
+                        0xD8);
+                }
+                storeRGB<BPP>(rgbRows[row] + x * BPP, channels[0], channels[1], channels[2]);
+            }
+        }
+
+        decodeRowsTail<BPP, NV12>(y0, y1, u, v, rgb0, rgb1, x, width);
+    }
+
+#endif
+
+    int bytesPerPixel(AVPixelFormat format)
+    {
+        switch (format)
+        {
+        case AV_PIX_FMT_RGB24: return 3;
+        case AV_PIX_FMT_RGBA:  return 4;
+        default:               return 0;
+        }
+    }
+
+    bool isYUV(AVPixelFormat format)
+    {
+        return format == AV_PIX_FMT_YUV420P || format == AV_PIX_FMT_NV12;
+    }
+
+    template<int BPP, bool NV12>
+    ColorConverter::EncodeRowsFunction selectEncodeRows(ColorConverter::Implementation implementation)
+    {
+        switch (implementation)
+        {
+#if defined(ALLOSHARED_X86)
+        case ColorConverter::AVX2:  return &encodeRowsAVX2<BPP, NV12>;
+        case ColorConverter::SSE41: return &encodeRowsSSE41<BPP, NV12>;
+#endif
+        default:                    return &encodeRowsScalar<BPP, NV12>;
+        }
+    }
+
+    template<int BPP, bool NV12>
+    ColorConverter::DecodeRowsFunction selectDecodeRows(ColorConverter::Implementation implementation)
+    {
+        switch (implementation)
+        {
+#if defined(ALLOSHARED_X86)
+        case ColorConverter::AVX2:  return &decodeRowsAVX2<BPP, NV12>;
+        case ColorConverter::SSE41: return &decodeRowsSSE41<BPP, NV12>;
+#endif
+        default:                    return &decodeRowsScalar<BPP, NV12>;
+        }
+    }
+
+    ColorConverter::EncodeRowsFunction getEncodeRows(int bpp, bool nv12, ColorConverter::Implementation implementation)
+    {
+        if (bpp == 3)
+        {
+            return (nv12) ? selectEncodeRows<3, true>(implementation) : selectEncodeRows<3, false>(implementation);
+        }
+        else
+        {
+            return (nv12) ? selectEncodeRows<4, true>(implementation) : selectEncodeRows<4, false>(implementation);
+        }
+    }
+
+    ColorConverter::DecodeRowsFunction getDecodeRows(int bpp, bool nv12, ColorConverter::Implementation implementation)
+    {
+        if (bpp == 3)
+        {
+            return (nv12) ? selectDecodeRows<3, true>(implementation) : selectDecodeRows<3, false>(implementation);
+        }
+        else
+        {
+            return (nv12) ? selectDecodeRows<4, true>(implementation) : selectDecodeRows<4, false>(implementation);
+        }
+    }
+
+    ColorConverter::Implementation detectImplementation()
+    {
+        if (ColorConverter::isSupported(ColorConverter::AVX2))
+        {
+            return ColorConverter::AVX2;
+        }
+        if (ColorConverter::isSupported(ColorConverter::SSE41))
+        {
+            return ColorConverter::SSE41;
+        }
+        return ColorConverter::SCALAR;
+    }
+}
+
+ColorConverter::Implementation ColorConverter::implementation = detectImplementation();
+
+ColorConverter::ColorConverter(size_t maxThreadsCount)
+    :
+    maxThreadsCount((maxThreadsCount == 0) ? (std::max)(std::thread::hardware_concurrency(), 1u) : maxThreadsCount),
+    job(nullptr), rowPairsCount(0), activeThreadsCount(0), pendingWorkersCount(0), generation(0), stopping(false)
+{
+}
+
+ColorConverter::~ColorConverter()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobCondition.notify_all();
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+bool ColorConverter::isSupported(AVPixelFormat srcFormat, AVPixelFormat dstFormat)
+{
+    return (bytesPerPixel(srcFormat) && isYUV(dstFormat)) ||
+           (isYUV(srcFormat) && bytesPerPixel(dstFormat));
+}
+
+bool ColorConverter::convert(const uint8_t* const srcData[], const int srcLinesize[], AVPixelFormat srcFormat,
+                             uint8_t* const       dstData[], const int dstLinesize[], AVPixelFormat dstFormat,
+                             int width, int height, bool flip)
+{
+    if (!isSupported(srcFormat, dstFormat) || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+
+    // Source row of an image row
+    auto srcRow = [height, flip](int row)
+    {
+        return (flip) ? height - 1 - row : row;
+    };
+
+    int rowPairsCount = (height + 1) / 2;
+
+    if (isYUV(dstFormat))
+    {
+        EncodeRowsFunction encodeRows = getEncodeRows(bytesPerPixel(srcFormat), dstFormat == AV_PIX_FMT_NV12, implementation);
+        runInParallel(rowPairsCount, [&](int begin, int end)
+        {
+            for (int pair = begin; pair < end; pair++)
+            {
+                // The last pair of an odd height image only has one row
+                int row0 = pair * 2;
+                int row1 = (std::min)(row0 + 1, height - 1);
+                encodeRows(srcData[0] + (ptrdiff_t)srcRow(row0) * srcLinesize[0],
+                           srcData[0] + (ptrdiff_t)srcRow(row1) * srcLinesize[0],
+                           dstData[0] + (ptrdiff_t)row0 * dstLinesize[0],
+                           dstData[0] + (ptrdiff_t)row1 * dstLinesize[0],
+                           dstData[1] + (ptrdiff_t)pair * dstLinesize[1],
+                           (dstFormat == AV_PIX_FMT_NV12) ? nullptr : dstData[2] + (ptrdiff_t)pair * dstLinesize[2],
+                           width);
+            }
+        });
+    }
+    else
+    {
+        DecodeRowsFunction decodeRows = getDecodeRows(bytesPerPixel(dstFormat), srcFormat == AV_PIX_FMT_NV12, implementation);
+        runInParallel(rowPairsCount, [&](int begin, int end)
+        {
+            for (int pair = begin; pair < end; pair++)
+            {
+                int row0 = pair * 2;
+                int row1 = (std::min)(row0 + 1, height - 1);
+                // The chroma plane is mirrored as a whole, like the luma plane
+                int chromaRow = (flip) ? rowPairsCount - 1 - pair : pair;
+                decodeRows(srcData[0] + (ptrdiff_t)srcRow(row0) * srcLinesize[0],
+                           srcData[0] + (ptrdiff_t)srcRow(row1) * srcLinesize[0],
+                           srcData[1] + (ptrdiff_t)chromaRow * srcLinesize[1],
+                           (srcFormat == AV_PIX_FMT_NV12) ? nullptr : srcData[2] + (ptrdiff_t)chromaRow * srcLinesize[2],
+                           dstData[0] + (ptrdiff_t)row0 * dstLinesize[0],
+                           dstData[0] + (ptrdiff_t)row1 * dstLinesize[0],
+                           width);
+            }
+        });
+    }
+
+    return true;
+}
+
+ColorConverter::Implementation ColorConverter::getImplementation()
+{
+    return implementation;
+}
+
+const char* ColorConverter::getImplementationName(Implementation implementation)
+{
+    switch (implementation)
+    {
+    case SSE41: return "SSE4.1";
+    case AVX2:  return "AVX2";
+    default:    return "scalar";
+    }
+}
+
+bool ColorConverter::setImplementation(Implementation implementation)
+{
+    if (!isSupported(implementation))
+    {
+        return false;
+    }
+    ColorConverter::implementation = implementation;
+    return true;
+}
+
+bool ColorConverter::isSupported(Implementation implementation)
+{
+    switch (implementation)
+    {
+    case SSE41: return CPUFeatures::hasSSE41();
+    case AVX2:  return CPUFeatures::hasAVX2();
+    default:    return true;
+    }
+}
+
+void ColorConverter::runInParallel(int rowPairsCount, const std::function<void(int, int)>& job)
+{
+    size_t threadsCount = (std::min)(maxThreadsCount,
+                                     (std::max)((size_t)(rowPairsCount * 2 / MIN_ROWS_PER_THREAD), (size_t)1));
+    if (threadsCount == 1)
+    {
+        job(0, rowPairsCount);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // Workers are started the first time an image is large enough to need them
+    while (workers.size() < threadsCount - 1)
+    {
+        workers.push_back(std::thread(std::bind(&ColorConverter::workerLoop, this, workers.size(), generation)));
+    }
+
+    this->job                 = &job;
+    this->rowPairsCount       = rowPairsCount;
+    this->activeThreadsCount  = threadsCount;
+    this->pendingWorkersCount = threadsCount - 1;
+    generation++;
+    lock.unlock();
+    jobCondition.notify_all();
+
+    // The calling thread takes the first band
+    job(0, (int)(rowPairsCount / threadsCount));
+
+    lock.lock();
+    while (pendingWorkersCount > 0)
+    {
+        doneCondition.wait(lock);
+    }
+    this->job = nullptr;
+}
+
+void ColorConverter::workerLoop(size_t index, unsigned long seenGeneration)
+{
+    // Worker index takes band index + 1
+    size_t band = index + 1;
+
+    while (true)
+    {
+        const std::function<void(int, int)>* currentJob;
+        int begin, end;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping && seenGeneration == generation)
+            {
+                jobCondition.wait(lock);
+            }
+            if (stopping)
+            {
+                return;
+            }
+            seenGeneration = generation;
+
+            if (band >= activeThreadsCount)
+            {
+                // Not needed for this image
+                continue;
+            }
+            currentJob = job;
+            begin = (int)(rowPairsCount * band       / activeThreadsCount);
+            end   = (int)(rowPairsCount * (band + 1) / activeThreadsCount);
+        }
+
+        (*currentJob)(begin, end);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pendingWorkersCount--;
+        }
+        doneCondition.notify_one();
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <libavutil/pixfmt.h>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Converts images between RGB24/RGBA and YUV420P/NV12 (BT.601, limited range)
+// without rescaling. The source can be flipped vertically on the fly
+// (e.g. for bottom-up OpenGL read-backs).
+// AVX2 or SSE4.1 kernels are picked at runtime; other CPUs use plain C++.
+// Large images are split into bands of rows that are converted in parallel.
+// Everything else (rescaling, other formats) is left to swscale.
+class ColorConverter
+{
+public:
+    enum Implementation { SCALAR, SSE41, AVX2 };
+
+    // Up to maxThreadsCount threads convert one image (including the calling thread).
+    // 0 means as many as there are cores.
+    ColorConverter(size_t maxThreadsCount = 1);
+    ~ColorConverter();
+
+    static bool isSupported(AVPixelFormat srcFormat, AVPixelFormat dstFormat);
+
+    // Both images are width x height. Returns false if the formats are not supported.
+    bool convert(const uint8_t* const srcData[], const int srcLinesize[], AVPixelFormat srcFormat,
+                 uint8_t* const       dstData[], const int dstLinesize[], AVPixelFormat dstFormat,
+                 int width, int height, bool flip = false);
+
+    static Implementation getImplementation();
+    static const char*    getImplementationName(Implementation implementation);
+    // Returns false if the CPU does not support implementation (mainly for benchmarking)
+    static bool           setImplementation(Implementation implementation);
+    static bool           isSupported(Implementation implementation);
+
+    // Converts two rows from RGB to YUV. For NV12 u is the interleaved UV row and v is unused.
+    typedef void (*EncodeRowsFunction)(const uint8_t* rgb0, const uint8_t* rgb1,
+                                       uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+                                       int width);
+    // Converts two rows from YUV to RGB sharing one chroma row
+    typedef void (*DecodeRowsFunction)(const uint8_t* y0, const uint8_t* y1, const uint8_t* u, const uint8_t* v,
+                                       uint8_t* rgb0, uint8_t* rgb1,
+                                       int width);
+
+private:
+    // Rows handled by one thread should be worth waking it up for
+    enum { MIN_ROWS_PER_THREAD = 256 };
+
+    void runInParallel(int rowPairsCount, const std::function<void(int, int)>& job);
+    void workerLoop(size_t index, unsigned long seenGeneration);
+
+    size_t                            maxThreadsCount;
+    std::vector<std::thread>          workers;
+    std::mutex                        mutex;
+    std::condition_variable           jobCondition;
+    std::condition_variable           doneCondition;
+    const std::function<void(int, int)>* job;
+    int                               rowPairsCount;
+    size_t                            activeThreadsCount;
+    size_t                            pendingWorkersCount;
+    unsigned long                     generation;
+    bool                              stopping;
+
+    static Implementation implementation;
+};
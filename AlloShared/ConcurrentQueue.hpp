@@ -46,6 +46,19 @@ public:
 		return true;
 	}
 
+	// Like tryPop() but leaves the element in the queue
+	bool tryFront(Data& front_value) const
+	{
+        std::unique_lock<std::mutex> lock(mutex);
+		if (isClosed_ || queue.empty())
+		{
+			return false;
+		}
+
+		front_value = queue.front();
+		return true;
+	}
+
 	bool waitAndPop(Data& popped_value)
 	{
         std::unique_lock<std::mutex> lock(mutex);
@@ -6,13 +6,21 @@ CubemapFace::CubemapFace(Frame* content,
     :
     content(content),
     index(index),
-    allocator(allocator)
+    allocator(allocator),
+    release(nullptr),
+    planesOwner(nullptr)
 {
 	newFaceFlag = true;
+    for (int i = 0; i < MAX_PLANES_COUNT; i++)
+    {
+        planes[i]    = nullptr;
+        linesizes[i] = 0;
+    }
 }
 
 CubemapFace::~CubemapFace()
 {
+    releasePlanes();
     Frame::destroy(content.get());
 }
 bool CubemapFace::getNewFaceFlag()
@@ -30,7 +38,52 @@ int CubemapFace::getIndex()
 
 Frame* CubemapFace::getContent()
 {
-    return content.get();
+    return (planesContent) ? planesContent.get() : content.get();
+}
+
+void CubemapFace::setPlanes(boost::uint8_t* const planes[], const int linesizes[], ReleasePlanes release, void* owner,
+                            Frame* planesContent)
+{
+    releasePlanes();
+    for (int i = 0; i < MAX_PLANES_COUNT; i++)
+    {
+        this->planes[i]    = planes[i];
+        this->linesizes[i] = linesizes[i];
+    }
+    this->release       = release;
+    planesOwner         = owner;
+    this->planesContent = planesContent;
+}
+
+void CubemapFace::releasePlanes()
+{
+    if (planesOwner)
+    {
+        if (release) release(planesOwner);
+        for (int i = 0; i < MAX_PLANES_COUNT; i++)
+        {
+            planes[i]    = nullptr;
+            linesizes[i] = 0;
+        }
+        release       = nullptr;
+        planesOwner   = nullptr;
+        planesContent = nullptr;
+    }
+}
+
+bool CubemapFace::hasPlanes()
+{
+    return planesOwner != nullptr;
+}
+
+boost::uint8_t* CubemapFace::getPlane(int index)
+{
+    return planes[index];
+}
+
+int CubemapFace::getLinesize(int index)
+{
+    return linesizes[index];
 }
 
 CubemapFace* CubemapFace::create(Frame* content,
@@ -28,8 +28,27 @@ public:
 	typedef boost::interprocess::offset_ptr<CubemapFace> Ptr;
     
     int getIndex();
+    // The frame whose pixels hold the picture, see setPlanes()
     Frame* getContent();
     
+    enum { MAX_PLANES_COUNT = 4 };
+    // Gives borrowed planes back to their owner
+    typedef void (*ReleasePlanes)(void* owner);
+    
+    // Lets the face show planes that belong to owner (e.g. a decoded picture) instead of
+    // having them copied into its content. They stay valid until the face is given other planes
+    // or destroyed, then release(owner) is called.
+    // If the planes are the pixels of a frame (laid out like avpicture_layout() does), getContent()
+    // returns that frame meanwhile, so that readers of the content get the picture without a copy.
+    // Only for faces that stay in one process.
+    void setPlanes(boost::uint8_t* const planes[], const int linesizes[], ReleasePlanes release, void* owner,
+                   Frame* planesContent = nullptr);
+    void releasePlanes();
+    // Whether the face shows borrowed planes. Otherwise its content holds the picture.
+    bool hasPlanes();
+    boost::uint8_t* getPlane(int index);
+    int             getLinesize(int index);
+    
     static CubemapFace* create(Frame* content,
                                int index,
                                Allocator& allocator);
@@ -45,6 +64,12 @@ protected:
     Frame::Ptr content;
     int index;
     Allocator& allocator;
+    
+    boost::uint8_t* planes[MAX_PLANES_COUNT];
+    int             linesizes[MAX_PLANES_COUNT];
+    ReleasePlanes   release;
+    void*           planesOwner;
+    Frame::Ptr      planesContent;
 };
 
 class Cubemap
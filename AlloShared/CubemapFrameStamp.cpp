@@ -0,0 +1,123 @@
+#include <cstring>
+
+#include "CubemapFrameStamp.hpp"
+
+// RFC 8285 one-byte header: "defined by profile" value and the IDs of our elements
+static const uint16_t ONE_BYTE_HEADER_PROFILE = 0xBEDE;
+enum ElementID { CAPTURE_TIME_ID = 1, FRAME_ID_ID = 2, FACE_ID = 3, EXPECTED_FACES_ID = 4 };
+
+static void writeUInt(uint8_t* data, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        data[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+    }
+}
+
+static uint64_t readUInt(const uint8_t* data, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+// Element header: ID and length - 1 in one byte
+static uint8_t* writeElement(uint8_t* data, ElementID id, uint64_t value, size_t size)
+{
+    data[0] = (uint8_t)((id << 4) | (size - 1));
+    writeUInt(data + 1, value, size);
+    return data + 1 + size;
+}
+
+void CubemapFrameStamp::writeRTPHeaderExtension(uint8_t* extension) const
+{
+    uint8_t* elements = extension + 4;
+    uint8_t* data = elements;
+    data = writeElement(data, CAPTURE_TIME_ID,   (uint64_t)captureTime, 8);
+    data = writeElement(data, FRAME_ID_ID,       frameId,               4);
+    data = writeElement(data, FACE_ID,           face,                  1);
+    data = writeElement(data, EXPECTED_FACES_ID, expectedFaces,         4);
+
+    // Padding up to the next 32-bit word
+    memset(data, 0, extension + RTP_HEADER_EXTENSION_SIZE - data);
+
+    writeUInt(extension,     ONE_BYTE_HEADER_PROFILE,                 2);
+    writeUInt(extension + 2, (RTP_HEADER_EXTENSION_SIZE - 4) / 4,     2);
+}
+
+bool CubemapFrameStamp::readRTPPacket(const uint8_t* packet, size_t size, CubemapFrameStamp& stamp)
+{
+    // Fixed header, CSRCs and extension header
+    if (size < 12 || (packet[0] >> 6) != 2 || !(packet[0] & 0x10))
+    {
+        return false;
+    }
+    size_t extensionOffset = 12 + 4 * (packet[0] & 0x0F);
+    if (size < extensionOffset + 4 || readUInt(packet + extensionOffset, 2) != ONE_BYTE_HEADER_PROFILE)
+    {
+        return false;
+    }
+    size_t elementsSize = 4 * readUInt(packet + extensionOffset + 2, 2);
+    const uint8_t* data = packet + extensionOffset + 4;
+    const uint8_t* end  = data + elementsSize;
+    if (end > packet + size)
+    {
+        return false;
+    }
+
+    int found = 0;
+    while (data < end)
+    {
+        uint8_t id = data[0] >> 4;
+        if (id == 0)
+        {
+            // Padding
+            data++;
+            continue;
+        }
+        if (id == 15)
+        {
+            // Reserved; the rest must not be interpreted
+            break;
+        }
+
+        size_t elementSize = (data[0] & 0x0F) + 1;
+        if (data + 1 + elementSize > end)
+        {
+            return false;
+        }
+
+        const uint8_t* value = data + 1;
+        switch (id)
+        {
+        case CAPTURE_TIME_ID:   stamp.captureTime   = (int64_t)readUInt(value, elementSize);  found |= 1 << id; break;
+        case FRAME_ID_ID:       stamp.frameId       = (uint32_t)readUInt(value, elementSize); found |= 1 << id; break;
+        case FACE_ID:           stamp.face          = (uint8_t)readUInt(value, elementSize);  found |= 1 << id; break;
+        case EXPECTED_FACES_ID: stamp.expectedFaces = (uint32_t)readUInt(value, elementSize); found |= 1 << id; break;
+        default: break; // not ours
+        }
+        data += 1 + elementSize;
+    }
+
+    const int all = (1 << CAPTURE_TIME_ID) | (1 << FRAME_ID_ID) | (1 << FACE_ID) | (1 << EXPECTED_FACES_ID);
+    return found == all;
+}
+
+int64_t CubemapFrameStamp::pack() const
+{
+    // frameId (32 bits) | expectedFaces (MAX_FACES bits) | face (7 bits); the sign bit stays clear
+    return (int64_t)(((uint64_t)(face & 0x7F) << 56) |
+                     ((uint64_t)(expectedFaces & ((1 << MAX_FACES) - 1)) << 32) |
+                     frameId);
+}
+
+CubemapFrameStamp CubemapFrameStamp::unpack(int64_t packed)
+{
+    return CubemapFrameStamp((uint32_t)packed,
+                             (uint32_t)((uint64_t)packed >> 32) & ((1 << MAX_FACES) - 1),
+                             (uint8_t)(((uint64_t)packed >> 56) & 0x7F),
+                             0);
+}
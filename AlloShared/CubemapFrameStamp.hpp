@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Tells the receiver which cubemap a face's frame belongs to, which face it
+// is and which faces the server streams, so that it knows when it has all
+// faces of a cubemap. It also carries the time the cubemap was captured.
+// It travels in an RFC 8285 one-byte RTP header extension on the first packet
+// of every frame so that the payload stays plain H.264.
+class CubemapFrameStamp
+{
+public:
+    enum { RTP_HEADER_EXTENSION_SIZE = 28, MAX_FACES = 24 };
+
+    CubemapFrameStamp() : frameId(0), expectedFaces(0), face(0), captureTime(0) {}
+    CubemapFrameStamp(uint32_t frameId, uint32_t expectedFaces, uint8_t face, int64_t captureTime)
+        : frameId(frameId), expectedFaces(expectedFaces), face(face), captureTime(captureTime) {}
+
+    // Same for all faces of a cubemap
+    uint32_t frameId;
+    // Bit i is set if the server streams face i (in the order of the streams)
+    uint32_t expectedFaces;
+    // Stream of the frame
+    uint8_t  face;
+    // Microseconds since epoch
+    int64_t  captureTime;
+
+    // Writes the header extension (RTP_HEADER_EXTENSION_SIZE bytes) that follows the fixed RTP header
+    void writeRTPHeaderExtension(uint8_t* extension) const;
+    // Returns false if the RTP packet does not have our header extension
+    static bool readRTPPacket(const uint8_t* packet, size_t size, CubemapFrameStamp& stamp);
+
+    // For carrying all but captureTime in a single int64_t (never -1)
+    int64_t pack() const;
+    static CubemapFrameStamp unpack(int64_t packed);
+};
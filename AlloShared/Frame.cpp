@@ -1,20 +1,64 @@
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
 #include "Frame.hpp"
 
+void* Frame::Slot::getPixels()
+{
+    return pixels.get();
+}
+
+std::chrono::system_clock::time_point Frame::Slot::getPresentationTime()
+{
+    return presentationTime;
+}
+
+boost::uint64_t Frame::Slot::getSequenceNumber()
+{
+    return sequenceNumber;
+}
+
+void Frame::Slot::setPresentationTime(std::chrono::system_clock::time_point presentationTime)
+{
+    this->presentationTime = presentationTime;
+}
+
 Frame::Frame(boost::uint32_t                         width,
              boost::uint32_t                         height,
              AVPixelFormat                           format,
              std::chrono::system_clock::time_point presentationTime,
-             Allocator&                              allocator)
+             Allocator&                              allocator,
+             size_t                                  slotsCount)
     :
     allocator(allocator), width(width), height(height), format(format),
-	presentationTime(presentationTime), pixels(allocator.allocate(width * height * 4)), // for RGBA
-	barrier(2)
+	slotsCount((slotsCount > 1) ? (size_t)MAILBOX_SLOTS_COUNT : 1),
+	publishedCount(0)
 {
+	for (size_t i = 0; i < this->slotsCount; i++)
+	{
+		slots[i].allocation       = allocator.allocate(getPixelsSize() + PIXELS_ALIGNMENT);
+		uintptr_t address         = (uintptr_t)slots[i].allocation.get();
+		slots[i].pixels           = (void*)((address + PIXELS_ALIGNMENT - 1) & ~(uintptr_t)(PIXELS_ALIGNMENT - 1));
+		slots[i].presentationTime = presentationTime;
+		slots[i].sequenceNumber   = 0;
+	}
+
+	// With a single slot all indices point to the same slot
+	readIndex   = 0;
+	middleIndex = (this->slotsCount > 1) ? 1 : 0;
+	writeIndex  = (this->slotsCount > 1) ? 2 : 0;
 }
 
 Frame::~Frame()
 {
-	allocator.deallocate(pixels.get(), width * height * 4);
+	for (size_t i = 0; i < slotsCount; i++)
+	{
+		allocator.deallocate(slots[i].allocation.get(), getPixelsSize() + PIXELS_ALIGNMENT);
+	}
 }
 
 boost::uint32_t Frame::getWidth()
@@ -32,43 +76,122 @@ AVPixelFormat Frame::getFormat()
     return format;
 }
 
+size_t Frame::getSlotsCount()
+{
+    return slotsCount;
+}
+
+size_t Frame::getPixelsSize()
+{
+    return width * height * 4; // for RGBA
+}
+
 std::chrono::system_clock::time_point Frame::getPresentationTime()
 {
-    return presentationTime;
+    return getReadSlot()->getPresentationTime();
 }
 
 void* Frame::getPixels()
 {
-    return pixels.get();
+    return getReadSlot()->getPixels();
 }
 
-Barrier& Frame::getBarrier()
+Frame::Slot* Frame::getReadSlot()
 {
-    return barrier;
+    return &slots[readIndex];
 }
 
-boost::interprocess::interprocess_mutex& Frame::getMutex()
+bool Frame::acquireNewestSlot()
 {
-    return mutex;
+	if (!(middleIndex.load() & FRESH_FLAG))
+	{
+		return false;
+	}
+
+	// Hand our slot back and take the newest one
+	readIndex = middleIndex.exchange(readIndex) & ~FRESH_FLAG;
+	return true;
 }
 
-void Frame::setPresentationTime(std::chrono::system_clock::time_point presentationTime)
+bool Frame::waitForNewestSlot(std::chrono::microseconds timeout)
 {
-    this->presentationTime = presentationTime;
+	if (acquireNewestSlot())
+	{
+		return true;
+	}
+
+	boost::system_time deadline = boost::get_system_time() + boost::posix_time::microseconds(timeout.count());
+	if (!mutex.timed_lock(deadline))
+	{
+		return false;
+	}
+
+	boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(mutex,
+		                                                                           boost::interprocess::accept_ownership);
+	while (!(middleIndex.load() & FRESH_FLAG))
+	{
+		if (!publishedCondition.timed_wait(lock, deadline))
+		{
+			break;
+		}
+	}
+
+	return acquireNewestSlot();
+}
+
+Frame::Slot* Frame::getWriteSlot()
+{
+    return &slots[writeIndex];
+}
+
+void Frame::publishWriteSlot()
+{
+	slots[writeIndex].sequenceNumber = ++publishedCount;
+
+	// Publish our slot and continue with the one that was published before (or released by the consumer)
+	writeIndex = middleIndex.exchange(writeIndex | FRESH_FLAG) & ~FRESH_FLAG;
+
+	// The mutex is only ever held for the short check in waitForNewestSlot(),
+	// unless the consumer died while holding it (see resetSync()). So we only wait
+	// for it briefly and otherwise notify without it. A consumer that is just about to wait
+	// may miss that notification, but it only waits until its timeout.
+	if (mutex.timed_lock(boost::get_system_time() + boost::posix_time::milliseconds(10)))
+	{
+		publishedCondition.notify_all();
+		mutex.unlock();
+	}
+	else
+	{
+		publishedCondition.notify_all();
+	}
+}
+
+void Frame::resetSync()
+{
+	// Hacky solution indeed (see Barrier::reset())
+	// That's not possible unfortunately since the mutex is locked and abandoned
+	//mutex.~interprocess_mutex();
+	void* mutexAddr = &mutex;
+	void* conditionAddr = &publishedCondition;
+	memset(mutexAddr, 0, sizeof(boost::interprocess::interprocess_mutex));
+	memset(conditionAddr, 0, sizeof(boost::interprocess::interprocess_condition));
+	new (mutexAddr)     boost::interprocess::interprocess_mutex;
+	new (conditionAddr) boost::interprocess::interprocess_condition;
 }
 
 Frame* Frame::create(boost::uint32_t                         width,
                      boost::uint32_t                         height,
                      AVPixelFormat                           format,
                      std::chrono::system_clock::time_point presentationTime,
-                     Allocator&                              allocator)
+                     Allocator&                              allocator,
+                     size_t                                  slotsCount)
 {
     void* addr = allocator.allocate(sizeof(Frame));
-    return new (addr) Frame(width, height, format, presentationTime, allocator);
+    return new (addr) Frame(width, height, format, presentationTime, allocator, slotsCount);
 }
 
 void Frame::destroy(Frame* frame)
 {
     frame->~Frame();
 	frame->allocator.deallocate(frame, sizeof(Frame));
-}
\ No newline at end of file
+}
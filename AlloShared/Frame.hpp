@@ -6,47 +6,101 @@
 #include <boost/interprocess/sync/interprocess_condition.hpp>
 #include <libavutil/pixfmt.h>
 //#include <boost/chrono/system_clocks.hpp>
+#include <atomic>
+#include <chrono>
 
-#include "Barrier.hpp"
 #include "Allocator.h"
 
+// A frame is a mailbox of pixel slots.
+// The producer (e.g. CubemapExtractionPlugin) always writes into a slot that
+// nobody reads and publishes it. The consumer (e.g. AlloServer) always takes
+// the most recently published slot and thereby skips stale ones.
+// With MAILBOX_SLOTS_COUNT slots neither side ever waits for the other.
+// Frames that are only accessed by one thread (e.g. in AlloReceiver) use a single slot.
+// Any other slots count is raised to MAILBOX_SLOTS_COUNT, since with two slots
+// producer and consumer would start out on the same one.
 class Frame
 {
 
 public:
 	typedef boost::interprocess::offset_ptr<Frame> Ptr;
 
+	enum { MAILBOX_SLOTS_COUNT = 3, MAX_SLOTS_COUNT = 3 };
+	// The pixels of every slot start at a multiple of it, so that SIMD code and decoders can work on them directly
+	enum { PIXELS_ALIGNMENT = 64 };
+
+	class Slot
+	{
+	public:
+		void*                                 getPixels();
+		std::chrono::system_clock::time_point getPresentationTime();
+		boost::uint64_t                       getSequenceNumber();
+
+		void setPresentationTime(std::chrono::system_clock::time_point presentationTime);
+
+	private:
+		friend class Frame;
+
+		boost::interprocess::offset_ptr<void> pixels;
+		// What the allocator gave us, pixels is aligned within it
+		boost::interprocess::offset_ptr<void> allocation;
+		std::chrono::system_clock::time_point presentationTime;
+		boost::uint64_t                       sequenceNumber;
+	};
+
     boost::uint32_t                              getWidth();
     boost::uint32_t                              getHeight();
     AVPixelFormat                                getFormat();
-    std::chrono::system_clock::time_point      getPresentationTime();
+    size_t                                       getSlotsCount();
+    // Bytes of pixels every slot has room for (enough for width x height RGBA)
+    size_t                                       getPixelsSize();
+
+    // Consumer side: pixels and presentation time of the slot the consumer currently holds
+    std::chrono::system_clock::time_point        getPresentationTime();
 	void*                                        getPixels();
-	Barrier&                                     getBarrier();
-	boost::interprocess::interprocess_mutex&     getMutex();
-    
-    void setPresentationTime(std::chrono::system_clock::time_point presentationTime);
-    
+	Slot*                                        getReadSlot();
+	// Swaps the newest published slot in if there is one. Returns false if nothing new was published.
+	bool                                         acquireNewestSlot();
+	// Like acquireNewestSlot() but waits up to timeout for the producer to publish a slot.
+	bool                                         waitForNewestSlot(std::chrono::microseconds timeout);
+
+    // Producer side
+	Slot*                                        getWriteSlot();
+	void                                         publishWriteSlot();
+
+	// Restores the notification primitives in case the consumer died while holding them
+	void                                         resetSync();
+
     static Frame* create(boost::uint32_t                         width,
                          boost::uint32_t                         height,
                          AVPixelFormat                           format,
                          std::chrono::system_clock::time_point presentationTime,
-                         Allocator&                              allocator);
+                         Allocator&                              allocator,
+                         size_t                                  slotsCount = 1);
     static void   destroy(Frame* Frame);
-    
+
 protected:
     Frame(boost::uint32_t                         width,
           boost::uint32_t                         height,
           AVPixelFormat                           format,
           std::chrono::system_clock::time_point presentationTime,
-          Allocator&                              allocator);
+          Allocator&                              allocator,
+          size_t                                  slotsCount = 1);
     ~Frame();
-    
+
+    // Flag that is set in the middle slot index when the middle slot holds unread pixels
+    static const boost::uint32_t FRESH_FLAG = 0x80000000;
+
     Allocator&                                  allocator;
     boost::uint32_t                             width;
     boost::uint32_t                             height;
     AVPixelFormat                               format;
-    std::chrono::system_clock::time_point     presentationTime;
-	boost::interprocess::offset_ptr<void>       pixels;
-	Barrier                                     barrier;
+	size_t                                      slotsCount;
+	Slot                                        slots[MAX_SLOTS_COUNT];
+	boost::uint32_t                             writeIndex;     // owned by the producer
+	boost::uint32_t                             readIndex;      // owned by the consumer
+	std::atomic<boost::uint32_t>                middleIndex;    // exchanged between both
+	boost::uint64_t                             publishedCount; // owned by the producer
+	boost::interprocess::interprocess_condition publishedCondition;
 	boost::interprocess::interprocess_mutex     mutex;
 };
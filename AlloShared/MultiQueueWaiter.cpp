@@ -0,0 +1,128 @@
+#include "MultiQueueWaiter.hpp"
+
+#if defined(__linux__)
+    #include <unistd.h>
+    #include <sys/syscall.h>
+    #include <linux/futex.h>
+    #include <time.h>
+#endif
+
+static int64_t nowMicroseconds()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+MultiQueueWaiter::MultiQueueWaiter()
+    :
+    readyMask(0), sleeping(0), firstNotifyTime(0)
+{
+}
+
+void MultiQueueWaiter::notify(size_t queue)
+{
+    uint64_t bit = (uint64_t)1 << (queue % MAX_QUEUES);
+    if (readyMask.load() & bit)
+    {
+        // Already signaled and not picked up yet
+        return;
+    }
+
+    // The time has to be stored before the bit is published, otherwise the consumer
+    // may compute its latency from the previous time. Producers that race for the first
+    // bit may move it a little later, which is fine for a statistic.
+    if (readyMask.load(std::memory_order_acquire) == 0)
+    {
+        firstNotifyTime.store(nowMicroseconds(), std::memory_order_relaxed);
+    }
+    readyMask.fetch_or(bit, std::memory_order_release);
+
+    // Either we see the consumer going to sleep here or it sees our bit
+    // when it checks readyMask once more after announcing that it sleeps
+    if (sleeping.load() == 1 && sleeping.exchange(0) == 1)
+    {
+        wake();
+    }
+}
+
+uint64_t MultiQueueWaiter::wait(std::chrono::microseconds& sleepLatency)
+{
+    return wait(sleepLatency, std::chrono::microseconds::max());
+}
+
+uint64_t MultiQueueWaiter::wait(std::chrono::microseconds& sleepLatency, std::chrono::microseconds timeout)
+{
+    sleepLatency = std::chrono::microseconds(0);
+
+    bool isTimed = timeout != std::chrono::microseconds::max();
+    std::chrono::steady_clock::time_point deadline;
+    if (isTimed)
+    {
+        deadline = std::chrono::steady_clock::now() + timeout;
+    }
+
+    while (true)
+    {
+        uint64_t mask = readyMask.exchange(0);
+        if (mask)
+        {
+            return mask;
+        }
+
+        std::chrono::microseconds remaining(0);
+        if (isTimed)
+        {
+            remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0)
+            {
+                return 0;
+            }
+        }
+
+        sleeping.store(1);
+        if (readyMask.load())
+        {
+            sleeping.store(0);
+            continue;
+        }
+
+#if defined(__linux__)
+        // Returns right away if a producer reset sleeping in the meantime
+        timespec relativeTimeout;
+        relativeTimeout.tv_sec  = remaining.count() / 1000000;
+        relativeTimeout.tv_nsec = (remaining.count() % 1000000) * 1000;
+        syscall(SYS_futex, (int*)&sleeping, FUTEX_WAIT_PRIVATE, 1, (isTimed) ? &relativeTimeout : NULL, NULL, 0);
+#else
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (sleeping.load() == 1)
+            {
+                if (!isTimed)
+                {
+                    condition.wait(lock);
+                }
+                else if (condition.wait_until(lock, deadline) == std::cv_status::timeout)
+                {
+                    break;
+                }
+            }
+        }
+#endif
+        sleeping.store(0);
+
+        if (readyMask.load())
+        {
+            sleepLatency = std::chrono::microseconds(nowMicroseconds() - firstNotifyTime.load(std::memory_order_relaxed));
+        }
+    }
+}
+
+void MultiQueueWaiter::wake()
+{
+#if defined(__linux__)
+    syscall(SYS_futex, (int*)&sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    // Taking the lock makes sure the consumer is either waiting already or still sees sleeping == 0
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.notify_one();
+#endif
+}
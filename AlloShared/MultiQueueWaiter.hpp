@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <condition_variable>
+
+// Lets one consumer sleep until any of up to MAX_QUEUES producers signals
+// that its queue got something. Signals of the same queue are merged until
+// the consumer picks them up.
+// On Linux the consumer sleeps on a futex so that producers only make a
+// syscall when it actually sleeps. Elsewhere a condition variable is used.
+class MultiQueueWaiter
+{
+public:
+    enum { MAX_QUEUES = 64 };
+
+    MultiQueueWaiter();
+
+    // Producer side: queue has something for the consumer
+    void notify(size_t queue);
+
+    // Consumer side: blocks until at least one queue was notified and returns
+    // the mask of all notified queues (bit i for queue i).
+    // sleepLatency is set to the time between the first notify() and the
+    // consumer running again, or to zero if it did not have to sleep.
+    uint64_t wait(std::chrono::microseconds& sleepLatency);
+    // Same but gives up after timeout and returns 0 then
+    uint64_t wait(std::chrono::microseconds& sleepLatency, std::chrono::microseconds timeout);
+
+private:
+    void wake();
+
+    std::atomic<uint64_t> readyMask;
+    std::atomic<int>      sleeping; // futex word: 1 while the consumer sleeps or is about to
+    // When readyMask became non-zero (steady clock, in microseconds)
+    std::atomic<int64_t>  firstNotifyTime;
+
+    std::mutex              mutex;
+    std::condition_variable condition;
+};
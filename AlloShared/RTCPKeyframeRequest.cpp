@@ -0,0 +1,86 @@
+#include "RTCPKeyframeRequest.hpp"
+
+enum PacketType { RR = 201, PSFB = 206 };
+// Payload-specific feedback message types
+enum FeedbackType { PLI = 1, FIR = 4 };
+
+static void writeUInt32(uint8_t* data, uint32_t value)
+{
+    data[0] = (uint8_t)(value >> 24);
+    data[1] = (uint8_t)(value >> 16);
+    data[2] = (uint8_t)(value >> 8);
+    data[3] = (uint8_t)value;
+}
+
+static uint32_t readUInt32(const uint8_t* data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+// Version 2, no padding, count or feedback type, packet type and length in 32-bit words minus one
+static void writeHeader(uint8_t* data, uint8_t count, uint8_t type, uint16_t length)
+{
+    data[0] = 0x80 | count;
+    data[1] = type;
+    data[2] = (uint8_t)(length >> 8);
+    data[3] = (uint8_t)length;
+}
+
+size_t RTCPKeyframeRequest::write(uint8_t* packet, uint32_t senderSSRC, uint32_t mediaSSRC)
+{
+    // Receiver report without report blocks
+    writeHeader(packet, 0, RR, 1);
+    writeUInt32(packet + 4, senderSSRC);
+
+    // Picture loss indication has no feedback control information
+    writeHeader(packet + 8, PLI, PSFB, 2);
+    writeUInt32(packet + 12, senderSSRC);
+    writeUInt32(packet + 16, mediaSSRC);
+
+    return PACKET_SIZE;
+}
+
+bool RTCPKeyframeRequest::read(const uint8_t* packet, size_t size, uint32_t mediaSSRC)
+{
+    const uint8_t* data = packet;
+    const uint8_t* end  = packet + size;
+
+    while (end - data >= 4)
+    {
+        if ((data[0] >> 6) != 2)
+        {
+            return false;
+        }
+        uint8_t        format = data[0] & 0x1F;
+        uint8_t        type   = data[1];
+        const uint8_t* next   = data + 4 * ((size_t)((data[2] << 8) | data[3]) + 1);
+        if (next > end)
+        {
+            return false;
+        }
+
+        // Sender SSRC, media SSRC and the feedback control information
+        if (type == PSFB && next - data >= 12)
+        {
+            if (format == PLI && readUInt32(data + 8) == mediaSSRC)
+            {
+                return true;
+            }
+            if (format == FIR)
+            {
+                // One entry of SSRC, sequence number and reserved bytes per media source
+                for (const uint8_t* entry = data + 12; next - entry >= 8; entry += 8)
+                {
+                    if (readUInt32(entry) == mediaSSRC)
+                    {
+                        return true;
+                    }
+                }
+            }
+        }
+
+        data = next;
+    }
+
+    return false;
+}
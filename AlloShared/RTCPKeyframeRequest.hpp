@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// RTCP feedback with which a receiver asks the sender of a stream for a keyframe
+// after it lost packets of it (PLI, RFC 4585; FIR, RFC 5104 is understood as well).
+class RTCPKeyframeRequest
+{
+public:
+    // live555 only accepts compound RTCP packets that start with a report.
+    // So the PLI follows an empty receiver report.
+    enum { PACKET_SIZE = 20 };
+
+    // Writes a compound RTCP packet (PACKET_SIZE bytes) asking the sender of mediaSSRC for a keyframe
+    static size_t write(uint8_t* packet, uint32_t senderSSRC, uint32_t mediaSSRC);
+    // Whether the compound RTCP packet asks the sender of mediaSSRC for a keyframe
+    static bool read(const uint8_t* packet, size_t size, uint32_t mediaSSRC);
+};
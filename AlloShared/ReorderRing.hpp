@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+// Collects the items several sources produce for the same key (e.g. the
+// faces' frames of one cubemap) in a fixed number of slots without locks.
+// The slot of a key is the key modulo capacity. Keys that are still in use
+// by an older key take the next free slot.
+// Every source may insert from its own thread, but one source must not insert
+// from two threads at once. Only one thread may claim.
+// Keys only have to be unique and ordered within 2^31 of each other.
+template<typename Data>
+class ReorderRing
+{
+public:
+    enum { MAX_SOURCES = 30 };
+    enum InsertResult { INSERTED, DUPLICATE, LATE, FULL };
+
+    ReorderRing(size_t capacity, size_t sourcesCount)
+        :
+        capacity(capacity), sourcesCount(sourcesCount), slots(new Slot[capacity]),
+        completeMask(((uint64_t)1 << sourcesCount) - 1), lastClaimedKey(0), hasClaimed(false)
+    {
+        for (size_t i = 0; i < capacity; i++)
+        {
+            slots[i].items.resize(sourcesCount);
+        }
+    }
+
+    // Gives the item of source for key to the ring.
+    // If it is not INSERTED the caller keeps the item.
+    InsertResult insert(int64_t key, size_t source, const Data& item)
+    {
+        uint32_t tag = (uint32_t)key;
+        uint64_t bit = (uint64_t)1 << source;
+
+        if (hasClaimed.load() && !isOlder(lastClaimedKey.load(), tag))
+        {
+            return LATE;
+        }
+
+        for (size_t probe = 0; probe < capacity; probe++)
+        {
+            Slot& slot = slots[(tag + probe) % capacity];
+            uint64_t state = slot.state.load();
+
+            while (true)
+            {
+                if (!(state & OCCUPIED))
+                {
+                    // Nobody else writes our item, so it is safe to do it before we own the slot
+                    slot.items[source] = item;
+                    if (slot.state.compare_exchange_weak(state, ((uint64_t)tag << 32) | OCCUPIED | bit))
+                    {
+                        return INSERTED;
+                    }
+                }
+                else if ((uint32_t)(state >> 32) == tag && !(state & CLAIMED))
+                {
+                    if (state & bit)
+                    {
+                        return DUPLICATE;
+                    }
+                    slot.items[source] = item;
+                    if (slot.state.compare_exchange_weak(state, state | bit))
+                    {
+                        return INSERTED;
+                    }
+                }
+                else
+                {
+                    // Taken by another key
+                    break;
+                }
+            }
+        }
+
+        return FULL;
+    }
+
+    // Looks at the oldest key. Returns false if no key is waiting.
+    // complete is set if all sources of the complete mask delivered their item,
+    // occupied to the number of keys waiting.
+    bool peekOldest(uint32_t& key, bool& complete, size_t& occupied)
+    {
+        uint64_t state;
+        if (!findOldest(state, occupied))
+        {
+            return false;
+        }
+
+        uint64_t mask = completeMask.load();
+        key      = (uint32_t)(state >> 32);
+        complete = (state & mask) == mask;
+        return true;
+    }
+
+    // Takes the items of the oldest key. items gets the item of every
+    // source (Data() if it did not deliver).
+    // late is set if the key was claimed before already, i.e. an item came
+    // in after its key was claimed.
+    bool claimOldest(std::vector<Data>& items, bool& late)
+    {
+        uint64_t state;
+        size_t   occupied;
+        Slot*    oldest = findOldest(state, occupied);
+        if (!oldest)
+        {
+            return false;
+        }
+
+        // Producers that come in from now on go elsewhere
+        state = oldest->state.fetch_or(CLAIMED);
+
+        uint32_t tag = (uint32_t)(state >> 32);
+        late = hasClaimed.load() && !isOlder(lastClaimedKey.load(), tag);
+        if (!late)
+        {
+            lastClaimedKey.store(tag);
+            hasClaimed.store(true);
+        }
+
+        items.resize(sourcesCount);
+        for (size_t i = 0; i < sourcesCount; i++)
+        {
+            items[i] = (state & ((uint64_t)1 << i)) ? oldest->items[i] : Data();
+        }
+
+        oldest->state.store(0);
+        return true;
+    }
+
+    size_t getCapacity() const
+    {
+        return capacity;
+    }
+
+    // Sources whose items make a key complete (all sources by default)
+    void setCompleteMask(uint64_t mask)
+    {
+        completeMask.store(mask & (((uint64_t)1 << sourcesCount) - 1));
+    }
+
+    // Whether key a comes before key b
+    static bool isOlder(uint32_t a, uint32_t b)
+    {
+        return (int32_t)(a - b) < 0;
+    }
+
+private:
+    struct Slot;
+
+    Slot* findOldest(uint64_t& oldestState, size_t& occupied)
+    {
+        Slot* oldest = nullptr;
+        occupied = 0;
+
+        for (size_t i = 0; i < capacity; i++)
+        {
+            uint64_t state = slots[i].state.load();
+            if ((state & OCCUPIED) && !(state & CLAIMED))
+            {
+                occupied++;
+                if (!oldest || isOlder((uint32_t)(state >> 32), (uint32_t)(oldestState >> 32)))
+                {
+                    oldest      = &slots[i];
+                    oldestState = state;
+                }
+            }
+        }
+
+        return oldest;
+    }
+
+    // Slot state: key (upper 32 bits) | OCCUPIED | CLAIMED | one bit per source
+    static const uint64_t OCCUPIED = (uint64_t)1 << 31;
+    static const uint64_t CLAIMED  = (uint64_t)1 << 30;
+
+    struct Slot
+    {
+        Slot() : state(0) {}
+        std::atomic<uint64_t> state;
+        std::vector<Data>     items;
+    };
+
+    size_t                   capacity;
+    size_t                   sourcesCount;
+    std::unique_ptr<Slot[]>  slots;
+    std::atomic<uint64_t>    completeMask;
+    std::atomic<uint32_t>    lastClaimedKey;
+    std::atomic<bool>        hasClaimed;
+};
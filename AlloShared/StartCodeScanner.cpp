@@ -0,0 +1,178 @@
+#include "StartCodeScanner.hpp"
+#include "CPUFeatures.hpp"
+
+#if defined(ALLOSHARED_X86)
+    #include <emmintrin.h>
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif
+#endif
+
+namespace
+{
+    inline int countTrailingZeros(unsigned int mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (int)index;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    StartCodeScanner::Implementation detectImplementation()
+    {
+        if (StartCodeScanner::isSupported(StartCodeScanner::AVX2))
+        {
+            return StartCodeScanner::AVX2;
+        }
+        if (StartCodeScanner::isSupported(StartCodeScanner::SSE2))
+        {
+            return StartCodeScanner::SSE2;
+        }
+        return StartCodeScanner::SCALAR;
+    }
+}
+
+StartCodeScanner::Implementation StartCodeScanner::implementation = SCALAR;
+StartCodeScanner::FindFunction   StartCodeScanner::find           = &StartCodeScanner::findScalar;
+
+// Picks the implementation before main() so that no thread ever sees it change
+static bool implementationDetected = StartCodeScanner::setImplementation(detectImplementation());
+
+const uint8_t* StartCodeScanner::findStartCode(const uint8_t* begin, const uint8_t* end)
+{
+    return find(begin, end);
+}
+
+StartCodeScanner::Implementation StartCodeScanner::getImplementation()
+{
+    return implementation;
+}
+
+const char* StartCodeScanner::getImplementationName(Implementation implementation)
+{
+    switch (implementation)
+    {
+    case SSE2: return "SSE2";
+    case AVX2: return "AVX2";
+    default:   return "scalar";
+    }
+}
+
+bool StartCodeScanner::setImplementation(Implementation implementation)
+{
+    if (!isSupported(implementation))
+    {
+        return false;
+    }
+
+    StartCodeScanner::implementation = implementation;
+    switch (implementation)
+    {
+    case SSE2: find = &findSSE2;   break;
+    case AVX2: find = &findAVX2;   break;
+    default:   find = &findScalar; break;
+    }
+    return true;
+}
+
+bool StartCodeScanner::isSupported(Implementation implementation)
+{
+    switch (implementation)
+    {
+    case SSE2: return CPUFeatures::hasSSE2();
+    case AVX2: return CPUFeatures::hasAVX2();
+    default:   return true;
+    }
+}
+
+const uint8_t* StartCodeScanner::findScalar(const uint8_t* begin, const uint8_t* end)
+{
+    for (const uint8_t* p = begin; p + 2 < end; p++)
+    {
+        // A start code can neither begin at p, p + 1 nor p + 2 if p[2] > 1
+        if (p[2] > 1)
+        {
+            p += 2;
+        }
+        else if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+        {
+            return p;
+        }
+    }
+    return end;
+}
+
+#if defined(ALLOSHARED_X86)
+
+const uint8_t* StartCodeScanner::findSSE2(const uint8_t* begin, const uint8_t* end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one  = _mm_set1_epi8(1);
+
+    // Compare 16 candidate positions at once: byte 0 == 0, byte 1 == 0 and byte 2 == 1
+    const uint8_t* p = begin;
+    for (; p + 18 <= end; p += 16)
+    {
+        __m128i first  = _mm_loadu_si128((const __m128i*)p);
+        __m128i second = _mm_loadu_si128((const __m128i*)(p + 1));
+        __m128i third  = _mm_loadu_si128((const __m128i*)(p + 2));
+
+        __m128i matches = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(first,  zero),
+                                                      _mm_cmpeq_epi8(second, zero)),
+                                        _mm_cmpeq_epi8(third, one));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(matches);
+        if (mask)
+        {
+            return p + countTrailingZeros(mask);
+        }
+    }
+
+    return findScalar(p, end);
+}
+
+ALLOSHARED_TARGET_AVX2
+const uint8_t* StartCodeScanner::findAVX2(const uint8_t* begin, const uint8_t* end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one  = _mm256_set1_epi8(1);
+
+    // Same as findSSE2() but with 32 candidate positions at once
+    const uint8_t* p = begin;
+    for (; p + 34 <= end; p += 32)
+    {
+        __m256i first  = _mm256_loadu_si256((const __m256i*)p);
+        __m256i second = _mm256_loadu_si256((const __m256i*)(p + 1));
+        __m256i third  = _mm256_loadu_si256((const __m256i*)(p + 2));
+
+        __m256i matches = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(first,  zero),
+                                                            _mm256_cmpeq_epi8(second, zero)),
+                                           _mm256_cmpeq_epi8(third, one));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(matches);
+        if (mask)
+        {
+            return p + countTrailingZeros(mask);
+        }
+    }
+
+    return findSSE2(p, end);
+}
+
+#else
+
+// Without x86 SIMD everything falls back to the scalar search.
+// isSupported() never lets these be selected.
+const uint8_t* StartCodeScanner::findSSE2(const uint8_t* begin, const uint8_t* end)
+{
+    return findScalar(begin, end);
+}
+
+const uint8_t* StartCodeScanner::findAVX2(const uint8_t* begin, const uint8_t* end)
+{
+    return findScalar(begin, end);
+}
+
+#endif
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Finds Annex-B start codes (00 00 01 and 00 00 00 01) in H.264 byte streams.
+// The fastest implementation the CPU supports (AVX2, SSE2 or plain C++) is
+// picked at runtime.
+class StartCodeScanner
+{
+public:
+    enum Implementation { SCALAR, SSE2, AVX2 };
+
+    // Returns a pointer to the 00 00 01 of the first start code in [begin, end)
+    // or end if there is none.
+    static const uint8_t* findStartCode(const uint8_t* begin, const uint8_t* end);
+
+    // Calls callback(const uint8_t* nalu, size_t size) for every NALU in [begin, end).
+    // The NALUs are passed without start codes and without trailing zero bytes.
+    // Bytes before the first start code are treated as a NALU as well.
+    template<typename Callback>
+    static void forEachNALU(const uint8_t* begin, const uint8_t* end, Callback callback);
+
+    static Implementation getImplementation();
+    static const char*    getImplementationName(Implementation implementation);
+    // Returns false if the CPU does not support implementation (mainly for benchmarking)
+    static bool           setImplementation(Implementation implementation);
+    static bool           isSupported(Implementation implementation);
+
+private:
+    typedef const uint8_t* (*FindFunction)(const uint8_t* begin, const uint8_t* end);
+
+    static const uint8_t* findScalar(const uint8_t* begin, const uint8_t* end);
+    static const uint8_t* findSSE2  (const uint8_t* begin, const uint8_t* end);
+    static const uint8_t* findAVX2  (const uint8_t* begin, const uint8_t* end);
+
+    static Implementation implementation;
+    static FindFunction   find;
+};
+
+template<typename Callback>
+void StartCodeScanner::forEachNALU(const uint8_t* begin, const uint8_t* end, Callback callback)
+{
+    const uint8_t* naluBegin = begin;
+    while (naluBegin < end)
+    {
+        const uint8_t* startCode = findStartCode(naluBegin, end);
+
+        // Leading zero of a 4-byte start code (and any other zero padding) belongs to no NALU
+        const uint8_t* naluEnd = startCode;
+        while (naluEnd > naluBegin && naluEnd[-1] == 0)
+        {
+            naluEnd--;
+        }
+
+        if (naluEnd > naluBegin)
+        {
+            callback(naluBegin, (size_t)(naluEnd - naluBegin));
+        }
+
+        if (startCode == end)
+        {
+            return;
+        }
+        naluBegin = startCode + 3;
+    }
+}
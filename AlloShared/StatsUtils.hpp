@@ -21,7 +21,7 @@ public:
     class Frame
     {
     public:
-        enum Status {RECEIVED, DECODED, COLOR_CONVERTED};
+        enum Status {RECEIVED, DECODED, COLOR_CONVERTED, ENCODED};
         
         Frame(int type, size_t size, int face, Status status) : type(type), size(size), face(face), status(status) {}
         int    type;
@@ -43,6 +43,114 @@ public:
     class Cubemap
     {
     };
+
+    // Packets that went out with syscallsCount send calls
+    class Transmission
+    {
+    public:
+        Transmission(size_t packetsCount, size_t syscallsCount) : packetsCount(packetsCount), syscallsCount(syscallsCount) {}
+        size_t packetsCount;
+        size_t syscallsCount;
+    };
+    
+    // The encode path allocated on the heap count times (see EncodeArena)
+    class EncodeAllocations
+    {
+    public:
+        EncodeAllocations(size_t count) : count(count) {}
+        size_t count;
+    };
+    
+    // Packets that came in with syscallsCount receive calls
+    class Reception
+    {
+    public:
+        Reception(size_t packetsCount, size_t syscallsCount) : packetsCount(packetsCount), syscallsCount(syscallsCount) {}
+        size_t packetsCount;
+        size_t syscallsCount;
+    };
+    
+    // A thread that sleeps until it has work woke up latency after work became available
+    // and used cpuTime since it woke up the last time
+    class WakeUp
+    {
+    public:
+        WakeUp(std::chrono::microseconds latency, std::chrono::microseconds cpuTime) : latency(latency), cpuTime(cpuTime) {}
+        std::chrono::microseconds latency;
+        std::chrono::microseconds cpuTime;
+    };
+    
+    // A cubemap was shown with the given playout delay; concealedFaces of it did not arrive in time
+    class Playout
+    {
+    public:
+        Playout(std::chrono::microseconds delay, std::chrono::microseconds jitter, int concealedFaces)
+            : delay(delay), jitter(jitter), concealedFaces(concealedFaces) {}
+        std::chrono::microseconds delay;
+        std::chrono::microseconds jitter;
+        int                       concealedFaces;
+    };
+    
+    // A face's frame that came after its cubemap was due
+    class LateFrame
+    {
+    public:
+        LateFrame(int face) : face(face) {}
+        int face;
+    };
+    
+    // A face's frame that was dropped since too many cubemaps were pending
+    class FrameWithoutRoom
+    {
+    public:
+        FrameWithoutRoom(int face) : face(face) {}
+        int face;
+    };
+    
+    // A face's frame that had no CubemapFrameStamp
+    class UnstampedFrame
+    {
+    public:
+        UnstampedFrame(int face) : face(face) {}
+        int face;
+    };
+    
+    // An IDR frame of a face was asked for (receiver) or the request came in (server)
+    class KeyframeRequest
+    {
+    public:
+        KeyframeRequest(int face) : face(face) {}
+        int face;
+    };
+    
+    // A face showed intact new frames again after it was concealed for duration
+    class Concealment
+    {
+    public:
+        Concealment(int face, std::chrono::microseconds duration) : face(face), duration(duration) {}
+        int                       face;
+        std::chrono::microseconds duration;
+    };
+    
+    // A face's decoder fell behind and a frame was decoded fast or dropped
+    class LoadShedding
+    {
+    public:
+        enum Step {FAST_DECODE, DROP_NON_REFERENCE, SKIP_TO_IDR};
+        
+        LoadShedding(int face, Step step) : face(face), step(step) {}
+        int  face;
+        Step step;
+    };
+    
+    // A face's frame came out of the decoder duration after its packet went in
+    class DecodeTime
+    {
+    public:
+        DecodeTime(int face, std::chrono::microseconds duration) : face(face), duration(duration) {}
+        int                       face;
+        std::chrono::microseconds duration;
+    };
     
     // STAT VALS
 	static Stats::StatVal nalusBitSum  (const std::string&                      name,
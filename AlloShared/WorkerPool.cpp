@@ -0,0 +1,164 @@
+#include "WorkerPool.hpp"
+
+#include <algorithm>
+
+WorkerPool::Strand::Strand(const std::function<void ()>& task)
+    :
+    task(task), state(IDLE), isDestroyed(false), deadline(0), sequence(0)
+{
+}
+
+bool WorkerPool::IsLater::operator()(const Entry& a, const Entry& b) const
+{
+    // Strands with the same deadline run in the order they were scheduled
+    if (a.deadline != b.deadline)
+    {
+        return a.deadline > b.deadline;
+    }
+    return a.sequence > b.sequence;
+}
+
+WorkerPool::WorkerPool(size_t threadsCount)
+    :
+    nextSequence(0), isStopping(false)
+{
+    if (threadsCount == 0)
+    {
+        threadsCount = (std::max)(std::thread::hardware_concurrency(), 1u);
+    }
+
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+        workers.push_back(std::thread(&WorkerPool::workerLoop, this));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    isStopping = true;
+    lock.unlock();
+    taskCondition.notify_all();
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+std::shared_ptr<WorkerPool::Strand> WorkerPool::createStrand(const std::function<void ()>& task)
+{
+    return std::shared_ptr<Strand>(new Strand(task));
+}
+
+void WorkerPool::enqueue(const std::shared_ptr<Strand>& strand)
+{
+    strand->sequence = nextSequence++;
+    queue.push({strand->deadline, strand->sequence, strand});
+}
+
+void WorkerPool::schedule(const std::shared_ptr<Strand>& strand, int64_t deadline)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (strand->isDestroyed)
+    {
+        return;
+    }
+
+    bool isEnqueued = false;
+    switch (strand->state)
+    {
+    case Strand::IDLE:
+        strand->state    = Strand::QUEUED;
+        strand->deadline = deadline;
+        enqueue(strand);
+        isEnqueued = true;
+        break;
+    case Strand::QUEUED:
+        if (deadline < strand->deadline)
+        {
+            // The entry with the later deadline is skipped when it comes up
+            strand->deadline = deadline;
+            enqueue(strand);
+            isEnqueued = true;
+        }
+        break;
+    case Strand::RUNNING:
+        // The task is enqueued again when it returns
+        strand->state    = Strand::RUNNING_SCHEDULED;
+        strand->deadline = deadline;
+        break;
+    case Strand::RUNNING_SCHEDULED:
+        strand->deadline = (std::min)(strand->deadline, deadline);
+        break;
+    }
+    lock.unlock();
+
+    if (isEnqueued)
+    {
+        taskCondition.notify_one();
+    }
+}
+
+void WorkerPool::destroyStrand(const std::shared_ptr<Strand>& strand)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    strand->isDestroyed = true;
+    while (strand->state == Strand::RUNNING || strand->state == Strand::RUNNING_SCHEDULED)
+    {
+        strandCondition.wait(lock);
+    }
+    strand->state = Strand::IDLE;
+}
+
+size_t WorkerPool::getThreadsCount()
+{
+    return workers.size();
+}
+
+void WorkerPool::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        while (!isStopping && queue.empty())
+        {
+            taskCondition.wait(lock);
+        }
+
+        if (isStopping)
+        {
+            return;
+        }
+
+        Entry entry = queue.top();
+        queue.pop();
+
+        std::shared_ptr<Strand>& strand = entry.strand;
+        if (strand->isDestroyed || strand->state != Strand::QUEUED || strand->sequence != entry.sequence)
+        {
+            continue;
+        }
+
+        strand->state = Strand::RUNNING;
+        lock.unlock();
+        strand->task();
+        lock.lock();
+
+        if (strand->state == Strand::RUNNING_SCHEDULED && !strand->isDestroyed)
+        {
+            strand->state = Strand::QUEUED;
+            enqueue(strand);
+            // This thread picks it up itself unless there is something more urgent
+        }
+        else
+        {
+            strand->state = Strand::IDLE;
+        }
+
+        if (strand->isDestroyed)
+        {
+            strandCondition.notify_all();
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// A fixed set of threads that runs the tasks of many strands.
+// A strand runs its task again whenever it is scheduled, but never on two threads at once,
+// so whatever the task processes keeps its order. Scheduling a strand that waits
+// or runs already is merged with that, and strands nobody schedules cost nothing.
+// Among the waiting strands the one with the earliest deadline runs first.
+class WorkerPool
+{
+public:
+    class Strand
+    {
+        friend class WorkerPool;
+
+        enum State { IDLE, QUEUED, RUNNING, RUNNING_SCHEDULED };
+
+        Strand(const std::function<void ()>& task);
+
+        std::function<void ()> task;
+        State                  state;
+        bool                   isDestroyed;
+        int64_t                deadline;
+        // Of the queue entry that is up to date
+        uint64_t               sequence;
+    };
+
+    // 0 threads means as many as there are cores
+    WorkerPool(size_t threadsCount);
+    // Waits for the tasks that are running
+    ~WorkerPool();
+
+    std::shared_ptr<Strand> createStrand(const std::function<void ()>& task);
+    // Has the strand's task run (once more if it is running right now).
+    // Deadlines are comparable among all strands of the pool, the smaller one is more urgent.
+    // A strand that waits already keeps the earlier of both deadlines.
+    // May be called from any thread, including the strand's task.
+    void schedule(const std::shared_ptr<Strand>& strand, int64_t deadline);
+    // Waits until the strand's task does not run any more. Later schedule() calls do nothing.
+    // Must not be called from the strand's task.
+    void destroyStrand(const std::shared_ptr<Strand>& strand);
+
+    size_t getThreadsCount();
+
+private:
+    struct Entry
+    {
+        int64_t                 deadline;
+        uint64_t                sequence;
+        std::shared_ptr<Strand> strand;
+    };
+    struct IsLater
+    {
+        bool operator()(const Entry& a, const Entry& b) const;
+    };
+
+    void enqueue(const std::shared_ptr<Strand>& strand);
+    void workerLoop();
+
+    std::vector<std::thread>                                 workers;
+    std::mutex                                               mutex;
+    std::condition_variable                                  taskCondition;
+    std::condition_variable                                  strandCondition;
+    // Entries of strands that were scheduled with an earlier deadline or destroyed meanwhile are skipped
+    std::priority_queue<Entry, std::vector<Entry>, IsLater>  queue;
+    uint64_t                                                 nextSequence;
+    bool                                                     isStopping;
+};
@@ -0,0 +1,133 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <string>
+
+extern "C"
+{
+    #include <libavutil/imgutils.h>
+    #include <libswscale/swscale.h>
+}
+
+#include "AlloShared/ColorConverter.hpp"
+
+// Compares swscale (as AlloServer and AlloReceiver used it) with ColorConverter
+// for the conversions of the streaming pipeline at typical face resolutions:
+// RGBA -> YUV420P with flip (server) and YUV420P -> RGB24 (receiver).
+
+static const int REPETITIONS = 20;
+
+struct Image
+{
+    Image(int width, int height, AVPixelFormat format)
+    {
+        if (av_image_alloc(data, linesize, width, height, format, 32) < 0)
+        {
+            std::cerr << "Could not allocate image" << std::endl;
+            abort();
+        }
+        int size = av_image_get_buffer_size(format, width, height, 32);
+        std::mt19937 random(42);
+        for (int i = 0; i < size; i++)
+        {
+            data[0][i] = (uint8_t)random();
+        }
+    }
+
+    ~Image()
+    {
+        av_freep(&data[0]);
+    }
+
+    uint8_t* data[4];
+    int linesize[4];
+};
+
+static void run(const std::string& name, int width, int height, const std::function<void()>& convert)
+{
+    // Warm up (allocations, thread start-up)
+    convert();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < REPETITIONS; r++)
+    {
+        convert();
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+    double milliseconds = duration.count() / 1000.0 / REPETITIONS;
+    std::cout << "  " << std::left << std::setw(20) << name
+              << std::right << std::setw(10) << std::fixed << std::setprecision(3) << milliseconds << " ms"
+              << std::setw(10) << std::setprecision(1) << width * height / milliseconds / 1000.0 << " MPixel/s" << std::endl;
+}
+
+static void benchmark(int width, int height, AVPixelFormat srcFormat, AVPixelFormat dstFormat, bool flip)
+{
+    std::cout << width << "x" << height << " " << av_get_pix_fmt_name(srcFormat) << " -> " << av_get_pix_fmt_name(dstFormat)
+              << ((flip) ? " (flipped)" : "") << std::endl;
+
+    Image src(width, height, srcFormat);
+    Image dst(width, height, dstFormat);
+
+    SwsContext* swsContext = sws_getContext(width, height, srcFormat, width, height, dstFormat,
+                                            SWS_BICUBIC, NULL, NULL, NULL);
+    run("swscale", width, height, [&]()
+    {
+        uint8_t* data[4];
+        int linesize[4];
+        for (int i = 0; i < 4; i++)
+        {
+            data[i]     = src.data[i];
+            linesize[i] = src.linesize[i];
+            if (flip && linesize[i] > 0)
+            {
+                data[i]    += linesize[i] * (height - 1);
+                linesize[i] = -linesize[i];
+            }
+        }
+        sws_scale(swsContext, data, linesize, 0, height, dst.data, dst.linesize);
+    });
+    sws_freeContext(swsContext);
+
+    std::vector<size_t> threadsCounts(1, 1);
+    if (std::thread::hardware_concurrency() > 1)
+    {
+        threadsCounts.push_back(std::thread::hardware_concurrency());
+    }
+
+    for (ColorConverter::Implementation implementation : {ColorConverter::SCALAR,
+                                                          ColorConverter::SSE41,
+                                                          ColorConverter::AVX2})
+    {
+        if (!ColorConverter::setImplementation(implementation))
+        {
+            std::cout << "  " << ColorConverter::getImplementationName(implementation) << " not supported" << std::endl;
+            continue;
+        }
+
+        for (size_t threads : threadsCounts)
+        {
+            ColorConverter converter(threads);
+            run(std::string(ColorConverter::getImplementationName(implementation)) + " x" + std::to_string(threads),
+                width, height, [&]()
+            {
+                converter.convert(src.data, src.linesize, srcFormat, dst.data, dst.linesize, dstFormat, width, height, flip);
+            });
+        }
+    }
+}
+
+int main()
+{
+    for (int resolution : {1024, 2048, 4096})
+    {
+        benchmark(resolution, resolution, AV_PIX_FMT_RGBA,    AV_PIX_FMT_YUV420P, true);
+        benchmark(resolution, resolution, AV_PIX_FMT_YUV420P, AV_PIX_FMT_RGB24,   false);
+    }
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <string>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/opt.h>
+}
+
+#include "AlloShared/Frame.hpp"
+#include "AlloShared/Cubemap.hpp"
+#include "AlloShared/Allocator.h"
+#include "AlloReceiver/FrameBufferProvider.hpp"
+
+// Compares how decoded faces get into the frames of a cubemap:
+// libavcodec's own pictures copied with avpicture_layout() (as H264CubemapSource does without a provider)
+// and pictures the decoder writes straight into frames through a FrameBufferPool.
+
+static const int FRAMES_COUNT      = 60;
+static const int FACES_PER_CUBEMAP = StereoCubemap::MAX_EYES_COUNT * CUBEMAP_MAX_FACES_COUNT;
+
+// A moving pattern encoded like AlloServer does, so that the decoder holds on to reference pictures
+static std::vector<AVPacket*> encode(int width, int height)
+{
+    AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!codec)
+    {
+        std::cerr << "Encoder not found" << std::endl;
+        abort();
+    }
+
+    AVCodecContext* context = avcodec_alloc_context3(codec);
+    context->width        = width;
+    context->height       = height;
+    context->time_base    = av_make_q(1, 30);
+    context->gop_size     = 30;
+    context->max_b_frames = 0;
+    context->pix_fmt      = AV_PIX_FMT_YUV420P;
+    av_opt_set(context->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(context->priv_data, "tune", "zerolatency", 0);
+    if (avcodec_open2(context, codec, NULL) < 0)
+    {
+        std::cerr << "Could not open encoder" << std::endl;
+        abort();
+    }
+
+    AVFrame* frame = av_frame_alloc();
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width  = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0)
+    {
+        std::cerr << "Could not allocate frame" << std::endl;
+        abort();
+    }
+
+    std::vector<AVPacket*> packets;
+    for (int i = 0; i < FRAMES_COUNT; i++)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                frame->data[0][y * frame->linesize[0] + x] = (uint8_t)(x + y + i * 4);
+            }
+        }
+        for (int plane = 1; plane < 3; plane++)
+        {
+            for (int y = 0; y < height / 2; y++)
+            {
+                for (int x = 0; x < width / 2; x++)
+                {
+                    frame->data[plane][y * frame->linesize[plane] + x] = (uint8_t)(128 + plane * (x - i));
+                }
+            }
+        }
+        frame->pts = i;
+
+        AVPacket* packet = new AVPacket;
+        av_init_packet(packet);
+        packet->data = NULL;
+        packet->size = 0;
+        int gotPacket = 0;
+        if (avcodec_encode_video2(context, packet, frame, &gotPacket) < 0)
+        {
+            std::cerr << "Error encoding frame" << std::endl;
+            abort();
+        }
+
+        if (gotPacket)
+        {
+            packets.push_back(packet);
+        }
+        else
+        {
+            delete packet;
+        }
+    }
+
+    av_frame_free(&frame);
+    avcodec_close(context);
+    av_free(context);
+    return packets;
+}
+
+static void run(const std::string& name, const std::vector<AVPacket*>& packets, int width, int height,
+                FrameBufferProvider* provider)
+{
+    AVCodec*        codec   = avcodec_find_decoder(AV_CODEC_ID_H264);
+    AVCodecContext* context = avcodec_alloc_context3(codec);
+    context->refcounted_frames = 1;
+    context->thread_count      = 1;
+    if (provider)
+    {
+        provider->install(context);
+    }
+    if (avcodec_open2(context, codec, NULL) < 0)
+    {
+        std::cerr << "Could not open decoder" << std::endl;
+        abort();
+    }
+
+    HeapAllocator allocator;
+    Frame*   content = Frame::create(width, height, AV_PIX_FMT_YUV420P, std::chrono::system_clock::time_point(), allocator);
+    AVFrame* picture = av_frame_alloc();
+
+    size_t picturesCount           = 0;
+    size_t referencedPicturesCount = 0;
+    size_t copiedBytes             = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (AVPacket* packet : packets)
+    {
+        int gotPicture = 0;
+        if (avcodec_decode_video2(context, picture, &gotPicture, packet) < 0)
+        {
+            std::cerr << "Error decoding frame" << std::endl;
+            abort();
+        }
+
+        if (gotPicture)
+        {
+            picturesCount++;
+            if (FrameBufferProvider::getFrame(picture))
+            {
+                // The face keeps a reference and shows the frame the picture is in
+                AVFrame* reference = av_frame_clone(picture);
+                av_frame_free(&reference);
+                referencedPicturesCount++;
+            }
+            else
+            {
+                copiedBytes += avpicture_layout((AVPicture*)picture, (AVPixelFormat)picture->format,
+                                                picture->width, picture->height,
+                                                (unsigned char*)content->getPixels(), (int)content->getPixelsSize());
+            }
+            av_frame_unref(picture);
+        }
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+    av_frame_free(&picture);
+    avcodec_close(context);
+    av_free(context);
+    Frame::destroy(content);
+
+    if (picturesCount == 0)
+    {
+        std::cout << "  " << name << ": no pictures decoded" << std::endl;
+        return;
+    }
+
+    double milliseconds = duration.count() / 1000.0 / picturesCount * FACES_PER_CUBEMAP;
+    double megabytes    = copiedBytes / 1000000.0 / picturesCount * FACES_PER_CUBEMAP;
+    std::cout << "  " << std::left << std::setw(20) << name
+              << std::right << std::setw(10) << std::fixed << std::setprecision(3) << milliseconds << " ms/cubemap"
+              << std::setw(10) << std::setprecision(2) << megabytes << " MB copied/cubemap"
+              << std::setw(6) << referencedPicturesCount << "/" << picturesCount << " pictures without copy" << std::endl;
+}
+
+int main()
+{
+    avcodec_register_all();
+
+    for (int resolution : {1024, 2048})
+    {
+        std::cout << resolution << "x" << resolution << " faces, " << FACES_PER_CUBEMAP << " per cubemap" << std::endl;
+
+        std::vector<AVPacket*> packets = encode(resolution, resolution);
+
+        run("libavcodec + copy", packets, resolution, resolution, nullptr);
+
+        // Enough for the reference pictures of the decoder and the one being handed over
+        HeapAllocator   allocator;
+        FrameBufferPool pool(allocator, 20);
+        run("FrameBufferPool", packets, resolution, resolution, &pool);
+
+        for (AVPacket* packet : packets)
+        {
+            av_free_packet(packet);
+            delete packet;
+        }
+    }
+
+    return 0;
+}
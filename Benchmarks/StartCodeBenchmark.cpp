@@ -0,0 +1,156 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <functional>
+
+#include "AlloShared/StartCodeScanner.hpp"
+
+// Compares the NALU splitting H264NALUSource used to do
+// with StartCodeScanner on data that looks like what AlloServer encodes:
+// frames of ~30 KB (15 MBit/s at 60 fps) cut into slices of at most 2000 bytes.
+
+static const size_t FRAMES_COUNT    = 12 * 60; // one second of all faces
+static const size_t FRAME_SIZE      = 15000000 / 8 / 60;
+static const size_t MAX_SLICE_SIZE  = 2000;
+static const int    REPETITIONS     = 50;
+
+static std::vector<std::vector<uint8_t> > makeFrames()
+{
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> byteDistribution(0, 255);
+    std::uniform_int_distribution<size_t> sliceSizeDistribution(MAX_SLICE_SIZE / 2, MAX_SLICE_SIZE);
+
+    std::vector<std::vector<uint8_t> > frames(FRAMES_COUNT);
+    for (std::vector<uint8_t>& frame : frames)
+    {
+        while (frame.size() < FRAME_SIZE)
+        {
+            // 4-byte start code + slice header + payload
+            frame.insert(frame.end(), {0x00, 0x00, 0x00, 0x01, 0x41});
+
+            size_t sliceSize = sliceSizeDistribution(random);
+            int zerosCount = 0;
+            for (size_t i = 0; i < sliceSize; i++)
+            {
+                // Compressed data has plenty of zeros
+                uint8_t byte = (byteDistribution(random) < 32) ? 0 : (uint8_t)byteDistribution(random);
+
+                // Emulation prevention as the encoder does it
+                if (zerosCount == 2 && byte <= 3)
+                {
+                    frame.push_back(0x03);
+                    zerosCount = 0;
+                }
+                frame.push_back(byte);
+                zerosCount = (byte == 0) ? zerosCount + 1 : 0;
+            }
+            // NALUs never end with a zero
+            frame.push_back(0x80);
+        }
+    }
+    return frames;
+}
+
+// The loop H264NALUSource::encodeFrameLoop used to run
+static size_t legacySplit(const std::vector<uint8_t>& frame)
+{
+    const uint8_t* data = frame.data();
+    size_t size = frame.size();
+
+    std::queue<std::pair<size_t, size_t> > naluPoses;
+    size_t naluStartPos = 0;
+    for (size_t i = 0; i < size - 3; i++)
+    {
+        if (data[i] == 0 &&
+            data[i + 1] == 0)
+        {
+            if (data[i + 2] == 0 &&
+                data[i + 3] == 1)
+            {
+                if (i != 0)
+                {
+                    naluPoses.push(std::make_pair(naluStartPos, i - 1));
+                }
+
+                naluStartPos = i + 4;
+                i += 3;
+            }
+            else if (data[i + 2] == 1)
+            {
+                if (i != 0)
+                {
+                    naluPoses.push(std::make_pair(naluStartPos, i - 1));
+                }
+
+                naluStartPos = i + 3;
+                i += 2;
+            }
+        }
+    }
+    naluPoses.push(std::make_pair(naluStartPos, size - 1));
+    return naluPoses.size();
+}
+
+static size_t scannerSplit(const std::vector<uint8_t>& frame)
+{
+    size_t nalusCount = 0;
+    StartCodeScanner::forEachNALU(frame.data(), frame.data() + frame.size(), [&nalusCount](const uint8_t*, size_t)
+    {
+        nalusCount++;
+    });
+    return nalusCount;
+}
+
+static void run(const std::string& name,
+                const std::vector<std::vector<uint8_t> >& frames,
+                const std::function<size_t(const std::vector<uint8_t>&)>& split)
+{
+    size_t bytesCount = 0;
+    size_t nalusCount = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < REPETITIONS; r++)
+    {
+        for (const std::vector<uint8_t>& frame : frames)
+        {
+            nalusCount += split(frame);
+            bytesCount += frame.size();
+        }
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+    double seconds = duration.count() / 1000000.0;
+    std::cout << std::left << std::setw(10) << name
+              << std::right << std::setw(10) << std::fixed << std::setprecision(1) << bytesCount / seconds / 1000000.0 << " MB/s"
+              << std::setw(10) << std::setprecision(3) << duration.count() / 1000.0 / REPETITIONS << " ms per second of video"
+              << " (" << nalusCount / REPETITIONS << " NALUs)" << std::endl;
+}
+
+int main()
+{
+    std::vector<std::vector<uint8_t> > frames = makeFrames();
+
+    std::cout << "Splitting " << FRAMES_COUNT << " frames of " << FRAME_SIZE << " bytes, "
+              << REPETITIONS << " times" << std::endl;
+
+    run("legacy", frames, &legacySplit);
+
+    for (StartCodeScanner::Implementation implementation : {StartCodeScanner::SCALAR,
+                                                            StartCodeScanner::SSE2,
+                                                            StartCodeScanner::AVX2})
+    {
+        if (StartCodeScanner::setImplementation(implementation))
+        {
+            run(StartCodeScanner::getImplementationName(implementation), frames, &scannerSplit);
+        }
+        else
+        {
+            std::cout << StartCodeScanner::getImplementationName(implementation) << " not supported" << std::endl;
+        }
+    }
+
+    return 0;
+}
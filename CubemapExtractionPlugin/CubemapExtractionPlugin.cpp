@@ -81,7 +81,7 @@ void resetIPCLoop()
 			Cubemap* eye = cubemap->getEye(j);
 			for (int i = 0; i < eye->getFacesCount(); i++)
 			{
-				eye->getFace(i)->getContent()->getBarrier().reset();
+				eye->getFace(i)->getContent()->resetSync();
 			}
 		}
 	}
@@ -145,12 +145,12 @@ void allocateSHM(CubemapConfig* cubemapConfig, BinocularsConfig* binocularsConfi
     unsigned long shmSize = 65536;
     if (cubemapConfig)
     {
-        shmSize += cubemapConfig->width * cubemapConfig->height * 4 * cubemapConfig->facesCount +
+        shmSize += cubemapConfig->width * cubemapConfig->height * 4 * Frame::MAILBOX_SLOTS_COUNT * cubemapConfig->facesCount +
                    sizeof(Cubemap) + cubemapConfig->facesCount * sizeof(CubemapFace);
     }
     if (binocularsConfig)
     {
-        shmSize += binocularsConfig->width * binocularsConfig->height * 4 + sizeof(Frame);
+        shmSize += binocularsConfig->width * binocularsConfig->height * 4 * Frame::MAILBOX_SLOTS_COUNT + sizeof(Frame);
     }
     
     boost::interprocess::shared_memory_object::remove(SHM_NAME);
@@ -285,7 +285,10 @@ Frame* getFrameFromTexture(void* texturePtr)
 
 void copyFromGPUToCPU(Frame* frame)
 {
-    frame->setPresentationTime(presentationTime);
+    // We always own the write slot of the frame,
+    // so copying never has to wait for AlloServer.
+    Frame::Slot* slot = frame->getWriteSlot();
+    slot->setPresentationTime(presentationTime);
     
     // PREPARE COPYING
     
@@ -358,45 +361,41 @@ void copyFromGPUToCPU(Frame* frame)
     // COPY
 
 
-	{
-		boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(frame->getMutex());
-
 #if SUPPORT_D3D9
-		// D3D9 case
-		if (g_DeviceType == kGfxRendererD3D9)
-		{
-			/*CubemapFaceD3D9* faceD3D9 = (CubemapFaceD3D9*)face;
-			memcpy(faceD3D9->getPixels(),
-			faceD3D9->lockedRect.pBits,
-			faceD3D9->getWidth() * faceD3D9->getHeight() * 4);*/
-		}
+	// D3D9 case
+	if (g_DeviceType == kGfxRendererD3D9)
+	{
+		/*CubemapFaceD3D9* faceD3D9 = (CubemapFaceD3D9*)face;
+		memcpy(faceD3D9->getPixels(),
+		faceD3D9->lockedRect.pBits,
+		faceD3D9->getWidth() * faceD3D9->getHeight() * 4);*/
+	}
 #endif
 
 
 #if SUPPORT_D3D11
-		// D3D11 case
-		if (g_DeviceType == kGfxRendererD3D11)
-		{
-			FrameD3D11* frameD3D11 = (FrameD3D11*)frame;
-			memcpy(frameD3D11->getPixels(),
-				frameD3D11->resource.pData,
-				frameD3D11->getWidth() * frameD3D11->getHeight() * 3 / 2);
-		}
+	// D3D11 case
+	if (g_DeviceType == kGfxRendererD3D11)
+	{
+		FrameD3D11* frameD3D11 = (FrameD3D11*)frame;
+		memcpy(slot->getPixels(),
+			frameD3D11->resource.pData,
+			frameD3D11->getWidth() * frameD3D11->getHeight() * 3 / 2);
+	}
 #endif
 
 
 #if SUPPORT_OPENGL
-		// OpenGL case
-		if (g_DeviceType == kGfxRendererOpenGL)
-		{
-			glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, frame->getPixels());
-		}
-#endif
-	}
-
-	while (alloServerProcess.isAlive() && !frame->getBarrier().timedWait(std::chrono::milliseconds(1000)))
+	// OpenGL case
+	if (g_DeviceType == kGfxRendererOpenGL)
 	{
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, slot->getPixels());
 	}
+#endif
+
+	// Make the pixels available to AlloServer.
+	// If it did not pick up the previous frame yet, that frame is simply skipped.
+	frame->publishWriteSlot();
 }
 
 void copyFromGPUtoCPU (std::vector<Frame*>& frames)
@@ -428,7 +427,7 @@ void copyFromGPUtoCPU (std::vector<Frame*>& frames)
 	{
 		for (auto frame : frames)
 		{
-			frame->getBarrier().reset();
+			frame->resetSync();
 		}
 		alloServerWasAlive = false;
 	}*/
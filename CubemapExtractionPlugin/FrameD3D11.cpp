@@ -29,7 +29,8 @@ FrameD3D11::FrameD3D11(boost::uint32_t width,
 	      height,
 		  PIX_FMT_YUV420P,//avPixel2DXGIFormat(description.Format),//PIX_FMT_YUV420P,
 	      presentationTime,
-	      allocator),
+	      allocator,
+	      MAILBOX_SLOTS_COUNT),
 	gpuTexturePtr(gpuTexturePtr),
 	cpuTexturePtr(cpuTexturePtr),
 	resource(resource)
@@ -20,7 +20,8 @@ CubemapFaceD3D9::CubemapFaceD3D9(boost::uint32_t width,
 	      height,
 		  AV_PIX_FMT_NONE,
 		  presentationTime,
-		  allocator),
+		  allocator,
+		  MAILBOX_SLOTS_COUNT),
 	texturePtr(texturePtr),
 	gpuSurfacePtr(gpuSurfacePtr),
 	cpuSurfacePtr(cpuSurfacePtr),
@@ -13,7 +13,8 @@ FrameOpenGL::FrameOpenGL(boost::uint32_t                         width,
 	      height,
 		  format,
 		  presentationTime,
-		  allocator),
+		  allocator,
+		  MAILBOX_SLOTS_COUNT),
 	gpuTextureID(gpuTextureID)
 {
 }